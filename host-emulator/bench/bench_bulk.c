@@ -0,0 +1,87 @@
+/**
+ * @file bench_bulk.c
+ * @brief Programming a 1 MB image with and without the DMA queue
+ * @author Filip Stojanovic
+ *
+ * Both workloads program the same erased range and compute the CRC-32 of the
+ * image, as an update or a blob store does:
+ *
+ *     bulk_write_page     W25Q128_WritePage of the whole range, CRC after it
+ *     bulk_async          W25Q128_Async_ProgramBulk, the next page is started
+ *                         from the interrupt and the CRC is computed while
+ *                         pages are programmed
+ */
+
+#include "emu_test.h"
+#include "w25q128_async_ll.h"
+
+#define IMAGE_ADDR (1024 * 1024)
+#define IMAGE_SIZE (1024 * 1024)
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_AsyncTypeDef async;
+static uint8_t image[IMAGE_SIZE];
+static uint8_t check[IMAGE_SIZE];
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+static void verify(uint32_t crc)
+{
+    EMU_CHECK(crc == W25Q128_Crc32(0, image, IMAGE_SIZE));
+    EMU_CHECK(W25Q128_FastRead(&w25, IMAGE_ADDR / W25Q128_PAGE_SIZE, 0,
+                                    IMAGE_SIZE, check) == W25Q128_SUCCESS);
+    EMU_CHECK(memcmp(image, check, IMAGE_SIZE) == 0);
+}
+
+int main(void)
+{
+    uint64_t start;
+    uint32_t crc;
+
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+    W25Q128_Async_Init(&async, &w25);
+    emu_test_fill(image, IMAGE_SIZE, 21);
+
+    EMU_CHECK(W25Q128_EraseRange(&w25, IMAGE_ADDR, IMAGE_SIZE) ==
+                                                            W25Q128_SUCCESS);
+    W25Q128_Emu_ResetStats(&emu);
+    start = W25Q128_Emu_GetTimeNs();
+    EMU_CHECK(W25Q128_WritePage(&w25, IMAGE_ADDR / W25Q128_PAGE_SIZE, 0,
+                                    IMAGE_SIZE, image) == W25Q128_SUCCESS);
+    crc = W25Q128_Crc32(0, image, IMAGE_SIZE);
+    W25Q128_Emu_Report(stdout, "bulk_write_page", &emu, NULL, IMAGE_SIZE,
+                                        W25Q128_Emu_GetTimeNs() - start);
+    verify(crc);
+
+    EMU_CHECK(W25Q128_EraseRange(&w25, IMAGE_ADDR, IMAGE_SIZE) ==
+                                                            W25Q128_SUCCESS);
+    W25Q128_Emu_ResetStats(&emu);
+    crc = 0;
+    start = W25Q128_Emu_GetTimeNs();
+    EMU_CHECK(W25Q128_Async_ProgramBulk(&async, IMAGE_ADDR, image, IMAGE_SIZE,
+                                                &crc) == W25Q128_SUCCESS);
+    W25Q128_Emu_Report(stdout, "bulk_async", &emu, NULL, IMAGE_SIZE,
+                                        W25Q128_Emu_GetTimeNs() - start);
+    verify(crc);
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
@@ -0,0 +1,60 @@
+/**
+ * @file bench_erase.c
+ * @brief Range erase against the sector-by-sector loop
+ * @author Filip Stojanovic
+ *
+ * A 1 MB log region is wiped with W25Q128_EraseRange and with a loop of
+ * W25Q128_EraseSector, a page of every sector is programmed before each run
+ * so no sector is skipped by the erased map.
+ */
+
+#include "emu_test.h"
+
+#define REGION_START 0x100000
+#define REGION_SIZE  0x100000
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static uint8_t page[W25Q128_PAGE_SIZE];
+
+// Leaves data in every sector of the region
+static void dirty_region(void)
+{
+    for (uint32_t addr = REGION_START; addr < REGION_START + REGION_SIZE;
+                                                addr += W25Q128_SECTOR_SIZE)
+        EMU_CHECK(W25Q128_WritePage(&w25, addr / W25Q128_PAGE_SIZE, 0,
+                                        sizeof(page), page) == W25Q128_SUCCESS);
+}
+
+int main(void)
+{
+    uint64_t start;
+
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+    memset(page, 0x00, sizeof(page));
+
+    dirty_region();
+    W25Q128_Emu_ResetStats(&emu);
+    start = W25Q128_Emu_GetTimeNs();
+    for (uint32_t addr = REGION_START; addr < REGION_START + REGION_SIZE;
+                                                addr += W25Q128_SECTOR_SIZE)
+        EMU_CHECK(W25Q128_EraseSector(&w25, addr / W25Q128_SECTOR_SIZE) ==
+                                                            W25Q128_SUCCESS);
+    W25Q128_Emu_Report(stdout, "erase_1mb_sector_loop", &emu, NULL,
+                        REGION_SIZE, W25Q128_Emu_GetTimeNs() - start);
+
+    dirty_region();
+    W25Q128_Emu_ResetStats(&emu);
+    start = W25Q128_Emu_GetTimeNs();
+    EMU_CHECK(W25Q128_EraseRange(&w25, REGION_START, REGION_SIZE) ==
+                                                            W25Q128_SUCCESS);
+    W25Q128_Emu_Report(stdout, "erase_1mb_range", &emu, NULL,
+                        REGION_SIZE, W25Q128_Emu_GetTimeNs() - start);
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
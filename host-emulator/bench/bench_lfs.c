@@ -0,0 +1,148 @@
+/**
+ * @file bench_lfs.c
+ * @brief littlefs workloads on the w25q128_lfs hooks
+ * @author Filip Stojanovic
+ *
+ * Built only with LITTLEFS=<path> (see Makefile). Every workload prints one
+ * JSON line, latencies are those of single littlefs calls:
+ *
+ *     lfs_format        format of a 4 MB filesystem
+ *     lfs_create        100 files created with 64 bytes each
+ *     lfs_append        1000 appends of 32 bytes, open/write/close
+ *     lfs_stat          stat of every file
+ *     lfs_mount         mount of the filesystem with 100 files
+ *     lfs_remove        remove of every file
+ */
+
+#include "emu_test.h"
+#include "lfs.h"
+#include "w25q128_lfs.h"
+
+#define FILES        100
+#define APPENDS      1000
+#define BLOCK_COUNT  1024
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_EmuLatencyTypeDef lat;
+static lfs_t lfs;
+static lfs_file_t file;
+static uint8_t record[64];
+static uint64_t start;
+static uint64_t op_start;
+
+static const struct lfs_config cfg = {
+    .context = &w25,
+    .read = w25q128_lfs_read,
+    .prog = w25q128_lfs_prog,
+    .erase = w25q128_lfs_erase,
+    .sync = w25q128_lfs_sync,
+    .read_size = 16,
+    .prog_size = 16,
+    .block_size = W25Q128_SECTOR_SIZE,
+    .block_count = BLOCK_COUNT,
+    .block_cycles = 500,
+    .cache_size = 256,
+    .lookahead_size = 32,
+};
+
+static void workload_start(void)
+{
+    memset(&lat, 0, sizeof(lat));
+    W25Q128_Emu_ResetStats(&emu);
+    start = W25Q128_Emu_GetTimeNs();
+}
+
+static void workload_end(const char *name, uint64_t bytes)
+{
+    W25Q128_Emu_Report(stdout, name, &emu, &lat, bytes,
+                                        W25Q128_Emu_GetTimeNs() - start);
+}
+
+static void op_begin(void)
+{
+    op_start = W25Q128_Emu_GetTimeNs();
+}
+
+static void op_end(int err)
+{
+    EMU_CHECK(err >= 0);
+    W25Q128_Emu_LatencyAdd(&lat, W25Q128_Emu_GetTimeNs() - op_start);
+}
+
+static void file_name(char *name, uint32_t i)
+{
+    snprintf(name, 16, "f%03u", (unsigned)i);
+}
+
+int main(void)
+{
+    char name[16];
+    struct lfs_info info;
+
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+    emu_test_fill(record, sizeof(record), 13);
+
+    workload_start();
+    op_begin();
+    op_end(lfs_format(&lfs, &cfg));
+    workload_end("lfs_format", 0);
+    EMU_CHECK(lfs_mount(&lfs, &cfg) == 0);
+
+    workload_start();
+    for (uint32_t i = 0; i < FILES; i++)
+    {
+        file_name(name, i);
+        op_begin();
+        EMU_CHECK(lfs_file_open(&lfs, &file, name,
+                                    LFS_O_WRONLY | LFS_O_CREAT) == 0);
+        EMU_CHECK(lfs_file_write(&lfs, &file, record, sizeof(record)) ==
+                                                    (lfs_ssize_t)sizeof(record));
+        op_end(lfs_file_close(&lfs, &file));
+    }
+    workload_end("lfs_create", FILES * sizeof(record));
+
+    workload_start();
+    for (uint32_t i = 0; i < APPENDS; i++)
+    {
+        file_name(name, i % 10);
+        op_begin();
+        EMU_CHECK(lfs_file_open(&lfs, &file, name,
+                                    LFS_O_WRONLY | LFS_O_APPEND) == 0);
+        EMU_CHECK(lfs_file_write(&lfs, &file, record, 32) == 32);
+        op_end(lfs_file_close(&lfs, &file));
+    }
+    workload_end("lfs_append", APPENDS * 32);
+
+    workload_start();
+    for (uint32_t i = 0; i < FILES; i++)
+    {
+        file_name(name, i);
+        op_begin();
+        op_end(lfs_stat(&lfs, name, &info));
+    }
+    workload_end("lfs_stat", 0);
+
+    EMU_CHECK(lfs_unmount(&lfs) == 0);
+    workload_start();
+    op_begin();
+    op_end(lfs_mount(&lfs, &cfg));
+    workload_end("lfs_mount", 0);
+
+    workload_start();
+    for (uint32_t i = 0; i < FILES; i++)
+    {
+        file_name(name, i);
+        op_begin();
+        op_end(lfs_remove(&lfs, name));
+    }
+    workload_end("lfs_remove", 0);
+
+    EMU_CHECK(lfs_unmount(&lfs) == 0);
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
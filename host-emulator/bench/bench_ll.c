@@ -0,0 +1,168 @@
+/**
+ * @file bench_ll.c
+ * @brief Low-level driver workloads on the emulator
+ * @author Filip Stojanovic
+ *
+ * Every workload prints one JSON line with MB/s, latency percentiles of its
+ * operations, bus bytes and the time spent in W25Q128_DelayMs (delay_ns):
+ *
+ *     seq_read          1 MB with W25Q128_FastRead in 4 KB reads
+ *     rand_read         1000 reads of 256 bytes at random addresses
+ *     seq_read_single   1 MB with W25Q128_Read (03h) in 4 KB reads
+ *     write_page        1 MB of erased flash with W25Q128_WritePage
+ *     write_aligned     256 random pages rewritten with W25Q128_Write
+ *     write_unaligned   256 writes of 100 bytes at random offsets
+ *     append_record     4096 records of 32 bytes appended with W25Q128_Write
+ *     erase_sector      64 sectors with W25Q128_EraseSector
+ */
+
+#include "emu_test.h"
+
+#define REGION_SIZE (1024 * 1024)
+#define READ_REGION  0x000000
+#define WRITE_REGION 0x100000
+#define RMW_REGION   0x200000
+#define LOG_REGION   0x300000
+#define ERASE_REGION 0x400000
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_EmuLatencyTypeDef lat;
+static uint8_t buf[W25Q128_SECTOR_SIZE];
+static uint64_t start;
+static uint64_t op_start;
+
+static void workload_start(void)
+{
+    memset(&lat, 0, sizeof(lat));
+    W25Q128_Emu_ResetStats(&emu);
+    start = W25Q128_Emu_GetTimeNs();
+}
+
+static void workload_end(const char *name, uint64_t bytes)
+{
+    W25Q128_Emu_Report(stdout, name, &emu, &lat, bytes,
+                                        W25Q128_Emu_GetTimeNs() - start);
+}
+
+static void op_begin(void)
+{
+    op_start = W25Q128_Emu_GetTimeNs();
+}
+
+static void op_end(W25Q128_StatusTypeDef status)
+{
+    EMU_CHECK(status == W25Q128_SUCCESS);
+    W25Q128_Emu_LatencyAdd(&lat, W25Q128_Emu_GetTimeNs() - op_start);
+}
+
+int main(void)
+{
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+    srand(13);
+
+    // Read region and the rewritten region hold data, the rest is erased
+    for (uint32_t i = 0; i < REGION_SIZE; i += sizeof(buf))
+    {
+        emu_test_fill(emu.mem + READ_REGION + i, sizeof(buf), i);
+        emu_test_fill(emu.mem + RMW_REGION + i, sizeof(buf), i + 1);
+    }
+    for (uint32_t i = 0; i < 64 * W25Q128_SECTOR_SIZE; i++)
+        emu.mem[ERASE_REGION + i] = 0x00;
+
+    workload_start();
+    for (uint32_t i = 0; i < REGION_SIZE; i += sizeof(buf))
+    {
+        op_begin();
+        op_end(W25Q128_FastRead(&w25, (READ_REGION + i) / W25Q128_PAGE_SIZE,
+                                                    0, sizeof(buf), buf));
+    }
+    workload_end("seq_read", REGION_SIZE);
+
+    workload_start();
+    for (uint32_t i = 0; i < 1000; i++)
+    {
+        uint32_t addr = READ_REGION + rand() % (REGION_SIZE - 256);
+
+        op_begin();
+        op_end(W25Q128_FastRead(&w25, addr / W25Q128_PAGE_SIZE,
+                                addr % W25Q128_PAGE_SIZE, 256, buf));
+    }
+    workload_end("rand_read", 1000 * 256);
+
+    EMU_CHECK(W25Q128_SetReadMode(&w25, W25Q128_READ_MODE_SINGLE) ==
+                                                            W25Q128_SUCCESS);
+    workload_start();
+    for (uint32_t i = 0; i < REGION_SIZE; i += sizeof(buf))
+    {
+        op_begin();
+        op_end(W25Q128_Read(&w25, (READ_REGION + i) / W25Q128_PAGE_SIZE,
+                                                    0, sizeof(buf), buf));
+    }
+    workload_end("seq_read_single", REGION_SIZE);
+    EMU_CHECK(W25Q128_SetReadMode(&w25, W25Q128_READ_MODE_AUTO) ==
+                                                            W25Q128_SUCCESS);
+
+    workload_start();
+    for (uint32_t i = 0; i < REGION_SIZE; i += W25Q128_PAGE_SIZE)
+    {
+        emu_test_fill(buf, W25Q128_PAGE_SIZE, i);
+        op_begin();
+        op_end(W25Q128_WritePage(&w25, (WRITE_REGION + i) / W25Q128_PAGE_SIZE,
+                                            0, W25Q128_PAGE_SIZE, buf));
+    }
+    workload_end("write_page", REGION_SIZE);
+
+    workload_start();
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t page = (RMW_REGION / W25Q128_PAGE_SIZE) + 
+                                rand() % (REGION_SIZE / W25Q128_PAGE_SIZE);
+
+        emu_test_fill(buf, W25Q128_PAGE_SIZE, rand());
+        op_begin();
+        op_end(W25Q128_Write(&w25, page, 0, W25Q128_PAGE_SIZE, buf));
+    }
+    workload_end("write_aligned", 256 * W25Q128_PAGE_SIZE);
+
+    workload_start();
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t addr = RMW_REGION + rand() % (REGION_SIZE - 100);
+
+        emu_test_fill(buf, 100, rand());
+        op_begin();
+        op_end(W25Q128_Write(&w25, addr / W25Q128_PAGE_SIZE,
+                                    addr % W25Q128_PAGE_SIZE, 100, buf));
+    }
+    workload_end("write_unaligned", 256 * 100);
+
+    // Records go to erased flash, they only clear bits
+    workload_start();
+    for (uint32_t i = 0; i < 4096; i++)
+    {
+        uint32_t addr = LOG_REGION + i * 32;
+
+        emu_test_fill(buf, 32, i);
+        op_begin();
+        op_end(W25Q128_Write(&w25, addr / W25Q128_PAGE_SIZE,
+                                    addr % W25Q128_PAGE_SIZE, 32, buf));
+    }
+    workload_end("append_record", 4096 * 32);
+
+    workload_start();
+    for (uint32_t i = 0; i < 64; i++)
+    {
+        op_begin();
+        op_end(W25Q128_EraseSector(&w25, ERASE_REGION / W25Q128_SECTOR_SIZE
+                                                                    + i));
+    }
+    workload_end("erase_sector", 64 * W25Q128_SECTOR_SIZE);
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
@@ -0,0 +1,93 @@
+/**
+ * @file bench_log.c
+ * @brief Append throughput of the log store
+ * @author Filip Stojanovic
+ *
+ * 1 MB of 32 byte records is appended to a 512 KB log, so the ring wraps and
+ * sectors are erased again. Latencies are those of W25Q128_Log_Append calls:
+ *
+ *     log_append          sectors are erased by the append that enters them
+ *     log_append_idle     W25Q128_Log_EraseAhead runs between appends, as
+ *                         from idle time, its time is not in the latencies
+ *     log_append_raw      same pages with W25Q128_WritePage, the device limit
+ */
+
+#include "emu_test.h"
+#include "w25q128_log.h"
+
+#define FIRST_SECTOR 256
+#define NUM_SECTORS  128
+#define RECORD_SIZE  32
+#define DATA_SIZE    (1024 * 1024)
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_LogTypeDef log_store;
+static W25Q128_EmuLatencyTypeDef lat;
+static uint8_t record[RECORD_SIZE];
+static uint8_t page[W25Q128_PAGE_SIZE];
+
+static void run(const char *name, uint8_t idle_erase)
+{
+    uint64_t start;
+
+    EMU_CHECK(W25Q128_Log_Format(&log_store, &w25, FIRST_SECTOR,
+                                        NUM_SECTORS) == W25Q128_SUCCESS);
+    memset(&lat, 0, sizeof(lat));
+    W25Q128_Emu_ResetStats(&emu);
+    start = W25Q128_Emu_GetTimeNs();
+
+    for (uint32_t i = 0; i < DATA_SIZE / RECORD_SIZE; i++)
+    {
+        uint64_t op_start;
+
+        if (idle_erase)
+            EMU_CHECK(W25Q128_Log_EraseAhead(&log_store) == W25Q128_SUCCESS);
+
+        emu_test_fill(record, RECORD_SIZE, i);
+        op_start = W25Q128_Emu_GetTimeNs();
+        EMU_CHECK(W25Q128_Log_Append(&log_store, record, RECORD_SIZE) ==
+                                                            W25Q128_SUCCESS);
+        W25Q128_Emu_LatencyAdd(&lat, W25Q128_Emu_GetTimeNs() - op_start);
+    }
+    EMU_CHECK(W25Q128_Log_Sync(&log_store) == W25Q128_SUCCESS);
+
+    W25Q128_Emu_Report(stdout, name, &emu, &lat, DATA_SIZE,
+                                        W25Q128_Emu_GetTimeNs() - start);
+}
+
+int main(void)
+{
+    uint32_t first_page = FIRST_SECTOR * (W25Q128_SECTOR_SIZE /
+                                                        W25Q128_PAGE_SIZE);
+    uint64_t start;
+
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+
+    run("log_append", 0);
+    run("log_append_idle", 1);
+
+    // Page programs of erased flash only
+    memset(emu.mem, 0xFF, emu.capacity);
+    memset(&lat, 0, sizeof(lat));
+    W25Q128_Emu_ResetStats(&emu);
+    emu_test_fill(page, sizeof(page), 1);
+    start = W25Q128_Emu_GetTimeNs();
+    for (uint32_t i = 0; i < DATA_SIZE / W25Q128_PAGE_SIZE; i++)
+    {
+        uint64_t op_start = W25Q128_Emu_GetTimeNs();
+
+        EMU_CHECK(W25Q128_WritePage(&w25, first_page + i, 0, sizeof(page),
+                                                    page) == W25Q128_SUCCESS);
+        W25Q128_Emu_LatencyAdd(&lat, W25Q128_Emu_GetTimeNs() - op_start);
+    }
+    W25Q128_Emu_Report(stdout, "log_append_raw", &emu, &lat, DATA_SIZE,
+                                        W25Q128_Emu_GetTimeNs() - start);
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
@@ -0,0 +1,221 @@
+/**
+ * @file bench_log_lz.c
+ * @brief Compressed against plain log records on three corpora
+ * @author Filip Stojanovic
+ *
+ * Built with W25Q128_LOG_COMPRESSION. 4000 records of each corpus are
+ * appended to a 512 KB log, so the ring wraps and bytes_programmed / erases
+ * show the flash written and erased for the same payload:
+ *
+ *     log_<corpus>_raw    W25Q128_Log_Append of every record
+ *     log_<corpus>_lz     W25Q128_Log_AppendCompressed of every record
+ *     lz_<corpus>_cpu     host time of one W25Q128_Lz_Compress pass per
+ *                         record, AppendCompressed makes two of them
+ *
+ * Corpora are text log lines (4 per record), binary accelerometer samples
+ * (32 per record) and random bytes, which are stored as plain records.
+ */
+
+#include "emu_test.h"
+#include "w25q128_log.h"
+
+#include <time.h>
+
+#define FIRST_SECTOR 256
+#define NUM_SECTORS  128
+#define NUM_RECORDS  4000
+#define MAX_RECORD   512
+
+typedef uint32_t (*corpus_fn)(uint32_t i, uint8_t *record);
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_LogTypeDef log_store;
+static W25Q128_EmuLatencyTypeDef lat;
+static uint16_t lz_table[W25Q128_LZ_TABLE_SIZE];
+static uint8_t record[MAX_RECORD];
+static uint8_t check[MAX_RECORD];
+static uint32_t seed;
+
+static uint32_t next_random(void)
+{
+    seed = seed * 1103515245 + 12345;
+
+    return seed >> 8;
+}
+
+static uint32_t corpus_text(uint32_t i, uint8_t *data)
+{
+    static const char *level[] = { "INFO", "WARN", "DBG " };
+    uint32_t size = 0;
+
+    for (uint32_t line = 0; line < 4; line++)
+    {
+        uint32_t t = i * 4 + line;
+
+        size += snprintf((char *)data + size, MAX_RECORD - size,
+                    "[%8u] %s sensor%u temp=%u.%02u C hum=%u%% bat=%umV "
+                    "state=RUNNING\n", t * 125, level[next_random() % 3],
+                    t % 4, 20 + next_random() % 5, next_random() % 100,
+                    40 + next_random() % 3, 3700 + next_random() % 20);
+    }
+
+    return size;
+}
+
+static uint32_t corpus_telemetry(uint32_t i, uint8_t *data)
+{
+    uint32_t size = 0;
+
+    // Timestamp, 3 axes and flags, 12 bytes little-endian
+    for (uint32_t k = 0; k < 32; k++)
+    {
+        uint32_t ts = (i * 32 + k) * 10;
+        uint16_t axis[3] = { next_random() % 16, 65533 + next_random() % 8,
+                             1000 + next_random() % 8 };
+
+        for (uint32_t b = 0; b < 4; b++)
+            data[size++] = (ts >> (8 * b)) & 0xFF;
+        for (uint32_t a = 0; a < 3; a++)
+        {
+            data[size++] = axis[a] & 0xFF;
+            data[size++] = axis[a] >> 8;
+        }
+        data[size++] = 0x01;
+        data[size++] = 0x01;
+    }
+
+    return size;
+}
+
+static uint32_t corpus_random(uint32_t i, uint8_t *data)
+{
+    (void)i;
+    for (uint32_t k = 0; k < 256; k++)
+        data[k] = next_random() & 0xFF;
+
+    return 256;
+}
+
+static W25Q128_StatusTypeDef count_sink(void *ctx, const uint8_t *data,
+                                                                uint32_t size)
+{
+    (void)data;
+    *(uint32_t *)ctx += size;
+
+    return W25Q128_SUCCESS;
+}
+
+static uint64_t host_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void run(const char *corpus, corpus_fn fill, uint8_t compress)
+{
+    W25Q128_LogIteratorTypeDef it;
+    char name[32];
+    uint64_t payload = 0;
+    uint64_t start;
+    uint32_t size;
+    uint32_t count;
+
+    EMU_CHECK(W25Q128_Log_Format(&log_store, &w25, FIRST_SECTOR,
+                                        NUM_SECTORS) == W25Q128_SUCCESS);
+    memset(&lat, 0, sizeof(lat));
+    W25Q128_Emu_ResetStats(&emu);
+    seed = 7;
+    start = W25Q128_Emu_GetTimeNs();
+    for (uint32_t i = 0; i < NUM_RECORDS; i++)
+    {
+        uint64_t op_start;
+
+        size = fill(i, record);
+        payload += size;
+        op_start = W25Q128_Emu_GetTimeNs();
+        if (compress)
+            EMU_CHECK(W25Q128_Log_AppendCompressed(&log_store, record,
+                                                size) == W25Q128_SUCCESS);
+        else
+            EMU_CHECK(W25Q128_Log_Append(&log_store, record, size) ==
+                                                            W25Q128_SUCCESS);
+        W25Q128_Emu_LatencyAdd(&lat, W25Q128_Emu_GetTimeNs() - op_start);
+    }
+    EMU_CHECK(W25Q128_Log_Sync(&log_store) == W25Q128_SUCCESS);
+    snprintf(name, sizeof(name), "log_%s_%s", corpus, compress ? "lz" : "raw");
+    W25Q128_Emu_Report(stdout, name, &emu, &lat, payload,
+                                        W25Q128_Emu_GetTimeNs() - start);
+
+    // Records left in the ring read back as written
+    W25Q128_Log_IterInit(&log_store, &it);
+    EMU_CHECK(W25Q128_Log_IterNext(&log_store, &it, check, sizeof(check),
+                                                &size) == W25Q128_SUCCESS);
+    count = 1;
+    while (W25Q128_Log_IterNext(&log_store, &it, check, sizeof(check),
+                                                &size) == W25Q128_SUCCESS)
+        count++;
+    seed = 7;
+    for (uint32_t i = 0; i < NUM_RECORDS; i++)
+        size = fill(i, record);
+    EMU_CHECK(memcmp(check, record, size) == 0);
+    EMU_CHECK(count <= NUM_RECORDS);
+}
+
+static void run_cpu(const char *corpus, corpus_fn fill)
+{
+    char name[32];
+    uint64_t payload = 0;
+    uint64_t elapsed = 0;
+
+    memset(&lat, 0, sizeof(lat));
+    W25Q128_Emu_ResetStats(&emu);
+    seed = 7;
+    for (uint32_t i = 0; i < NUM_RECORDS; i++)
+    {
+        uint32_t size = fill(i, record);
+        uint32_t stored = 0;
+        uint64_t op_start = host_ns();
+        uint64_t op_ns;
+
+        EMU_CHECK(W25Q128_Lz_Compress(record, size, lz_table, count_sink,
+                                                &stored) == W25Q128_SUCCESS);
+        op_ns = host_ns() - op_start;
+        W25Q128_Emu_LatencyAdd(&lat, op_ns);
+        elapsed += op_ns;
+        payload += size;
+    }
+    snprintf(name, sizeof(name), "lz_%s_cpu", corpus);
+    W25Q128_Emu_Report(stdout, name, &emu, &lat, payload, elapsed);
+}
+
+int main(void)
+{
+    static const struct {
+        const char *name;
+        corpus_fn fill;
+    } corpora[] = {
+        { "text", corpus_text },
+        { "telemetry", corpus_telemetry },
+        { "random", corpus_random },
+    };
+
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+
+    for (uint32_t c = 0; c < sizeof(corpora) / sizeof(corpora[0]); c++)
+    {
+        run(corpora[c].name, corpora[c].fill, 0);
+        run(corpora[c].name, corpora[c].fill, 1);
+        run_cpu(corpora[c].name, corpora[c].fill);
+    }
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
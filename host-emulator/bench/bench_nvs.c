@@ -0,0 +1,107 @@
+/**
+ * @file bench_nvs.c
+ * @brief Set, mount and get costs of the key-value store with 10k keys
+ * @author Filip Stojanovic
+ *
+ * Built with a 16384 slot index (64 KB of RAM) and 16 byte entry alignment,
+ * so a store can span 150 sectors. 10k keys with 24 byte values are set and
+ * 2000 of them set again, the 12k entries fill about 140 sectors:
+ *
+ *     nvs_set     latencies of the 12k W25Q128_Nvs_Set calls
+ *     nvs_mount   W25Q128_Nvs_Mount, the index build at boot
+ *     nvs_get     latencies of W25Q128_Nvs_Get of every key
+ */
+
+#include "emu_test.h"
+#include "w25q128_nvs.h"
+
+#define FIRST_SECTOR 256
+#define NUM_SECTORS  150
+#define NUM_KEYS     10000
+#define NUM_UPDATES  2000
+#define VALUE_SIZE   24
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_NvsTypeDef nvs;
+static W25Q128_EmuLatencyTypeDef lat;
+
+static void key_value(uint32_t i, uint32_t seed, char *key, uint8_t *value)
+{
+    snprintf(key, W25Q128_NVS_MAX_KEY_SIZE + 1, "cfg.%05u", i);
+    emu_test_fill(value, VALUE_SIZE, i * 7 + seed);
+}
+
+static void set_key(uint32_t i, uint32_t seed)
+{
+    char key[W25Q128_NVS_MAX_KEY_SIZE + 1];
+    uint8_t value[VALUE_SIZE];
+    uint64_t op_start;
+
+    key_value(i, seed, key, value);
+    op_start = W25Q128_Emu_GetTimeNs();
+    EMU_CHECK(W25Q128_Nvs_Set(&nvs, key, value, VALUE_SIZE) ==
+                                                            W25Q128_SUCCESS);
+    W25Q128_Emu_LatencyAdd(&lat, W25Q128_Emu_GetTimeNs() - op_start);
+}
+
+int main(void)
+{
+    char key[W25Q128_NVS_MAX_KEY_SIZE + 1];
+    uint8_t value[VALUE_SIZE];
+    uint8_t check[VALUE_SIZE];
+    uint64_t start;
+    uint32_t size;
+
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+    EMU_CHECK(W25Q128_Nvs_Format(&nvs, &w25, FIRST_SECTOR, NUM_SECTORS) ==
+                                                            W25Q128_SUCCESS);
+
+    memset(&lat, 0, sizeof(lat));
+    W25Q128_Emu_ResetStats(&emu);
+    start = W25Q128_Emu_GetTimeNs();
+    for (uint32_t i = 0; i < NUM_KEYS; i++)
+        set_key(i, 0);
+    for (uint32_t i = 0; i < NUM_UPDATES; i++)
+        set_key(i * (NUM_KEYS / NUM_UPDATES), 1);
+    W25Q128_Emu_Report(stdout, "nvs_set", &emu, &lat,
+                                (NUM_KEYS + NUM_UPDATES) * VALUE_SIZE,
+                                W25Q128_Emu_GetTimeNs() - start);
+
+    // Index is rebuilt from flash only
+    memset(&lat, 0, sizeof(lat));
+    W25Q128_Emu_ResetStats(&emu);
+    start = W25Q128_Emu_GetTimeNs();
+    EMU_CHECK(W25Q128_Nvs_Mount(&nvs, &w25, FIRST_SECTOR, NUM_SECTORS) ==
+                                                            W25Q128_SUCCESS);
+    W25Q128_Emu_LatencyAdd(&lat, W25Q128_Emu_GetTimeNs() - start);
+    EMU_CHECK(nvs.keys == NUM_KEYS);
+    W25Q128_Emu_Report(stdout, "nvs_mount", &emu, &lat,
+                                (uint64_t)NUM_SECTORS * W25Q128_SECTOR_SIZE,
+                                W25Q128_Emu_GetTimeNs() - start);
+
+    memset(&lat, 0, sizeof(lat));
+    W25Q128_Emu_ResetStats(&emu);
+    start = W25Q128_Emu_GetTimeNs();
+    for (uint32_t i = 0; i < NUM_KEYS; i++)
+    {
+        uint64_t op_start;
+
+        key_value(i, (i % (NUM_KEYS / NUM_UPDATES) == 0) ? 1 : 0, key,
+                                                                    value);
+        op_start = W25Q128_Emu_GetTimeNs();
+        EMU_CHECK(W25Q128_Nvs_Get(&nvs, key, check, sizeof(check), &size) ==
+                                                            W25Q128_SUCCESS);
+        W25Q128_Emu_LatencyAdd(&lat, W25Q128_Emu_GetTimeNs() - op_start);
+        EMU_CHECK(size == VALUE_SIZE && memcmp(value, check, size) == 0);
+    }
+    W25Q128_Emu_Report(stdout, "nvs_get", &emu, &lat, NUM_KEYS * VALUE_SIZE,
+                                            W25Q128_Emu_GetTimeNs() - start);
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
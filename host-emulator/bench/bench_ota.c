@@ -0,0 +1,92 @@
+/**
+ * @file bench_ota.c
+ * @brief Image download throughput with and without the image writer
+ * @author Filip Stojanovic
+ *
+ * A 700 KB image arrives in 1460 byte chunks (TCP segments) and is written
+ * over the previous image. Latencies are those of the chunk writes:
+ *
+ *     ota_write           every chunk through W25Q128_Write, which reads,
+ *                         erases and programs the sectors it touches
+ *     ota_writer          W25Q128_Ota_Open, W25Q128_Ota_Append of every
+ *                         chunk and W25Q128_Ota_Finalize, so the time also
+ *                         covers erasing ahead and the CRC read back
+ */
+
+#include "emu_test.h"
+#include "w25q128_ota.h"
+
+#define SLOT_ADDR  (2 * 1024 * 1024)
+#define SLOT_SIZE  (1024 * 1024)
+#define IMAGE_SIZE 700001
+#define CHUNK_SIZE 1460
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_OtaTypeDef ota;
+static W25Q128_EmuLatencyTypeDef lat;
+static uint8_t image[IMAGE_SIZE];
+static uint8_t check[IMAGE_SIZE];
+
+// Slot holds the previous image
+static void old_image(void)
+{
+    memset(emu.mem + SLOT_ADDR, 0x5A, SLOT_SIZE);
+    memset(&lat, 0, sizeof(lat));
+    W25Q128_Emu_ResetStats(&emu);
+}
+
+int main(void)
+{
+    uint64_t start;
+
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+    emu_test_fill(image, IMAGE_SIZE, 22);
+
+    old_image();
+    start = W25Q128_Emu_GetTimeNs();
+    for (uint32_t pos = 0; pos < IMAGE_SIZE; pos += CHUNK_SIZE)
+    {
+        uint32_t addr = SLOT_ADDR + pos;
+        uint32_t len = (IMAGE_SIZE - pos < CHUNK_SIZE) ?
+                                            IMAGE_SIZE - pos : CHUNK_SIZE;
+        uint64_t op_start = W25Q128_Emu_GetTimeNs();
+
+        EMU_CHECK(W25Q128_Write(&w25, addr / W25Q128_PAGE_SIZE,
+                                    addr % W25Q128_PAGE_SIZE, len,
+                                    &image[pos]) == W25Q128_SUCCESS);
+        W25Q128_Emu_LatencyAdd(&lat, W25Q128_Emu_GetTimeNs() - op_start);
+    }
+    W25Q128_Emu_Report(stdout, "ota_write", &emu, &lat, IMAGE_SIZE,
+                                        W25Q128_Emu_GetTimeNs() - start);
+    EMU_CHECK(memcmp(emu.mem + SLOT_ADDR, image, IMAGE_SIZE) == 0);
+
+    old_image();
+    start = W25Q128_Emu_GetTimeNs();
+    EMU_CHECK(W25Q128_Ota_Open(&ota, &w25, SLOT_ADDR, SLOT_SIZE, 1,
+                                        IMAGE_SIZE) == W25Q128_SUCCESS);
+    for (uint32_t pos = 0; pos < IMAGE_SIZE; pos += CHUNK_SIZE)
+    {
+        uint32_t len = (IMAGE_SIZE - pos < CHUNK_SIZE) ?
+                                            IMAGE_SIZE - pos : CHUNK_SIZE;
+        uint64_t op_start = W25Q128_Emu_GetTimeNs();
+
+        EMU_CHECK(W25Q128_Ota_Append(&ota, &image[pos], len) ==
+                                                            W25Q128_SUCCESS);
+        W25Q128_Emu_LatencyAdd(&lat, W25Q128_Emu_GetTimeNs() - op_start);
+    }
+    EMU_CHECK(W25Q128_Ota_Finalize(&ota, W25Q128_Crc32(0, image,
+                                        IMAGE_SIZE)) == W25Q128_SUCCESS);
+    W25Q128_Emu_Report(stdout, "ota_writer", &emu, &lat, IMAGE_SIZE,
+                                        W25Q128_Emu_GetTimeNs() - start);
+    EMU_CHECK(W25Q128_FastRead(&w25, SLOT_ADDR / W25Q128_PAGE_SIZE, 0,
+                                    IMAGE_SIZE, check) == W25Q128_SUCCESS);
+    EMU_CHECK(memcmp(check, image, IMAGE_SIZE) == 0);
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
@@ -0,0 +1,142 @@
+/**
+ * @file bench_stripe.c
+ * @brief Striped littlefs block device on 1, 2 and 4 devices
+ * @author Filip Stojanovic
+ *
+ * Built only with LITTLEFS=<path> (see Makefile). Every device sits on its
+ * own SPI bus, so DMA transfers of different devices overlap. For both
+ * layouts (whole blocks per device and 1 KB interleave) a 512 KB file is
+ * written in 4 KB writes and read back, one JSON line per workload and
+ * device count. Bus counters in the report are those of the first device.
+ */
+
+#include "emu_test.h"
+#include "lfs.h"
+#include "w25q128_stripe_lfs.h"
+
+#define MAX_CHIPS  4
+#define CHIP_SIZE  (4 * 1024 * 1024)
+#define FILE_SIZE  (512 * 1024)
+#define CHUNK_SIZE 4096
+
+static SPI_HandleTypeDef hspi[MAX_CHIPS];
+static GPIO_TypeDef gpio[MAX_CHIPS];
+static W25Q128_EmuTypeDef emu[MAX_CHIPS];
+static W25Q128_TypeDef w25[MAX_CHIPS];
+static W25Q128_AsyncTypeDef async[MAX_CHIPS];
+static W25Q128_AsyncTypeDef *chips[MAX_CHIPS];
+static w25q128_stripe_t stripe;
+static W25Q128_EmuLatencyTypeDef lat;
+static lfs_t lfs;
+static lfs_file_t file;
+static uint8_t data[CHUNK_SIZE];
+static uint8_t check[CHUNK_SIZE];
+static uint64_t start;
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    w25q128_stripe_dma_cplt(&stripe, hspi);
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    w25q128_stripe_dma_cplt(&stripe, hspi);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    w25q128_stripe_dma_cplt(&stripe, hspi);
+}
+
+static void workload_start(void)
+{
+    memset(&lat, 0, sizeof(lat));
+    W25Q128_Emu_ResetStats(&emu[0]);
+    start = W25Q128_Emu_GetTimeNs();
+}
+
+static void workload_end(const char *layout, const char *op,
+                                                    uint8_t num_chips)
+{
+    char name[48];
+
+    snprintf(name, sizeof(name), "stripe_%s_%s_%u", layout, op,
+                                                    (unsigned)num_chips);
+    W25Q128_Emu_Report(stdout, name, &emu[0], &lat, FILE_SIZE,
+                                        W25Q128_Emu_GetTimeNs() - start);
+}
+
+static void run(uint8_t num_chips, uint32_t stripe_size, const char *layout)
+{
+    struct lfs_config cfg = {
+        .context = &stripe,
+        .read = w25q128_stripe_read,
+        .prog = w25q128_stripe_prog,
+        .erase = w25q128_stripe_erase,
+        .sync = w25q128_stripe_sync,
+        .read_size = 16,
+        .prog_size = 16,
+        .block_cycles = 500,
+        .cache_size = 1024,
+        .lookahead_size = 32,
+    };
+
+    for (uint8_t i = 0; i < num_chips; i++)
+    {
+        emu_test_device(&emu[i], &w25[i], &hspi[i], &gpio[i], CHIP_SIZE);
+        W25Q128_Reset(&w25[i]);
+        W25Q128_Async_Init(&async[i], &w25[i]);
+        chips[i] = &async[i];
+    }
+    EMU_CHECK(w25q128_stripe_init(&stripe, chips, num_chips,
+                                                        stripe_size) == 0);
+    cfg.block_size = w25q128_stripe_block_size(&stripe);
+    cfg.block_count = w25q128_stripe_block_count(&stripe);
+
+    EMU_CHECK(lfs_format(&lfs, &cfg) == 0);
+    EMU_CHECK(lfs_mount(&lfs, &cfg) == 0);
+
+    workload_start();
+    EMU_CHECK(lfs_file_open(&lfs, &file, "data",
+                                    LFS_O_WRONLY | LFS_O_CREAT) == 0);
+    for (uint32_t pos = 0; pos < FILE_SIZE; pos += CHUNK_SIZE)
+    {
+        uint64_t op_start = W25Q128_Emu_GetTimeNs();
+
+        emu_test_fill(data, CHUNK_SIZE, pos / CHUNK_SIZE);
+        EMU_CHECK(lfs_file_write(&lfs, &file, data, CHUNK_SIZE) ==
+                                                                CHUNK_SIZE);
+        W25Q128_Emu_LatencyAdd(&lat, W25Q128_Emu_GetTimeNs() - op_start);
+    }
+    EMU_CHECK(lfs_file_close(&lfs, &file) == 0);
+    workload_end(layout, "write", num_chips);
+
+    workload_start();
+    EMU_CHECK(lfs_file_open(&lfs, &file, "data", LFS_O_RDONLY) == 0);
+    for (uint32_t pos = 0; pos < FILE_SIZE; pos += CHUNK_SIZE)
+    {
+        uint64_t op_start = W25Q128_Emu_GetTimeNs();
+
+        EMU_CHECK(lfs_file_read(&lfs, &file, check, CHUNK_SIZE) ==
+                                                                CHUNK_SIZE);
+        W25Q128_Emu_LatencyAdd(&lat, W25Q128_Emu_GetTimeNs() - op_start);
+        emu_test_fill(data, CHUNK_SIZE, pos / CHUNK_SIZE);
+        EMU_CHECK(memcmp(data, check, CHUNK_SIZE) == 0);
+    }
+    EMU_CHECK(lfs_file_close(&lfs, &file) == 0);
+    workload_end(layout, "read", num_chips);
+
+    EMU_CHECK(lfs_unmount(&lfs) == 0);
+    for (uint8_t i = 0; i < num_chips; i++)
+        W25Q128_Emu_Deinit(&emu[i]);
+}
+
+int main(void)
+{
+    for (uint8_t n = 1; n <= MAX_CHIPS; n *= 2)
+        run(n, 0, "block");
+    for (uint8_t n = 1; n <= MAX_CHIPS; n *= 2)
+        run(n, 1024, "interleave");
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+/**
+ * @file bench_suspend.c
+ * @brief Read latency during erases, with and without suspend
+ * @author Filip Stojanovic
+ *
+ * Sector erases run back to back through the asynchronous queue, a 256 byte
+ * read arrives at a random time during each of them. The application calls
+ * W25Q128_Async_Process every 50 us. Built once as is and once with
+ * W25Q128_ASYNC_MAX_SUSPEND 0 (bench_suspend_off), the latency histogram of
+ * the reads is reported.
+ */
+
+#include "emu_test.h"
+#include "w25q128_async_ll.h"
+
+#define ERASES          200
+#define READ_SIZE       256
+#define PROCESS_STEP_NS (50 * 1000ULL)
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_AsyncTypeDef async;
+static W25Q128_EmuLatencyTypeDef lat;
+static uint8_t data[READ_SIZE];
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+// Application work between two Process calls
+static void process_step(void)
+{
+    W25Q128_Emu_Advance(PROCESS_STEP_NS);
+    (void)HAL_GetTick();
+    W25Q128_Async_Process(&async);
+}
+
+int main(void)
+{
+    W25Q128_AsyncTransferTypeDef erase;
+    W25Q128_AsyncTransferTypeDef read;
+    uint64_t start;
+    uint64_t elapsed;
+
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+    W25Q128_Async_Init(&async, &w25);
+    srand(9);
+
+    W25Q128_Emu_ResetStats(&emu);
+    start = W25Q128_Emu_GetTimeNs();
+    for (uint32_t i = 0; i < ERASES; i++)
+    {
+        uint32_t steps = rand() % 800;
+        uint64_t read_start;
+
+        EMU_CHECK(W25Q128_Async_EraseSector(&async, &erase, 16 + i, NULL,
+                                                NULL) == W25Q128_SUCCESS);
+        for (uint32_t s = 0; s < steps && !W25Q128_Async_IsDone(&erase); s++)
+            process_step();
+
+        read_start = W25Q128_Emu_GetTimeNs();
+        EMU_CHECK(W25Q128_Async_Read(&async, &read, (rand() % 16) * 4096,
+                        data, READ_SIZE, NULL, NULL) == W25Q128_SUCCESS);
+        while (!W25Q128_Async_IsDone(&read))
+            process_step();
+        EMU_CHECK(read.status == W25Q128_SUCCESS);
+        W25Q128_Emu_LatencyAdd(&lat, W25Q128_Emu_GetTimeNs() - read_start);
+
+        while (!W25Q128_Async_IsDone(&erase))
+            process_step();
+        EMU_CHECK(erase.status == W25Q128_SUCCESS);
+    }
+    elapsed = W25Q128_Emu_GetTimeNs() - start;
+
+    W25Q128_Emu_Report(stdout, (W25Q128_ASYNC_MAX_SUSPEND > 0) ?
+                            "read_during_erase_suspend" :
+                            "read_during_erase_no_suspend", &emu, &lat,
+                            (uint64_t)ERASES * READ_SIZE, elapsed);
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
@@ -0,0 +1,57 @@
+/**
+ * @file lfs.h
+ * @brief Host replacement of the littlefs subset used by the littlefs layer
+ * @author Filip Stojanovic
+ *
+ * Lets the tests build the w25q128_lfs and w25q128_stripe_lfs hooks without
+ * a littlefs checkout and call them directly with a hand-built lfs_config.
+ * Types, error codes and lfs_config follow littlefs v2, lfs_t is opaque and
+ * lfs_fs_traverse is defined by the test that needs it. Programs built with
+ * LITTLEFS=<path> use the real header instead.
+ */
+
+#ifndef LFS_H
+#define LFS_H
+
+#include <stdint.h>
+
+typedef uint32_t lfs_size_t;
+typedef uint32_t lfs_off_t;
+typedef int32_t lfs_ssize_t;
+typedef int32_t lfs_soff_t;
+typedef uint32_t lfs_block_t;
+
+enum lfs_error {
+    LFS_ERR_OK = 0,
+    LFS_ERR_IO = -5,
+    LFS_ERR_CORRUPT = -84,
+    LFS_ERR_NOENT = -2,
+    LFS_ERR_INVAL = -22,
+    LFS_ERR_NOSPC = -28,
+};
+
+struct lfs_config {
+    void *context;
+    int (*read)(const struct lfs_config *c, lfs_block_t block,
+                                lfs_off_t off, void *buffer, lfs_size_t size);
+    int (*prog)(const struct lfs_config *c, lfs_block_t block,
+                        lfs_off_t off, const void *buffer, lfs_size_t size);
+    int (*erase)(const struct lfs_config *c, lfs_block_t block);
+    int (*sync)(const struct lfs_config *c);
+    lfs_size_t read_size;
+    lfs_size_t prog_size;
+    lfs_size_t block_size;
+    lfs_size_t block_count;
+    int32_t block_cycles;
+    lfs_size_t cache_size;
+    lfs_size_t lookahead_size;
+};
+
+typedef struct lfs {
+    const struct lfs_config *cfg;
+} lfs_t;
+
+int lfs_fs_traverse(lfs_t *lfs, int (*cb)(void *data, lfs_block_t block),
+                                                                void *data);
+
+#endif
@@ -0,0 +1,165 @@
+/**
+ * @file stm32f4xx_hal.h
+ * @brief Host replacement of the STM32 HAL subset used by the w25q128 driver
+ * @author Filip Stojanovic
+ *
+ * Shadows the real HAL header when host-emulator directory is first in the
+ * include path. SPI transfers and chip select are routed to the emulated
+ * devices (see w25q128_emu.h), HAL_Delay and HAL_GetTick run on the virtual
+ * clock of the emulator.
+ */
+
+#ifndef STM32F4XX_HAL_SHIM_H
+#define STM32F4XX_HAL_SHIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {
+    HAL_OK = 0x00,
+    HAL_ERROR = 0x01,
+    HAL_BUSY = 0x02,
+    HAL_TIMEOUT = 0x03,
+} HAL_StatusTypeDef;
+
+typedef enum {
+    GPIO_PIN_RESET = 0,
+    GPIO_PIN_SET = 1,
+} GPIO_PinState;
+
+typedef struct {
+    uint32_t ODR;
+} GPIO_TypeDef;
+
+typedef enum {
+    HAL_SPI_STATE_RESET = 0x00,
+    HAL_SPI_STATE_READY = 0x01,
+    HAL_SPI_STATE_BUSY = 0x02,
+    HAL_SPI_STATE_BUSY_TX = 0x03,
+    HAL_SPI_STATE_BUSY_RX = 0x04,
+    HAL_SPI_STATE_BUSY_TX_RX = 0x05,
+    HAL_SPI_STATE_ERROR = 0x06,
+} HAL_SPI_StateTypeDef;
+
+typedef struct __SPI_HandleTypeDef {
+    volatile HAL_SPI_StateTypeDef State;
+    // DMA transfer whose callback is not called yet and its completion time
+    uint8_t pending_cplt;
+    uint64_t cplt_ns;
+} SPI_HandleTypeDef;
+
+/*
+ * QUADSPI peripheral, commands are clocked through the emulated devices
+ * attached with W25Q128_Emu_InitQspi. Mode constants are the number of lines
+ * and sizes are in bytes, DDR is not supported.
+ */
+#define HAL_QSPI_MODULE_ENABLED
+
+typedef struct {
+    uint32_t Instruction;
+    uint32_t Address;
+    uint32_t AlternateBytes;
+    uint32_t AddressSize;
+    uint32_t AlternateBytesSize;
+    uint32_t DummyCycles;
+    uint32_t InstructionMode;
+    uint32_t AddressMode;
+    uint32_t AlternateByteMode;
+    uint32_t DataMode;
+    uint32_t NbData;
+    uint32_t DdrMode;
+    uint32_t DdrHoldHalfCycle;
+    uint32_t SIOOMode;
+} QSPI_CommandTypeDef;
+
+typedef struct {
+    // Data phase of the last command, sent by Transmit or Receive
+    uint32_t data_lines;
+    uint32_t data_size;
+} QSPI_HandleTypeDef;
+
+#define QSPI_INSTRUCTION_NONE        0U
+#define QSPI_INSTRUCTION_1_LINE      1U
+#define QSPI_INSTRUCTION_2_LINES     2U
+#define QSPI_INSTRUCTION_4_LINES     4U
+#define QSPI_ADDRESS_NONE            0U
+#define QSPI_ADDRESS_1_LINE          1U
+#define QSPI_ADDRESS_2_LINES         2U
+#define QSPI_ADDRESS_4_LINES         4U
+#define QSPI_ALTERNATE_BYTES_NONE    0U
+#define QSPI_ALTERNATE_BYTES_1_LINE  1U
+#define QSPI_ALTERNATE_BYTES_2_LINES 2U
+#define QSPI_ALTERNATE_BYTES_4_LINES 4U
+#define QSPI_DATA_NONE               0U
+#define QSPI_DATA_1_LINE             1U
+#define QSPI_DATA_2_LINES            2U
+#define QSPI_DATA_4_LINES            4U
+#define QSPI_ADDRESS_24_BITS         3U
+#define QSPI_ADDRESS_32_BITS         4U
+#define QSPI_ALTERNATE_BYTES_8_BITS  1U
+#define QSPI_DDR_MODE_DISABLE        0U
+#define QSPI_DDR_MODE_ENABLE         1U
+#define QSPI_DDR_HHC_ANALOG_DELAY    0U
+#define QSPI_SIOO_INST_EVERY_CMD     0U
+
+#define GPIO_PIN_0  ((uint16_t)0x0001)
+#define GPIO_PIN_1  ((uint16_t)0x0002)
+#define GPIO_PIN_2  ((uint16_t)0x0004)
+#define GPIO_PIN_3  ((uint16_t)0x0008)
+#define GPIO_PIN_4  ((uint16_t)0x0010)
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin,
+                                                    GPIO_PinState PinState);
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *pData,
+                                            uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *hspi, uint8_t *pData,
+                                            uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef *hspi,
+                                uint8_t *pTxData, uint8_t *pRxData,
+                                uint16_t Size, uint32_t Timeout);
+
+/*
+ * DMA transfers take bus time without stopping the CPU, completion callback
+ * is called from the first HAL_GetTick, HAL_Delay or HAL_SPI_GetState call
+ * after the transfer time, the same way an interrupt would preempt the
+ * polling code.
+ */
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData,
+                                                                uint16_t Size);
+HAL_StatusTypeDef HAL_SPI_Receive_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData,
+                                                                uint16_t Size);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef *hspi,
+                                uint8_t *pTxData, uint8_t *pRxData,
+                                uint16_t Size);
+HAL_SPI_StateTypeDef HAL_SPI_GetState(SPI_HandleTypeDef *hspi);
+
+HAL_StatusTypeDef HAL_QSPI_Command(QSPI_HandleTypeDef *hqspi,
+                                QSPI_CommandTypeDef *cmd, uint32_t Timeout);
+HAL_StatusTypeDef HAL_QSPI_Transmit(QSPI_HandleTypeDef *hqspi, uint8_t *pData,
+                                                            uint32_t Timeout);
+HAL_StatusTypeDef HAL_QSPI_Receive(QSPI_HandleTypeDef *hqspi, uint8_t *pData,
+                                                            uint32_t Timeout);
+
+// Weak, can be overridden like on target
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi);
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi);
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi);
+
+void HAL_Delay(uint32_t Delay);
+uint32_t HAL_GetTick(void);
+
+// Core clock of the CMSIS system file. Spin loops take no virtual time, so
+// programs define W25Q128_POWER_DELAY_US as HAL_Shim_DelayUs, which does.
+extern uint32_t SystemCoreClock;
+void HAL_Shim_DelayUs(uint32_t delay_us);
+
+// Deferred DMA callbacks are the only "interrupts", PRIMASK holds them back
+extern volatile uint32_t hal_shim_primask;
+
+static inline uint32_t __get_PRIMASK(void) { return hal_shim_primask; }
+static inline void __set_PRIMASK(uint32_t primask) { hal_shim_primask = primask; }
+static inline void __disable_irq(void) { hal_shim_primask = 1; }
+static inline void __enable_irq(void) { hal_shim_primask = 0; }
+
+#endif
@@ -0,0 +1,293 @@
+/**
+ * @file stm32f4xx_hal_shim.c
+ * @brief Host replacement of the STM32 HAL subset used by the w25q128 driver
+ * @author Filip Stojanovic
+ */
+
+#include "stm32f4xx_hal.h"
+#include "w25q128_emu.h"
+
+// Virtual time spent by every HAL_GetTick call, keeps polling loops moving
+#define HAL_SHIM_GET_TICK_NS 100
+
+#define HAL_SHIM_MAX_SPI 8
+
+typedef enum {
+    SHIM_CPLT_NONE = 0,
+    SHIM_CPLT_TX = 1,
+    SHIM_CPLT_RX = 2,
+    SHIM_CPLT_TX_RX = 3,
+} ShimCpltTypeDef;
+
+volatile uint32_t hal_shim_primask;
+uint32_t SystemCoreClock = 168000000;
+
+// Handles that have started a DMA transfer
+static SPI_HandleTypeDef *spi_handles[HAL_SHIM_MAX_SPI];
+
+/*************************** Static functions *********************************/
+static HAL_StatusTypeDef spi_start_dma(SPI_HandleTypeDef *hspi,
+                                uint8_t *tx, uint8_t *rx, uint16_t size,
+                                ShimCpltTypeDef cplt,
+                                HAL_SPI_StateTypeDef state);
+static void spi_deliver(SPI_HandleTypeDef *hspi);
+static void spi_deliver_all(void);
+static HAL_StatusTypeDef qspi_data(QSPI_HandleTypeDef *hqspi,
+                                        uint8_t *tx, uint8_t *rx);
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin,
+                                                    GPIO_PinState PinState)
+{
+    if (PinState == GPIO_PIN_SET)
+        GPIOx->ODR |= GPIO_Pin;
+    else
+        GPIOx->ODR &= ~GPIO_Pin;
+
+    W25Q128_Emu_ChipSelect(GPIOx, GPIO_Pin, PinState);
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *pData,
+                                            uint16_t Size, uint32_t Timeout)
+{
+    (void)Timeout;
+
+    if (hspi->State != HAL_SPI_STATE_READY)
+        return HAL_BUSY;
+
+    W25Q128_Emu_Transfer(hspi, pData, NULL, Size);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *hspi, uint8_t *pData,
+                                            uint16_t Size, uint32_t Timeout)
+{
+    (void)Timeout;
+
+    if (hspi->State != HAL_SPI_STATE_READY)
+        return HAL_BUSY;
+
+    W25Q128_Emu_Transfer(hspi, NULL, pData, Size);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef *hspi,
+                                uint8_t *pTxData, uint8_t *pRxData,
+                                uint16_t Size, uint32_t Timeout)
+{
+    (void)Timeout;
+
+    if (hspi->State != HAL_SPI_STATE_READY)
+        return HAL_BUSY;
+
+    W25Q128_Emu_Transfer(hspi, pTxData, pRxData, Size);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData,
+                                                                uint16_t Size)
+{
+    return spi_start_dma(hspi, pData, NULL, Size, SHIM_CPLT_TX,
+                                                    HAL_SPI_STATE_BUSY_TX);
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData,
+                                                                uint16_t Size)
+{
+    return spi_start_dma(hspi, NULL, pData, Size, SHIM_CPLT_RX,
+                                                    HAL_SPI_STATE_BUSY_RX);
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef *hspi,
+                                uint8_t *pTxData, uint8_t *pRxData,
+                                uint16_t Size)
+{
+    return spi_start_dma(hspi, pTxData, pRxData, Size, SHIM_CPLT_TX_RX,
+                                                HAL_SPI_STATE_BUSY_TX_RX);
+}
+
+HAL_SPI_StateTypeDef HAL_SPI_GetState(SPI_HandleTypeDef *hspi)
+{
+    spi_deliver(hspi);
+    return hspi->State;
+}
+
+HAL_StatusTypeDef HAL_QSPI_Command(QSPI_HandleTypeDef *hqspi,
+                                QSPI_CommandTypeDef *cmd, uint32_t Timeout)
+{
+    uint8_t header[4];
+    uint32_t dummy_lines = cmd->AddressMode ? cmd->AddressMode :
+                                                        cmd->InstructionMode;
+    (void)Timeout;
+
+    // Device counts whole bytes, dummy clocks must fill them
+    if (cmd->DdrMode != QSPI_DDR_MODE_DISABLE || 
+        (cmd->DummyCycles > 0 && 
+                (dummy_lines == 0 || (cmd->DummyCycles * dummy_lines) % 8)))
+        return HAL_ERROR;
+
+    W25Q128_Emu_QspiSelect(hqspi, GPIO_PIN_RESET);
+
+    if (cmd->InstructionMode != QSPI_INSTRUCTION_NONE)
+    {
+        header[0] = cmd->Instruction;
+        W25Q128_Emu_QspiTransfer(hqspi, header, NULL, 1, cmd->InstructionMode);
+    }
+    if (cmd->AddressMode != QSPI_ADDRESS_NONE)
+    {
+        for (uint32_t i = 0; i < cmd->AddressSize; i++)
+            header[i] = cmd->Address >> (8 * (cmd->AddressSize - 1 - i));
+        W25Q128_Emu_QspiTransfer(hqspi, header, NULL, cmd->AddressSize,
+                                                            cmd->AddressMode);
+    }
+    if (cmd->AlternateByteMode != QSPI_ALTERNATE_BYTES_NONE)
+    {
+        header[0] = cmd->AlternateBytes;
+        W25Q128_Emu_QspiTransfer(hqspi, header, NULL, 1,
+                                                    cmd->AlternateByteMode);
+    }
+    if (cmd->DummyCycles > 0)
+        W25Q128_Emu_QspiTransfer(hqspi, NULL, NULL,
+                        cmd->DummyCycles * dummy_lines / 8, dummy_lines);
+
+    hqspi->data_lines = cmd->DataMode;
+    hqspi->data_size = cmd->NbData;
+    if (cmd->DataMode == QSPI_DATA_NONE)
+        W25Q128_Emu_QspiSelect(hqspi, GPIO_PIN_SET);
+
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_QSPI_Transmit(QSPI_HandleTypeDef *hqspi, uint8_t *pData,
+                                                            uint32_t Timeout)
+{
+    (void)Timeout;
+
+    return qspi_data(hqspi, pData, NULL);
+}
+
+HAL_StatusTypeDef HAL_QSPI_Receive(QSPI_HandleTypeDef *hqspi, uint8_t *pData,
+                                                            uint32_t Timeout)
+{
+    (void)Timeout;
+
+    return qspi_data(hqspi, NULL, pData);
+}
+
+__attribute__((weak)) void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    (void)hspi;
+}
+
+__attribute__((weak)) void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    (void)hspi;
+}
+
+__attribute__((weak)) void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    (void)hspi;
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+    W25Q128_Emu_Delay(Delay * 1000000ULL);
+    spi_deliver_all();
+}
+
+uint32_t HAL_GetTick(void)
+{
+    W25Q128_Emu_Advance(HAL_SHIM_GET_TICK_NS);
+    spi_deliver_all();
+
+    return (uint32_t)(W25Q128_Emu_GetTimeNs() / 1000000ULL);
+}
+
+// Like a cycle counted spin, DMA completions wait for the next HAL call
+void HAL_Shim_DelayUs(uint32_t delay_us)
+{
+    W25Q128_Emu_Advance(delay_us * 1000ULL);
+}
+
+/*************************** Static functions *********************************/
+static HAL_StatusTypeDef spi_start_dma(SPI_HandleTypeDef *hspi,
+                                uint8_t *tx, uint8_t *rx, uint16_t size,
+                                ShimCpltTypeDef cplt,
+                                HAL_SPI_StateTypeDef state)
+{
+    uint8_t known = 0;
+
+    if (hspi->State != HAL_SPI_STATE_READY || size == 0)
+        return HAL_BUSY;
+
+    for (uint8_t i = 0; i < HAL_SHIM_MAX_SPI && !known; i++)
+    {
+        if (spi_handles[i] == hspi)
+            known = 1;
+    }
+    for (uint8_t i = 0; i < HAL_SHIM_MAX_SPI && !known; i++)
+    {
+        if (spi_handles[i] == NULL)
+        {
+            spi_handles[i] = hspi;
+            known = 1;
+        }
+    }
+    if (!known)
+        return HAL_ERROR;
+
+    // Data moves right away, only the completion is deferred
+    hspi->cplt_ns = W25Q128_Emu_TransferDMA(hspi, tx, rx, size);
+    hspi->State = state;
+    hspi->pending_cplt = cplt;
+
+    return HAL_OK;
+}
+
+static void spi_deliver(SPI_HandleTypeDef *hspi)
+{
+    ShimCpltTypeDef cplt = (ShimCpltTypeDef)hspi->pending_cplt;
+
+    if (cplt == SHIM_CPLT_NONE || hal_shim_primask ||
+                                    W25Q128_Emu_GetTimeNs() < hspi->cplt_ns)
+        return;
+
+    hspi->pending_cplt = SHIM_CPLT_NONE;
+    hspi->State = HAL_SPI_STATE_READY;
+
+    switch (cplt)
+    {
+        case SHIM_CPLT_TX:
+            HAL_SPI_TxCpltCallback(hspi);
+            break;
+        case SHIM_CPLT_RX:
+            HAL_SPI_RxCpltCallback(hspi);
+            break;
+        default:
+            HAL_SPI_TxRxCpltCallback(hspi);
+            break;
+    }
+}
+
+static void spi_deliver_all(void)
+{
+    for (uint8_t i = 0; i < HAL_SHIM_MAX_SPI; i++)
+    {
+        if (spi_handles[i] != NULL)
+            spi_deliver(spi_handles[i]);
+    }
+}
+
+// Data phase of the command, chip select goes high at its end
+static HAL_StatusTypeDef qspi_data(QSPI_HandleTypeDef *hqspi,
+                                        uint8_t *tx, uint8_t *rx)
+{
+    if (hqspi->data_lines == QSPI_DATA_NONE)
+        return HAL_ERROR;
+
+    W25Q128_Emu_QspiTransfer(hqspi, tx, rx, hqspi->data_size,
+                                                        hqspi->data_lines);
+    W25Q128_Emu_QspiSelect(hqspi, GPIO_PIN_SET);
+    hqspi->data_lines = QSPI_DATA_NONE;
+
+    return HAL_OK;
+}
\ No newline at end of file
@@ -0,0 +1,76 @@
+/**
+ * @file emu_test.h
+ * @brief Helpers of the host tests and benchmarks
+ * @author Filip Stojanovic
+ *
+ * Tests exit with 1 on the first failed check and with 0 once all checks
+ * have passed, benchmarks print their results with W25Q128_Emu_Report.
+ */
+
+#ifndef EMU_TEST_H
+#define EMU_TEST_H
+
+#include "w25q128_emu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EMU_CHECK(cond)                                                     \
+    do {                                                                    \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,          \
+                                                        __LINE__, #cond);   \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+// Virtual time in microseconds
+#define EMU_TIME_US() (W25Q128_Emu_GetTimeNs() / 1000)
+
+/**
+ * @brief Function that creates an emulated device in memory and a driver
+ *        struct connected to it
+ * @param emu Pointer to the emulator struct
+ * @param w25 Pointer to the flash configuration struct, zeroed first
+ * @param hspi SPI handle of the device
+ * @param cs_port Chip select port
+ * @param capacity Memory size in bytes
+ * @return None
+ */
+static inline void emu_test_device(W25Q128_EmuTypeDef *emu,
+                                    W25Q128_TypeDef *w25,
+                                    SPI_HandleTypeDef *hspi,
+                                    GPIO_TypeDef *cs_port, uint32_t capacity)
+{
+    EMU_CHECK(W25Q128_Emu_InitSize(emu, hspi, cs_port, GPIO_PIN_4, NULL,
+                                            capacity) == W25Q128_SUCCESS);
+
+    memset(w25, 0, sizeof(*w25));
+    w25->hspi = hspi;
+    w25->cs_port = cs_port;
+    w25->cs_pin = GPIO_PIN_4;
+}
+
+/**
+ * @brief Function that fills a buffer with reproducible pseudo-random data
+ * @param data Pointer to the buffer
+ * @param size Buffer size
+ * @param seed Seed, the same seed gives the same data
+ * @return None
+ */
+static inline void emu_test_fill(uint8_t *data, uint32_t size, uint32_t seed)
+{
+    uint32_t x = seed * 2654435761u + 1;
+
+    for (uint32_t i = 0; i < size; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        data[i] = x >> 24;
+    }
+}
+
+#endif
@@ -0,0 +1,114 @@
+/**
+ * @file test_async_instr.c
+ * @brief Instrumentation counters of the asynchronous queue
+ * @author Filip Stojanovic
+ *
+ * Built with W25Q128_INSTRUMENTATION. Erases, page programs and reads that
+ * the async queue completes, also an erase suspended by a read, must count
+ * like those of the blocking functions: once per erased sector and once in
+ * the latency histogram of their kind, in the same bucket as a blocking
+ * erase. Transfers that fail are not counted.
+ */
+
+#include "emu_test.h"
+#include "w25q128_async_ll.h"
+
+#define ERASE_SECTOR 3
+#define SYNC_SECTOR  4
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_AsyncTypeDef async;
+static W25Q128_InstrumentationTypeDef instr;
+static uint8_t data[W25Q128_PAGE_SIZE];
+static uint8_t check[W25Q128_PAGE_SIZE];
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+static uint32_t hist_sum(const uint32_t *hist)
+{
+    uint32_t sum = 0;
+
+    for (uint32_t i = 0; i < W25Q128_INSTR_HIST_BUCKETS; i++)
+        sum += hist[i];
+    return sum;
+}
+
+int main(void)
+{
+    W25Q128_AsyncTransferTypeDef erase;
+    W25Q128_AsyncTransferTypeDef prog;
+    W25Q128_AsyncTransferTypeDef read;
+    uint32_t bucket;
+
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+    W25Q128_Async_Init(&async, &w25);
+    emu_test_fill(data, sizeof(data), 14);
+
+    // Not blank, so no erase is skipped
+    memset(emu.mem + SYNC_SECTOR * W25Q128_SECTOR_SIZE, 0, W25Q128_PAGE_SIZE);
+    W25Q128_ResetInstrumentation(&w25);
+
+    // Blocking erase for reference
+    EMU_CHECK(W25Q128_EraseSector(&w25, SYNC_SECTOR) == W25Q128_SUCCESS);
+    W25Q128_GetInstrumentation(&w25, &instr);
+    EMU_CHECK(instr.sector_erases[SYNC_SECTOR] == 1);
+    EMU_CHECK(hist_sum(instr.erase_hist) == 1);
+    for (bucket = 0; instr.erase_hist[bucket] == 0; bucket++)
+        ;
+    W25Q128_ResetInstrumentation(&w25);
+
+    // Erase suspended by a read, then a page program in the erased sector
+    EMU_CHECK(W25Q128_Async_EraseSector(&async, &erase, ERASE_SECTOR, NULL,
+                                                    NULL) == W25Q128_SUCCESS);
+    while (async.state != W25Q128_ASYNC_STATE_WAIT_WIP)
+        (void)HAL_GetTick();
+    EMU_CHECK(W25Q128_Async_Read(&async, &read, 0, check, sizeof(check), NULL,
+                                                    NULL) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Async_Wait(&async, &read, 100) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Async_WritePage(&async, &prog,
+                        ERASE_SECTOR * W25Q128_SECTOR_SIZE, data,
+                        sizeof(data), NULL, NULL) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Async_Wait(&async, &erase, 1000) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Async_Wait(&async, &prog, 100) == W25Q128_SUCCESS);
+    EMU_CHECK(emu.stats.suspends == 1);
+
+    W25Q128_GetInstrumentation(&w25, &instr);
+    EMU_CHECK(instr.sector_erases[ERASE_SECTOR] == 1);
+    EMU_CHECK(instr.sector_erases[SYNC_SECTOR] == 0);
+    EMU_CHECK(hist_sum(instr.erase_hist) == 1);
+    EMU_CHECK(instr.erase_hist[bucket] == 1);
+    EMU_CHECK(hist_sum(instr.program_hist) == 1);
+    EMU_CHECK(hist_sum(instr.read_hist) == 1);
+
+    // Program that times out is not counted
+    emu.timing.page_program_us = 50 * 1000;
+    EMU_CHECK(W25Q128_Async_WritePage(&async, &prog,
+                        ERASE_SECTOR * W25Q128_SECTOR_SIZE + sizeof(data),
+                        data, sizeof(data), NULL, NULL) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Async_Wait(&async, &prog, 100) ==
+                                                    W25Q128_ERROR_TIMEOUT);
+    EMU_CHECK(W25Q128_WaitForReady(&w25, 100) == W25Q128_READY);
+    W25Q128_GetInstrumentation(&w25, &instr);
+    EMU_CHECK(hist_sum(instr.program_hist) == 1);
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
@@ -0,0 +1,135 @@
+/**
+ * @file test_async_suspend.c
+ * @brief Erase suspend for queued reads and late W25Q128_Async_Process calls
+ * @author Filip Stojanovic
+ *
+ * A read queued during an erase suspends it. If Process is called late, the
+ * device has long been suspended with WIP clear: the read must be served and
+ * the erase resumed, not reported finished. A device that stays busy for
+ * longer than the suspend timeout with SUS set is waited for as well, and no
+ * suspend follows a resume within tRS.
+ */
+
+#include "emu_test.h"
+#include "w25q128_async_ll.h"
+
+#define ERASE_SECTOR 3
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_AsyncTypeDef async;
+static uint8_t data[W25Q128_PAGE_SIZE];
+static uint8_t check[W25Q128_PAGE_SIZE];
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+static void wait_for_state(W25Q128_AsyncStateTypeDef state)
+{
+    while (async.state != state)
+        (void)HAL_GetTick();
+}
+
+// Erases a programmed sector while a read of another sector is queued
+static void erase_with_read(uint64_t process_delay_ns)
+{
+    W25Q128_AsyncTransferTypeDef erase;
+    W25Q128_AsyncTransferTypeDef read;
+    uint32_t suspends = emu.stats.suspends;
+
+    EMU_CHECK(W25Q128_WritePage(&w25, ERASE_SECTOR * 16, 0, sizeof(data),
+                                                    data) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Async_EraseSector(&async, &erase, ERASE_SECTOR, NULL,
+                                                    NULL) == W25Q128_SUCCESS);
+    wait_for_state(W25Q128_ASYNC_STATE_WAIT_WIP);
+    EMU_CHECK(W25Q128_Async_Read(&async, &read, 0, check, sizeof(check), NULL,
+                                                    NULL) == W25Q128_SUCCESS);
+
+    // Suspend is sent, after that nobody looks at the queue for a while
+    while (async.state != W25Q128_ASYNC_STATE_SUSPEND_WAIT)
+    {
+        W25Q128_Async_Process(&async);
+        (void)HAL_GetTick();
+    }
+    W25Q128_Emu_Advance(process_delay_ns);
+
+    EMU_CHECK(W25Q128_Async_Wait(&async, &read, 100) == W25Q128_SUCCESS);
+    EMU_CHECK(memcmp(data, check, sizeof(check)) == 0);
+    EMU_CHECK(emu.stats.suspends == suspends + 1);
+    EMU_CHECK(!W25Q128_Async_IsDone(&erase));
+
+    EMU_CHECK(W25Q128_Async_Wait(&async, &erase, 1000) == W25Q128_SUCCESS);
+    EMU_CHECK(!emu.suspended && emu.op == 0);
+    EMU_CHECK(emu.mem[ERASE_SECTOR * W25Q128_SECTOR_SIZE] == 0xFF);
+}
+
+/*
+ * A read queued right after a resume may suspend the erase again only once
+ * tRS has passed. The resume is moved across a tick in steps, so some land
+ * just before the tick changes.
+ */
+static void reads_after_resume(void)
+{
+    W25Q128_AsyncTransferTypeDef erase;
+    W25Q128_AsyncTransferTypeDef read;
+    uint32_t ignored = emu.stats.ignored;
+
+    for (uint32_t offset_us = 0; offset_us < 1000; offset_us += 10)
+    {
+        EMU_CHECK(W25Q128_Async_EraseSector(&async, &erase, ERASE_SECTOR,
+                                            NULL, NULL) == W25Q128_SUCCESS);
+        wait_for_state(W25Q128_ASYNC_STATE_WAIT_WIP);
+        W25Q128_Emu_Advance(offset_us * 1000ULL);
+
+        EMU_CHECK(W25Q128_Async_Read(&async, &read, 0, check, sizeof(check),
+                                            NULL, NULL) == W25Q128_SUCCESS);
+        EMU_CHECK(W25Q128_Async_Wait(&async, &read, 100) == W25Q128_SUCCESS);
+        wait_for_state(W25Q128_ASYNC_STATE_WAIT_WIP);
+        EMU_CHECK(W25Q128_Async_Read(&async, &read, 0, check, sizeof(check),
+                                            NULL, NULL) == W25Q128_SUCCESS);
+        EMU_CHECK(W25Q128_Async_Wait(&async, &read, 100) == W25Q128_SUCCESS);
+        EMU_CHECK(memcmp(data, check, sizeof(check)) == 0);
+
+        EMU_CHECK(W25Q128_Async_Wait(&async, &erase, 1000) ==
+                                                            W25Q128_SUCCESS);
+        EMU_CHECK(emu.stats.ignored == ignored);
+    }
+}
+
+int main(void)
+{
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+    W25Q128_Async_Init(&async, &w25);
+    emu_test_fill(data, sizeof(data), 9);
+    EMU_CHECK(W25Q128_WritePage(&w25, 0, 0, sizeof(data), data) ==
+                                                            W25Q128_SUCCESS);
+
+    // Process is called right away, 5 ms later and 100 ms later
+    erase_with_read(0);
+    erase_with_read(5 * 1000 * 1000ULL);
+    erase_with_read(100 * 1000 * 1000ULL);
+    reads_after_resume();
+
+    // Device that takes longer than W25Q128_TIMEOUT_SUSPEND_MS to suspend
+    emu.timing.suspend_us = 5000;
+    erase_with_read(0);
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+/**
+ * @file test_async_timeout.c
+ * @brief Operation timeout of the asynchronous queue
+ * @author Filip Stojanovic
+ *
+ * W25Q128_Async_Process can be called late, i.e. after a long task switch.
+ * An operation that has finished in the meantime must complete successfully,
+ * only an operation the device still reports BUSY for may time out. A bulk
+ * program on such a device fails and leaves none of its pages queued.
+ * Timeouts follow the erase times read by W25Q128_InitSFDP.
+ */
+
+#include "emu_test.h"
+#include "w25q128_async_ll.h"
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_AsyncTypeDef async;
+static uint8_t data[4 * W25Q128_PAGE_SIZE];
+static uint8_t check[W25Q128_PAGE_SIZE];
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+// Runs DMA until the operation has been sent and waits for WIP
+static void wait_for_wip_state(void)
+{
+    while (async.state != W25Q128_ASYNC_STATE_WAIT_WIP)
+        (void)HAL_GetTick();
+}
+
+int main(void)
+{
+    W25Q128_AsyncTransferTypeDef xfer;
+
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+    W25Q128_Async_Init(&async, &w25);
+    emu_test_fill(data, sizeof(data), 3);
+
+    // Program finishes while nobody calls Process for 10 ms
+    EMU_CHECK(W25Q128_Async_WritePage(&async, &xfer, 0, data, sizeof(check),
+                                            NULL, NULL) == W25Q128_SUCCESS);
+    wait_for_wip_state();
+    W25Q128_Emu_Advance(10 * 1000 * 1000ULL);
+    EMU_CHECK(W25Q128_Async_Wait(&async, &xfer, 100) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Read(&w25, 0, 0, sizeof(check), check) ==
+                                                            W25Q128_SUCCESS);
+    EMU_CHECK(memcmp(data, check, sizeof(check)) == 0);
+
+    // Same for an erase, 1 s after its end
+    EMU_CHECK(W25Q128_Async_EraseSector(&async, &xfer, 0, NULL, NULL) ==
+                                                            W25Q128_SUCCESS);
+    wait_for_wip_state();
+    W25Q128_Emu_Advance(1000 * 1000 * 1000ULL);
+    EMU_CHECK(W25Q128_Async_Wait(&async, &xfer, 100) == W25Q128_SUCCESS);
+
+    // Device that is still busy after the page program timeout
+    emu.timing.page_program_us = 50 * 1000;
+    EMU_CHECK(W25Q128_Async_WritePage(&async, &xfer, 0, data, sizeof(check),
+                                            NULL, NULL) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Async_Wait(&async, &xfer, 100) ==
+                                                    W25Q128_ERROR_TIMEOUT);
+    EMU_CHECK(W25Q128_Async_IsDone(&xfer));
+    EMU_CHECK(W25Q128_WaitForReady(&w25, 100) == W25Q128_READY);
+
+    // Bulk program returns after the first page times out, queue is empty
+    EMU_CHECK(W25Q128_EraseSector(&w25, 1) == W25Q128_SUCCESS);
+    W25Q128_Emu_ResetStats(&emu);
+    EMU_CHECK(W25Q128_Async_ProgramBulk(&async, W25Q128_SECTOR_SIZE, data,
+                            sizeof(data), NULL) == W25Q128_ERROR_TIMEOUT);
+    EMU_CHECK(async.count == 0 && async.current == NULL);
+    EMU_CHECK(emu.stats.commands[INST_PAGE_PROGRAM] == 1);
+    EMU_CHECK(W25Q128_WaitForReady(&w25, 100) == W25Q128_READY);
+
+    // Same range once the device is back to its program time
+    emu.timing.page_program_us = 400;
+    EMU_CHECK(W25Q128_EraseSector(&w25, 1) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Async_ProgramBulk(&async, W25Q128_SECTOR_SIZE, data,
+                                    sizeof(data), NULL) == W25Q128_SUCCESS);
+    EMU_CHECK(memcmp(emu.mem + W25Q128_SECTOR_SIZE, data, sizeof(data)) == 0);
+
+    // SFDP allows 576 ms for a sector erase, more than the 400 ms default
+    EMU_CHECK(W25Q128_InitSFDP(&w25) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_GetTimeout(&w25, INST_SECTOR_ERASE_4KB) == 576);
+    emu.timing.sector_erase_us = 500 * 1000;
+    EMU_CHECK(W25Q128_Async_EraseSector(&async, &xfer, 2, NULL, NULL) ==
+                                                            W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Async_Wait(&async, &xfer, 1000) == W25Q128_SUCCESS);
+    EMU_CHECK(emu.mem[2 * W25Q128_SECTOR_SIZE] == 0xFF);
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
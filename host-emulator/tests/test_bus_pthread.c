@@ -0,0 +1,173 @@
+/**
+ * @file test_bus_pthread.c
+ * @brief Shared bus arbiter with the pthread backend
+ * @author Filip Stojanovic
+ *
+ * Built with W25Q128_BUS_LOCK_PTHREAD and four waiter slots. While the main
+ * thread owns the bus, threads of different priorities queue for it one by
+ * one; on release the bus must pass to them by priority, FIFO among equal
+ * ones, and a thread that finds every slot taken must get an error instead
+ * of waiting. Then four threads program and read back their own pages of
+ * one device through the bus: every WREN, page program and busy poll must
+ * run as one sequence, so the device never sees a command while it is busy
+ * and every page holds the data of its thread.
+ */
+
+#include "emu_test.h"
+#include "w25q128_bus_ll.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#define WAITERS 4
+#define WRITERS 4
+#define PAGES   64
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_BusTypeDef bus;
+
+// Priorities of the queued threads, in the order they start waiting
+static const uint32_t priority[WAITERS] = { 1, 3, 2, 3 };
+static uint32_t order[WAITERS];
+static uint32_t served;
+static W25Q128_StatusTypeDef overflow_status;
+
+static uint8_t waiters(void)
+{
+    uint8_t num;
+
+    pthread_mutex_lock(&bus.mutex);
+    num = bus.num_waiters;
+    pthread_mutex_unlock(&bus.mutex);
+
+    return num;
+}
+
+static void *waiter(void *arg)
+{
+    uint32_t id = (uint32_t)(uintptr_t)arg;
+
+    W25Q128_Bus_SetPriority(priority[id]);
+    EMU_CHECK(W25Q128_Bus_Acquire(&bus) == W25Q128_SUCCESS);
+    order[served++] = id;
+    W25Q128_Bus_Release(&bus);
+
+    return NULL;
+}
+
+static void *overflow(void *arg)
+{
+    (void)arg;
+
+    overflow_status = W25Q128_Bus_Acquire(&bus);
+
+    return NULL;
+}
+
+static void *writer(void *arg)
+{
+    uint32_t id = (uint32_t)(uintptr_t)arg;
+    uint8_t data[W25Q128_PAGE_SIZE];
+    uint8_t check[W25Q128_PAGE_SIZE];
+
+    W25Q128_Bus_SetPriority(id);
+    for (uint32_t i = 0; i < PAGES; i++)
+    {
+        uint32_t page = i * WRITERS + id;
+
+        emu_test_fill(data, sizeof(data), page);
+        EMU_CHECK(W25Q128_WritePage(&w25, page, 0, sizeof(data), data) ==
+                                                            W25Q128_SUCCESS);
+        EMU_CHECK(W25Q128_FastRead(&w25, page, 0, sizeof(check), check) ==
+                                                            W25Q128_SUCCESS);
+        EMU_CHECK(memcmp(data, check, sizeof(check)) == 0);
+        sched_yield();
+    }
+
+    return NULL;
+}
+
+static void priority_handoff(void)
+{
+    static const uint32_t expected[WAITERS] = { 1, 3, 2, 0 };
+    pthread_t threads[WAITERS];
+    pthread_t extra;
+    W25Q128_BusStatsTypeDef stats;
+
+    EMU_CHECK(W25Q128_Bus_Init(&bus) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Bus_Acquire(&bus) == W25Q128_SUCCESS);
+
+    // Nested locks of the owner only count
+    EMU_CHECK(W25Q128_Bus_Acquire(&bus) == W25Q128_SUCCESS);
+    W25Q128_Bus_Release(&bus);
+
+    for (uint32_t i = 0; i < WAITERS; i++)
+    {
+        EMU_CHECK(pthread_create(&threads[i], NULL, waiter,
+                                                (void *)(uintptr_t)i) == 0);
+        while (waiters() != i + 1)
+            sched_yield();
+    }
+
+    // Every slot is taken
+    EMU_CHECK(pthread_create(&extra, NULL, overflow, NULL) == 0);
+    EMU_CHECK(pthread_join(extra, NULL) == 0);
+    EMU_CHECK(overflow_status == W25Q128_ERROR);
+    EMU_CHECK(served == 0);
+
+    W25Q128_Bus_Release(&bus);
+    for (uint32_t i = 0; i < WAITERS; i++)
+        EMU_CHECK(pthread_join(threads[i], NULL) == 0);
+
+    EMU_CHECK(served == WAITERS);
+    EMU_CHECK(memcmp(order, expected, sizeof(order)) == 0);
+    W25Q128_Bus_GetStats(&bus, &stats);
+    EMU_CHECK(stats.contentions == WAITERS && stats.handoffs == WAITERS);
+    EMU_CHECK(stats.max_waiters == WAITERS);
+    EMU_CHECK(!bus.busy);
+}
+
+static void atomic_sequences(void)
+{
+    pthread_t threads[WRITERS];
+    W25Q128_BusStatsTypeDef stats;
+
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+    EMU_CHECK(W25Q128_Bus_Init(&bus) == W25Q128_SUCCESS);
+    w25.bus = &bus;
+    W25Q128_Emu_ResetStats(&emu);
+
+    // All writers wait before the first one starts
+    EMU_CHECK(W25Q128_Bus_Acquire(&bus) == W25Q128_SUCCESS);
+    for (uint32_t i = 0; i < WRITERS; i++)
+        EMU_CHECK(pthread_create(&threads[i], NULL, writer,
+                                                (void *)(uintptr_t)i) == 0);
+    while (waiters() != WRITERS)
+        sched_yield();
+    W25Q128_Bus_Release(&bus);
+    for (uint32_t i = 0; i < WRITERS; i++)
+        EMU_CHECK(pthread_join(threads[i], NULL) == 0);
+
+    EMU_CHECK(emu.stats.ignored == 0);
+    EMU_CHECK(emu.stats.commands[INST_PAGE_PROGRAM] == WRITERS * PAGES);
+    EMU_CHECK(emu.stats.commands[INST_WRITE_ENABLE] == WRITERS * PAGES);
+    W25Q128_Bus_GetStats(&bus, &stats);
+    EMU_CHECK(stats.contentions >= WRITERS);
+    printf("bus: %u locks, %u contended, %u handoffs, max %u waiting\n",
+                    (unsigned)stats.acquisitions, (unsigned)stats.contentions,
+                    (unsigned)stats.handoffs, (unsigned)stats.max_waiters);
+
+    W25Q128_Emu_Deinit(&emu);
+}
+
+int main(void)
+{
+    priority_handoff();
+    atomic_sequences();
+
+    return 0;
+}
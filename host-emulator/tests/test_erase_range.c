@@ -0,0 +1,69 @@
+/**
+ * @file test_erase_range.c
+ * @brief Range erase with the fewest aligned erase commands
+ * @author Filip Stojanovic
+ *
+ * Range starts and ends inside 64 KB blocks, so the head and the tail are
+ * erased by 4 KB and 32 KB commands and only the middle by 64 KB commands.
+ * Data around the range must stay intact.
+ */
+
+#include "emu_test.h"
+
+#define RANGE_START 0x3000
+#define RANGE_END   0x25000
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static uint8_t data[0x30000];
+static uint8_t check[0x30000];
+
+int main(void)
+{
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+
+    // Program every page of the first 192 KB
+    emu_test_fill(data, sizeof(data), 4);
+    for (uint32_t page = 0; page < sizeof(data) / W25Q128_PAGE_SIZE; page++)
+        EMU_CHECK(W25Q128_WritePage(&w25, page, 0, W25Q128_PAGE_SIZE,
+                            data + page * W25Q128_PAGE_SIZE) == W25Q128_SUCCESS);
+
+    // Ranges that are not sector aligned are refused
+    EMU_CHECK(W25Q128_EraseRange(&w25, RANGE_START + 1, 0x1000) ==
+                                                            W25Q128_ERROR);
+    EMU_CHECK(W25Q128_EraseRange(&w25, RANGE_START, 0x1001) == W25Q128_ERROR);
+    EMU_CHECK(W25Q128_EraseRange(&w25, 16 * 1024 * 1024 - 0x1000, 0x2000) ==
+                                                            W25Q128_ERROR);
+
+    // 0x3000 4K, 0x4000-0x7000 4K, 0x8000 32K, 0x10000 64K, 0x20000-0x24000 4K
+    W25Q128_Emu_ResetStats(&emu);
+    EMU_CHECK(W25Q128_EraseRange(&w25, RANGE_START, RANGE_END - RANGE_START)
+                                                        == W25Q128_SUCCESS);
+    EMU_CHECK(emu.stats.commands[0x20] == 10);
+    EMU_CHECK(emu.stats.commands[0x52] == 1);
+    EMU_CHECK(emu.stats.commands[0xD8] == 1);
+    EMU_CHECK(emu.stats.commands[0xC7] == 0 && emu.stats.commands[0x60] == 0);
+
+    memset(data + RANGE_START, 0xFF, RANGE_END - RANGE_START);
+    EMU_CHECK(W25Q128_FastRead(&w25, 0, 0, sizeof(check), check) ==
+                                                            W25Q128_SUCCESS);
+    EMU_CHECK(memcmp(data, check, sizeof(data)) == 0);
+
+    // Whole memory is a single chip erase
+    W25Q128_Emu_ResetStats(&emu);
+    EMU_CHECK(W25Q128_EraseRange(&w25, 0, 16 * 1024 * 1024) ==
+                                                            W25Q128_SUCCESS);
+    EMU_CHECK(emu.stats.erases == 1);
+    EMU_CHECK(emu.stats.commands[0xC7] + emu.stats.commands[0x60] == 1);
+    EMU_CHECK(W25Q128_FastRead(&w25, 0, 0, sizeof(check), check) ==
+                                                            W25Q128_SUCCESS);
+    memset(data, 0xFF, sizeof(data));
+    EMU_CHECK(memcmp(data, check, sizeof(data)) == 0);
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+/**
+ * @file test_four_byte.c
+ * @brief 4-byte addressing on a 32 MB part
+ * @author Filip Stojanovic
+ *
+ * Built with W25Q128_4BYTE_ADDRESS. W25Q128_InitSFDP finds 256 Mbit and
+ * switches the device to the 4-byte opcodes, data written across the 16 MB
+ * boundary must land above it and not wrap to the start of the memory.
+ * Synchronous functions and the asynchronous queue are both checked.
+ */
+
+#include "emu_test.h"
+#include "w25q128_async_ll.h"
+
+#define PART_SIZE (32 * 1024 * 1024)
+#define DATA_SIZE 1024
+
+// Write crosses the 16 MB boundary in the middle of the data
+#define DATA_ADDR (W25Q128_CAPACITY - DATA_SIZE / 2)
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_AsyncTypeDef async;
+static uint8_t data[DATA_SIZE];
+static uint8_t check[DATA_SIZE];
+static uint8_t erased[DATA_SIZE];
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+int main(void)
+{
+    W25Q128_AsyncTransferTypeDef xfer;
+    uint32_t page = DATA_ADDR / W25Q128_PAGE_SIZE;
+
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, PART_SIZE);
+    W25Q128_Reset(&w25);
+    memset(erased, 0xFF, sizeof(erased));
+    emu_test_fill(data, sizeof(data), 18);
+
+    // Without SFDP the device is a 16 MB part with 3-byte addresses
+    EMU_CHECK(W25Q128_GetCapacity(&w25) == W25Q128_CAPACITY);
+    EMU_CHECK(W25Q128_InitSFDP(&w25) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_GetCapacity(&w25) == PART_SIZE);
+    EMU_CHECK(w25.address_bytes == 4);
+
+    // Program and read across the boundary
+    W25Q128_Emu_ResetStats(&emu);
+    EMU_CHECK(W25Q128_WritePage(&w25, page, 0, DATA_SIZE, data) ==
+                                                            W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_FastRead(&w25, page, 0, DATA_SIZE, check) ==
+                                                            W25Q128_SUCCESS);
+    EMU_CHECK(memcmp(data, check, DATA_SIZE) == 0);
+    EMU_CHECK(memcmp(emu.mem + DATA_ADDR, data, DATA_SIZE) == 0);
+    EMU_CHECK(memcmp(emu.mem, erased, DATA_SIZE) == 0);
+    EMU_CHECK(emu.stats.commands[INST_PAGE_PROGRAM_4B] == 4);
+    EMU_CHECK(emu.stats.commands[INST_PAGE_PROGRAM] == 0);
+    EMU_CHECK(emu.stats.commands[INST_FAST_READ_4B] == 1);
+    EMU_CHECK(emu.stats.commands[INST_FAST_READ] == 0);
+
+    // Last sector of the memory
+    memset(emu.mem + PART_SIZE - W25Q128_SECTOR_SIZE, 0x00,
+                                                        W25Q128_SECTOR_SIZE);
+    EMU_CHECK(W25Q128_EraseSector(&w25, PART_SIZE / W25Q128_SECTOR_SIZE - 1)
+                                                        == W25Q128_SUCCESS);
+    EMU_CHECK(emu.stats.commands[INST_SECTOR_ERASE_4KB_4B] == 1);
+    EMU_CHECK(emu.mem[PART_SIZE - 1] == 0xFF);
+
+    // 64 KB block above 16 MB, start of the memory is not touched
+    memset(emu.mem, 0x00, W25Q128_BLOCK64_SIZE);
+    memset(emu.mem + W25Q128_CAPACITY, 0x00, W25Q128_BLOCK64_SIZE);
+    EMU_CHECK(W25Q128_EraseRange(&w25, W25Q128_CAPACITY,
+                                W25Q128_BLOCK64_SIZE) == W25Q128_SUCCESS);
+    EMU_CHECK(emu.stats.commands[INST_BLOCK_ERASE_64KB_4B] == 1);
+    EMU_CHECK(emu.mem[W25Q128_CAPACITY] == 0xFF);
+    EMU_CHECK(emu.mem[0] == 0x00);
+
+    // Asynchronous queue
+    emu_test_fill(data, sizeof(data), 19);
+    W25Q128_Async_Init(&async, &w25);
+    EMU_CHECK(W25Q128_Async_EraseSector(&async, &xfer,
+                    W25Q128_CAPACITY / W25Q128_SECTOR_SIZE + 1, NULL, NULL)
+                                                        == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Async_Wait(&async, &xfer, 1000) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Async_WritePage(&async, &xfer,
+                            W25Q128_CAPACITY + W25Q128_SECTOR_SIZE, data,
+                            W25Q128_PAGE_SIZE, NULL, NULL) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Async_Wait(&async, &xfer, 100) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Async_Read(&async, &xfer,
+                            W25Q128_CAPACITY + W25Q128_SECTOR_SIZE, check,
+                            W25Q128_PAGE_SIZE, NULL, NULL) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Async_Wait(&async, &xfer, 100) == W25Q128_SUCCESS);
+    EMU_CHECK(memcmp(data, check, W25Q128_PAGE_SIZE) == 0);
+    EMU_CHECK(memcmp(emu.mem + W25Q128_CAPACITY + W25Q128_SECTOR_SIZE, data,
+                                                    W25Q128_PAGE_SIZE) == 0);
+    EMU_CHECK(emu.stats.ignored == 0);
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
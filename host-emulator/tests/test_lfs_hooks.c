@@ -0,0 +1,302 @@
+/**
+ * @file test_lfs_hooks.c
+ * @brief littlefs block device hooks of w25q128_lfs
+ * @author Filip Stojanovic
+ *
+ * Built against the littlefs shim (lfs-shim/lfs.h), the hooks are called
+ * directly with a hand-built lfs_config. Built twice, as test_lfs_hooks with
+ * a 4 line read cache with readahead and a 1 KB prog buffer, and as
+ * test_lfs_direct without either. Every read must return what the flash
+ * holds, also after progs and erases of cached lines and across line
+ * boundaries. With the cache, lines are read once, read ahead and evicted
+ * least recently used first. With the buffer, progs reach the flash only
+ * when a read of the block, a full window, a prog elsewhere or a sync needs
+ * them, and an erase of the block drops them.
+ *
+ * Both are built with the erased map. Background erase must erase dirty
+ * blocks that lfs_fs_traverse, defined here, does not report, at most the
+ * given number per call, and only blank check blocks that are blank; a later
+ * erase of such a block sends no command.
+ */
+
+#include "emu_test.h"
+#include "w25q128_lfs.h"
+
+#define BLOCK_COUNT 64
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static uint8_t data[W25Q128_SECTOR_SIZE];
+static uint8_t check[W25Q128_SECTOR_SIZE];
+static uint8_t image[W25Q128_SECTOR_SIZE];
+static int traverse_err;
+
+static const struct lfs_config cfg = {
+    .context = &w25,
+    .read = w25q128_lfs_read,
+    .prog = w25q128_lfs_prog,
+    .erase = w25q128_lfs_erase,
+    .sync = w25q128_lfs_sync,
+    .read_size = 16,
+    .prog_size = 16,
+    .block_size = W25Q128_SECTOR_SIZE,
+    .block_count = BLOCK_COUNT,
+    .block_cycles = 500,
+    .cache_size = 256,
+    .lookahead_size = 16,
+};
+
+// Blocks below 11 and block 30 are in use
+int lfs_fs_traverse(lfs_t *lfs, int (*cb)(void *data, lfs_block_t block),
+                                                                void *data)
+{
+    for (lfs_block_t block = 0; block < lfs->cfg->block_count; block++)
+    {
+        if ((block < 11 || block == 30) && cb(data, block) != 0)
+            return LFS_ERR_CORRUPT;
+    }
+
+    return traverse_err;
+}
+
+// Reads through the hook and compares with the flash image
+static void read_check(lfs_block_t block, lfs_off_t off, lfs_size_t size)
+{
+    EMU_CHECK(cfg.read(&cfg, block, off, check, size) == 0);
+    EMU_CHECK(memcmp(check, emu.mem + block * W25Q128_SECTOR_SIZE + off,
+                                                                size) == 0);
+}
+
+static uint32_t reads(void)
+{
+    return emu.stats.commands[INST_FAST_READ];
+}
+
+static uint32_t programs(void)
+{
+    return emu.stats.commands[INST_PAGE_PROGRAM];
+}
+
+// Progs a pattern into block 3 or another block, image follows block 3
+static void prog(lfs_block_t block, lfs_off_t off, lfs_size_t size)
+{
+    emu_test_fill(data, size, block * W25Q128_SECTOR_SIZE + off);
+    EMU_CHECK(cfg.prog(&cfg, block, off, data, size) == 0);
+    if (block == 3)
+        memcpy(&image[off], data, size);
+}
+
+// Page programs sent since the last call
+static uint32_t programs_since(void)
+{
+    static uint32_t last;
+    uint32_t count = programs() - last;
+
+    last += count;
+    return count;
+}
+
+static void read_cache(void)
+{
+    uint32_t count;
+#if W25Q128_LFS_CACHE_LINES > 0
+    struct w25q128_lfs_cache_stats stats;
+#endif
+
+    // Blocks 0 and 1 hold data written around the littlefs layer
+    emu_test_fill(data, sizeof(data), 7);
+    for (uint32_t block = 0; block < 2; block++)
+    {
+        for (uint32_t page = 0; page < W25Q128_PAGES_PER_SECTOR; page++)
+            EMU_CHECK(W25Q128_WritePage(&w25, block * W25Q128_PAGES_PER_SECTOR
+                            + page, 0, W25Q128_PAGE_SIZE,
+                            &data[page * W25Q128_PAGE_SIZE]) ==
+                                                            W25Q128_SUCCESS);
+    }
+#if W25Q128_LFS_CACHE_LINES > 0
+    w25q128_lfs_cache_invalidate();
+    w25q128_lfs_cache_reset_stats();
+#endif
+
+    // Miss reads the line and the next one, the rest of both are hits
+    count = reads();
+    read_check(0, 0, 16);
+    read_check(0, 16, 64);
+    read_check(0, 300, 16);
+#if W25Q128_LFS_CACHE_LINES > 0
+    w25q128_lfs_cache_get_stats(&stats);
+    EMU_CHECK(stats.misses == 1 && stats.readahead == 1 && stats.hits == 2);
+    EMU_CHECK(reads() - count == 2);
+#else
+    EMU_CHECK(reads() - count == 3);
+#endif
+
+    // Across line and block boundaries
+    read_check(0, 250, 20);
+    read_check(0, W25Q128_SECTOR_SIZE - 100, 100);
+    read_check(1, 0, W25Q128_SECTOR_SIZE);
+
+    // Least recently used line goes first, line 0 was used last
+    read_check(0, 0, 16);
+#if W25Q128_LFS_CACHE_LINES > 0
+    w25q128_lfs_cache_reset_stats();
+    read_check(1, 2 * W25Q128_LFS_CACHE_LINE_SIZE, 16);
+    read_check(0, 0, 16);
+    w25q128_lfs_cache_get_stats(&stats);
+    EMU_CHECK(stats.hits == 1);
+#endif
+
+    // Prog and erase drop the lines they touch
+    read_check(2, 0, 64);
+    memset(data, 0x5A, 32);
+    EMU_CHECK(cfg.prog(&cfg, 2, 16, data, 32) == 0);
+    EMU_CHECK(cfg.sync(&cfg) == 0);
+    read_check(2, 0, 64);
+    EMU_CHECK(memcmp(&check[16], data, 32) == 0);
+    EMU_CHECK(cfg.erase(&cfg, 0) == 0);
+    read_check(0, 0, 16);
+    EMU_CHECK(check[0] == 0xFF && check[15] == 0xFF);
+#if W25Q128_LFS_CACHE_LINES > 0
+    w25q128_lfs_cache_get_stats(&stats);
+    EMU_CHECK(stats.invalidations >= 2);
+#endif
+}
+
+static void prog_buffer(void)
+{
+    const uint8_t buffered = (W25Q128_LFS_PROG_BUFFER_SIZE > 0);
+
+    memset(image, 0xFF, sizeof(image));
+    (void)programs_since();
+
+    // Contiguous progs wait for a read of the block
+    prog(3, 0, 16);
+    prog(3, 16, 16);
+    EMU_CHECK(programs_since() == (buffered ? 0 : 2));
+    EMU_CHECK(emu.mem[3 * W25Q128_SECTOR_SIZE] == (buffered ? 0xFF : image[0]));
+    read_check(3, 0, 32);
+    EMU_CHECK(programs_since() == (buffered ? 1 : 0));
+    EMU_CHECK(memcmp(check, image, 32) == 0);
+
+    // Complete window goes out in page programs
+    for (uint32_t off = 1024; off < 1024 + 768; off += W25Q128_PAGE_SIZE)
+        prog(3, off, W25Q128_PAGE_SIZE);
+    EMU_CHECK(programs_since() == (buffered ? 0 : 3));
+    prog(3, 1024 + 768, W25Q128_PAGE_SIZE);
+    EMU_CHECK(programs_since() == (buffered ? 4 : 1));
+
+    // Prog across the end of a window, only the first part is programmed
+    prog(3, 3072 - 16, 32);
+    EMU_CHECK(programs_since() == (buffered ? 1 : 2));
+
+    // Prog elsewhere in the block, then in another block
+    prog(3, 3072 + 64, 16);
+    EMU_CHECK(programs_since() == 1);
+    prog(4, 0, 16);
+    EMU_CHECK(programs_since() == 1);
+
+    // Erase drops what is pending for its block
+    prog(4, 16, 16);
+    EMU_CHECK(cfg.erase(&cfg, 4) == 0);
+    EMU_CHECK(cfg.sync(&cfg) == 0);
+    EMU_CHECK(programs_since() == (buffered ? 0 : 1));
+    for (uint32_t i = 0; i < W25Q128_SECTOR_SIZE; i++)
+        EMU_CHECK(emu.mem[4 * W25Q128_SECTOR_SIZE + i] == 0xFF);
+
+    // Sync programs the rest, once
+    prog(5, 0, 16);
+    EMU_CHECK(programs_since() == (buffered ? 0 : 1));
+    EMU_CHECK(cfg.sync(&cfg) == 0);
+    EMU_CHECK(programs_since() == (buffered ? 1 : 0));
+    EMU_CHECK(cfg.sync(&cfg) == 0);
+    EMU_CHECK(programs_since() == 0);
+
+    EMU_CHECK(memcmp(emu.mem + 3 * W25Q128_SECTOR_SIZE, image,
+                                                        sizeof(image)) == 0);
+    read_check(3, 0, W25Q128_SECTOR_SIZE);
+}
+
+static void background_erase(void)
+{
+    lfs_t lfs = { .cfg = &cfg };
+    struct lfs_config small = cfg;
+    W25Q128_EraseStatsTypeDef stats;
+    uint32_t erases;
+
+    // Free blocks 11 to 15 are dirty, the rest of the blank ones are known
+    EMU_CHECK(W25Q128_ScanErased(&w25, 0, BLOCK_COUNT) == W25Q128_SUCCESS);
+    for (lfs_block_t block = 11; block < 16; block++)
+        prog(block, 0, 16);
+    EMU_CHECK(cfg.sync(&cfg) == 0);
+    read_check(11, 0, 16);
+    W25Q128_ResetEraseStats(&w25);
+    erases = emu.stats.erases;
+
+    // Limit per call, cached data of erased blocks is dropped
+    EMU_CHECK(w25q128_lfs_background_erase(&lfs, &cfg, 3) == 3);
+    EMU_CHECK(emu.stats.erases - erases == 3);
+    read_check(11, 0, 16);
+    EMU_CHECK(check[0] == 0xFF);
+    EMU_CHECK(w25q128_lfs_background_erase(&lfs, &cfg, 10) == 2);
+    EMU_CHECK(w25q128_lfs_background_erase(&lfs, &cfg, 10) == 0);
+    EMU_CHECK(emu.stats.erases - erases == 5);
+    W25Q128_GetEraseStats(&w25, &stats);
+    EMU_CHECK(stats.background_erases == 5);
+    for (lfs_block_t block = 11; block < 16; block++)
+        EMU_CHECK(W25Q128_IsSectorErased(&w25, block));
+
+    // Erase by littlefs later is free
+    EMU_CHECK(cfg.erase(&cfg, 12) == 0);
+    EMU_CHECK(emu.stats.erases - erases == 5);
+    W25Q128_GetEraseStats(&w25, &stats);
+    EMU_CHECK(stats.erases_avoided == 1);
+
+    // Blank block unknown to the map is only checked
+    W25Q128_ResetEraseStats(&w25);
+    W25Q128_UpdateErasedMap(&w25, 20 * W25Q128_SECTOR_SIZE,
+                                                    W25Q128_SECTOR_SIZE, 0);
+    EMU_CHECK(w25q128_lfs_background_erase(&lfs, &cfg, 10) == 1);
+    EMU_CHECK(emu.stats.erases - erases == 5);
+    W25Q128_GetEraseStats(&w25, &stats);
+    EMU_CHECK(stats.blank_checks == 1 && stats.background_erases == 0);
+    EMU_CHECK(W25Q128_IsSectorErased(&w25, 20));
+
+    // Pending prog of a used block reaches the flash first
+    prog(30, 0, 16);
+    EMU_CHECK(w25q128_lfs_background_erase(&lfs, &cfg, 10) == 0);
+    EMU_CHECK(memcmp(emu.mem + 30 * W25Q128_SECTOR_SIZE, data, 16) == 0);
+
+    // Traverse errors and layouts without one block per sector
+    prog(16, 0, 16);
+    EMU_CHECK(cfg.sync(&cfg) == 0);
+    traverse_err = LFS_ERR_CORRUPT;
+    EMU_CHECK(w25q128_lfs_background_erase(&lfs, &cfg, 10) ==
+                                                            LFS_ERR_CORRUPT);
+    traverse_err = 0;
+    small.block_size = W25Q128_SECTOR_SIZE / 2;
+    EMU_CHECK(w25q128_lfs_background_erase(&lfs, &small, 10) ==
+                                                            LFS_ERR_INVAL);
+    small = cfg;
+    small.block_count = W25Q128_GetCapacity(&w25) / W25Q128_SECTOR_SIZE + 1;
+    EMU_CHECK(w25q128_lfs_background_erase(&lfs, &small, 10) ==
+                                                            LFS_ERR_INVAL);
+    EMU_CHECK(emu.stats.erases - erases == 5);
+    EMU_CHECK(w25q128_lfs_background_erase(&lfs, &cfg, 10) == 1);
+    EMU_CHECK(emu.stats.erases - erases == 6);
+}
+
+int main(void)
+{
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+
+    read_cache();
+    prog_buffer();
+    background_erase();
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+/**
+ * @file test_log_lz.c
+ * @brief Compressed log records and the sizes they are stored with
+ * @author Filip Stojanovic
+ *
+ * Built with W25Q128_LOG_COMPRESSION. An empty record, random data and a
+ * record of short repeats are appended with W25Q128_Log_AppendCompressed.
+ * Only the last may be stored compressed, saved_bytes must match the flash
+ * bytes it saves, and all of them must read back as given, also after the
+ * log is mounted again.
+ */
+
+#include "emu_test.h"
+#include "w25q128_log.h"
+
+#define FIRST_SECTOR 16
+#define NUM_SECTORS  4
+#define RECORD_SIZE  600
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_LogTypeDef log_store;
+static uint8_t random_data[RECORD_SIZE];
+static uint8_t repeats[RECORD_SIZE];
+static uint8_t check[RECORD_SIZE];
+
+static void read_back(void)
+{
+    W25Q128_LogIteratorTypeDef it;
+    uint32_t size;
+
+    W25Q128_Log_IterInit(&log_store, &it);
+    EMU_CHECK(W25Q128_Log_IterNext(&log_store, &it, check, sizeof(check),
+                                                &size) == W25Q128_SUCCESS);
+    EMU_CHECK(size == 0);
+    EMU_CHECK(W25Q128_Log_IterNext(&log_store, &it, check, sizeof(check),
+                                                &size) == W25Q128_SUCCESS);
+    EMU_CHECK(size == RECORD_SIZE && memcmp(check, random_data, size) == 0);
+    EMU_CHECK(W25Q128_Log_IterNext(&log_store, &it, check, sizeof(check),
+                                                &size) == W25Q128_SUCCESS);
+    EMU_CHECK(size == RECORD_SIZE && memcmp(check, repeats, size) == 0);
+    EMU_CHECK(W25Q128_Log_IterNext(&log_store, &it, check, sizeof(check),
+                                                    &size) == W25Q128_END);
+}
+
+int main(void)
+{
+    W25Q128_LogStatsTypeDef stats;
+    uint32_t head;
+
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+    emu_test_fill(random_data, RECORD_SIZE, 23);
+    for (uint32_t i = 0; i < RECORD_SIZE; i++)
+        repeats[i] = "w25q128 "[i % 8];
+
+    EMU_CHECK(W25Q128_Log_Format(&log_store, &w25, FIRST_SECTOR,
+                                        NUM_SECTORS) == W25Q128_SUCCESS);
+
+    // Neither gets smaller, both are stored as plain records. The first
+    // append moves the head to a new sector.
+    EMU_CHECK(W25Q128_Log_AppendCompressed(&log_store, random_data, 0) ==
+                                                            W25Q128_SUCCESS);
+    EMU_CHECK(log_store.head_offset == W25Q128_LOG_SECTOR_HEADER_SIZE +
+                                            W25Q128_LOG_RECORD_HEADER_SIZE);
+    head = log_store.head_offset;
+    EMU_CHECK(W25Q128_Log_AppendCompressed(&log_store, random_data,
+                                        RECORD_SIZE) == W25Q128_SUCCESS);
+    EMU_CHECK(log_store.head_offset - head ==
+                                W25Q128_LOG_RECORD_HEADER_SIZE + RECORD_SIZE);
+    W25Q128_Log_GetStats(&log_store, &stats);
+    EMU_CHECK(stats.compressed == 0 && stats.saved_bytes == 0);
+
+    head = log_store.head_offset;
+    EMU_CHECK(W25Q128_Log_AppendCompressed(&log_store, repeats,
+                                        RECORD_SIZE) == W25Q128_SUCCESS);
+    W25Q128_Log_GetStats(&log_store, &stats);
+    EMU_CHECK(stats.records == 3 && stats.bytes == 2 * RECORD_SIZE);
+    EMU_CHECK(stats.compressed == 1);
+    EMU_CHECK(stats.saved_bytes > 0 && stats.saved_bytes < RECORD_SIZE);
+    EMU_CHECK(log_store.head_offset - head == W25Q128_LOG_RECORD_HEADER_SIZE +
+                                            RECORD_SIZE - stats.saved_bytes);
+    read_back();
+
+    EMU_CHECK(W25Q128_Log_Sync(&log_store) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Log_Mount(&log_store, &w25, FIRST_SECTOR,
+                                        NUM_SECTORS) == W25Q128_SUCCESS);
+    read_back();
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
@@ -0,0 +1,162 @@
+/**
+ * @file test_log_power.c
+ * @brief Power loss during log appends and erases
+ * @author Filip Stojanovic
+ *
+ * Records are appended to a small log on an image file and synced every few
+ * records. Power is cut at a random point of a page program or of an erase
+ * (the torn operation keeps part of its bytes), the device is powered up
+ * from the same image and the log is mounted again. Every mount must return
+ * the records in order without gaps, up to at least the last synced one, and
+ * appending must continue after them.
+ */
+
+#include "emu_test.h"
+#include "w25q128_log.h"
+
+#include <setjmp.h>
+#include <unistd.h>
+
+#define FIRST_SECTOR 16
+#define NUM_SECTORS  24
+#define CUTS         60
+#define SYNC_EVERY   8
+#define MAX_RECORD   100
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_LogTypeDef log_store;
+static char image[64];
+static jmp_buf power_lost;
+
+// Operations left until the cut, or the next erase is cut
+static uint32_t ops_left;
+static uint8_t cut_erase;
+static uint32_t erase_cuts;
+static uint32_t program_cuts;
+
+// Record i holds its number and data derived from it
+static uint32_t record_make(uint32_t i, uint8_t *data)
+{
+    uint32_t size = 8 + i % (MAX_RECORD - 8);
+
+    emu_test_fill(data, size, i);
+    memcpy(data, &i, sizeof(i));
+    return size;
+}
+
+static void cut_power(W25Q128_EmuTypeDef *dev)
+{
+    uint8_t erase = (dev->op_size > W25Q128_PAGE_SIZE);
+
+    if (cut_erase ? !erase : --ops_left > 0)
+        return;
+
+    // Somewhere within the busy time of the operation
+    W25Q128_Emu_Advance(rand() % dev->op_busy_ns);
+    if (erase)
+        erase_cuts++;
+    else
+        program_cuts++;
+    W25Q128_Emu_PowerCut(dev);
+    longjmp(power_lost, 1);
+}
+
+static void power_up(void)
+{
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Emu_Deinit(&emu);
+    EMU_CHECK(W25Q128_Emu_InitSize(&emu, &hspi1, &gpioa, GPIO_PIN_4, image,
+                                    16 * 1024 * 1024) == W25Q128_SUCCESS);
+    W25Q128_Reset(&w25);
+}
+
+// Checks the mounted log and returns the number of the next record
+static uint32_t log_check(uint32_t synced, uint32_t appended)
+{
+    static uint8_t data[MAX_RECORD];
+    static uint8_t expected[MAX_RECORD];
+    W25Q128_LogIteratorTypeDef it;
+    uint32_t next = 0;
+    uint32_t count = 0;
+    uint32_t size;
+
+    W25Q128_Log_IterInit(&log_store, &it);
+    while (W25Q128_Log_IterNext(&log_store, &it, data, sizeof(data), &size)
+                                                        == W25Q128_SUCCESS)
+    {
+        uint32_t i;
+
+        memcpy(&i, data, sizeof(i));
+        EMU_CHECK(count == 0 || i == next);
+        EMU_CHECK(size == record_make(i, expected));
+        EMU_CHECK(memcmp(data, expected, size) == 0);
+        next = i + 1;
+        count++;
+    }
+
+    EMU_CHECK(next >= synced && next <= appended);
+    return next;
+}
+
+int main(void)
+{
+    static uint8_t data[MAX_RECORD];
+    volatile uint32_t appended = 0;
+    volatile uint32_t synced = 0;
+    volatile uint32_t cut = 0;
+
+    snprintf(image, sizeof(image), "/tmp/w25q128_log_power_%d.img",
+                                                            (int)getpid());
+    unlink(image);
+    srand(19);
+
+    power_up();
+    EMU_CHECK(W25Q128_Log_Format(&log_store, &w25, FIRST_SECTOR,
+                                        NUM_SECTORS) == W25Q128_SUCCESS);
+
+    setjmp(power_lost);
+    while (cut < CUTS)
+    {
+        uint32_t next;
+
+        // Power is back, the log continues after the last readable record
+        emu.op_hook = NULL;
+        power_up();
+        EMU_CHECK(W25Q128_Log_Mount(&log_store, &w25, FIRST_SECTOR,
+                                        NUM_SECTORS) == W25Q128_SUCCESS);
+        next = log_check(synced, appended);
+        appended = next;
+        synced = next;
+
+        // Every third cut hits an erase, the ring wraps several times
+        cut_erase = (cut % 3 == 2);
+        ops_left = 1 + rand() % 200;
+        cut++;
+        emu.op_hook = cut_power;
+        for (;;)
+        {
+            uint32_t size = record_make(appended, data);
+
+            EMU_CHECK(W25Q128_Log_Append(&log_store, data, size) ==
+                                                            W25Q128_SUCCESS);
+            appended++;
+            if (appended % SYNC_EVERY == 0)
+            {
+                EMU_CHECK(W25Q128_Log_Sync(&log_store) == W25Q128_SUCCESS);
+                synced = appended;
+            }
+        }
+    }
+
+    printf("log power loss: %u program and %u erase cuts, %u records\n",
+                        program_cuts, erase_cuts, (unsigned)appended);
+    EMU_CHECK(program_cuts > 0 && erase_cuts > 0);
+
+    W25Q128_Emu_Deinit(&emu);
+    unlink(image);
+
+    return 0;
+}
@@ -0,0 +1,225 @@
+/**
+ * @file test_nvs_power.c
+ * @brief Power loss during key-value sets, deletes and collections
+ * @author Filip Stojanovic
+ *
+ * Random keys are set and deleted in a small store on an image file, which
+ * is collected now and then, so sets also collect when they run out of
+ * sectors. Power is cut in a page program or an erase of a set, a delete or
+ * a collection. Half of the set cuts tear the page program of the new entry
+ * right after the low byte of its value size, so its header reads as an
+ * entry far larger than the sector. After every power-up the store must
+ * mount, hold every key as last stored (the key being set or deleted either
+ * way) and keep accepting sets and collections.
+ */
+
+#include "emu_test.h"
+#include "w25q128_nvs.h"
+
+#include <setjmp.h>
+#include <unistd.h>
+
+#define FIRST_SECTOR 32
+#define NUM_SECTORS  6
+#define NUM_KEYS     24
+#define CUTS         90
+#define MAX_VALUE    400
+
+typedef enum {
+    RUN_SET = 0,
+    RUN_DELETE = 1,
+    RUN_COLLECT = 2,
+    RUN_NONE = 3,
+} RunTypeDef;
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_NvsTypeDef nvs;
+static char image[64];
+static jmp_buf power_lost;
+
+// Version last stored for every key, 0 if it is deleted
+static uint32_t version[NUM_KEYS];
+
+// Operation in progress, the cut hits operations of cut_run only
+static volatile RunTypeDef running = RUN_NONE;
+static volatile uint32_t running_key;
+static volatile uint32_t running_version;
+static RunTypeDef cut_run;
+static uint8_t tear_header;
+static uint32_t ops_left;
+static uint32_t cuts[RUN_NONE];
+static uint32_t header_tears;
+
+static void key_name(uint32_t key, char *name)
+{
+    snprintf(name, 8, "key%02u", (unsigned)key);
+}
+
+// Value holds its version and data derived from the key and the version
+static uint32_t value_make(uint32_t key, uint32_t ver, uint8_t *data)
+{
+    uint32_t size = 16 + (key * 37 + ver * 11) % (MAX_VALUE - 16);
+
+    emu_test_fill(data, size, key * 100000 + ver);
+    memcpy(data, &ver, sizeof(ver));
+    return size;
+}
+
+static void cut_power(W25Q128_EmuTypeDef *dev)
+{
+    uint64_t at;
+
+    if (running != cut_run || --ops_left > 0)
+        return;
+
+    at = rand() % dev->op_busy_ns;
+    if (tear_header)
+    {
+        uint32_t loc = (FIRST_SECTOR + nvs.active) * W25Q128_SECTOR_SIZE +
+                                            nvs.sectors[nvs.active].used;
+
+        // Waits for the program of the next entry header
+        if (nvs.active == NUM_SECTORS || dev->op_size > W25Q128_PAGE_SIZE ||
+                        dev->op_addr != loc - loc % W25Q128_PAGE_SIZE)
+        {
+            ops_left = 1;
+            return;
+        }
+
+        // State, key length and the low byte of the value size
+        at = dev->op_busy_ns * (loc % W25Q128_PAGE_SIZE + 3) /
+                    W25Q128_PAGE_SIZE + dev->op_busy_ns / W25Q128_PAGE_SIZE / 2;
+        header_tears++;
+    }
+
+    W25Q128_Emu_Advance(at);
+    cuts[cut_run]++;
+    W25Q128_Emu_PowerCut(dev);
+    longjmp(power_lost, 1);
+}
+
+static void power_up(void)
+{
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Emu_Deinit(&emu);
+    EMU_CHECK(W25Q128_Emu_InitSize(&emu, &hspi1, &gpioa, GPIO_PIN_4, image,
+                                    16 * 1024 * 1024) == W25Q128_SUCCESS);
+    W25Q128_Reset(&w25);
+}
+
+// Version found for a key, 0 if it is not stored
+static uint32_t stored_version(uint32_t key)
+{
+    static uint8_t data[MAX_VALUE];
+    static uint8_t expected[MAX_VALUE];
+    W25Q128_StatusTypeDef status;
+    char name[8];
+    uint32_t size;
+    uint32_t ver;
+
+    key_name(key, name);
+    status = W25Q128_Nvs_Get(&nvs, name, data, sizeof(data), &size);
+    if (status == W25Q128_NOT_FOUND)
+        return 0;
+
+    EMU_CHECK(status == W25Q128_SUCCESS && size >= sizeof(ver));
+    memcpy(&ver, data, sizeof(ver));
+    EMU_CHECK(size == value_make(key, ver, expected));
+    EMU_CHECK(memcmp(data, expected, size) == 0);
+    return ver;
+}
+
+// Checks the mounted store against the versions last stored
+static void store_check(void)
+{
+    for (uint32_t key = 0; key < NUM_KEYS; key++)
+    {
+        uint32_t ver = stored_version(key);
+
+        if (key == running_key && running == RUN_SET)
+            EMU_CHECK(ver == version[key] || ver == running_version);
+        else if (key == running_key && running == RUN_DELETE)
+            EMU_CHECK(ver == version[key] || ver == 0);
+        else
+            EMU_CHECK(ver == version[key]);
+        version[key] = ver;
+    }
+}
+
+int main(void)
+{
+    static uint8_t data[MAX_VALUE];
+    volatile uint32_t next_version = 1;
+    volatile uint32_t cut = 0;
+
+    snprintf(image, sizeof(image), "/tmp/w25q128_nvs_power_%d.img",
+                                                            (int)getpid());
+    unlink(image);
+    srand(20);
+
+    power_up();
+    EMU_CHECK(W25Q128_Nvs_Format(&nvs, &w25, FIRST_SECTOR, NUM_SECTORS) ==
+                                                            W25Q128_SUCCESS);
+
+    setjmp(power_lost);
+    while (cut < CUTS)
+    {
+        // Power is back, every key is as last stored
+        emu.op_hook = NULL;
+        power_up();
+        EMU_CHECK(W25Q128_Nvs_Mount(&nvs, &w25, FIRST_SECTOR, NUM_SECTORS) ==
+                                                            W25Q128_SUCCESS);
+        store_check();
+        running = RUN_NONE;
+
+        cut_run = (RunTypeDef)(cut % 3);
+        tear_header = (cut % 6 == 0);
+        ops_left = 1 + rand() % 12;
+        cut++;
+        emu.op_hook = cut_power;
+        for (;;)
+        {
+            uint32_t key = rand() % NUM_KEYS;
+            uint32_t op = rand() % 10;
+            char name[8];
+
+            key_name(key, name);
+            running_key = key;
+            if (op < 7)
+            {
+                uint32_t ver = next_version++;
+                uint32_t size = value_make(key, ver, data);
+
+                running_version = ver;
+                running = RUN_SET;
+                EMU_CHECK(W25Q128_Nvs_Set(&nvs, name, data, size) ==
+                                                            W25Q128_SUCCESS);
+                version[key] = ver;
+            } else if (op < 9) {
+                running = RUN_DELETE;
+                EMU_CHECK(W25Q128_Nvs_Delete(&nvs, name) ==
+                        (version[key] ? W25Q128_SUCCESS : W25Q128_NOT_FOUND));
+                version[key] = 0;
+            } else {
+                running = RUN_COLLECT;
+                EMU_CHECK(W25Q128_Nvs_Collect(&nvs, 1) != W25Q128_ERROR);
+            }
+            running = RUN_NONE;
+        }
+    }
+
+    printf("nvs power loss: %u set (%u header), %u delete and %u collect "
+            "cuts\n", cuts[RUN_SET], header_tears, cuts[RUN_DELETE],
+            cuts[RUN_COLLECT]);
+    EMU_CHECK(cuts[RUN_SET] > 0 && cuts[RUN_DELETE] > 0 &&
+                                                    cuts[RUN_COLLECT] > 0);
+    EMU_CHECK(header_tears > 0);
+
+    W25Q128_Emu_Deinit(&emu);
+    unlink(image);
+
+    return 0;
+}
@@ -0,0 +1,170 @@
+/**
+ * @file test_ota_resume.c
+ * @brief Interrupted image download, resume and finalize
+ * @author Filip Stojanovic
+ *
+ * An image is appended in chunks of random size until power is cut in a
+ * page program, an erase ahead or a progress marker. Once powered up, the
+ * slot is opened again with the same image: the download must resume at the
+ * last marker with the image intact up to it. The rest is appended, finalize
+ * must refuse a wrong CRC and accept the right one, after which the slot
+ * verifies. Every download is a new image with other data and id, so the
+ * slot starts over and an area not erased again shows in the CRC.
+ */
+
+#include "emu_test.h"
+#include "w25q128_ota.h"
+
+#include <setjmp.h>
+#include <unistd.h>
+
+#define SLOT_ADDR  (2 * 1024 * 1024)
+#define SLOT_SIZE  (512 * 1024)
+#define IMAGE_SIZE 200001
+#define CUTS       12
+#define MAX_CHUNK  1500
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_OtaTypeDef ota;
+static char image_file[64];
+static uint8_t image[IMAGE_SIZE];
+static uint8_t check[IMAGE_SIZE];
+static uint32_t crc;
+static jmp_buf power_lost;
+
+// Operations left until the cut, operation the cut waits for after them,
+// image bytes programmed before it and whether it hit a marker
+static uint32_t ops_left;
+static uint8_t cut_target;
+static uint32_t programmed;
+static uint8_t marker_cut;
+static uint32_t erase_cuts;
+static uint32_t marker_cuts;
+
+static void cut_power(W25Q128_EmuTypeDef *dev)
+{
+    uint8_t erase = (dev->op_size > W25Q128_PAGE_SIZE);
+    uint8_t marker = (dev->op_addr >= SLOT_ADDR + SLOT_SIZE -
+                                                        W25Q128_SECTOR_SIZE);
+
+    if (ops_left > 0 && --ops_left > 0)
+        return;
+    if ((cut_target == 1 && !erase) || (cut_target == 2 && !marker))
+        return;
+
+    programmed = ota.programmed;
+    marker_cut = marker;
+    erase_cuts += erase;
+    marker_cuts += marker;
+
+    W25Q128_Emu_Advance(rand() % dev->op_busy_ns);
+    W25Q128_Emu_PowerCut(dev);
+    longjmp(power_lost, 1);
+}
+
+static void power_up(void)
+{
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Emu_Deinit(&emu);
+    EMU_CHECK(W25Q128_Emu_InitSize(&emu, &hspi1, &gpioa, GPIO_PIN_4,
+                            image_file, 16 * 1024 * 1024) == W25Q128_SUCCESS);
+    W25Q128_Reset(&w25);
+}
+
+static void append_to(uint32_t end)
+{
+    uint32_t offset = W25Q128_Ota_GetOffset(&ota);
+
+    while (offset < end)
+    {
+        uint32_t size = 1 + rand() % MAX_CHUNK;
+
+        if (size > end - offset)
+            size = end - offset;
+        EMU_CHECK(W25Q128_Ota_Append(&ota, &image[offset], size) ==
+                                                            W25Q128_SUCCESS);
+        offset += size;
+    }
+}
+
+int main(void)
+{
+    volatile uint32_t cut = 0;
+
+    snprintf(image_file, sizeof(image_file), "/tmp/w25q128_ota_resume_%d.img",
+                                                            (int)getpid());
+    unlink(image_file);
+    srand(22);
+
+    power_up();
+
+    if (setjmp(power_lost) != 0)
+    {
+        uint32_t interval = ota.marker_interval;
+        uint32_t expected = programmed - (programmed % interval);
+        uint32_t offset;
+
+        emu.op_hook = NULL;
+        power_up();
+
+        // Same image resumes at the last marker, a torn one is skipped
+        EMU_CHECK(W25Q128_Ota_Open(&ota, &w25, SLOT_ADDR, SLOT_SIZE, cut,
+                                        IMAGE_SIZE) == W25Q128_SUCCESS);
+        offset = W25Q128_Ota_GetOffset(&ota);
+        EMU_CHECK(offset == expected ||
+                        (marker_cut && offset + interval == expected));
+        EMU_CHECK(ota.stats.resumed == offset);
+        EMU_CHECK(W25Q128_FastRead(&w25, SLOT_ADDR / W25Q128_PAGE_SIZE, 0,
+                                    IMAGE_SIZE, check) == W25Q128_SUCCESS);
+        EMU_CHECK(memcmp(image, check, offset) == 0);
+
+        append_to(IMAGE_SIZE);
+        EMU_CHECK(W25Q128_Ota_Finalize(&ota, crc ^ 1) == W25Q128_ERROR);
+        EMU_CHECK(W25Q128_Ota_Verify(&ota, &w25, SLOT_ADDR, SLOT_SIZE) ==
+                                                            W25Q128_ERROR);
+
+        EMU_CHECK(W25Q128_Ota_Open(&ota, &w25, SLOT_ADDR, SLOT_SIZE, cut,
+                                        IMAGE_SIZE) == W25Q128_SUCCESS);
+        EMU_CHECK(W25Q128_Ota_GetOffset(&ota) == IMAGE_SIZE);
+        EMU_CHECK(W25Q128_Ota_Finalize(&ota, crc) == W25Q128_SUCCESS);
+        EMU_CHECK(W25Q128_Ota_Verify(&ota, &w25, SLOT_ADDR, SLOT_SIZE) ==
+                                                            W25Q128_SUCCESS);
+        EMU_CHECK(ota.image_id == cut && ota.image_size == IMAGE_SIZE);
+    }
+
+    while (cut < CUTS)
+    {
+        cut++;
+        emu_test_fill(image, IMAGE_SIZE, cut);
+        crc = W25Q128_Crc32(0, image, IMAGE_SIZE);
+
+        // New image, the slot is started over
+        EMU_CHECK(W25Q128_Ota_Open(&ota, &w25, SLOT_ADDR, SLOT_SIZE, cut,
+                                        IMAGE_SIZE) == W25Q128_SUCCESS);
+        EMU_CHECK(W25Q128_Ota_GetOffset(&ota) == 0);
+        EMU_CHECK(W25Q128_Ota_Verify(&ota, &w25, SLOT_ADDR, SLOT_SIZE) ==
+                                                            W25Q128_ERROR);
+        EMU_CHECK(W25Q128_Ota_Open(&ota, &w25, SLOT_ADDR, SLOT_SIZE, cut,
+                                        IMAGE_SIZE) == W25Q128_SUCCESS);
+
+        // Cut in the first half of the image, every third one waits for an
+        // erase ahead and every third for a marker after that point
+        ops_left = 1 + rand() % (IMAGE_SIZE / W25Q128_PAGE_SIZE / 2);
+        cut_target = cut % 3;
+        emu.op_hook = cut_power;
+        append_to(IMAGE_SIZE);
+        EMU_CHECK(0);
+    }
+
+    printf("ota resume: %u cuts, %u in erases, %u in markers\n", CUTS,
+                                                erase_cuts, marker_cuts);
+    EMU_CHECK(erase_cuts > 0 && marker_cuts > 0);
+
+    W25Q128_Emu_Deinit(&emu);
+    unlink(image_file);
+
+    return 0;
+}
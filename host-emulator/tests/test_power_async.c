@@ -0,0 +1,109 @@
+/**
+ * @file test_power_async.c
+ * @brief Automatic deep power-down next to the asynchronous queue
+ * @author Filip Stojanovic
+ *
+ * Built with W25Q128_AUTO_POWER_DOWN. While the queue has transfers,
+ * W25Q128_PowerDown must refuse without touching the bus, and transfers must
+ * restart the idle time of W25Q128_PowerIdle. A command right after a
+ * release waits only for tRES1, not for the next tick of the time source,
+ * and the device never ignores a command.
+ */
+
+#include "emu_test.h"
+#include "w25q128_async_ll.h"
+
+#define ERASE_SECTOR 5
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_AsyncTypeDef async;
+static uint8_t data[W25Q128_PAGE_SIZE];
+static uint8_t check[W25Q128_PAGE_SIZE];
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    W25Q128_Async_DMACpltHandler(&async, hspi);
+}
+
+int main(void)
+{
+    W25Q128_AsyncTransferTypeDef erase;
+    W25Q128_AsyncTransferTypeDef read;
+    W25Q128_PowerStatsTypeDef stats;
+    uint32_t commands;
+    uint64_t start;
+
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+    W25Q128_Async_Init(&async, &w25);
+    emu_test_fill(data, sizeof(data), 25);
+    EMU_CHECK(W25Q128_WritePage(&w25, 0, 0, sizeof(data), data) ==
+                                                            W25Q128_SUCCESS);
+
+    // Queued erase and read, power-down is refused without a command
+    EMU_CHECK(W25Q128_Async_EraseSector(&async, &erase, ERASE_SECTOR, NULL,
+                                                    NULL) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Async_Read(&async, &read, 0, check, sizeof(check), NULL,
+                                                    NULL) == W25Q128_SUCCESS);
+    commands = emu.stats.commands[INST_READ_STATUS_REG_2] +
+                                    emu.stats.commands[INST_POWER_DOWN];
+    EMU_CHECK(W25Q128_PowerDown(&w25) == W25Q128_BUSY);
+    EMU_CHECK(emu.stats.commands[INST_READ_STATUS_REG_2] +
+                            emu.stats.commands[INST_POWER_DOWN] == commands);
+    EMU_CHECK(W25Q128_Async_Wait(&async, &read, 100) == W25Q128_SUCCESS);
+    EMU_CHECK(memcmp(data, check, sizeof(check)) == 0);
+    EMU_CHECK(W25Q128_PowerDown(&w25) == W25Q128_BUSY);
+    EMU_CHECK(W25Q128_Async_Wait(&async, &erase, 1000) == W25Q128_SUCCESS);
+    EMU_CHECK(emu.stats.commands[INST_POWER_DOWN] == 0);
+
+    // Erase outlasted the idle time, its end restarted it
+    EMU_CHECK(W25Q128_PowerIdle(&w25) == W25Q128_SUCCESS);
+    EMU_CHECK(!w25.power_down);
+    HAL_Delay(W25Q128_POWER_IDLE_MS + 2);
+    EMU_CHECK(W25Q128_PowerIdle(&w25) == W25Q128_SUCCESS);
+    EMU_CHECK(w25.power_down && emu.stats.commands[INST_POWER_DOWN] == 1);
+
+    // Queue releases the device itself
+    EMU_CHECK(W25Q128_Async_Read(&async, &read, 0, check, sizeof(check), NULL,
+                                                    NULL) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Async_Wait(&async, &read, 100) == W25Q128_SUCCESS);
+    EMU_CHECK(memcmp(data, check, sizeof(check)) == 0);
+    EMU_CHECK(!w25.power_down && !w25.power_async);
+
+    // Release right before a command waits about tRES1, not a tick
+    HAL_Delay(W25Q128_POWER_IDLE_MS + 2);
+    EMU_CHECK(W25Q128_PowerIdle(&w25) == W25Q128_SUCCESS);
+    EMU_CHECK(w25.power_down);
+    W25Q128_ResetPowerStats(&w25);
+    start = W25Q128_Emu_GetTimeNs();
+    EMU_CHECK(W25Q128_PowerWake(&w25) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_FastRead(&w25, 0, 0, sizeof(check), check) ==
+                                                            W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_Emu_GetTimeNs() - start < 100000);
+    EMU_CHECK(memcmp(data, check, sizeof(check)) == 0);
+    W25Q128_GetPowerStats(&w25, &stats);
+    EMU_CHECK(stats.hinted_releases == 1 && stats.release_waits == 1);
+
+    EMU_CHECK(emu.stats.ignored == 0);
+    printf("power async: %u power-downs, %u releases, %llu ns release\n",
+            emu.stats.commands[INST_POWER_DOWN],
+            emu.stats.commands[INST_RELEASE_POWER_DOWN_ID],
+            (unsigned long long)(W25Q128_Emu_GetTimeNs() - start));
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
@@ -0,0 +1,138 @@
+/**
+ * @file test_read_modes.c
+ * @brief Read modes on SPI and QSPI transports with their clock cycles
+ * @author Filip Stojanovic
+ *
+ * Built with W25Q128_CONTINUOUS_READ. Every mode reads the same 256 bytes
+ * twice, the emulator counts the clocks of each read: Dual and Quad I/O skip
+ * the instruction on the second read. Prints the cycles of every mode.
+ */
+
+#include "emu_test.h"
+
+#define READ_SIZE 256
+
+typedef struct {
+    W25Q128_ReadModeTypeDef mode;
+    const char *name;
+    uint32_t first_cycles;
+    uint32_t next_cycles;
+} ReadModeCase;
+
+// Instruction, address, mode bits, dummy clocks and 256 data bytes
+static const ReadModeCase qspi_cases[] = {
+    {W25Q128_READ_MODE_FAST,     "0Bh 1-1-1", 2088, 2088},
+    {W25Q128_READ_MODE_DUAL_OUT, "3Bh 1-1-2", 1064, 1064},
+    {W25Q128_READ_MODE_DUAL_IO,  "BBh 1-2-2", 1048, 1040},
+    {W25Q128_READ_MODE_QUAD_OUT, "6Bh 1-1-4",  552,  552},
+    {W25Q128_READ_MODE_QUAD_IO,  "EBh 1-4-4",  532,  524},
+};
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static QSPI_HandleTypeDef hqspi;
+static W25Q128_EmuTypeDef emu_spi;
+static W25Q128_EmuTypeDef emu_qspi;
+static W25Q128_TypeDef w25_spi;
+static W25Q128_TypeDef w25_qspi;
+static uint8_t data[READ_SIZE];
+static uint8_t check[READ_SIZE];
+
+// Reads the test data and returns its clock cycles
+static uint32_t read_cycles(W25Q128_EmuTypeDef *emu, W25Q128_TypeDef *w25)
+{
+    uint64_t start = emu->stats.bus_cycles;
+
+    memset(check, 0x00, sizeof(check));
+    EMU_CHECK(W25Q128_FastRead(w25, 0x100, 0, READ_SIZE, check) ==
+                                                            W25Q128_SUCCESS);
+    EMU_CHECK(memcmp(data, check, READ_SIZE) == 0);
+
+    return (uint32_t)(emu->stats.bus_cycles - start);
+}
+
+int main(void)
+{
+    uint32_t cycles;
+
+    emu_test_fill(data, sizeof(data), 6);
+
+    // Standard SPI: Read Data and Fast Read only, Fast Read by default
+    emu_test_device(&emu_spi, &w25_spi, &hspi1, &gpioa, 16 * 1024 * 1024);
+    memcpy(emu_spi.mem + 0x10000, data, READ_SIZE);
+    W25Q128_Reset(&w25_spi);
+
+    cycles = read_cycles(&emu_spi, &w25_spi);
+    EMU_CHECK(w25_spi.read_mode == W25Q128_READ_MODE_FAST);
+    EMU_CHECK(cycles == 2088);
+    printf("spi  0Bh 1-1-1 %4u cycles\n", cycles);
+    EMU_CHECK(W25Q128_SetReadMode(&w25_spi, W25Q128_READ_MODE_SINGLE) ==
+                                                            W25Q128_SUCCESS);
+    cycles = read_cycles(&emu_spi, &w25_spi);
+    EMU_CHECK(cycles == 2080);
+    printf("spi  03h 1-1-1 %4u cycles\n", cycles);
+    EMU_CHECK(W25Q128_SetReadMode(&w25_spi, W25Q128_READ_MODE_DUAL_OUT) ==
+                                                            W25Q128_ERROR);
+    EMU_CHECK(emu_spi.stats.ignored == 0);
+
+    // QSPI: the widest mode is selected and QE bit is set for it
+    EMU_CHECK(W25Q128_Emu_InitQspi(&emu_qspi, &hqspi, NULL,
+                                    16 * 1024 * 1024) == W25Q128_SUCCESS);
+    memcpy(emu_qspi.mem + 0x10000, data, READ_SIZE);
+    w25_qspi.transport = W25Q128_TRANSPORT_QSPI;
+    w25_qspi.hqspi = &hqspi;
+
+    EMU_CHECK(!(emu_qspi.sr[1] & W25Q128_SR2_QE));
+    read_cycles(&emu_qspi, &w25_qspi);
+    EMU_CHECK(w25_qspi.read_mode == W25Q128_READ_MODE_QUAD_IO);
+    EMU_CHECK(emu_qspi.sr[1] & W25Q128_SR2_QE);
+    EMU_CHECK(emu_qspi.stats.commands[INST_FAST_READ_QUAD_IO] == 1);
+
+    for (uint32_t i = 0; i < sizeof(qspi_cases) / sizeof(qspi_cases[0]); i++)
+    {
+        const ReadModeCase *c = &qspi_cases[i];
+        uint32_t next;
+
+        // Status read takes the device out of continuous read mode
+        EMU_CHECK(!(W25Q128_ReadStatusRegister(&w25_qspi) & W25Q128_SR1_BUSY));
+        EMU_CHECK(W25Q128_SetReadMode(&w25_qspi, c->mode) == W25Q128_SUCCESS);
+        cycles = read_cycles(&emu_qspi, &w25_qspi);
+        next = read_cycles(&emu_qspi, &w25_qspi);
+        printf("qspi %s %4u cycles, next read %4u\n", c->name, cycles, next);
+        EMU_CHECK(cycles == c->first_cycles);
+        EMU_CHECK(next == c->next_cycles);
+    }
+
+    // Device is left in continuous Quad I/O, the mode is switched right away
+    EMU_CHECK(w25_qspi.continuous_read);
+    EMU_CHECK(W25Q128_SetReadMode(&w25_qspi, W25Q128_READ_MODE_DUAL_IO) ==
+                                                            W25Q128_SUCCESS);
+    EMU_CHECK(read_cycles(&emu_qspi, &w25_qspi) == 1048);
+    EMU_CHECK(emu_qspi.stats.ignored == 0);
+
+    // Quad Page Program once QE is set
+    emu_test_fill(data, sizeof(data), 7);
+    EMU_CHECK(W25Q128_EraseSector(&w25_qspi, 0x20) == W25Q128_SUCCESS);
+    cycles = (uint32_t)emu_qspi.stats.bus_cycles;
+    EMU_CHECK(W25Q128_WritePage(&w25_qspi, 0x200, 0, READ_SIZE, data) ==
+                                                            W25Q128_SUCCESS);
+    EMU_CHECK(emu_qspi.stats.commands[INST_QUAD_PAGE_PROGRAM] == 1);
+    EMU_CHECK(memcmp(emu_qspi.mem + 0x20000, data, READ_SIZE) == 0);
+    printf("qspi 32h 1-1-4 program %u cycles with WREN and status polls\n",
+                        (uint32_t)emu_qspi.stats.bus_cycles - cycles);
+
+    // Quad commands are not served once QE bit is cleared
+    EMU_CHECK(W25Q128_WriteStatusRegisterN(&w25_qspi, 2, 0x00) ==
+                                                            W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_SetReadMode(&w25_qspi, W25Q128_READ_MODE_DUAL_OUT) ==
+                                                            W25Q128_SUCCESS);
+    w25_qspi.read_mode = W25Q128_READ_MODE_QUAD_OUT;
+    EMU_CHECK(W25Q128_FastRead(&w25_qspi, 0x200, 0, READ_SIZE, check) ==
+                                                            W25Q128_SUCCESS);
+    EMU_CHECK(check[0] == 0xFF && emu_qspi.stats.ignored == 1);
+
+    W25Q128_Emu_Deinit(&emu_qspi);
+    W25Q128_Emu_Deinit(&emu_spi);
+
+    return 0;
+}
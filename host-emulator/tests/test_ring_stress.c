@@ -0,0 +1,153 @@
+/**
+ * @file test_ring_stress.c
+ * @brief Concurrent producers pushing into the ingestion ring
+ * @author Filip Stojanovic
+ *
+ * Four pthread producers push records tagged with their id and sequence
+ * number while the main thread drains the ring into a log large enough to
+ * never wrap. Every logged record must come in order per producer with its
+ * content intact, and each producer must find exactly the records it pushed
+ * successfully. The producers run once without pacing, so the ring fills and
+ * drops, and once paced so that normally nothing is dropped.
+ *
+ * `make tsan` builds and runs it with ThreadSanitizer, which must not report.
+ */
+
+#include "emu_test.h"
+#include "w25q128_ring.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#define FIRST_SECTOR 0
+#define NUM_SECTORS  2048
+#define PRODUCERS    4
+#define PUSHES       10000
+#define MAX_RECORD   127
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static W25Q128_LogTypeDef log_store;
+static W25Q128_RingTypeDef ring;
+static atomic_uint finished;
+static uint32_t pace_ns;
+static uint32_t pushed[PRODUCERS];
+
+// Record holds producer id, sequence number and data derived from both
+static uint32_t record_make(uint32_t id, uint32_t seq, uint8_t *data)
+{
+    uint32_t size = 8 + (seq * 13 + id * 7) % (MAX_RECORD - 7);
+
+    memcpy(data, &id, sizeof(id));
+    memcpy(data + 4, &seq, sizeof(seq));
+    for (uint32_t i = 8; i < size; i++)
+        data[i] = (uint8_t)(id + seq + i);
+
+    return size;
+}
+
+static void *producer(void *arg)
+{
+    uint32_t id = (uint32_t)(uintptr_t)arg;
+    uint8_t data[MAX_RECORD];
+
+    for (uint32_t seq = 0; seq < PUSHES; seq++)
+    {
+        uint32_t size = record_make(id, seq, data);
+
+        if (W25Q128_Ring_Push(&ring, data, size) == W25Q128_SUCCESS)
+            pushed[id]++;
+        if (pace_ns > 0)
+        {
+            struct timespec ts = { 0, pace_ns };
+
+            nanosleep(&ts, NULL);
+        }
+    }
+    atomic_fetch_add(&finished, 1);
+
+    return NULL;
+}
+
+static void run(uint32_t pace)
+{
+    pthread_t threads[PRODUCERS];
+    W25Q128_LogIteratorTypeDef it;
+    W25Q128_RingStatsTypeDef stats;
+    uint8_t data[W25Q128_RING_MAX_RECORD_SIZE];
+    uint8_t expected[MAX_RECORD];
+    uint32_t next[PRODUCERS] = { 0 };
+    uint32_t logged[PRODUCERS] = { 0 };
+    uint32_t size;
+
+    EMU_CHECK(W25Q128_Log_Format(&log_store, &w25, FIRST_SECTOR,
+                                        NUM_SECTORS) == W25Q128_SUCCESS);
+    W25Q128_Ring_Init(&ring);
+    atomic_store(&finished, 0);
+    pace_ns = pace;
+    memset(pushed, 0, sizeof(pushed));
+
+    for (uint32_t i = 0; i < PRODUCERS; i++)
+        EMU_CHECK(pthread_create(&threads[i], NULL, producer,
+                                                (void *)(uintptr_t)i) == 0);
+
+    // Ring is empty once all producers finished and a drain found nothing
+    for (;;)
+    {
+        uint8_t done = (atomic_load(&finished) == PRODUCERS);
+        W25Q128_StatusTypeDef status = W25Q128_Ring_Drain(&ring, &log_store,
+                                                                        64);
+
+        EMU_CHECK(status != W25Q128_ERROR);
+        if (status == W25Q128_END)
+        {
+            if (done && W25Q128_Ring_GetUsed(&ring) == 0)
+                break;
+            EMU_CHECK(W25Q128_Log_EraseAhead(&log_store) == W25Q128_SUCCESS);
+        }
+    }
+    EMU_CHECK(W25Q128_Log_Sync(&log_store) == W25Q128_SUCCESS);
+    for (uint32_t i = 0; i < PRODUCERS; i++)
+        EMU_CHECK(pthread_join(threads[i], NULL) == 0);
+
+    W25Q128_Log_IterInit(&log_store, &it);
+    while (W25Q128_Log_IterNext(&log_store, &it, data, sizeof(data), &size) ==
+                                                            W25Q128_SUCCESS)
+    {
+        uint32_t id;
+        uint32_t seq;
+
+        memcpy(&id, data, sizeof(id));
+        memcpy(&seq, data + 4, sizeof(seq));
+        EMU_CHECK(id < PRODUCERS && seq >= next[id] && seq < PUSHES);
+        EMU_CHECK(record_make(id, seq, expected) == size);
+        EMU_CHECK(memcmp(expected, data, size) == 0);
+        next[id] = seq + 1;
+        logged[id]++;
+    }
+
+    W25Q128_Ring_GetStats(&ring, &stats);
+    for (uint32_t i = 0; i < PRODUCERS; i++)
+        EMU_CHECK(logged[i] == pushed[i]);
+    EMU_CHECK(stats.pushed + stats.dropped == PRODUCERS * PUSHES);
+    EMU_CHECK(stats.drained == stats.pushed);
+    EMU_CHECK(stats.high_water <= W25Q128_RING_SIZE);
+
+    printf("ring stress, pace %u us: %u pushed, %u dropped, high water %u\n",
+            pace / 1000, stats.pushed, stats.dropped, stats.high_water);
+}
+
+int main(void)
+{
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+
+    run(0);
+    run(200000);
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
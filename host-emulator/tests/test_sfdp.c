@@ -0,0 +1,102 @@
+/**
+ * @file test_sfdp.c
+ * @brief Geometry and timings taken from SFDP
+ * @author Filip Stojanovic
+ *
+ * W25Q128_InitSFDP on the W25Q128JV table and on the table of another part:
+ * 8 MB, no 32 KB erase, other erase, program and tRES1 times, quad reads
+ * only with 6 dummy clocks for EBh. A table with 512 byte pages is rejected
+ * and leaves the defaults in place.
+ */
+
+#include "emu_test.h"
+
+#define PART_SIZE (8 * 1024 * 1024)
+
+static const uint32_t part_bfpt[16] = {
+    0xFFE020E5,     // 4 KB erase 20h, 3 byte address, 1-1-4 and 1-4-4 only
+    0x03FFFFFF,     // 64 Mbit
+    0x6B08EB46,     // 1-1-4 6Bh 8 dummy, 1-4-4 EBh 2 mode + 6 dummy
+    0xBB803B08,     // Dual reads are not supported
+    0xFFFFFFEE,
+    0xFF00FFFF,
+    0xFF00FFFF,
+    0x0000200C,     // Erase type 4 KB 20h only
+    0x0000D810,     // 64 KB D8h
+    0x00BC01D3,     // Erase 30, -, 256 ms typical, max 8x
+    0x44002A81,     // 256 B page, program 704 us, chip erase 20 s, max 4x
+    0xFFFFFFFF,
+    0xFFFFFFFF,
+    0x5CD5BD04,     // Release from deep power-down takes 30 us
+    0xFFFFFFFF,
+    0xFFFFFFFF,
+};
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static uint32_t bfpt[16];
+
+int main(void)
+{
+    const W25Q128_GeometryTypeDef *geo = &w25.geometry;
+
+    // W25Q128JV
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+    EMU_CHECK(W25Q128_InitSFDP(&w25) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_GetCapacity(&w25) == 16 * 1024 * 1024);
+    EMU_CHECK(geo->erase_size[0] == 4096 && geo->erase_inst[0] == 0x20);
+    EMU_CHECK(geo->erase_size[1] == 32768 && geo->erase_inst[1] == 0x52);
+    EMU_CHECK(geo->erase_size[2] == 65536 && geo->erase_inst[2] == 0xD8);
+    EMU_CHECK(geo->erase_typ_ms[0] == 48 && geo->erase_max_ms[0] == 576);
+    EMU_CHECK(geo->read[W25Q128_READ_MODE_DUAL_IO].instruction == 0xBB);
+    EMU_CHECK(geo->release_power_down_us == 3);
+    W25Q128_Emu_Deinit(&emu);
+
+    // Another part
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, PART_SIZE);
+    emu.sfdp_bfpt = part_bfpt;
+    W25Q128_Reset(&w25);
+    EMU_CHECK(W25Q128_InitSFDP(&w25) == W25Q128_SUCCESS);
+    EMU_CHECK(W25Q128_GetCapacity(&w25) == PART_SIZE);
+
+    EMU_CHECK(geo->erase_size[0] == 4096 && geo->erase_inst[0] == 0x20);
+    EMU_CHECK(geo->erase_typ_ms[0] == 30 && geo->erase_max_ms[0] == 240);
+    EMU_CHECK(geo->erase_size[1] == 65536 && geo->erase_inst[1] == 0xD8);
+    EMU_CHECK(geo->erase_typ_ms[1] == 256 && geo->erase_max_ms[1] == 2048);
+    EMU_CHECK(geo->erase_size[2] == 0 && geo->erase_size[3] == 0);
+    EMU_CHECK(geo->page_size == 256 && geo->page_program_max_ms == 3);
+    EMU_CHECK(geo->chip_erase_max_ms == 80000);
+    EMU_CHECK(geo->release_power_down_us == 30);
+
+    EMU_CHECK(geo->read[W25Q128_READ_MODE_DUAL_OUT].instruction == 0);
+    EMU_CHECK(geo->read[W25Q128_READ_MODE_DUAL_IO].instruction == 0);
+    EMU_CHECK(geo->read[W25Q128_READ_MODE_QUAD_OUT].instruction == 0x6B);
+    EMU_CHECK(geo->read[W25Q128_READ_MODE_QUAD_OUT].dummy_cycles == 8);
+    EMU_CHECK(geo->read[W25Q128_READ_MODE_QUAD_IO].instruction == 0xEB);
+    EMU_CHECK(geo->read[W25Q128_READ_MODE_QUAD_IO].mode_clocks == 2);
+    EMU_CHECK(geo->read[W25Q128_READ_MODE_QUAD_IO].dummy_cycles == 6);
+
+    // Ranges are erased with the types of the table, no 32 KB erase
+    W25Q128_Emu_ResetStats(&emu);
+    EMU_CHECK(W25Q128_EraseRange(&w25, 0x7F000, 0x11000) == W25Q128_SUCCESS);
+    EMU_CHECK(emu.stats.commands[0x20] == 1);
+    EMU_CHECK(emu.stats.commands[0x52] == 0);
+    EMU_CHECK(emu.stats.commands[0xD8] == 1);
+
+    // Page of 512 bytes is not supported, defaults are kept
+    memcpy(bfpt, part_bfpt, sizeof(bfpt));
+    bfpt[10] = (bfpt[10] & ~0xF0u) | (9 << 4);
+    emu.sfdp_bfpt = bfpt;
+    memset(&w25.geometry, 0, sizeof(w25.geometry));
+    EMU_CHECK(W25Q128_InitSFDP(&w25) == W25Q128_ERROR);
+    EMU_CHECK(w25.geometry.capacity == 0);
+    EMU_CHECK(W25Q128_GetCapacity(&w25) == 16 * 1024 * 1024);
+    EMU_CHECK(emu.stats.ignored == 0);
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
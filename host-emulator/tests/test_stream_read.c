@@ -0,0 +1,101 @@
+/**
+ * @file test_stream_read.c
+ * @brief Double-buffered W25Q128_StreamRead
+ * @author Filip Stojanovic
+ *
+ * Streams of 150 KB from an odd address are read with small chunks and with
+ * the largest chunk a 16-bit DMA length allows, so the stream is far longer
+ * than one HAL transfer. Chunks must come in order, alternate between the
+ * two buffers, hold the flash content at their offset and arrive while the
+ * next chunk is still being received, all in a single Fast Read command. A
+ * consumer error stops the stream and leaves the device usable.
+ */
+
+#include "emu_test.h"
+
+#define STREAM_ADDR 0x12345
+#define STREAM_SIZE (150 * 1024)
+
+typedef struct {
+    uint32_t addr;
+    uint32_t size;
+    uint32_t offset;
+    uint32_t chunks;
+    uint32_t stop_at;
+} StreamTypeDef;
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static uint8_t buf[2][65535];
+
+static W25Q128_StatusTypeDef consume(const uint8_t *data, uint32_t size,
+                                            uint32_t offset, void *user_data)
+{
+    StreamTypeDef *stream = user_data;
+
+    EMU_CHECK(offset == stream->offset);
+    EMU_CHECK(data == buf[stream->chunks % 2]);
+    EMU_CHECK(memcmp(data, emu.mem + stream->addr + offset, size) == 0);
+
+    // Next chunk is in flight
+    if (offset + size < stream->size)
+        EMU_CHECK(HAL_SPI_GetState(&hspi1) == HAL_SPI_STATE_BUSY_RX);
+
+    stream->offset += size;
+    stream->chunks++;
+    if (stream->chunks == stream->stop_at)
+        return W25Q128_ERROR;
+
+    return W25Q128_SUCCESS;
+}
+
+static void stream_check(uint32_t addr, uint32_t size, uint16_t chunk_size)
+{
+    StreamTypeDef stream = { .addr = addr, .size = size };
+
+    W25Q128_Emu_ResetStats(&emu);
+    EMU_CHECK(W25Q128_StreamRead(&w25, addr, size, buf[0], buf[1], chunk_size,
+                                    consume, &stream) == W25Q128_SUCCESS);
+    EMU_CHECK(stream.offset == size);
+    EMU_CHECK(stream.chunks == (size + chunk_size - 1) / chunk_size);
+    EMU_CHECK(emu.stats.commands[INST_FAST_READ] == (size ? 1 : 0));
+}
+
+int main(void)
+{
+    StreamTypeDef stream = { .addr = STREAM_ADDR, .size = STREAM_SIZE };
+    uint8_t check[64];
+
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+    emu_test_fill(emu.mem, 1024 * 1024, 11);
+
+    stream_check(STREAM_ADDR, STREAM_SIZE, 4096);
+    stream_check(STREAM_ADDR, STREAM_SIZE, 65535);
+    stream_check(STREAM_ADDR, STREAM_SIZE, 1000);
+    stream_check(STREAM_ADDR + 1, 100, 4096);
+    stream_check(STREAM_ADDR, 0, 4096);
+
+    // Consumer stops the stream
+    stream.stop_at = 3;
+    EMU_CHECK(W25Q128_StreamRead(&w25, STREAM_ADDR, STREAM_SIZE, buf[0],
+                        buf[1], 4096, consume, &stream) == W25Q128_ERROR);
+    EMU_CHECK(stream.chunks == 3);
+    EMU_CHECK(HAL_SPI_GetState(&hspi1) == HAL_SPI_STATE_READY);
+    EMU_CHECK(W25Q128_FastRead(&w25, 3, 5, sizeof(check), check) ==
+                                                            W25Q128_SUCCESS);
+    EMU_CHECK(memcmp(check, emu.mem + 3 * W25Q128_PAGE_SIZE + 5,
+                                                        sizeof(check)) == 0);
+
+    // Chunk size and range
+    EMU_CHECK(W25Q128_StreamRead(&w25, 0, 100, buf[0], buf[1], 0, consume,
+                                                &stream) == W25Q128_ERROR);
+    EMU_CHECK(W25Q128_StreamRead(&w25, W25Q128_GetCapacity(&w25) - 10, 11,
+                    buf[0], buf[1], 4096, consume, &stream) == W25Q128_ERROR);
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
@@ -0,0 +1,184 @@
+/**
+ * @file test_stripe_hooks.c
+ * @brief littlefs block device hooks of w25q128_stripe_lfs
+ * @author Filip Stojanovic
+ *
+ * Built against the littlefs shim (lfs-shim/lfs.h), the hooks are called
+ * directly with a hand-built lfs_config over three emulated devices, each
+ * on its own SPI bus. For whole blocks per device and for 1 KB interleave,
+ * progged data must land on the device and at the address of the layout,
+ * read back unchanged at any offset, and an erase must keep only the
+ * devices of its block busy until the next call that uses them or a sync.
+ * An erase that times out fails the sync.
+ */
+
+#include "emu_test.h"
+#include "w25q128_stripe_lfs.h"
+
+#define NUM_CHIPS  3
+#define CHIP_SIZE  (4 * 1024 * 1024)
+#define MAX_BLOCK  (NUM_CHIPS * W25Q128_SECTOR_SIZE)
+
+static SPI_HandleTypeDef hspi[NUM_CHIPS];
+static GPIO_TypeDef gpio[NUM_CHIPS];
+static W25Q128_EmuTypeDef emu[NUM_CHIPS];
+static W25Q128_TypeDef w25[NUM_CHIPS];
+static W25Q128_AsyncTypeDef async[NUM_CHIPS];
+static W25Q128_AsyncTypeDef *chips[NUM_CHIPS];
+static w25q128_stripe_t stripe;
+static uint8_t data[MAX_BLOCK];
+static uint8_t check[MAX_BLOCK];
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    w25q128_stripe_dma_cplt(&stripe, hspi);
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    w25q128_stripe_dma_cplt(&stripe, hspi);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    w25q128_stripe_dma_cplt(&stripe, hspi);
+}
+
+// Flash byte that holds a byte of a block
+static uint8_t *locate(lfs_block_t block, lfs_off_t off)
+{
+    uint32_t unit;
+
+    if (stripe.stripe_size == 0)
+        return &emu[block % NUM_CHIPS].mem[(block / NUM_CHIPS) *
+                                                W25Q128_SECTOR_SIZE + off];
+
+    unit = off / stripe.stripe_size;
+    return &emu[unit % NUM_CHIPS].mem[block * W25Q128_SECTOR_SIZE +
+                                (unit / NUM_CHIPS) * stripe.stripe_size +
+                                off % stripe.stripe_size];
+}
+
+static void prog_check(const struct lfs_config *cfg, lfs_block_t block,
+                                            lfs_off_t off, lfs_size_t size)
+{
+    emu_test_fill(data, size, block * MAX_BLOCK + off);
+    EMU_CHECK(cfg->prog(cfg, block, off, data, size) == 0);
+    for (uint32_t i = 0; i < size; i++)
+        EMU_CHECK(*locate(block, off + i) == data[i]);
+
+    EMU_CHECK(cfg->read(cfg, block, off, check, size) == 0);
+    EMU_CHECK(memcmp(check, data, size) == 0);
+}
+
+static uint32_t commands(uint8_t chip, uint8_t inst)
+{
+    return emu[chip].stats.commands[inst];
+}
+
+static void run(uint32_t stripe_size)
+{
+    struct lfs_config cfg = {
+        .context = &stripe,
+        .read = w25q128_stripe_read,
+        .prog = w25q128_stripe_prog,
+        .erase = w25q128_stripe_erase,
+        .sync = w25q128_stripe_sync,
+        .read_size = 16,
+        .prog_size = 16,
+        .block_cycles = 500,
+        .cache_size = 256,
+        .lookahead_size = 16,
+    };
+    lfs_size_t sectors;
+    uint64_t start;
+
+    for (uint8_t i = 0; i < NUM_CHIPS; i++)
+    {
+        emu_test_device(&emu[i], &w25[i], &hspi[i], &gpio[i], CHIP_SIZE);
+        W25Q128_Reset(&w25[i]);
+        W25Q128_Async_Init(&async[i], &w25[i]);
+        chips[i] = &async[i];
+    }
+    EMU_CHECK(w25q128_stripe_init(&stripe, chips, NUM_CHIPS,
+                                                        stripe_size) == 0);
+    sectors = W25Q128_GetCapacity(&w25[0]) / W25Q128_SECTOR_SIZE;
+    cfg.block_size = w25q128_stripe_block_size(&stripe);
+    cfg.block_count = w25q128_stripe_block_count(&stripe);
+    EMU_CHECK(cfg.block_size == (stripe_size ? MAX_BLOCK :
+                                                    W25Q128_SECTOR_SIZE));
+    EMU_CHECK(cfg.block_count == (stripe_size ? sectors :
+                                                    sectors * NUM_CHIPS));
+
+    // Whole block, pages go to the devices of the block only
+    prog_check(&cfg, 1, 0, cfg.block_size);
+    for (uint8_t i = 0; i < NUM_CHIPS; i++)
+    {
+        uint32_t pages = (stripe_size || i == 1) ?
+                                            W25Q128_PAGES_PER_SECTOR : 0;
+
+        EMU_CHECK(commands(i, INST_PAGE_PROGRAM) == pages);
+    }
+
+    // Across units and pages at odd offsets, neighbours stay blank
+    prog_check(&cfg, 2, 1024 - 16, 2080);
+    EMU_CHECK(*locate(2, 1024 - 17) == 0xFF);
+    EMU_CHECK(*locate(2, 1024 + 2064) == 0xFF);
+    prog_check(&cfg, 2, 3600, 48);
+
+    // Reads at any offset
+    emu_test_fill(data, cfg.block_size, 1 * MAX_BLOCK);
+    EMU_CHECK(cfg.read(&cfg, 1, 1000, check, 3000) == 0);
+    EMU_CHECK(memcmp(check, &data[1000], 3000) == 0);
+    EMU_CHECK(cfg.read(&cfg, 1, cfg.block_size - 16, check, 16) == 0);
+    EMU_CHECK(memcmp(check, &data[cfg.block_size - 16], 16) == 0);
+
+    // Erase runs until a call needs its devices
+    start = EMU_TIME_US();
+    EMU_CHECK(cfg.erase(&cfg, 1) == 0);
+    EMU_CHECK(EMU_TIME_US() - start < 1000);
+    if (stripe_size == 0)
+    {
+        EMU_CHECK(cfg.read(&cfg, 2, 0, check, 64) == 0);
+        EMU_CHECK(EMU_TIME_US() - start < 5000);
+    }
+    EMU_CHECK(cfg.sync(&cfg) == 0);
+    EMU_CHECK(EMU_TIME_US() - start >= 40000);
+    for (uint8_t i = 0; i < NUM_CHIPS; i++)
+    {
+        uint32_t erases = (stripe_size || i == 1) ? 1 : 0;
+
+        EMU_CHECK(commands(i, INST_SECTOR_ERASE_4KB) == erases);
+    }
+    for (uint32_t off = 0; off < cfg.block_size; off++)
+        EMU_CHECK(*locate(1, off) == 0xFF);
+    EMU_CHECK(cfg.read(&cfg, 1, 0, check, 16) == 0);
+    EMU_CHECK(check[0] == 0xFF);
+
+    // Erase that never finishes fails the sync, not the erase
+    emu[0].timing.sector_erase_us = 1000 * 1000;
+    EMU_CHECK(cfg.erase(&cfg, 3) == 0);
+    EMU_CHECK(cfg.sync(&cfg) == LFS_ERR_IO);
+    EMU_CHECK(W25Q128_WaitForReady(&w25[0], 2000) == W25Q128_READY);
+    EMU_CHECK(cfg.sync(&cfg) == 0);
+
+    for (uint8_t i = 0; i < NUM_CHIPS; i++)
+        W25Q128_Emu_Deinit(&emu[i]);
+}
+
+int main(void)
+{
+    run(0);
+    run(1024);
+
+    // Layouts that do not fit
+    EMU_CHECK(w25q128_stripe_init(&stripe, chips, 0, 0) == LFS_ERR_INVAL);
+    EMU_CHECK(w25q128_stripe_init(&stripe, chips,
+                        W25Q128_STRIPE_MAX_CHIPS + 1, 0) == LFS_ERR_INVAL);
+    EMU_CHECK(w25q128_stripe_init(&stripe, chips, NUM_CHIPS, 3000) ==
+                                                            LFS_ERR_INVAL);
+    EMU_CHECK(w25q128_stripe_init(&stripe, chips, NUM_CHIPS,
+                            2 * W25Q128_SECTOR_SIZE) == LFS_ERR_INVAL);
+
+    return 0;
+}
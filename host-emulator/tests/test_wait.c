@@ -0,0 +1,89 @@
+/**
+ * @file test_wait.c
+ * @brief Program and erase functions return once the device is ready
+ * @author Filip Stojanovic
+ *
+ * Completion is taken from the BUSY bit, so every operation has to return
+ * close to the busy time modelled by the emulator and follow it when it
+ * changes, instead of sleeping for a fixed worst-case delay.
+ */
+
+#include "emu_test.h"
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static uint8_t data[W25Q128_SECTOR_SIZE];
+
+int main(void)
+{
+    uint64_t start;
+    uint64_t elapsed;
+
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+    emu_test_fill(data, sizeof(data), 1);
+
+    // Page program, 256 bytes take about 50 us on the bus
+    W25Q128_Emu_ResetStats(&emu);
+    start = EMU_TIME_US();
+    EMU_CHECK(W25Q128_WritePage(&w25, 0, 0, W25Q128_PAGE_SIZE, data) ==
+                                                            W25Q128_SUCCESS);
+    elapsed = EMU_TIME_US() - start;
+    EMU_CHECK(elapsed >= 400 && elapsed < 470);
+    EMU_CHECK(emu.stats.delay_calls == 0);
+
+    // Busy time of a faster part
+    emu.timing.page_program_us = 250;
+    start = EMU_TIME_US();
+    EMU_CHECK(W25Q128_WritePage(&w25, 1, 0, W25Q128_PAGE_SIZE, data) ==
+                                                            W25Q128_SUCCESS);
+    elapsed = EMU_TIME_US() - start;
+    EMU_CHECK(elapsed >= 250 && elapsed < 320);
+    emu.timing.page_program_us = 400;
+
+    // Programs starting late in a tick cross the next one without sleeping
+    for (uint32_t offset_us = 500; offset_us < 1000; offset_us += 50)
+    {
+        W25Q128_Emu_Advance(1000000 - W25Q128_Emu_GetTimeNs() % 1000000 +
+                                                        offset_us * 1000ULL);
+        W25Q128_Emu_ResetStats(&emu);
+        start = EMU_TIME_US();
+        EMU_CHECK(W25Q128_WritePage(&w25, 2 + offset_us / 50, 0,
+                                W25Q128_PAGE_SIZE, data) == W25Q128_SUCCESS);
+        elapsed = EMU_TIME_US() - start;
+        EMU_CHECK(elapsed >= 400 && elapsed < 470);
+        EMU_CHECK(emu.stats.delay_calls == 0);
+    }
+
+    // Erases sleep 1 ms between polls after the first millisecond
+    start = EMU_TIME_US();
+    EMU_CHECK(W25Q128_EraseSector(&w25, 0) == W25Q128_SUCCESS);
+    elapsed = EMU_TIME_US() - start;
+    EMU_CHECK(elapsed >= 45000 && elapsed < 47000);
+
+    start = EMU_TIME_US();
+    EMU_CHECK(W25Q128_EraseRange(&w25, 0x10000, 0x10000) == W25Q128_SUCCESS);
+    elapsed = EMU_TIME_US() - start;
+    EMU_CHECK(emu.stats.commands[0xD8] == 1);
+    EMU_CHECK(elapsed >= 150000 && elapsed < 152000);
+
+    // Non-volatile status register write
+    start = EMU_TIME_US();
+    EMU_CHECK(W25Q128_WriteStatusRegisterN(&w25, 3, 0x00) == W25Q128_SUCCESS);
+    elapsed = EMU_TIME_US() - start;
+    EMU_CHECK(elapsed >= 10000 && elapsed < 12000);
+
+    // Sector rewrite: erase and 16 page programs, about 52 ms
+    emu_test_fill(data, sizeof(data), 2);
+    start = EMU_TIME_US();
+    EMU_CHECK(W25Q128_Write(&w25, 0, 0, sizeof(data), data) ==
+                                                            W25Q128_SUCCESS);
+    elapsed = EMU_TIME_US() - start;
+    EMU_CHECK(elapsed < 55000);
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
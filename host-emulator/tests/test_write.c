@@ -0,0 +1,117 @@
+/**
+ * @file test_write.c
+ * @brief Differential read-modify-write of W25Q128_Write
+ * @author Filip Stojanovic
+ *
+ * W25Q128_Write compares every affected sector with the new data. Pages that
+ * do not change must not be programmed, changes that only clear bits must be
+ * programmed in place without an erase, and a sector must be erased and its
+ * pages programmed back only when a bit has to go from 0 to 1. Flash content
+ * and the write counters are checked after every kind of write.
+ *
+ * Built twice, as test_write with the static work buffer and as
+ * test_write_nostatic without it, where W25Q128_Write must fail before
+ * sending anything until the device gets its own work_buf. A work_buf that
+ * is set is used instead of the static one.
+ */
+
+#include "emu_test.h"
+
+static SPI_HandleTypeDef hspi1;
+static GPIO_TypeDef gpioa;
+static W25Q128_EmuTypeDef emu;
+static W25Q128_TypeDef w25;
+static uint8_t image[3 * W25Q128_SECTOR_SIZE];
+static uint8_t data[2 * W25Q128_SECTOR_SIZE];
+static uint8_t work_buf[W25Q128_SECTOR_SIZE];
+
+// Writes through W25Q128_Write and the image, then compares them
+static void write_check(uint32_t addr, uint32_t size)
+{
+    memcpy(&image[addr], data, size);
+    EMU_CHECK(W25Q128_Write(&w25, addr / W25Q128_PAGE_SIZE,
+                addr % W25Q128_PAGE_SIZE, size, data) == W25Q128_SUCCESS);
+    EMU_CHECK(memcmp(emu.mem, image, sizeof(image)) == 0);
+}
+
+static void stats_check(uint32_t erases, uint32_t erases_avoided,
+                        uint32_t pages_programmed, uint32_t pages_unchanged)
+{
+    W25Q128_WriteStatsTypeDef stats;
+    uint32_t sectors = erases + erases_avoided;
+
+    W25Q128_GetWriteStats(&w25, &stats);
+    EMU_CHECK(stats.erases == erases);
+    EMU_CHECK(stats.erases_avoided == erases_avoided);
+    EMU_CHECK(stats.pages_programmed == pages_programmed);
+    EMU_CHECK(stats.pages_unchanged == pages_unchanged);
+    EMU_CHECK(stats.programs_avoided ==
+                    sectors * W25Q128_PAGES_PER_SECTOR - pages_programmed);
+    EMU_CHECK(emu.stats.commands[INST_SECTOR_ERASE_4KB] == erases);
+    EMU_CHECK(emu.stats.commands[INST_PAGE_PROGRAM] == pages_programmed);
+
+    W25Q128_ResetWriteStats(&w25);
+    W25Q128_Emu_ResetStats(&emu);
+}
+
+int main(void)
+{
+    emu_test_device(&emu, &w25, &hspi1, &gpioa, 16 * 1024 * 1024);
+    W25Q128_Reset(&w25);
+    memset(image, 0xFF, sizeof(image));
+    W25Q128_ResetWriteStats(&w25);
+    W25Q128_Emu_ResetStats(&emu);
+
+#if !W25Q128_STATIC_WORK_BUFFER
+    // No buffer to read the sector into
+    emu_test_fill(data, W25Q128_PAGE_SIZE, 3);
+    EMU_CHECK(W25Q128_Write(&w25, 0, 0, W25Q128_PAGE_SIZE, data) ==
+                                                            W25Q128_ERROR);
+    EMU_CHECK(emu.stats.commands[INST_FAST_READ] == 0);
+    stats_check(0, 0, 0, 0);
+    w25.work_buf = work_buf;
+#endif
+
+    // Blank sector, programmed without an erase
+    emu_test_fill(data, W25Q128_SECTOR_SIZE, 4);
+    write_check(0, W25Q128_SECTOR_SIZE);
+    stats_check(0, 1, W25Q128_PAGES_PER_SECTOR, 0);
+
+    // Same data again, nothing is sent
+    write_check(0, W25Q128_SECTOR_SIZE);
+    stats_check(0, 1, 0, W25Q128_PAGES_PER_SECTOR);
+
+    // Bits only cleared in one page, programmed in place
+    memcpy(data, image, W25Q128_SECTOR_SIZE);
+    for (uint32_t i = 10; i < 40; i++)
+        data[3 * W25Q128_PAGE_SIZE + i] &= 0x0F;
+    data[3 * W25Q128_PAGE_SIZE + 10] = 0x00;
+    write_check(0, W25Q128_SECTOR_SIZE);
+    stats_check(0, 1, 1, W25Q128_PAGES_PER_SECTOR - 1);
+
+    // Small unaligned write that sets bits, rest of the sector is kept
+    memset(data, 0xA5, 10);
+    data[0] = 0xFF;
+    write_check(5 * W25Q128_PAGE_SIZE + 7, 10);
+    stats_check(1, 0, W25Q128_PAGES_PER_SECTOR, 0);
+
+    // Across a sector boundary, first sector needs an erase, second not
+    emu_test_fill(data, 2 * W25Q128_PAGE_SIZE, 5);
+    data[0] = 0xFF;
+    write_check(W25Q128_SECTOR_SIZE - W25Q128_PAGE_SIZE,
+                                                    2 * W25Q128_PAGE_SIZE);
+    stats_check(1, 1, W25Q128_PAGES_PER_SECTOR + 1, 0);
+
+    // Sector is rebuilt in the buffer of the device, blank pages are skipped
+    w25.work_buf = work_buf;
+    memset(work_buf, 0x5A, sizeof(work_buf));
+    memset(data, 0xFF, 4);
+    write_check(W25Q128_SECTOR_SIZE + 100, 4);
+    stats_check(1, 0, 1, 0);
+    EMU_CHECK(memcmp(work_buf, &image[W25Q128_SECTOR_SIZE],
+                                                    sizeof(work_buf)) == 0);
+
+    W25Q128_Emu_Deinit(&emu);
+
+    return 0;
+}
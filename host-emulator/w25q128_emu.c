@@ -0,0 +1,1031 @@
+/**
+ * @file w25q128_emu.c
+ * @brief Host-side w25q128 flash emulator
+ * @author Filip Stojanovic
+ */
+
+#include "w25q128_emu.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef enum {
+    EMU_OP_NONE = 0,
+    EMU_OP_PROGRAM = 1,
+    EMU_OP_ERASE = 2,
+    EMU_OP_WRITE_SR = 3,
+    EMU_OP_RESET = 4,
+} EmuOpTypeDef;
+
+// Writable bits of the status registers (OTP lock bits are left out)
+static const uint8_t sr_write_mask[3] = {0xFC, 0x43, 0x64};
+
+static const W25Q128_EmuTimingTypeDef default_timing = {
+    .spi_hz = 42000000,
+    .page_program_us = 400,
+    .sector_erase_us = 45000,
+    .block32_erase_us = 120000,
+    .block64_erase_us = 150000,
+    .chip_erase_us = 40000000,
+    .write_sr_us = 10000,
+    .suspend_us = 20,
+    .resume_us = 20,
+    .reset_us = 30,
+    .power_down_us = 3,
+    .release_us = 3,
+};
+
+/*
+ * SFDP of the W25Q128JV: header, one parameter header and the JESD216B
+ * Basic Flash Parameter Table at 0x80. Unused bytes read as 0xFF.
+ */
+static const uint32_t sfdp_header[4] = {
+    0x50444653,     // "SFDP"
+    0xFF000106,     // Revision 1.6, one parameter header
+    0x10010600,     // BFPT revision 1.6, 16 DWORDs
+    0xFF000080,     // Table pointer 0x80
+};
+
+static const uint32_t sfdp_bfpt[16] = {
+    0xFFF120E5,     // 4 KB erase 20h, 3 byte address, 1-1-2, 1-2-2, 1-4-4, 1-1-4
+    0x07FFFFFF,     // 128 Mbit
+    0x6B08EB44,     // 1-1-4 6Bh 8 dummy, 1-4-4 EBh 2 mode + 4 dummy
+    0xBB803B08,     // 1-2-2 BBh 4 mode, 1-1-2 3Bh 8 dummy
+    0xFFFFFFEE,
+    0xFF00FFFF,
+    0xFF00FFFF,
+    0x520F200C,     // Erase types 4 KB 20h, 32 KB 52h
+    0x0000D810,     // 64 KB D8h
+    0x00A53A25,     // Erase 48, 128, 160 ms typical, max 12x
+    0x49002683,     // 256 B page, program 448 us, chip erase 40 s
+    0xFFFFFFFF,     // DWORDs 12 and 13 are not parsed by the driver
+    0xFFFFFFFF,
+    0x5CD5A204,     // Deep power-down B9h, release ABh, 3 us to next command
+    0xFFFFFFFF,
+    0xFFFFFFFF,
+};
+
+static W25Q128_EmuTypeDef *devices[W25Q128_EMU_MAX_DEVICES];
+static uint64_t time_ns;
+
+/*************************** Static functions *********************************/
+static uint64_t emu_byte_time_ns(SPI_HandleTypeDef *hspi);
+static void emu_transfer(SPI_HandleTypeDef *hspi, const uint8_t *tx,
+                                uint8_t *rx, uint32_t size, uint8_t advance);
+static void emu_update(W25Q128_EmuTypeDef *emu);
+static uint8_t emu_busy(W25Q128_EmuTypeDef *emu);
+static uint8_t emu_status(W25Q128_EmuTypeDef *emu, uint8_t reg);
+static uint8_t emu_byte(W25Q128_EmuTypeDef *emu, uint8_t mosi,
+                                                            uint8_t lines);
+static void emu_end_command(W25Q128_EmuTypeDef *emu);
+static void emu_start_op(W25Q128_EmuTypeDef *emu, EmuOpTypeDef op,
+                            uint32_t addr, uint32_t size, uint32_t time_us);
+static uint8_t emu_read_byte(W25Q128_EmuTypeDef *emu, uint32_t offset);
+static uint8_t emu_power_settling(W25Q128_EmuTypeDef *emu);
+static uint8_t emu_sfdp_byte(W25Q128_EmuTypeDef *emu, uint32_t addr);
+static uint8_t emu_address_bytes(uint8_t opcode);
+static uint8_t emu_header_bytes(uint8_t opcode);
+static uint8_t emu_phase_lines(W25Q128_EmuTypeDef *emu, uint32_t pos);
+static uint32_t latency_bucket(uint64_t ns);
+static uint64_t latency_bucket_limit(uint32_t bucket);
+
+W25Q128_StatusTypeDef W25Q128_Emu_Init(W25Q128_EmuTypeDef *emu,
+                                        SPI_HandleTypeDef *hspi,
+                                        GPIO_TypeDef *cs_port, uint16_t cs_pin,
+                                        const char *image_path)
+{
+    return W25Q128_Emu_InitSize(emu, hspi, cs_port, cs_pin, image_path,
+                                                            W25Q128_CAPACITY);
+}
+
+W25Q128_StatusTypeDef W25Q128_Emu_InitSize(W25Q128_EmuTypeDef *emu,
+                                        SPI_HandleTypeDef *hspi,
+                                        GPIO_TypeDef *cs_port, uint16_t cs_pin,
+                                        const char *image_path,
+                                        uint32_t capacity)
+{
+    uint8_t slot = W25Q128_EMU_MAX_DEVICES;
+    uint8_t capacity_log2 = 0;
+
+    while ((1UL << capacity_log2) < capacity && capacity_log2 < 31)
+        capacity_log2++;
+    if (capacity < W25Q128_BLOCK64_SIZE || capacity != (1UL << capacity_log2))
+        return W25Q128_ERROR;
+
+    for (uint8_t i = 0; i < W25Q128_EMU_MAX_DEVICES; i++)
+    {
+        if (devices[i] == NULL)
+        {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == W25Q128_EMU_MAX_DEVICES)
+        return W25Q128_ERROR;
+
+    memset(emu, 0, sizeof(*emu));
+    emu->hspi = hspi;
+    emu->cs_port = cs_port;
+    emu->cs_pin = cs_pin;
+    emu->timing = default_timing;
+    emu->capacity = capacity;
+    emu->capacity_log2 = capacity_log2;
+    emu->fd = -1;
+
+    if (image_path == NULL)
+    {
+        emu->mem = mmap(NULL, emu->capacity, PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (emu->mem == MAP_FAILED)
+            return W25Q128_ERROR;
+        memset(emu->mem, 0xFF, emu->capacity);
+    } else {
+        struct stat st;
+        uint8_t fresh;
+
+        emu->fd = open(image_path, O_RDWR | O_CREAT, 0644);
+        if (emu->fd < 0 || fstat(emu->fd, &st) != 0)
+            return W25Q128_ERROR;
+
+        // New image (or one of the wrong size) starts erased
+        fresh = (st.st_size != emu->capacity);
+        if (fresh && ftruncate(emu->fd, emu->capacity) != 0)
+        {
+            close(emu->fd);
+            return W25Q128_ERROR;
+        }
+
+        emu->mem = mmap(NULL, emu->capacity, PROT_READ | PROT_WRITE,
+                                                    MAP_SHARED, emu->fd, 0);
+        if (emu->mem == MAP_FAILED)
+        {
+            close(emu->fd);
+            return W25Q128_ERROR;
+        }
+        if (fresh)
+            memset(emu->mem, 0xFF, emu->capacity);
+    }
+
+    if (hspi != NULL && hspi->State == HAL_SPI_STATE_RESET)
+        hspi->State = HAL_SPI_STATE_READY;
+
+    devices[slot] = emu;
+    return W25Q128_SUCCESS;
+}
+
+W25Q128_StatusTypeDef W25Q128_Emu_InitQspi(W25Q128_EmuTypeDef *emu,
+                                        QSPI_HandleTypeDef *hqspi,
+                                        const char *image_path,
+                                        uint32_t capacity)
+{
+    // No SPI handle and chip select, commands come from the peripheral
+    if (W25Q128_Emu_InitSize(emu, NULL, NULL, 0, image_path, capacity)
+                                                        != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    emu->hqspi = hqspi;
+    return W25Q128_SUCCESS;
+}
+
+void W25Q128_Emu_Deinit(W25Q128_EmuTypeDef *emu)
+{
+    for (uint8_t i = 0; i < W25Q128_EMU_MAX_DEVICES; i++)
+    {
+        if (devices[i] == emu)
+            devices[i] = NULL;
+    }
+
+    // Operation that is still in progress is lost, like on power loss
+    if (emu->mem != NULL && emu->mem != MAP_FAILED)
+    {
+        if (emu->fd >= 0)
+            msync(emu->mem, emu->capacity, MS_SYNC);
+        munmap(emu->mem, emu->capacity);
+    }
+    if (emu->fd >= 0)
+        close(emu->fd);
+    emu->mem = NULL;
+    emu->fd = -1;
+}
+
+void W25Q128_Emu_PowerCut(W25Q128_EmuTypeDef *emu)
+{
+    uint64_t remaining_ns = 0;
+    uint32_t size;
+
+    if (emu->suspended)
+        remaining_ns = emu->op_remaining_ns;
+    else if (time_ns < emu->op_end_ns)
+        remaining_ns = emu->op_end_ns - time_ns;
+
+    if (emu->mem != NULL &&
+        (emu->op == EMU_OP_PROGRAM || emu->op == EMU_OP_ERASE))
+    {
+        size = (emu->op == EMU_OP_PROGRAM) ? W25Q128_PAGE_SIZE : emu->op_size;
+        if (remaining_ns > 0)
+            size = (uint32_t)((uint64_t)size *
+                        (emu->op_busy_ns - remaining_ns) / emu->op_busy_ns);
+
+        for (uint32_t i = 0; i < size; i++)
+        {
+            if (emu->op == EMU_OP_PROGRAM)
+                emu->mem[emu->op_addr + i] &= emu->op_data[i];
+            else
+                emu->mem[emu->op_addr + i] = 0xFF;
+        }
+    }
+
+    W25Q128_Emu_Deinit(emu);
+}
+
+uint64_t W25Q128_Emu_GetTimeNs(void)
+{
+    return time_ns;
+}
+
+void W25Q128_Emu_Advance(uint64_t ns)
+{
+    time_ns += ns;
+}
+
+void W25Q128_Emu_Delay(uint64_t ns)
+{
+    time_ns += ns;
+
+    for (uint8_t i = 0; i < W25Q128_EMU_MAX_DEVICES; i++)
+    {
+        if (devices[i] == NULL)
+            continue;
+        devices[i]->stats.delay_ns += ns;
+        devices[i]->stats.delay_calls++;
+    }
+}
+
+void W25Q128_Emu_LatencyAdd(W25Q128_EmuLatencyTypeDef *lat, uint64_t ns)
+{
+    lat->count++;
+    lat->sum_ns += ns;
+    if (ns > lat->max_ns)
+        lat->max_ns = ns;
+    lat->buckets[latency_bucket(ns)]++;
+}
+
+uint64_t W25Q128_Emu_LatencyPercentile(const W25Q128_EmuLatencyTypeDef *lat,
+                                                            uint32_t percent)
+{
+    uint64_t target = ((uint64_t)lat->count * percent + 99) / 100;
+    uint64_t seen = 0;
+
+    if (lat->count == 0)
+        return 0;
+
+    for (uint32_t i = 0; i < W25Q128_EMU_LATENCY_BUCKETS; i++)
+    {
+        seen += lat->buckets[i];
+        if (seen >= target && seen > 0)
+        {
+            uint64_t limit = latency_bucket_limit(i);
+            return (limit < lat->max_ns) ? limit : lat->max_ns;
+        }
+    }
+    return lat->max_ns;
+}
+
+void W25Q128_Emu_Report(FILE *out, const char *name, W25Q128_EmuTypeDef *emu,
+                        const W25Q128_EmuLatencyTypeDef *lat, uint64_t bytes,
+                        uint64_t elapsed_ns)
+{
+    const W25Q128_EmuStatsTypeDef *st = &emu->stats;
+    double mbps = 0.0;
+    uint8_t first = 1;
+
+    if (elapsed_ns > 0)
+        mbps = ((double)bytes / (1024.0 * 1024.0)) / (elapsed_ns / 1e9);
+
+    fprintf(out, "{\"name\":\"%s\",\"elapsed_ns\":%llu,\"bytes\":%llu,"
+                 "\"mb_per_s\":%.3f", name, (unsigned long long)elapsed_ns,
+                 (unsigned long long)bytes, mbps);
+
+    if (lat != NULL && lat->count > 0)
+    {
+        fprintf(out, ",\"ops\":%u,\"avg_ns\":%llu,\"p50_ns\":%llu,"
+                     "\"p99_ns\":%llu,\"max_ns\":%llu", lat->count,
+                (unsigned long long)(lat->sum_ns / lat->count),
+                (unsigned long long)W25Q128_Emu_LatencyPercentile(lat, 50),
+                (unsigned long long)W25Q128_Emu_LatencyPercentile(lat, 99),
+                (unsigned long long)lat->max_ns);
+    }
+
+    fprintf(out, ",\"bus_bytes\":%llu,\"bus_cycles\":%llu,"
+                 "\"bytes_read\":%llu,\"bytes_programmed\":%llu,\"erases\":%u,"
+                 "\"status_polls\":%u,\"busy_ns\":%llu,\"delay_ns\":%llu,"
+                 "\"delay_calls\":%u,\"ignored\":%u,\"suspends\":%u,"
+                 "\"power_down_ns\":%llu",
+            (unsigned long long)st->bus_bytes,
+            (unsigned long long)st->bus_cycles,
+            (unsigned long long)st->bytes_read,
+            (unsigned long long)st->bytes_programmed, st->erases,
+            st->status_polls, (unsigned long long)st->busy_ns,
+            (unsigned long long)st->delay_ns, st->delay_calls, st->ignored,
+            st->suspends, (unsigned long long)st->power_down_ns);
+
+    fprintf(out, ",\"commands\":{");
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        if (st->commands[i] == 0)
+            continue;
+        fprintf(out, "%s\"0x%02X\":%u", first ? "" : ",", (unsigned)i,
+                                                            st->commands[i]);
+        first = 0;
+    }
+    fprintf(out, "}}\n");
+}
+
+void W25Q128_Emu_GetStats(W25Q128_EmuTypeDef *emu,
+                                            W25Q128_EmuStatsTypeDef *stats)
+{
+    *stats = emu->stats;
+}
+
+void W25Q128_Emu_ResetStats(W25Q128_EmuTypeDef *emu)
+{
+    memset(&emu->stats, 0, sizeof(emu->stats));
+}
+
+void W25Q128_Emu_ChipSelect(GPIO_TypeDef *cs_port, uint16_t cs_pin,
+                                                        GPIO_PinState state)
+{
+    for (uint8_t i = 0; i < W25Q128_EMU_MAX_DEVICES; i++)
+    {
+        W25Q128_EmuTypeDef *emu = devices[i];
+
+        if (emu == NULL || emu->cs_port != cs_port || emu->cs_pin != cs_pin)
+            continue;
+
+        emu_update(emu);
+        if (state == GPIO_PIN_RESET)
+        {
+            emu->selected = 1;
+            emu->pos = 0;
+        } else if (emu->selected) {
+            emu->selected = 0;
+            emu_end_command(emu);
+        }
+    }
+}
+
+void W25Q128_Emu_Transfer(SPI_HandleTypeDef *hspi, const uint8_t *tx,
+                                                uint8_t *rx, uint32_t size)
+{
+    emu_transfer(hspi, tx, rx, size, 1);
+}
+
+void W25Q128_Emu_QspiSelect(QSPI_HandleTypeDef *hqspi, GPIO_PinState state)
+{
+    for (uint8_t i = 0; i < W25Q128_EMU_MAX_DEVICES; i++)
+    {
+        W25Q128_EmuTypeDef *emu = devices[i];
+
+        if (emu == NULL || emu->hqspi != hqspi)
+            continue;
+
+        emu_update(emu);
+        if (state == GPIO_PIN_RESET)
+        {
+            emu->selected = 1;
+            emu->pos = 0;
+        } else if (emu->selected) {
+            emu->selected = 0;
+            emu_end_command(emu);
+        }
+    }
+}
+
+void W25Q128_Emu_QspiTransfer(QSPI_HandleTypeDef *hqspi, const uint8_t *tx,
+                            uint8_t *rx, uint32_t size, uint8_t lines)
+{
+    uint32_t spi_hz = default_timing.spi_hz;
+    uint64_t start_ns = time_ns;
+
+    for (uint8_t i = 0; i < W25Q128_EMU_MAX_DEVICES; i++)
+    {
+        if (devices[i] != NULL && devices[i]->hqspi == hqspi)
+        {
+            spi_hz = devices[i]->timing.spi_hz;
+            break;
+        }
+    }
+
+    for (uint32_t n = 0; n < size; n++)
+    {
+        uint8_t mosi = (tx != NULL) ? tx[n] : 0x00;
+        uint8_t miso = 0xFF;
+
+        // A byte takes 8 / lines clocks
+        time_ns = start_ns + ((n + 1) * 8ULL * 1000000000ULL) / 
+                                                    ((uint64_t)lines * spi_hz);
+
+        for (uint8_t i = 0; i < W25Q128_EMU_MAX_DEVICES; i++)
+        {
+            W25Q128_EmuTypeDef *emu = devices[i];
+
+            if (emu == NULL || emu->hqspi != hqspi || !emu->selected)
+                continue;
+            emu_update(emu);
+            emu->stats.bus_bytes++;
+            emu->stats.bus_cycles += 8 / lines;
+            miso &= emu_byte(emu, mosi, lines);
+        }
+
+        if (rx != NULL)
+            rx[n] = miso;
+    }
+}
+
+uint64_t W25Q128_Emu_TransferDMA(SPI_HandleTypeDef *hspi, const uint8_t *tx,
+                                                uint8_t *rx, uint32_t size)
+{
+    emu_transfer(hspi, tx, rx, size, 0);
+
+    return time_ns + (size * emu_byte_time_ns(hspi));
+}
+
+/*************************** Static functions *********************************/
+static uint64_t emu_byte_time_ns(SPI_HandleTypeDef *hspi)
+{
+    uint32_t spi_hz = default_timing.spi_hz;
+
+    for (uint8_t i = 0; i < W25Q128_EMU_MAX_DEVICES; i++)
+    {
+        if (devices[i] != NULL && devices[i]->hspi == hspi)
+        {
+            spi_hz = devices[i]->timing.spi_hz;
+            break;
+        }
+    }
+
+    // Eight clocks per byte
+    return (8ULL * 1000000000ULL) / spi_hz;
+}
+
+static void emu_transfer(SPI_HandleTypeDef *hspi, const uint8_t *tx,
+                                uint8_t *rx, uint32_t size, uint8_t advance)
+{
+    uint64_t byte_ns = emu_byte_time_ns(hspi);
+
+    for (uint32_t n = 0; n < size; n++)
+    {
+        uint8_t mosi = (tx != NULL) ? tx[n] : 0x00;
+        uint8_t miso = 0xFF;
+
+        if (advance)
+            time_ns += byte_ns;
+
+        for (uint8_t i = 0; i < W25Q128_EMU_MAX_DEVICES; i++)
+        {
+            W25Q128_EmuTypeDef *emu = devices[i];
+
+            if (emu == NULL || emu->hspi != hspi || !emu->selected)
+                continue;
+            emu_update(emu);
+            emu->stats.bus_bytes++;
+            emu->stats.bus_cycles += 8;
+            miso &= emu_byte(emu, mosi, 1);
+        }
+
+        if (rx != NULL)
+            rx[n] = miso;
+    }
+}
+
+// Completes the operation in progress once its time has elapsed
+static void emu_update(W25Q128_EmuTypeDef *emu)
+{
+    if (emu->op == EMU_OP_NONE || emu->suspended || time_ns < emu->op_end_ns)
+        return;
+
+    switch (emu->op)
+    {
+        case EMU_OP_PROGRAM:
+            for (uint32_t i = 0; i < W25Q128_PAGE_SIZE; i++)
+                emu->mem[emu->op_addr + i] &= emu->op_data[i];
+            break;
+        case EMU_OP_ERASE:
+            memset(&emu->mem[emu->op_addr], 0xFF, emu->op_size);
+            break;
+        default:
+            break;
+    }
+
+    emu->op = EMU_OP_NONE;
+    emu->sr[0] &= ~W25Q128_SR1_WEL;
+}
+
+static uint8_t emu_busy(W25Q128_EmuTypeDef *emu)
+{
+    // Device stays busy for tSUS after the suspend command
+    if (emu->suspended)
+        return (time_ns < emu->op_end_ns);
+
+    return (emu->op != EMU_OP_NONE);
+}
+
+static uint8_t emu_status(W25Q128_EmuTypeDef *emu, uint8_t reg)
+{
+    uint8_t value = emu->sr[reg];
+
+    if (reg == 0 && emu_busy(emu))
+        value |= W25Q128_SR1_BUSY;
+    if (reg == 1 && emu->suspended)
+        value |= W25Q128_SR2_SUS;
+
+    return value;
+}
+
+static uint8_t emu_read_byte(W25Q128_EmuTypeDef *emu, uint32_t offset)
+{
+    uint32_t addr = (emu->addr + offset) % emu->capacity;
+
+    emu->stats.bytes_read++;
+    return emu->mem[addr];
+}
+
+static uint8_t emu_power_settling(W25Q128_EmuTypeDef *emu)
+{
+    return time_ns < emu->ready_ns;
+}
+
+// Returns SFDP byte at addr, density follows the configured capacity
+static uint8_t emu_sfdp_byte(W25Q128_EmuTypeDef *emu, uint32_t addr)
+{
+    uint32_t dw;
+
+    addr &= 0xFF;
+
+    if (addr < sizeof(sfdp_header))
+        return (sfdp_header[addr / 4] >> (8 * (addr % 4))) & 0xFF;
+    if (addr < 0x80)
+        return 0xFF;
+
+    // Table of another part is served as it is
+    if (emu->sfdp_bfpt != NULL)
+    {
+        dw = emu->sfdp_bfpt[(addr - 0x80) / 4];
+        return (dw >> (8 * (addr % 4))) & 0xFF;
+    }
+
+    // Density and address mode follow the configured capacity
+    dw = sfdp_bfpt[(addr - 0x80) / 4];
+    if (addr < 0x84 && emu->capacity > W25Q128_CAPACITY)
+        dw |= 1 << 17; // 3-byte or 4-byte address
+    else if (addr >= 0x84 && addr < 0x88)
+        dw = emu->capacity * 8 - 1;
+
+    return (dw >> (8 * (addr % 4))) & 0xFF;
+}
+
+// 4-byte address variants of the commands, the rest uses 3 bytes
+static uint8_t emu_address_bytes(uint8_t opcode)
+{
+    switch (opcode)
+    {
+        case INST_READ_DATA_4B:
+        case INST_FAST_READ_4B:
+        case INST_FAST_READ_DUAL_OUTPUT_4B:
+        case INST_FAST_READ_QUAD_OUTPUT_4B:
+        case INST_FAST_READ_DUAL_IO_4B:
+        case INST_FAST_READ_QUAD_IO_4B:
+        case INST_PAGE_PROGRAM_4B:
+        case INST_QUAD_PAGE_PROGRAM_4B:
+        case INST_SECTOR_ERASE_4KB_4B:
+        case INST_BLOCK_ERASE_64KB_4B:
+            return 4;
+        default:
+            return 3;
+    }
+}
+
+// Bytes between the instruction and the data: address, mode bits and dummy
+static uint8_t emu_header_bytes(uint8_t opcode)
+{
+    uint8_t addr_bytes = emu_address_bytes(opcode);
+
+    switch (opcode)
+    {
+        case INST_FAST_READ:
+        case INST_FAST_READ_4B:
+        case INST_FAST_READ_DUAL_OUTPUT:
+        case INST_FAST_READ_DUAL_OUTPUT_4B:
+        case INST_FAST_READ_QUAD_OUTPUT:
+        case INST_FAST_READ_QUAD_OUTPUT_4B:
+        case INST_FAST_READ_DUAL_IO:        // Mode bits
+        case INST_FAST_READ_DUAL_IO_4B:
+        case INST_READ_SFDP_REG:
+            return addr_bytes + 1;
+        case INST_FAST_READ_QUAD_IO:        // Mode bits and 4 dummy clocks
+        case INST_FAST_READ_QUAD_IO_4B:
+            return addr_bytes + 3;
+        default:
+            return addr_bytes;
+    }
+}
+
+// Lines the byte at pos is clocked on, 0 if the command is not available
+static uint8_t emu_phase_lines(W25Q128_EmuTypeDef *emu, uint32_t pos)
+{
+    uint8_t addr_lines = 1;
+    uint8_t data_lines = 1;
+    uint8_t quad = 0;
+
+    switch (emu->opcode)
+    {
+        case INST_FAST_READ_DUAL_OUTPUT:
+        case INST_FAST_READ_DUAL_OUTPUT_4B:
+            data_lines = 2;
+            break;
+        case INST_FAST_READ_DUAL_IO:
+        case INST_FAST_READ_DUAL_IO_4B:
+            addr_lines = 2;
+            data_lines = 2;
+            break;
+        case INST_FAST_READ_QUAD_OUTPUT:
+        case INST_FAST_READ_QUAD_OUTPUT_4B:
+        case INST_QUAD_PAGE_PROGRAM:
+        case INST_QUAD_PAGE_PROGRAM_4B:
+            data_lines = 4;
+            quad = 1;
+            break;
+        case INST_FAST_READ_QUAD_IO:
+        case INST_FAST_READ_QUAD_IO_4B:
+            addr_lines = 4;
+            data_lines = 4;
+            quad = 1;
+            break;
+        default:
+            break;
+    }
+
+    // IO2 and IO3 are WP and HOLD while QE bit is clear
+    if (quad && !(emu->sr[1] & W25Q128_SR2_QE))
+        return 0;
+
+    if (pos == 0)
+        return 1;
+    return (pos <= emu_header_bytes(emu->opcode)) ? addr_lines : data_lines;
+}
+
+// Returns the byte that device shifts out while mosi is shifted in
+static uint8_t emu_byte(W25Q128_EmuTypeDef *emu, uint8_t mosi,
+                                                            uint8_t lines)
+{
+    uint32_t pos = emu->pos++;
+    uint8_t addr_bytes;
+    uint8_t header;
+
+    if (pos == 0)
+    {
+        emu->addr = 0;
+        emu->page_len = 0;
+        emu->invalid = 0;
+
+        // In continuous read mode the first byte is already the address
+        if (emu->continuous && !emu->powered_down)
+        {
+            emu->opcode = emu->continuous;
+            emu->pos = 2;
+            pos = 1;
+        } else {
+            emu->opcode = mosi;
+            emu->stats.commands[mosi]++;
+            emu->invalid = (lines != 1);
+            return 0xFF;
+        }
+    }
+
+    if (emu->powered_down && emu->opcode != INST_RELEASE_POWER_DOWN_ID)
+        return 0xFF;
+
+    // Device is not ready for commands within tRES1 of the release
+    if (emu_power_settling(emu))
+        return 0xFF;
+
+    // Only status reads and suspend are accepted while busy
+    if (emu_busy(emu) && emu->opcode != INST_READ_STATUS_REG_1 &&
+        emu->opcode != INST_READ_STATUS_REG_2 &&
+        emu->opcode != INST_READ_STATUS_REG_3)
+        return 0xFF;
+
+    if (lines != emu_phase_lines(emu, pos))
+        emu->invalid = 1;
+    if (emu->invalid)
+        return 0xFF;
+
+    // Address phase is the same for all addressed commands
+    addr_bytes = emu_address_bytes(emu->opcode);
+    header = emu_header_bytes(emu->opcode);
+    if (pos <= addr_bytes)
+        emu->addr = (emu->addr << 8) | mosi;
+
+    switch (emu->opcode)
+    {
+        case INST_READ_STATUS_REG_1:
+            if (pos == 1)
+                emu->stats.status_polls++;
+            return emu_status(emu, 0);
+        case INST_READ_STATUS_REG_2:
+            return emu_status(emu, 1);
+        case INST_READ_STATUS_REG_3:
+            return emu_status(emu, 2);
+
+        case INST_WRITE_STATUS_REG_1:
+        case INST_WRITE_STATUS_REG_2:
+        case INST_WRITE_STATUS_REG_3:
+            if (pos == 1)
+                emu->page_buf[0] = mosi;
+            return 0xFF;
+
+        case INST_JEDEC_ID:
+            if (pos <= 3)
+                return ((W25Q128_EMU_JEDEC_ID & 0xFFFF00) | 
+                                emu->capacity_log2) >> (8 * (3 - pos)) & 0xFF;
+            return 0xFF;
+
+        case INST_MANUFACTURER_DEVICE_ID:
+            if (pos <= 3)
+                return 0xFF;
+            return ((pos - 4) % 2) ? emu->capacity_log2 - 1 : 0xEF;
+
+        case INST_RELEASE_POWER_DOWN_ID:
+            return (pos >= 4) ? emu->capacity_log2 - 1 : 0xFF;
+
+        case INST_READ_DATA:
+        case INST_READ_DATA_4B:
+            return (pos > addr_bytes) ? 
+                            emu_read_byte(emu, pos - addr_bytes - 1) : 0xFF;
+
+        case INST_FAST_READ_DUAL_IO:
+        case INST_FAST_READ_DUAL_IO_4B:
+        case INST_FAST_READ_QUAD_IO:
+        case INST_FAST_READ_QUAD_IO_4B:
+            // Mode bits 10b in M5-4 keep the instruction for the next read
+            if (pos == addr_bytes + 1u)
+                emu->continuous = ((mosi & 0x30) == 0x20) ? emu->opcode : 0;
+            /* fall through */
+        case INST_FAST_READ:
+        case INST_FAST_READ_4B:
+        case INST_FAST_READ_DUAL_OUTPUT:
+        case INST_FAST_READ_DUAL_OUTPUT_4B:
+        case INST_FAST_READ_QUAD_OUTPUT:
+        case INST_FAST_READ_QUAD_OUTPUT_4B:
+            return (pos > header) ? 
+                            emu_read_byte(emu, pos - header - 1) : 0xFF;
+
+        case INST_READ_SFDP_REG:
+            return (pos > header) ? 
+                        emu_sfdp_byte(emu, emu->addr + pos - header - 1) : 0xFF;
+
+        case INST_PAGE_PROGRAM:
+        case INST_PAGE_PROGRAM_4B:
+        case INST_QUAD_PAGE_PROGRAM:
+        case INST_QUAD_PAGE_PROGRAM_4B:
+            if (pos == addr_bytes)
+                memset(emu->page_buf, 0xFF, sizeof(emu->page_buf));
+            if (pos > addr_bytes)
+            {
+                // Data wraps around within the page
+                emu->page_buf[(emu->addr + emu->page_len) % W25Q128_PAGE_SIZE]
+                                                                        = mosi;
+                emu->page_len++;
+            }
+            return 0xFF;
+
+        default:
+            return 0xFF;
+    }
+}
+
+// Executes the command when chip select goes high
+static void emu_end_command(W25Q128_EmuTypeDef *emu)
+{
+    uint8_t wel = emu->sr[0] & W25Q128_SR1_WEL;
+    uint8_t opcode = emu->opcode;
+    uint32_t len = emu->pos;
+    uint8_t reset_enabled = emu->reset_enabled;
+
+    if (len == 0)
+        return;
+
+    emu->reset_enabled = 0;
+
+    if (emu->powered_down)
+    {
+        if (opcode == INST_RELEASE_POWER_DOWN_ID)
+        {
+            emu->stats.power_down_ns += time_ns - emu->power_ns;
+            emu->powered_down = 0;
+            emu->ready_ns = time_ns + emu->timing.release_us * 1000ULL;
+        } else {
+            emu->stats.ignored++;
+        }
+        return;
+    }
+
+    if (emu_power_settling(emu) || emu->invalid)
+    {
+        emu->stats.ignored++;
+        return;
+    }
+
+    if (emu_busy(emu))
+    {
+        if (opcode == INST_ERASE_PROGRAM_SUSPEND && len == 1 &&
+            (emu->op == EMU_OP_PROGRAM || emu->op == EMU_OP_ERASE) &&
+            !emu->suspended &&
+            time_ns >= emu->resume_ns + emu->timing.resume_us * 1000ULL)
+        {
+            emu->op_remaining_ns = emu->op_end_ns - time_ns;
+            emu->op_end_ns = time_ns + emu->timing.suspend_us * 1000ULL;
+            emu->suspended = 1;
+            emu->stats.suspends++;
+        } else if (opcode != INST_READ_STATUS_REG_1 &&
+                   opcode != INST_READ_STATUS_REG_2 &&
+                   opcode != INST_READ_STATUS_REG_3) {
+            emu->stats.ignored++;
+        }
+        return;
+    }
+
+    switch (opcode)
+    {
+        case INST_WRITE_ENABLE:
+            emu->sr[0] |= W25Q128_SR1_WEL;
+            break;
+
+        case INST_WRITE_DISABLE:
+            emu->sr[0] &= ~W25Q128_SR1_WEL;
+            break;
+
+        case INST_WRITE_STATUS_REG_1:
+        case INST_WRITE_STATUS_REG_2:
+        case INST_WRITE_STATUS_REG_3:
+        {
+            uint8_t reg = (opcode == INST_WRITE_STATUS_REG_1) ? 0 :
+                          (opcode == INST_WRITE_STATUS_REG_2) ? 1 : 2;
+            if (len != 2 || !wel || emu->suspended)
+            {
+                emu->stats.ignored++;
+                break;
+            }
+            emu->sr[reg] = (emu->sr[reg] & ~sr_write_mask[reg]) |
+                                        (emu->page_buf[0] & sr_write_mask[reg]);
+            emu_start_op(emu, EMU_OP_WRITE_SR, 0, 0, emu->timing.write_sr_us);
+            break;
+        }
+
+        case INST_PAGE_PROGRAM:
+        case INST_PAGE_PROGRAM_4B:
+        case INST_QUAD_PAGE_PROGRAM:
+        case INST_QUAD_PAGE_PROGRAM_4B:
+            if (len < 2u + emu_address_bytes(opcode) || !wel || 
+                                                            emu->suspended)
+            {
+                emu->stats.ignored++;
+                break;
+            }
+            memcpy(emu->op_data, emu->page_buf, W25Q128_PAGE_SIZE);
+            emu->stats.bytes_programmed += (emu->page_len > W25Q128_PAGE_SIZE) ?
+                                            W25Q128_PAGE_SIZE : emu->page_len;
+            emu->addr %= emu->capacity;
+            emu_start_op(emu, EMU_OP_PROGRAM,
+                            emu->addr - (emu->addr % W25Q128_PAGE_SIZE),
+                            W25Q128_PAGE_SIZE, emu->timing.page_program_us);
+            break;
+
+        case INST_SECTOR_ERASE_4KB:
+        case INST_BLOCK_ERASE_32KB:
+        case INST_BLOCK_ERASE_64KB:
+        case INST_SECTOR_ERASE_4KB_4B:
+        case INST_BLOCK_ERASE_64KB_4B:
+        {
+            uint32_t size = W25Q128_SECTOR_SIZE;
+            uint32_t time_us = emu->timing.sector_erase_us;
+
+            if (opcode == INST_BLOCK_ERASE_32KB)
+            {
+                size = W25Q128_BLOCK32_SIZE;
+                time_us = emu->timing.block32_erase_us;
+            } else if (opcode == INST_BLOCK_ERASE_64KB || 
+                                        opcode == INST_BLOCK_ERASE_64KB_4B) {
+                size = W25Q128_BLOCK64_SIZE;
+                time_us = emu->timing.block64_erase_us;
+            }
+
+            if (len != 1u + emu_address_bytes(opcode) || !wel || 
+                                                            emu->suspended)
+            {
+                emu->stats.ignored++;
+                break;
+            }
+            emu->stats.erases++;
+            emu->addr %= emu->capacity;
+            emu_start_op(emu, EMU_OP_ERASE, emu->addr - (emu->addr % size),
+                                                                size, time_us);
+            break;
+        }
+
+        case INST_CHIP_ERASE:
+        case 0x60: // Alternative chip erase opcode
+            if (len != 1 || !wel || emu->suspended)
+            {
+                emu->stats.ignored++;
+                break;
+            }
+            emu->stats.erases++;
+            emu_start_op(emu, EMU_OP_ERASE, 0, emu->capacity,
+                                                    emu->timing.chip_erase_us);
+            break;
+
+        case INST_ERASE_PROGRAM_RESUME:
+            if (emu->suspended)
+            {
+                emu->suspended = 0;
+                emu->op_end_ns = time_ns + emu->op_remaining_ns;
+                emu->resume_ns = time_ns;
+            }
+            break;
+
+        case INST_ENABLE_RESET:
+            emu->reset_enabled = 1;
+            break;
+
+        case INST_RESET_DEVICE:
+            if (!reset_enabled)
+            {
+                emu->stats.ignored++;
+                break;
+            }
+            // Suspended operation is abandoned, volatile bits are cleared
+            emu->op = EMU_OP_NONE;
+            emu->suspended = 0;
+            emu->sr[0] &= ~W25Q128_SR1_WEL;
+            emu_start_op(emu, EMU_OP_RESET, 0, 0, emu->timing.reset_us);
+            break;
+
+        case INST_POWER_DOWN:
+            emu->powered_down = 1;
+            emu->power_ns = time_ns;
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void emu_start_op(W25Q128_EmuTypeDef *emu, EmuOpTypeDef op,
+                            uint32_t addr, uint32_t size, uint32_t time_us)
+{
+    emu->op = op;
+    emu->op_addr = addr;
+    emu->op_size = size;
+    emu->op_busy_ns = time_us * 1000ULL;
+    emu->op_end_ns = time_ns + (time_us * 1000ULL);
+    emu->suspended = 0;
+    emu->stats.busy_ns += time_us * 1000ULL;
+
+    if (emu->op_hook != NULL && (op == EMU_OP_PROGRAM || op == EMU_OP_ERASE))
+        emu->op_hook(emu);
+}
+
+static uint32_t latency_bucket(uint64_t ns)
+{
+    uint32_t msb = 0;
+    uint32_t sub;
+
+    if (ns < W25Q128_EMU_LATENCY_SUB_BUCKETS)
+        return (uint32_t)ns;
+
+    while ((ns >> (msb + 1)) != 0)
+        msb++;
+
+    // Three bits below the most significant one select the sub-bucket
+    sub = (ns >> (msb - 3)) & (W25Q128_EMU_LATENCY_SUB_BUCKETS - 1);
+    return ((msb - 2) * W25Q128_EMU_LATENCY_SUB_BUCKETS) + sub;
+}
+
+// Largest value that falls in the bucket
+static uint64_t latency_bucket_limit(uint32_t bucket)
+{
+    uint32_t msb;
+    uint64_t sub;
+
+    if (bucket < W25Q128_EMU_LATENCY_SUB_BUCKETS)
+        return bucket;
+
+    msb = (bucket / W25Q128_EMU_LATENCY_SUB_BUCKETS) + 2;
+    sub = bucket % W25Q128_EMU_LATENCY_SUB_BUCKETS;
+
+    return ((W25Q128_EMU_LATENCY_SUB_BUCKETS + sub + 1) << (msb - 3)) - 1;
+}
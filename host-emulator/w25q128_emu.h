@@ -0,0 +1,332 @@
+/**
+ * @file w25q128_emu.h
+ * @brief Host-side w25q128 flash emulator
+ * @author Filip Stojanovic
+ *
+ * Emulates the device at SPI byte level behind the HAL shim, so the
+ * unmodified drivers run on a Linux host. Memory image is a file mapped with
+ * mmap (or anonymous memory) of 16 MB, or of a larger part with the 4-byte
+ * address opcodes, program can only clear bits and erase sets bytes to 0xFF.
+ * Busy times of program/erase/status write operations are modelled on a
+ * virtual clock, which also drives HAL_GetTick and HAL_Delay.
+ *
+ * Devices attached to the QSPI peripheral of the shim also serve the dual and
+ * quad reads, Quad Page Program and continuous read mode. Clock cycles of
+ * every command are counted, so read modes can be compared.
+ *
+ * Build example, host-emulator must come before the HAL in the include path:
+ *
+ *     gcc -Ihost-emulator -Ilow-level-driver host-emulator/w25q128_emu.c \
+ *         host-emulator/stm32f4xx_hal_shim.c low-level-driver/w25q128_ll.c \
+ *         low-level-driver/w25q128_transport_ll.c \
+ *         low-level-driver/w25q128_bus_ll.c app.c
+ */
+
+#ifndef W25Q128_EMU_H
+#define W25Q128_EMU_H
+
+#include "w25q128_ll.h"
+
+#include <stdio.h>
+
+// Maximum number of emulated devices
+#define W25Q128_EMU_MAX_DEVICES 4
+
+// JEDEC ID of the 16 MB part, capacity byte follows the configured size
+#define W25Q128_EMU_JEDEC_ID 0xEF4018
+
+// Latency histogram: 8 linear sub-buckets for every power of two nanoseconds
+#define W25Q128_EMU_LATENCY_SUB_BUCKETS 8
+#define W25Q128_EMU_LATENCY_BUCKETS     (64 * W25Q128_EMU_LATENCY_SUB_BUCKETS)
+
+/**
+ * Device timings in microseconds, W25Q128JV datasheet typical values are
+ * used by default.
+ */
+typedef struct {
+    uint32_t spi_hz;
+    uint32_t page_program_us;   // tPP
+    uint32_t sector_erase_us;   // tSE
+    uint32_t block32_erase_us;  // tBE1
+    uint32_t block64_erase_us;  // tBE2
+    uint32_t chip_erase_us;     // tCE
+    uint32_t write_sr_us;       // tW
+    uint32_t suspend_us;        // tSUS
+    uint32_t resume_us;         // tRS, resume to the next suspend
+    uint32_t reset_us;          // tRST
+    uint32_t power_down_us;     // tDP
+    uint32_t release_us;        // tRES1
+} W25Q128_EmuTimingTypeDef;
+
+typedef struct {
+    uint32_t commands[256];     // Commands per opcode
+    uint64_t bus_bytes;         // Bytes clocked while device was selected
+    uint64_t bus_cycles;        // Clocks while device was selected
+    uint64_t bytes_read;
+    uint64_t bytes_programmed;
+    uint32_t erases;
+    uint32_t ignored;           // Commands ignored while busy, powered down,
+                                // within tRES1, without WEL, suspends within
+                                // tRS of a resume, or sent on the wrong
+                                // number of lines
+    uint32_t status_polls;
+    uint32_t suspends;
+    uint64_t busy_ns;           // Time spent in program/erase/status write
+    uint64_t delay_ns;          // Time spent in HAL_Delay (W25Q128_DelayMs)
+    uint32_t delay_calls;
+    uint64_t power_down_ns;     // Time spent in deep power-down
+} W25Q128_EmuStatsTypeDef;
+
+/**
+ * Latency recorder of a workload, percentiles are accurate to 1/8 of the
+ * power of two they fall in.
+ */
+typedef struct {
+    uint32_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint32_t buckets[W25Q128_EMU_LATENCY_BUCKETS];
+} W25Q128_EmuLatencyTypeDef;
+
+typedef struct W25Q128_Emu {
+    SPI_HandleTypeDef *hspi;
+    GPIO_TypeDef *cs_port;
+    uint16_t cs_pin;
+    QSPI_HandleTypeDef *hqspi;
+    W25Q128_EmuTimingTypeDef timing;
+    W25Q128_EmuStatsTypeDef stats;
+    const uint32_t *sfdp_bfpt;  // 16 DWORDs served instead of the W25Q128JV
+                                // table (density included), NULL by default
+    void (*op_hook)(struct W25Q128_Emu *emu); // Called when a program or
+                                // erase starts, i.e. to cut the power in it
+
+    uint8_t *mem;
+    uint32_t capacity;
+    uint8_t capacity_log2;
+    int fd;
+
+    // Status registers, BUSY and SUS are derived from the operation state
+    uint8_t sr[3];
+    uint8_t powered_down;
+    uint64_t power_ns;          // Last power-down command
+    uint64_t ready_ns;          // End of tRES1 after the release command
+
+    // Command currently being clocked in
+    uint8_t selected;
+    uint32_t pos;
+    uint8_t opcode;
+    uint32_t addr;
+    uint8_t page_buf[W25Q128_PAGE_SIZE];
+    uint32_t page_len;
+    uint8_t reset_enabled;
+    uint8_t invalid;            // Wrong lines or QE clear, command is ignored
+    uint8_t continuous;         // Read opcode latched by continuous read mode
+
+    // Program or erase in progress, applied once the busy time has elapsed
+    uint8_t op;
+    uint32_t op_addr;
+    uint32_t op_size;
+    uint8_t op_data[W25Q128_PAGE_SIZE];
+    uint64_t op_busy_ns;
+    uint64_t op_end_ns;
+    uint64_t op_remaining_ns;
+    uint8_t suspended;
+    uint64_t resume_ns;         // Last resume, next suspend waits for tRS
+} W25Q128_EmuTypeDef;
+
+
+/**
+ * @brief Function that creates an emulated device
+ * @param emu Pointer to the emulator struct
+ * @param hspi SPI handle the device is connected to
+ * @param cs_port Chip select port
+ * @param cs_pin Chip select pin
+ * @param image_path Path of the 16 MB image file, created erased if it does
+ *                   not exist. NULL keeps the image in memory only.
+ * @retval ::W25Q128_StatusTypeDef
+ */
+W25Q128_StatusTypeDef W25Q128_Emu_Init(W25Q128_EmuTypeDef *emu,
+                                        SPI_HandleTypeDef *hspi,
+                                        GPIO_TypeDef *cs_port, uint16_t cs_pin,
+                                        const char *image_path);
+
+/**
+ * @brief Function that creates an emulated device of the given size
+ * @param emu Pointer to the emulator struct
+ * @param hspi SPI handle the device is connected to
+ * @param cs_port Chip select port
+ * @param cs_pin Chip select pin
+ * @param image_path Path of the image file, NULL keeps it in memory only
+ * @param capacity Memory size in bytes, power of two, i.e. 32 MB for W25Q256.
+ *                 SFDP and JEDEC ID report it, above 16 MB the upper memory 
+ *                 is reached with the 4-byte address opcodes.
+ * @retval ::W25Q128_StatusTypeDef
+ */
+W25Q128_StatusTypeDef W25Q128_Emu_InitSize(W25Q128_EmuTypeDef *emu,
+                                        SPI_HandleTypeDef *hspi,
+                                        GPIO_TypeDef *cs_port, uint16_t cs_pin,
+                                        const char *image_path,
+                                        uint32_t capacity);
+
+/**
+ * @brief Function that creates an emulated device on a QUADSPI peripheral
+ * @param emu Pointer to the emulator struct
+ * @param hqspi QSPI handle the device is connected to, the peripheral drives
+ *              the chip select
+ * @param image_path Path of the image file, NULL keeps it in memory only
+ * @param capacity Memory size in bytes, power of two
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Dual and quad commands are only served on the lines they are
+ *       defined for, quad commands also need the QE bit.
+ */
+W25Q128_StatusTypeDef W25Q128_Emu_InitQspi(W25Q128_EmuTypeDef *emu,
+                                        QSPI_HandleTypeDef *hqspi,
+                                        const char *image_path,
+                                        uint32_t capacity);
+
+/**
+ * @brief Function that removes an emulated device and unmaps its image
+ * @param emu Pointer to the emulator struct
+ * @return None
+ */
+void W25Q128_Emu_Deinit(W25Q128_EmuTypeDef *emu);
+
+/**
+ * @brief Function that cuts the power of an emulated device
+ * @param emu Pointer to the emulator struct
+ * @return None
+ * @note Program or erase in progress is torn: the part of its bytes that
+ *       corresponds to the elapsed busy time is applied, the rest keeps the
+ *       old data. Device is removed as with W25Q128_Emu_Deinit, initialize it
+ *       again with the same image file to power it up.
+ */
+void W25Q128_Emu_PowerCut(W25Q128_EmuTypeDef *emu);
+
+/**
+ * @brief Function that returns the virtual time
+ * @return Time elapsed since the start in nanoseconds
+ */
+uint64_t W25Q128_Emu_GetTimeNs(void);
+
+/**
+ * @brief Function that advances the virtual time
+ * @param ns Number of nanoseconds
+ * @return None
+ */
+void W25Q128_Emu_Advance(uint64_t ns);
+
+/**
+ * @brief Function that copies device counters
+ * @param emu Pointer to the emulator struct
+ * @param stats Pointer to the struct in which counters are copied
+ * @return None
+ */
+void W25Q128_Emu_GetStats(W25Q128_EmuTypeDef *emu,
+                                            W25Q128_EmuStatsTypeDef *stats);
+
+/**
+ * @brief Function that resets device counters
+ * @param emu Pointer to the emulator struct
+ * @return None
+ */
+void W25Q128_Emu_ResetStats(W25Q128_EmuTypeDef *emu);
+
+/**
+ * @brief Function that spends virtual time in a delay, used by HAL_Delay
+ * @param ns Number of nanoseconds
+ * @return None
+ * @note Delay is counted in the stats of every device.
+ */
+void W25Q128_Emu_Delay(uint64_t ns);
+
+/**
+ * @brief Function that adds a sample to the latency recorder
+ * @param lat Pointer to the latency recorder
+ * @param ns Latency in nanoseconds
+ * @return None
+ */
+void W25Q128_Emu_LatencyAdd(W25Q128_EmuLatencyTypeDef *lat, uint64_t ns);
+
+/**
+ * @brief Function that calculates a latency percentile
+ * @param lat Pointer to the latency recorder
+ * @param percent Percentile, i.e. 50 or 99
+ * @return Upper bound of the percentile in nanoseconds
+ */
+uint64_t W25Q128_Emu_LatencyPercentile(const W25Q128_EmuLatencyTypeDef *lat,
+                                                            uint32_t percent);
+
+/**
+ * @brief Function that writes results of a workload as one JSON line
+ * @param out Output stream
+ * @param name Name of the workload
+ * @param emu Pointer to the emulator struct, counters since the last reset
+ *            are reported
+ * @param lat Pointer to the latency recorder of the operations, can be NULL
+ * @param bytes Payload bytes moved by the workload, used for MB/s
+ * @param elapsed_ns Virtual time of the workload
+ * @return None
+ */
+void W25Q128_Emu_Report(FILE *out, const char *name, W25Q128_EmuTypeDef *emu,
+                        const W25Q128_EmuLatencyTypeDef *lat, uint64_t bytes,
+                        uint64_t elapsed_ns);
+
+/**
+ * @brief Function that selects the device with the given chip select, used
+ *        by the HAL shim
+ * @param cs_port Chip select port
+ * @param cs_pin Chip select pin
+ * @param state Chip select level
+ * @return None
+ */
+void W25Q128_Emu_ChipSelect(GPIO_TypeDef *cs_port, uint16_t cs_pin,
+                                                        GPIO_PinState state);
+
+/**
+ * @brief Function that clocks bytes through the selected devices on the bus,
+ *        used by the HAL shim
+ * @param hspi SPI handle
+ * @param tx Data sent to the device, NULL sends zeros
+ * @param rx Buffer for the data received from the device, can be NULL
+ * @param size Number of bytes
+ * @return None
+ */
+void W25Q128_Emu_Transfer(SPI_HandleTypeDef *hspi, const uint8_t *tx,
+                                                uint8_t *rx, uint32_t size);
+
+/**
+ * @brief Function that selects the devices on a QSPI peripheral, used by the
+ *        HAL shim
+ * @param hqspi QSPI handle
+ * @param state Chip select level
+ * @return None
+ */
+void W25Q128_Emu_QspiSelect(QSPI_HandleTypeDef *hqspi, GPIO_PinState state);
+
+/**
+ * @brief Function that clocks bytes through the selected devices on a QSPI
+ *        peripheral, used by the HAL shim
+ * @param hqspi QSPI handle
+ * @param tx Data sent to the device, NULL sends zeros
+ * @param rx Buffer for the data received from the device, can be NULL
+ * @param size Number of bytes
+ * @param lines Number of lines (1, 2 or 4), a byte takes 8 / lines clocks
+ * @return None
+ */
+void W25Q128_Emu_QspiTransfer(QSPI_HandleTypeDef *hqspi, const uint8_t *tx,
+                            uint8_t *rx, uint32_t size, uint8_t lines);
+
+/**
+ * @brief Function that clocks bytes of a DMA transfer, used by the HAL shim
+ * @param hspi SPI handle
+ * @param tx Data sent to the device, NULL sends zeros
+ * @param rx Buffer for the data received from the device, can be NULL
+ * @param size Number of bytes
+ * @return Virtual time at which the transfer completes
+ * @note The virtual time is not advanced, the CPU is free while DMA runs, so
+ *       transfers on different buses overlap.
+ */
+uint64_t W25Q128_Emu_TransferDMA(SPI_HandleTypeDef *hspi, const uint8_t *tx,
+                                                uint8_t *rx, uint32_t size);
+
+#endif
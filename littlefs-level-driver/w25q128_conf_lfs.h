@@ -0,0 +1,41 @@
+/**
+ * @file w25q128_conf_lfs.h 
+ * @brief w25q128 littlefs layer configuration file
+ * @author Filip Stojanovic
+ */
+
+#ifndef W25Q128_CONF_LFS_H
+#define W25Q128_CONF_LFS_H
+
+/* Number of read cache lines, 0 disables the read cache */
+#ifndef W25Q128_LFS_CACHE_LINES
+#define W25Q128_LFS_CACHE_LINES 0
+#endif
+
+/* Size of a read cache line, W25Q128_PAGE_SIZE or W25Q128_SECTOR_SIZE */
+#ifndef W25Q128_LFS_CACHE_LINE_SIZE
+#define W25Q128_LFS_CACHE_LINE_SIZE 256
+#endif
+
+/* Number of sequential lines that are read ahead on a cache miss */
+#ifndef W25Q128_LFS_CACHE_READAHEAD
+#define W25Q128_LFS_CACHE_READAHEAD 0
+#endif
+
+/* Size of the prog write-back buffer, multiple of 256, 0 programs directly */
+#ifndef W25Q128_LFS_PROG_BUFFER_SIZE
+#define W25Q128_LFS_PROG_BUFFER_SIZE 256
+#endif
+
+/*
+ * Background erase and skipped erases of erased blocks need the erased map of
+ * the low-level driver. It changes W25Q128_TypeDef and cannot be enabled in
+ * this file, build every source with -DW25Q128_ERASED_MAP=1.
+ */
+
+/* Maximum number of devices of a striped block device (w25q128_stripe_lfs) */
+#ifndef W25Q128_STRIPE_MAX_CHIPS
+#define W25Q128_STRIPE_MAX_CHIPS 4
+#endif
+
+#endif
\ No newline at end of file
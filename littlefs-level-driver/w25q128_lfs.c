@@ -1,18 +1,131 @@
 /**
  * @file w25q128_lfs.c
- * @brief w25q128 flash littlefs layer 
+ * @brief w25q128 flash littlefs layer
  * @author Filip Stojanovic
  */
 
 #include "w25q128_lfs.h"
 #include "w25q128_ll.h"
 
+#include <string.h>
+
+#if W25Q128_LFS_CACHE_LINES > 0
+#if W25Q128_LFS_CACHE_READAHEAD >= W25Q128_LFS_CACHE_LINES
+#error "W25Q128_LFS_CACHE_READAHEAD must be less than W25Q128_LFS_CACHE_LINES"
+#endif
+
+typedef struct {
+    W25Q128_TypeDef *w25;
+    uint32_t addr;
+    uint32_t last_used;
+    uint8_t valid;
+    uint8_t data[W25Q128_LFS_CACHE_LINE_SIZE];
+} w25q128_lfs_cache_line_t;
+
+static w25q128_lfs_cache_line_t cache[W25Q128_LFS_CACHE_LINES];
+static uint32_t cache_clock;
+static struct w25q128_lfs_cache_stats cache_stats;
+
+/*************************** Static functions *********************************/
+static w25q128_lfs_cache_line_t *cache_lookup(W25Q128_TypeDef *w25,
+                                                            uint32_t addr);
+static w25q128_lfs_cache_line_t *cache_fill(W25Q128_TypeDef *w25,
+                                                            uint32_t addr);
+static void cache_invalidate(W25Q128_TypeDef *w25, uint32_t addr,
+                                                            uint32_t size);
+#endif
+
+#if W25Q128_LFS_PROG_BUFFER_SIZE > 0
+#if W25Q128_LFS_PROG_BUFFER_SIZE % 256
+#error "W25Q128_LFS_PROG_BUFFER_SIZE must be a multiple of the page size"
+#endif
+
+// Pending progs, always within one buffer aligned window of a single block
+static struct {
+    W25Q128_TypeDef *w25;
+    lfs_block_t block;
+    uint32_t addr;
+    uint32_t len;
+    uint8_t data[W25Q128_LFS_PROG_BUFFER_SIZE];
+} prog_buf;
+
+/*************************** Static functions *********************************/
+static int prog_buffer_flush(void);
+#endif
+
+static int program(W25Q128_TypeDef *w25, uint32_t addr, const uint8_t *data,
+                                                            uint32_t size);
+
+#if W25Q128_ERASED_MAP
+// Blocks reported by lfs_fs_traverse
+static uint8_t used_map[W25Q128_MAX_SECTOR_COUNT / 8];
+
+static int mark_used(void *data, lfs_block_t block);
+#endif
+
 int w25q128_lfs_read(const struct lfs_config *c, lfs_block_t block,
                                 lfs_off_t off, void *buffer, lfs_size_t size)
 {
     W25Q128_TypeDef *w25 = (W25Q128_TypeDef *)c->context;
 
-    uint32_t page = block * (c->block_size / W25Q128_PAGE_SIZE) + 
+#if W25Q128_LFS_PROG_BUFFER_SIZE > 0
+    // Pending data must reach the flash before it is read back
+    if (prog_buf.len > 0 && prog_buf.w25 == w25 && prog_buf.block == block)
+    {
+        if (prog_buffer_flush() != 0)
+            return LFS_ERR_IO;
+    }
+#endif
+
+#if W25Q128_LFS_CACHE_LINES > 0
+    uint32_t addr = block * c->block_size + off;
+    uint8_t *dst = buffer;
+
+    while (size > 0)
+    {
+        uint32_t line_offset = addr % W25Q128_LFS_CACHE_LINE_SIZE;
+        uint32_t len = W25Q128_LFS_CACHE_LINE_SIZE - line_offset;
+        w25q128_lfs_cache_line_t *line;
+
+        if (len > size)
+            len = size;
+
+        line = cache_lookup(w25, addr - line_offset);
+        if (line != NULL)
+        {
+            cache_stats.hits++;
+        } else {
+            cache_stats.misses++;
+            line = cache_fill(w25, addr - line_offset);
+            if (line == NULL)
+                return LFS_ERR_IO;
+
+            for (uint32_t i = 1; i <= W25Q128_LFS_CACHE_READAHEAD; i++)
+            {
+                uint32_t ahead = addr - line_offset +
+                                            (i * W25Q128_LFS_CACHE_LINE_SIZE);
+                if (ahead >= W25Q128_GetCapacity(w25))
+                    break;
+                if (cache_lookup(w25, ahead) != NULL)
+                    continue;
+                // Read ahead line must not evict the one that is being used
+                line->last_used = ++cache_clock;
+                if (cache_fill(w25, ahead) == NULL)
+                    break;
+                cache_stats.readahead++;
+            }
+        }
+
+        memcpy(dst, &line->data[line_offset], len);
+
+        addr += len;
+        dst += len;
+        size -= len;
+    }
+
+    return 0;
+#else
+    uint32_t page = block * (c->block_size / W25Q128_PAGE_SIZE) +
                                                     (off / W25Q128_PAGE_SIZE);
 
     uint32_t offset = off % W25Q128_PAGE_SIZE;
@@ -21,8 +134,9 @@ int w25q128_lfs_read(const struct lfs_config *c, lfs_block_t block,
                                                                         buffer);
     if (status != W25Q128_SUCCESS)
         return LFS_ERR_IO;
-    
+
     return 0;
+#endif
 }
 
 int w25q128_lfs_prog(const struct lfs_config *c, lfs_block_t block,
@@ -30,33 +144,257 @@ int w25q128_lfs_prog(const struct lfs_config *c, lfs_block_t block,
 {
     W25Q128_TypeDef *w25 = (W25Q128_TypeDef *)c->context;
 
-    uint32_t page = block * (c->block_size / W25Q128_PAGE_SIZE) + 
-                                                    (off / W25Q128_PAGE_SIZE);
+    uint32_t addr = block * c->block_size + off;
 
-    uint32_t offset = off % W25Q128_PAGE_SIZE;
+#if W25Q128_LFS_PROG_BUFFER_SIZE > 0
+    const uint8_t *src = buffer;
 
-    W25Q128_StatusTypeDef status = W25Q128_Write(w25, page, offset, size, 
-                                                                        buffer);
-    if (status != W25Q128_SUCCESS)
+    while (size > 0)
+    {
+        uint32_t window_end;
+        uint32_t len;
+
+        if (prog_buf.len > 0 && (prog_buf.w25 != w25 ||
+            prog_buf.block != block || prog_buf.addr + prog_buf.len != addr))
+        {
+            if (prog_buffer_flush() != 0)
+                return LFS_ERR_IO;
+        }
+
+        if (prog_buf.len == 0)
+        {
+            prog_buf.w25 = w25;
+            prog_buf.block = block;
+            prog_buf.addr = addr;
+        }
+
+        window_end = (prog_buf.addr / W25Q128_LFS_PROG_BUFFER_SIZE + 1) *
+                                                W25Q128_LFS_PROG_BUFFER_SIZE;
+        len = window_end - addr;
+        if (len > size)
+            len = size;
+
+        memcpy(&prog_buf.data[prog_buf.addr % W25Q128_LFS_PROG_BUFFER_SIZE +
+                                                    prog_buf.len], src, len);
+        prog_buf.len += len;
+        addr += len;
+        src += len;
+        size -= len;
+
+        // Window is complete
+        if (addr == window_end)
+        {
+            if (prog_buffer_flush() != 0)
+                return LFS_ERR_IO;
+        }
+    }
+
+    return 0;
+#else
+    if (program(w25, addr, buffer, size) != 0)
         return LFS_ERR_IO;
-    
-    return 0;                                                           
+
+    return 0;
+#endif
 }
 
 int w25q128_lfs_erase(const struct lfs_config *c, lfs_block_t block)
 {
     W25Q128_TypeDef *w25 = (W25Q128_TypeDef *)c->context;
 
+#if W25Q128_LFS_PROG_BUFFER_SIZE > 0
+    // Erase would wipe the pending data anyway
+    if (prog_buf.len > 0 && prog_buf.w25 == w25 && prog_buf.block == block)
+        prog_buf.len = 0;
+#endif
+
+#if W25Q128_LFS_CACHE_LINES > 0
+    cache_invalidate(w25, block * c->block_size, c->block_size);
+#endif
+
     W25Q128_StatusTypeDef status = W25Q128_EraseSector(w25, block);
 
     if (status != W25Q128_SUCCESS)
         return LFS_ERR_IO;
-    
+
     return 0;
 }
 
 int w25q128_lfs_sync(const struct lfs_config *c)
 {
-    // For now, nothing to sync
+    (void)c;
+
+#if W25Q128_LFS_PROG_BUFFER_SIZE > 0
+    if (prog_buffer_flush() != 0)
+        return LFS_ERR_IO;
+#endif
+
     return 0;
-}
\ No newline at end of file
+}
+
+#if W25Q128_ERASED_MAP
+int w25q128_lfs_background_erase(lfs_t *lfs, const struct lfs_config *c,
+                                                        lfs_size_t max_blocks)
+{
+    W25Q128_TypeDef *w25 = (W25Q128_TypeDef *)c->context;
+    lfs_size_t erased = 0;
+    int err;
+
+    if (c->block_size != W25Q128_SECTOR_SIZE || 
+        c->block_count > W25Q128_GetCapacity(w25) / W25Q128_SECTOR_SIZE)
+        return LFS_ERR_INVAL;
+
+#if W25Q128_LFS_PROG_BUFFER_SIZE > 0
+    if (prog_buffer_flush() != 0)
+        return LFS_ERR_IO;
+#endif
+
+    memset(used_map, 0, sizeof(used_map));
+    err = lfs_fs_traverse(lfs, mark_used, NULL);
+    if (err < 0)
+        return err;
+
+    for (lfs_block_t block = 0; block < c->block_count && erased < max_blocks;
+                                                                    block++)
+    {
+        if ((used_map[block / 8] >> (block % 8)) & 0x01)
+            continue;
+        if (W25Q128_IsSectorErased(w25, block))
+            continue;
+
+#if W25Q128_LFS_CACHE_LINES > 0
+        cache_invalidate(w25, block * c->block_size, c->block_size);
+#endif
+        if (W25Q128_PreEraseSector(w25, block) != W25Q128_SUCCESS)
+            return LFS_ERR_IO;
+        erased++;
+    }
+
+    return erased;
+}
+#endif
+
+#if W25Q128_LFS_CACHE_LINES > 0
+void w25q128_lfs_cache_get_stats(struct w25q128_lfs_cache_stats *stats)
+{
+    *stats = cache_stats;
+}
+
+void w25q128_lfs_cache_reset_stats(void)
+{
+    memset(&cache_stats, 0, sizeof(cache_stats));
+}
+
+void w25q128_lfs_cache_invalidate(void)
+{
+    for (uint32_t i = 0; i < W25Q128_LFS_CACHE_LINES; i++)
+        cache[i].valid = 0;
+}
+#endif
+
+/*************************** Static functions *********************************/
+// Programs already erased flash directly, littlefs never progs over data
+static int program(W25Q128_TypeDef *w25, uint32_t addr, const uint8_t *data,
+                                                            uint32_t size)
+{
+#if W25Q128_LFS_CACHE_LINES > 0
+    cache_invalidate(w25, addr, size);
+#endif
+
+    if (W25Q128_WritePage(w25, addr / W25Q128_PAGE_SIZE,
+                    addr % W25Q128_PAGE_SIZE, size, (uint8_t *)data)
+                                                        != W25Q128_SUCCESS)
+        return LFS_ERR_IO;
+
+    return 0;
+}
+
+#if W25Q128_LFS_PROG_BUFFER_SIZE > 0
+static int prog_buffer_flush(void)
+{
+    int err;
+
+    if (prog_buf.len == 0)
+        return 0;
+
+    err = program(prog_buf.w25, prog_buf.addr,
+            &prog_buf.data[prog_buf.addr % W25Q128_LFS_PROG_BUFFER_SIZE],
+            prog_buf.len);
+    prog_buf.len = 0;
+
+    return err;
+}
+#endif
+
+#if W25Q128_ERASED_MAP
+static int mark_used(void *data, lfs_block_t block)
+{
+    (void)data;
+
+    if (block < W25Q128_MAX_SECTOR_COUNT)
+        used_map[block / 8] |= (1 << (block % 8));
+
+    return 0;
+}
+#endif
+
+#if W25Q128_LFS_CACHE_LINES > 0
+static w25q128_lfs_cache_line_t *cache_lookup(W25Q128_TypeDef *w25,
+                                                            uint32_t addr)
+{
+    for (uint32_t i = 0; i < W25Q128_LFS_CACHE_LINES; i++)
+    {
+        if (cache[i].valid && cache[i].w25 == w25 && cache[i].addr == addr)
+        {
+            cache[i].last_used = ++cache_clock;
+            return &cache[i];
+        }
+    }
+    return NULL;
+}
+
+// Reads the line into the least recently used slot
+static w25q128_lfs_cache_line_t *cache_fill(W25Q128_TypeDef *w25,
+                                                            uint32_t addr)
+{
+    w25q128_lfs_cache_line_t *victim = &cache[0];
+
+    for (uint32_t i = 0; i < W25Q128_LFS_CACHE_LINES; i++)
+    {
+        if (!cache[i].valid)
+        {
+            victim = &cache[i];
+            break;
+        }
+        if (cache[i].last_used < victim->last_used)
+            victim = &cache[i];
+    }
+
+    victim->valid = 0;
+    if (W25Q128_FastRead(w25, addr / W25Q128_PAGE_SIZE, 0,
+                W25Q128_LFS_CACHE_LINE_SIZE, victim->data) != W25Q128_SUCCESS)
+        return NULL;
+
+    victim->w25 = w25;
+    victim->addr = addr;
+    victim->valid = 1;
+    victim->last_used = ++cache_clock;
+
+    return victim;
+}
+
+static void cache_invalidate(W25Q128_TypeDef *w25, uint32_t addr,
+                                                            uint32_t size)
+{
+    for (uint32_t i = 0; i < W25Q128_LFS_CACHE_LINES; i++)
+    {
+        if (cache[i].valid && cache[i].w25 == w25 &&
+            cache[i].addr < addr + size &&
+            addr < cache[i].addr + W25Q128_LFS_CACHE_LINE_SIZE)
+        {
+            cache[i].valid = 0;
+            cache_stats.invalidations++;
+        }
+    }
+}
+#endif
\ No newline at end of file
@@ -8,6 +8,19 @@
 #define NOR_FLASH_H
 
 #include "lfs.h"
+#include "w25q128_conf_lfs.h"
+#include "w25q128_ll.h"
+
+#include <stdint.h>
+
+#if W25Q128_LFS_CACHE_LINES > 0
+struct w25q128_lfs_cache_stats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t readahead;     // Lines filled by readahead
+    uint32_t invalidations; // Lines dropped by prog/erase
+};
+#endif
 
 /**
  * @brief littlefs read function - read a region in a block 
@@ -48,4 +61,41 @@ int w25q128_lfs_erase(const struct lfs_config *c, lfs_block_t block);
  */
 int w25q128_lfs_sync(const struct lfs_config *c);
 
+#if W25Q128_LFS_CACHE_LINES > 0
+/**
+ * @brief Function that copies read cache counters
+ * @param stats Pointer to the struct to which counters are copied
+ * @return None
+ */
+void w25q128_lfs_cache_get_stats(struct w25q128_lfs_cache_stats *stats);
+
+/**
+ * @brief Function that clears read cache counters
+ * @return None
+ */
+void w25q128_lfs_cache_reset_stats(void);
+
+/**
+ * @brief Function that drops all read cache lines
+ * @return None
+ * @note Must be called if flash was written bypassing the littlefs layer.
+ */
+void w25q128_lfs_cache_invalidate(void);
+#endif
+
+#if W25Q128_ERASED_MAP
+/**
+ * @brief Function that erases free littlefs blocks ahead of use
+ * @param lfs Pointer to the mounted littlefs instance
+ * @param c Pointer to the lfs_config struct
+ * @param max_blocks Maximum number of blocks erased in one call
+ * @return Number of erased blocks or littlefs error code
+ * @note Call it from idle time, never while other littlefs operation is in 
+ *       progress. Blocks in use are found with lfs_fs_traverse, erased blocks
+ *       make later w25q128_lfs_erase calls return right away.
+ */
+int w25q128_lfs_background_erase(lfs_t *lfs, const struct lfs_config *c,
+                                                        lfs_size_t max_blocks);
+#endif
+
 #endif
\ No newline at end of file
@@ -0,0 +1,256 @@
+/**
+ * @file w25q128_stripe_lfs.c
+ * @brief w25q128 striped (RAID-0) littlefs block device over several devices
+ * @author Filip Stojanovic
+ */
+
+#include "w25q128_stripe_lfs.h"
+
+#include <string.h>
+
+// Longest wait for the transfers of one call, covers a suspended erase
+#define W25Q128_STRIPE_TIMEOUT_MS (2 * W25Q128_TIMEOUT_SECTOR_ERASE_MS)
+
+/*************************** Static functions *********************************/
+static int stripe_submit(w25q128_stripe_t *stripe, uint8_t chip,
+                                W25Q128_AsyncOpTypeDef op, uint32_t addr,
+                                uint8_t *data, uint32_t size);
+static int stripe_wait(w25q128_stripe_t *stripe, uint32_t chips);
+static int stripe_transfer(w25q128_stripe_t *stripe, lfs_block_t block,
+                                lfs_off_t off, uint8_t *data, lfs_size_t size,
+                                W25Q128_AsyncOpTypeDef op);
+
+int w25q128_stripe_init(w25q128_stripe_t *stripe,
+                                    W25Q128_AsyncTypeDef *const *chips,
+                                    uint8_t num_chips, uint32_t stripe_size)
+{
+    if (num_chips == 0 || num_chips > W25Q128_STRIPE_MAX_CHIPS)
+        return LFS_ERR_INVAL;
+
+    if (stripe_size > W25Q128_SECTOR_SIZE ||
+        (stripe_size > 0 && W25Q128_SECTOR_SIZE % stripe_size != 0))
+        return LFS_ERR_INVAL;
+
+    memset(stripe, 0, sizeof(*stripe));
+    for (uint8_t i = 0; i < num_chips; i++)
+        stripe->chips[i] = chips[i];
+    stripe->num_chips = num_chips;
+    stripe->stripe_size = stripe_size;
+
+    return 0;
+}
+
+lfs_size_t w25q128_stripe_block_size(const w25q128_stripe_t *stripe)
+{
+    if (stripe->stripe_size == 0)
+        return W25Q128_SECTOR_SIZE;
+
+    return W25Q128_SECTOR_SIZE * stripe->num_chips;
+}
+
+lfs_size_t w25q128_stripe_block_count(const w25q128_stripe_t *stripe)
+{
+    // Devices are expected to be of the same size
+    lfs_size_t sectors = W25Q128_GetCapacity(stripe->chips[0]->w25) / 
+                                                        W25Q128_SECTOR_SIZE;
+
+    if (stripe->stripe_size == 0)
+        return sectors * stripe->num_chips;
+
+    return sectors;
+}
+
+void w25q128_stripe_dma_cplt(w25q128_stripe_t *stripe,
+                                                    SPI_HandleTypeDef *hspi)
+{
+    for (uint8_t i = 0; i < stripe->num_chips; i++)
+        W25Q128_Async_DMACpltHandler(stripe->chips[i], hspi);
+}
+
+int w25q128_stripe_read(const struct lfs_config *c, lfs_block_t block,
+                                lfs_off_t off, void *buffer, lfs_size_t size)
+{
+    w25q128_stripe_t *stripe = (w25q128_stripe_t *)c->context;
+
+    return stripe_transfer(stripe, block, off, buffer, size,
+                                                        W25Q128_ASYNC_READ);
+}
+
+int w25q128_stripe_prog(const struct lfs_config *c, lfs_block_t block,
+                            lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+    w25q128_stripe_t *stripe = (w25q128_stripe_t *)c->context;
+
+    return stripe_transfer(stripe, block, off, (uint8_t *)buffer, size,
+                                                W25Q128_ASYNC_PAGE_PROGRAM);
+}
+
+int w25q128_stripe_erase(const struct lfs_config *c, lfs_block_t block)
+{
+    w25q128_stripe_t *stripe = (w25q128_stripe_t *)c->context;
+    uint8_t first = 0;
+    uint8_t last = stripe->num_chips - 1;
+    uint32_t sector = block;
+    int err = 0;
+
+    if (stripe->stripe_size == 0)
+    {
+        first = block % stripe->num_chips;
+        last = first;
+        sector = block / stripe->num_chips;
+    }
+
+    // Erases of all devices of the block run at the same time and are
+    // completed by the next call that uses the device
+    for (uint8_t i = first; i <= last && err == 0; i++)
+    {
+#if W25Q128_ERASED_MAP
+        if (W25Q128_IsSectorErased(stripe->chips[i]->w25, sector))
+            continue;
+#endif
+        err = stripe_submit(stripe, i, W25Q128_ASYNC_ERASE_SECTOR,
+                                    sector * W25Q128_SECTOR_SIZE, NULL, 0);
+    }
+
+    return err;
+}
+
+int w25q128_stripe_sync(const struct lfs_config *c)
+{
+    w25q128_stripe_t *stripe = (w25q128_stripe_t *)c->context;
+
+    return stripe_wait(stripe, (1u << stripe->num_chips) - 1);
+}
+
+/*************************** Static functions *********************************/
+static int stripe_submit(w25q128_stripe_t *stripe, uint8_t chip,
+                                W25Q128_AsyncOpTypeDef op, uint32_t addr,
+                                uint8_t *data, uint32_t size)
+{
+    W25Q128_AsyncTransferTypeDef *xfer;
+
+    // Queue of this device is full, let it drain first
+    if (stripe->pending[chip] == W25Q128_ASYNC_QUEUE_SIZE)
+    {
+        if (stripe_wait(stripe, 1u << chip) != 0)
+            return LFS_ERR_IO;
+    }
+
+    xfer = &stripe->xfers[chip][stripe->pending[chip]];
+    xfer->op = op;
+    xfer->addr = addr;
+    xfer->data = data;
+    xfer->size = size;
+    xfer->callback = NULL;
+    xfer->user_data = NULL;
+
+    if (W25Q128_Async_Submit(stripe->chips[chip], xfer) != W25Q128_SUCCESS)
+        return LFS_ERR_IO;
+
+    stripe->pending[chip]++;
+    return 0;
+}
+
+/*
+ * Waits for all transfers of the devices in the chips bit mask. Descriptors
+ * stay queued until they complete, so after the timeout the queues are
+ * drained anyway: every transfer ends at the latest with the timeout of its
+ * own operation.
+ */
+static int stripe_wait(w25q128_stripe_t *stripe, uint32_t chips)
+{
+    uint32_t start_time = HAL_GetTick();
+    uint8_t busy = 1;
+    int err = 0;
+
+    while (busy)
+    {
+        busy = 0;
+        for (uint8_t i = 0; i < stripe->num_chips; i++)
+        {
+            if (!(chips & (1u << i)))
+                continue;
+
+            // Reads can overtake a suspended operation, check them all
+            for (uint8_t j = 0; j < stripe->pending[i]; j++)
+            {
+                if (!W25Q128_Async_IsDone(&stripe->xfers[i][j]))
+                {
+                    W25Q128_Async_Process(stripe->chips[i]);
+                    busy = 1;
+                    break;
+                }
+            }
+        }
+
+        if (busy && (HAL_GetTick() - start_time) > W25Q128_STRIPE_TIMEOUT_MS)
+            err = LFS_ERR_IO;
+    }
+
+    for (uint8_t i = 0; i < stripe->num_chips; i++)
+    {
+        if (!(chips & (1u << i)))
+            continue;
+
+        for (uint8_t j = 0; j < stripe->pending[i]; j++)
+        {
+            if (stripe->xfers[i][j].status != W25Q128_SUCCESS)
+                err = LFS_ERR_IO;
+        }
+        stripe->pending[i] = 0;
+    }
+
+    return err;
+}
+
+/*
+ * Splits the region into device pieces (units of the stripe, pages for
+ * progs) and submits them all before waiting, so every device works on its
+ * pieces at the same time.
+ */
+static int stripe_transfer(w25q128_stripe_t *stripe, lfs_block_t block,
+                                lfs_off_t off, uint8_t *data, lfs_size_t size,
+                                W25Q128_AsyncOpTypeDef op)
+{
+    uint32_t chips = 0;
+    int err = 0;
+
+    while (size > 0 && err == 0)
+    {
+        uint8_t chip;
+        uint32_t addr;
+        uint32_t len = size;
+
+        if (stripe->stripe_size == 0)
+        {
+            chip = block % stripe->num_chips;
+            addr = (block / stripe->num_chips) * W25Q128_SECTOR_SIZE + off;
+        } else {
+            uint32_t unit = off / stripe->stripe_size;
+            uint32_t unit_offset = off % stripe->stripe_size;
+
+            chip = unit % stripe->num_chips;
+            addr = block * W25Q128_SECTOR_SIZE +
+                    (unit / stripe->num_chips) * stripe->stripe_size +
+                    unit_offset;
+            if (len > stripe->stripe_size - unit_offset)
+                len = stripe->stripe_size - unit_offset;
+        }
+
+        if (op == W25Q128_ASYNC_PAGE_PROGRAM &&
+                        len > W25Q128_PAGE_SIZE - (addr % W25Q128_PAGE_SIZE))
+            len = W25Q128_PAGE_SIZE - (addr % W25Q128_PAGE_SIZE);
+
+        err = stripe_submit(stripe, chip, op, addr, data, len);
+        chips |= 1u << chip;
+
+        off += len;
+        data += len;
+        size -= len;
+    }
+
+    if (stripe_wait(stripe, chips) != 0)
+        return LFS_ERR_IO;
+
+    return err;
+}
\ No newline at end of file
@@ -0,0 +1,123 @@
+/**
+ * @file w25q128_stripe_lfs.h
+ * @brief w25q128 striped (RAID-0) littlefs block device over several devices
+ * @author Filip Stojanovic
+ *
+ * Spreads littlefs blocks over up to W25Q128_STRIPE_MAX_CHIPS devices, each
+ * driven by its own asynchronous queue (w25q128_async_ll), so transfers on
+ * different devices run at the same time. Two layouts are supported:
+ *
+ * - stripe_size 0: littlefs block is one sector, block n lives on device
+ *   n % num_chips. Capacity and block_count grow with the number of devices,
+ *   an erase keeps only its own device busy.
+ * - stripe_size > 0: littlefs block is one sector on every device
+ *   (num_chips * 4 KB), its data is interleaved in stripe_size units. Reads
+ *   and progs longer than one unit and every erase run on all devices in
+ *   parallel.
+ *
+ * Reads and progs wait only for the devices they use. Erases are left
+ * running: the next call that uses the device (or sync) waits for the erase
+ * and returns its error, so littlefs keeps working on the other devices.
+ *
+ * lfs_config context must point to the w25q128_stripe_t struct and the SPI
+ * DMA complete callbacks must reach every queue, i.e. through 
+ * w25q128_stripe_dma_cplt().
+ */
+
+#ifndef W25Q128_STRIPE_LFS_H
+#define W25Q128_STRIPE_LFS_H
+
+#include "lfs.h"
+#include "w25q128_conf_lfs.h"
+#include "w25q128_async_ll.h"
+
+#include <stdint.h>
+
+typedef struct {
+    W25Q128_AsyncTypeDef *chips[W25Q128_STRIPE_MAX_CHIPS];
+    uint8_t num_chips;
+    uint32_t stripe_size;
+
+    // Transfers in flight on every device, erases included
+    W25Q128_AsyncTransferTypeDef xfers[W25Q128_STRIPE_MAX_CHIPS]
+                                                [W25Q128_ASYNC_QUEUE_SIZE];
+    uint8_t pending[W25Q128_STRIPE_MAX_CHIPS];
+} w25q128_stripe_t;
+
+/**
+ * @brief Function that initializes a striped block device
+ * @param stripe Pointer to the stripe struct
+ * @param chips Initialized asynchronous queues, one per device
+ * @param num_chips Number of devices
+ * @param stripe_size Interleave unit in bytes, must divide the sector size.
+ *                    0 places whole blocks on a single device.
+ * @return 0 or LFS_ERR_INVAL
+ */
+int w25q128_stripe_init(w25q128_stripe_t *stripe, 
+                                    W25Q128_AsyncTypeDef *const *chips,
+                                    uint8_t num_chips, uint32_t stripe_size);
+
+/**
+ * @brief Function that returns block_size to use in lfs_config
+ * @param stripe Pointer to the stripe struct
+ * @return Block size in bytes
+ */
+lfs_size_t w25q128_stripe_block_size(const w25q128_stripe_t *stripe);
+
+/**
+ * @brief Function that returns block_count to use in lfs_config
+ * @param stripe Pointer to the stripe struct
+ * @return Number of blocks
+ */
+lfs_size_t w25q128_stripe_block_count(const w25q128_stripe_t *stripe);
+
+/**
+ * @brief Function that forwards SPI DMA complete callback to all devices
+ * @param stripe Pointer to the stripe struct
+ * @param hspi SPI handle passed to the HAL callback
+ * @return None
+ */
+void w25q128_stripe_dma_cplt(w25q128_stripe_t *stripe, 
+                                                    SPI_HandleTypeDef *hspi);
+
+/**
+ * @brief littlefs read function - read a region in a block 
+ * @param c Pointer to the lfs_config struct
+ * @param block littlefs block
+ * @param off littlefs offset in block
+ * @param buffer Pointer to the data buffer
+ * @param size littlefs data size
+ * @return littlefs error codes
+ */
+int w25q128_stripe_read(const struct lfs_config *c, lfs_block_t block,
+                                lfs_off_t off, void *buffer, lfs_size_t size);
+
+/**
+ * @brief littlefs prog function - program a region in a block 
+ * @param c Pointer to the lfs_config struct
+ * @param block littlefs block
+ * @param off littlefs offset in block
+ * @param buffer Pointer to the data buffer
+ * @param size littlefs data size
+ * @return littlefs error codes
+ */
+int w25q128_stripe_prog(const struct lfs_config *c, lfs_block_t block,
+                            lfs_off_t off, const void *buffer, lfs_size_t size);
+
+/**
+ * @brief littlefs erase function - erase a block 
+ * @param c Pointer to the lfs_config struct
+ * @param block littlefs block
+ * @return littlefs error codes
+ */
+int w25q128_stripe_erase(const struct lfs_config *c, lfs_block_t block);
+
+/**
+ * @brief littlefs sync function - sync the state of underlying block device 
+ * @param c Pointer to the lfs_config struct
+ * @return littlefs error codes
+ * @note Waits for the erases that are still running on any device.
+ */
+int w25q128_stripe_sync(const struct lfs_config *c);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,42 @@
+/**
+ * @file w25q128_conf_log.h
+ * @brief w25q128 log store configuration file
+ * @author Filip Stojanovic
+ */
+
+#ifndef W25Q128_CONF_LOG_H
+#define W25Q128_CONF_LOG_H
+
+/*
+ * Sectors erased ahead of the write head at once, multiple of the sector
+ * size. Erase starts at the head and ends at the next boundary of this size,
+ * so 64 KB uses a single block erase once the head is aligned.
+ */
+#ifndef W25Q128_LOG_ERASE_AHEAD_SIZE
+#define W25Q128_LOG_ERASE_AHEAD_SIZE 65536
+#endif
+
+/*
+ * W25Q128_Log_AppendCompressed and its hash table in W25Q128_LogTypeDef, 0
+ * leaves them out. Compressed records are read back in either case.
+ */
+#ifndef W25Q128_LOG_COMPRESSION
+#define W25Q128_LOG_COMPRESSION 0
+#endif
+
+/* Compressor hash table, 2^bits entries of 2 bytes in W25Q128_LogTypeDef */
+#ifndef W25Q128_LZ_HASH_BITS
+#define W25Q128_LZ_HASH_BITS 9
+#endif
+
+/* Ingestion ring (w25q128_ring) size in bytes, power of two */
+#ifndef W25Q128_RING_SIZE
+#define W25Q128_RING_SIZE 4096
+#endif
+
+/* Largest ring record, W25Q128_Ring_Drain keeps one on its stack */
+#ifndef W25Q128_RING_MAX_RECORD_SIZE
+#define W25Q128_RING_MAX_RECORD_SIZE 256
+#endif
+
+#endif
\ No newline at end of file
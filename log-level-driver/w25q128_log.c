@@ -0,0 +1,717 @@
+/**
+ * @file w25q128_log.c
+ * @brief w25q128 append-only circular log store
+ * @author Filip Stojanovic
+ */
+
+#include "w25q128_log.h"
+
+#include <string.h>
+
+#define W25Q128_LOG_MAGIC 0x4C353257 // "W25L"
+
+// Erased record size, ends the records of a sector
+#define W25Q128_LOG_RECORD_END 0xFFFF
+
+// Size flag of a compressed record
+#define W25Q128_LOG_RECORD_COMPRESSED 0x8000
+
+// Sectors between the head and the oldest sector that may hold no data
+#define W25Q128_LOG_GAP_SECTORS \
+                    (W25Q128_LOG_ERASE_AHEAD_SIZE / W25Q128_SECTOR_SIZE + 1)
+
+/**
+ * Stored data of a compressed record, read ahead in small pieces.
+ */
+typedef struct {
+    W25Q128_LogTypeDef *log;
+    uint32_t addr;
+    uint32_t end;
+    uint32_t crc;           // Of the bytes read so far
+    uint8_t buf[32];
+    uint8_t pos;
+    uint8_t len;
+    uint8_t read_failed;
+} W25Q128_LogSourceTypeDef;
+
+#if W25Q128_LOG_COMPRESSION
+/**
+ * Compressed output, counted in the first pass and buffered in the second.
+ */
+typedef struct {
+    uint32_t size;
+    uint32_t max_size;
+    uint32_t crc;
+} W25Q128_LogSinkTypeDef;
+#endif
+
+/*************************** Static functions *********************************/
+static uint32_t get_u32(const uint8_t *p);
+static void set_u32(uint8_t *p, uint32_t value);
+static uint32_t sector_addr(W25Q128_LogTypeDef *log, uint32_t sector);
+static void log_init(W25Q128_LogTypeDef *log, W25Q128_TypeDef *w25,
+                                uint32_t first_sector, uint32_t num_sectors);
+static W25Q128_StatusTypeDef log_read(W25Q128_LogTypeDef *log, uint32_t addr,
+                                        uint8_t *data, uint32_t size);
+static W25Q128_StatusTypeDef log_read_header(W25Q128_LogTypeDef *log,
+                                        uint32_t sector, uint32_t *seq);
+static W25Q128_StatusTypeDef log_check_record(W25Q128_LogTypeDef *log,
+                                        uint32_t sector, uint32_t offset,
+                                        uint32_t *size);
+static W25Q128_StatusTypeDef log_find_end(W25Q128_LogTypeDef *log);
+static W25Q128_StatusTypeDef log_put(W25Q128_LogTypeDef *log,
+                                        const uint8_t *data, uint32_t size);
+static W25Q128_StatusTypeDef log_advance(W25Q128_LogTypeDef *log);
+static W25Q128_StatusTypeDef log_source(void *ctx, uint8_t *data,
+                                                            uint32_t size);
+static W25Q128_StatusTypeDef log_read_compressed(W25Q128_LogTypeDef *log,
+                                        const uint8_t *header, uint32_t addr,
+                                        uint32_t stored_size, uint8_t *data,
+                                        uint32_t max_size, uint32_t *size);
+#if W25Q128_LOG_COMPRESSION
+static W25Q128_StatusTypeDef log_sink_count(void *ctx, const uint8_t *data,
+                                                            uint32_t size);
+static W25Q128_StatusTypeDef log_sink_put(void *ctx, const uint8_t *data,
+                                                            uint32_t size);
+#endif
+
+W25Q128_StatusTypeDef W25Q128_Log_Mount(W25Q128_LogTypeDef *log,
+                                        W25Q128_TypeDef *w25,
+                                        uint32_t first_sector,
+                                        uint32_t num_sectors)
+{
+    W25Q128_StatusTypeDef status = W25Q128_END;
+    uint32_t first;
+    uint32_t first_seq;
+    uint32_t seq;
+    uint32_t lo;
+    uint32_t hi;
+
+    if (num_sectors < 2 || (first_sector + num_sectors) * W25Q128_SECTOR_SIZE
+                                                > W25Q128_GetCapacity(w25))
+        return W25Q128_ERROR;
+
+    log_init(log, w25, first_sector, num_sectors);
+
+    // Oldest or newest data starts within the erase gap of the region start
+    for (first = 0; first < num_sectors && first <= W25Q128_LOG_GAP_SECTORS;
+                                                                    first++)
+    {
+        status = log_read_header(log, first, &first_seq);
+        if (status != W25Q128_END)
+            break;
+    }
+    if (status == W25Q128_ERROR)
+        return W25Q128_ERROR;
+    if (status == W25Q128_END)
+        return W25Q128_SUCCESS;
+
+    /*
+     * From the first valid sector on, sequence numbers grow up to the head,
+     * followed by the erase gap and older sectors. Head is the last sector
+     * not older than the first one.
+     */
+    lo = first;
+    hi = num_sectors - 1;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo + 1) / 2;
+
+        status = log_read_header(log, mid, &seq);
+        if (status == W25Q128_ERROR)
+            return W25Q128_ERROR;
+
+        if (status == W25Q128_SUCCESS && (int32_t)(seq - first_seq) >= 0)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    if (log_read_header(log, lo, &log->head_seq) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+    log->head = lo;
+
+    // Oldest sector follows the erase gap, or is the first one
+    log->tail = first;
+    for (uint32_t i = 1; i < num_sectors && i <= W25Q128_LOG_GAP_SECTORS; i++)
+    {
+        uint32_t sector = (log->head + i) % num_sectors;
+
+        status = log_read_header(log, sector, &seq);
+        if (status == W25Q128_ERROR)
+            return W25Q128_ERROR;
+        if (status == W25Q128_SUCCESS && (int32_t)(seq - log->head_seq) < 0)
+        {
+            log->tail = sector;
+            break;
+        }
+    }
+    log->count = (log->head + num_sectors - log->tail) % num_sectors + 1;
+    log->tail_seq = log->head_seq - log->count + 1;
+
+    return log_find_end(log);
+}
+
+W25Q128_StatusTypeDef W25Q128_Log_Format(W25Q128_LogTypeDef *log,
+                                        W25Q128_TypeDef *w25,
+                                        uint32_t first_sector,
+                                        uint32_t num_sectors)
+{
+    if (num_sectors < 2 || (first_sector + num_sectors) * W25Q128_SECTOR_SIZE
+                                                > W25Q128_GetCapacity(w25))
+        return W25Q128_ERROR;
+
+    log_init(log, w25, first_sector, num_sectors);
+
+    if (W25Q128_EraseRange(w25, first_sector * W25Q128_SECTOR_SIZE,
+                            num_sectors * W25Q128_SECTOR_SIZE)
+                                                        != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    // Head is parked on the last sector, every other one is ready for use
+    log->erased = num_sectors - 1;
+
+    return W25Q128_SUCCESS;
+}
+
+W25Q128_StatusTypeDef W25Q128_Log_Append(W25Q128_LogTypeDef *log,
+                                        const uint8_t *data, uint32_t size)
+{
+    uint8_t header[W25Q128_LOG_RECORD_HEADER_SIZE];
+    uint32_t crc;
+
+    if (size > W25Q128_LOG_MAX_RECORD_SIZE)
+        return W25Q128_ERROR;
+
+    if (log->head_offset + W25Q128_LOG_RECORD_HEADER_SIZE + size >
+                                                        W25Q128_SECTOR_SIZE)
+    {
+        if (log_advance(log) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+    }
+
+    header[0] = size & 0xFF;
+    header[1] = (size >> 8) & 0xFF;
+    crc = W25Q128_Crc32(W25Q128_Crc32(0, header, 2), data, size);
+    set_u32(&header[2], crc);
+
+    if (log_put(log, header, sizeof(header)) != W25Q128_SUCCESS ||
+        log_put(log, data, size) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    log->stats.records++;
+    log->stats.bytes += size;
+
+    return W25Q128_SUCCESS;
+}
+
+#if W25Q128_LOG_COMPRESSION
+W25Q128_StatusTypeDef W25Q128_Log_AppendCompressed(W25Q128_LogTypeDef *log,
+                                        const uint8_t *data, uint32_t size)
+{
+    W25Q128_LogSinkTypeDef sink;
+    W25Q128_StatusTypeDef status;
+    uint8_t header[W25Q128_LOG_RECORD_HEADER_SIZE];
+    uint8_t original[2];
+    uint32_t stored_size;
+
+    if (size > W25Q128_LOG_MAX_RECORD_SIZE)
+        return W25Q128_ERROR;
+
+    original[0] = size & 0xFF;
+    original[1] = (size >> 8) & 0xFF;
+
+    // Stored size and CRC, stops as soon as it is no smaller than the data
+    sink.size = sizeof(original);
+    sink.max_size = size;
+    sink.crc = W25Q128_Crc32(0, original, sizeof(original));
+    status = W25Q128_Lz_Compress(data, size, log->lz_table, log_sink_count,
+                                                                    &sink);
+    if (status != W25Q128_SUCCESS && status != W25Q128_END)
+        return W25Q128_ERROR;
+    stored_size = sink.size;
+
+    // Sink is not called for empty data, the size alone is then larger
+    if (status == W25Q128_END || stored_size >= size)
+        return W25Q128_Log_Append(log, data, size);
+
+    if (log->head_offset + W25Q128_LOG_RECORD_HEADER_SIZE + stored_size >
+                                                        W25Q128_SECTOR_SIZE)
+    {
+        if (log_advance(log) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+    }
+
+    header[0] = stored_size & 0xFF;
+    header[1] = ((stored_size | W25Q128_LOG_RECORD_COMPRESSED) >> 8) & 0xFF;
+    set_u32(&header[2], W25Q128_Crc32(sink.crc, header, 2));
+
+    if (log_put(log, header, sizeof(header)) != W25Q128_SUCCESS ||
+        log_put(log, original, sizeof(original)) != W25Q128_SUCCESS ||
+        W25Q128_Lz_Compress(data, size, log->lz_table, log_sink_put, log)
+                                                        != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    log->stats.records++;
+    log->stats.bytes += size;
+    log->stats.compressed++;
+    log->stats.saved_bytes += size - stored_size;
+
+    return W25Q128_SUCCESS;
+}
+#endif
+
+W25Q128_StatusTypeDef W25Q128_Log_Sync(W25Q128_LogTypeDef *log)
+{
+    uint32_t addr;
+
+    if (log->page_fill == log->page_prog)
+        return W25Q128_SUCCESS;
+
+    addr = sector_addr(log, log->head) + log->head_offset - log->page_fill +
+                                                            log->page_prog;
+    if (W25Q128_WritePage(log->w25, addr / W25Q128_PAGE_SIZE,
+                            addr % W25Q128_PAGE_SIZE,
+                            log->page_fill - log->page_prog,
+                            &log->page[log->page_prog]) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    log->page_prog = log->page_fill;
+    log->stats.page_programs++;
+
+    return W25Q128_SUCCESS;
+}
+
+W25Q128_StatusTypeDef W25Q128_Log_EraseAhead(W25Q128_LogTypeDef *log)
+{
+    uint32_t start;
+    uint32_t addr;
+    uint32_t sectors;
+    uint32_t free;
+
+    if (log->erased > 0)
+        return W25Q128_SUCCESS;
+
+    // Up to the next erase-ahead boundary, never the head sector itself
+    start = (log->head + 1) % log->num_sectors;
+    addr = sector_addr(log, start);
+    sectors = (W25Q128_LOG_ERASE_AHEAD_SIZE -
+                (addr % W25Q128_LOG_ERASE_AHEAD_SIZE)) / W25Q128_SECTOR_SIZE;
+    if (sectors > log->num_sectors - start)
+        sectors = log->num_sectors - start;
+    if (sectors > log->num_sectors - 1)
+        sectors = log->num_sectors - 1;
+
+    // Ring is full, the oldest sectors go
+    free = log->num_sectors - log->count;
+    if (sectors > free)
+    {
+        uint32_t drop = sectors - free;
+
+        log->tail = (log->tail + drop) % log->num_sectors;
+        log->tail_seq += drop;
+        log->count -= drop;
+        log->stats.dropped_sectors += drop;
+    }
+
+    if (W25Q128_EraseRange(log->w25, addr, sectors * W25Q128_SECTOR_SIZE)
+                                                        != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    log->erased = sectors;
+    log->stats.erases++;
+
+    return W25Q128_SUCCESS;
+}
+
+void W25Q128_Log_IterInit(W25Q128_LogTypeDef *log,
+                                            W25Q128_LogIteratorTypeDef *it)
+{
+    it->sector = log->tail;
+    it->seq = log->tail_seq;
+    it->offset = W25Q128_LOG_SECTOR_HEADER_SIZE;
+}
+
+W25Q128_StatusTypeDef W25Q128_Log_IterNext(W25Q128_LogTypeDef *log,
+                                        W25Q128_LogIteratorTypeDef *it,
+                                        uint8_t *data, uint32_t max_size,
+                                        uint32_t *size)
+{
+    uint8_t header[W25Q128_LOG_RECORD_HEADER_SIZE];
+    W25Q128_StatusTypeDef status;
+    uint32_t addr;
+    uint32_t record_size;
+    uint32_t stored_size;
+
+    while (1)
+    {
+        // Sector of the iterator was erased by the ring
+        if ((int32_t)(it->seq - log->tail_seq) < 0)
+            W25Q128_Log_IterInit(log, it);
+
+        if ((int32_t)(it->seq - log->head_seq) > 0 ||
+            (it->seq == log->head_seq && it->offset >= log->head_offset))
+            return W25Q128_END;
+
+        addr = sector_addr(log, it->sector) + it->offset;
+        if (it->offset + W25Q128_LOG_RECORD_HEADER_SIZE <= W25Q128_SECTOR_SIZE)
+        {
+            if (log_read(log, addr, header, sizeof(header)) != W25Q128_SUCCESS)
+                return W25Q128_ERROR;
+            record_size = header[0] | (header[1] << 8);
+        } else {
+            record_size = W25Q128_LOG_RECORD_END;
+        }
+        stored_size = record_size & ~W25Q128_LOG_RECORD_COMPRESSED;
+
+        if (record_size != W25Q128_LOG_RECORD_END &&
+            (record_size & W25Q128_LOG_RECORD_COMPRESSED) &&
+            stored_size <= W25Q128_LOG_MAX_RECORD_SIZE &&
+            it->offset + W25Q128_LOG_RECORD_HEADER_SIZE + stored_size <=
+                                                        W25Q128_SECTOR_SIZE)
+        {
+            it->offset += W25Q128_LOG_RECORD_HEADER_SIZE + stored_size;
+            status = log_read_compressed(log, header,
+                                    addr + W25Q128_LOG_RECORD_HEADER_SIZE,
+                                    stored_size, data, max_size, size);
+            if (status != W25Q128_END)
+                return status;
+        }
+        else if (record_size <= W25Q128_LOG_MAX_RECORD_SIZE &&
+            it->offset + W25Q128_LOG_RECORD_HEADER_SIZE + record_size <=
+                                                        W25Q128_SECTOR_SIZE)
+        {
+            *size = record_size;
+            it->offset += W25Q128_LOG_RECORD_HEADER_SIZE + record_size;
+            if (record_size > max_size)
+                return W25Q128_ERROR;
+
+            if (log_read(log, addr + W25Q128_LOG_RECORD_HEADER_SIZE, data,
+                                            record_size) != W25Q128_SUCCESS)
+                return W25Q128_ERROR;
+
+            if (W25Q128_Crc32(W25Q128_Crc32(0, header, 2), data, record_size)
+                                                    == get_u32(&header[2]))
+                return W25Q128_SUCCESS;
+        }
+
+        // End of the records of this sector, or a torn record
+        it->sector = (it->sector + 1) % log->num_sectors;
+        it->seq++;
+        it->offset = W25Q128_LOG_SECTOR_HEADER_SIZE;
+    }
+}
+
+void W25Q128_Log_GetStats(W25Q128_LogTypeDef *log,
+                                            W25Q128_LogStatsTypeDef *stats)
+{
+    *stats = log->stats;
+}
+
+/*************************** Static functions *********************************/
+static uint32_t get_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void set_u32(uint8_t *p, uint32_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
+}
+
+static uint32_t sector_addr(W25Q128_LogTypeDef *log, uint32_t sector)
+{
+    return (log->first_sector + sector) * W25Q128_SECTOR_SIZE;
+}
+
+// Empty log, the first append enters sector 0
+static void log_init(W25Q128_LogTypeDef *log, W25Q128_TypeDef *w25,
+                                uint32_t first_sector, uint32_t num_sectors)
+{
+    memset(log, 0, sizeof(*log));
+    log->w25 = w25;
+    log->first_sector = first_sector;
+    log->num_sectors = num_sectors;
+    log->head = num_sectors - 1;
+    log->head_offset = W25Q128_SECTOR_SIZE;
+    log->tail_seq = 1;
+}
+
+// Reads flash, with the bytes that are still in the page buffer on top
+static W25Q128_StatusTypeDef log_read(W25Q128_LogTypeDef *log, uint32_t addr,
+                                        uint8_t *data, uint32_t size)
+{
+    uint32_t buf_start = sector_addr(log, log->head) + log->head_offset -
+                                        log->page_fill + log->page_prog;
+    uint32_t buf_end = buf_start + log->page_fill - log->page_prog;
+    uint32_t start = (addr > buf_start) ? addr : buf_start;
+    uint32_t end = (addr + size < buf_end) ? addr + size : buf_end;
+
+    if (W25Q128_FastRead(log->w25, addr / W25Q128_PAGE_SIZE,
+                    addr % W25Q128_PAGE_SIZE, size, data) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    if (start < end)
+        memcpy(&data[start - addr],
+                    &log->page[log->page_prog + (start - buf_start)],
+                    end - start);
+
+    return W25Q128_SUCCESS;
+}
+
+// W25Q128_SUCCESS for a valid header, W25Q128_END for erased or torn one
+static W25Q128_StatusTypeDef log_read_header(W25Q128_LogTypeDef *log,
+                                        uint32_t sector, uint32_t *seq)
+{
+    uint8_t header[W25Q128_LOG_SECTOR_HEADER_SIZE];
+
+    if (log_read(log, sector_addr(log, sector), header, sizeof(header))
+                                                        != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    if (get_u32(&header[0]) != W25Q128_LOG_MAGIC ||
+                    get_u32(&header[8]) != W25Q128_Crc32(0, header, 8))
+        return W25Q128_END;
+
+    *seq = get_u32(&header[4]);
+    return W25Q128_SUCCESS;
+}
+
+// Used while mounting, the page buffer holds no data yet
+static W25Q128_StatusTypeDef log_check_record(W25Q128_LogTypeDef *log,
+                                        uint32_t sector, uint32_t offset,
+                                        uint32_t *size)
+{
+    uint8_t header[W25Q128_LOG_RECORD_HEADER_SIZE];
+    uint32_t addr = sector_addr(log, sector) + offset;
+    uint32_t crc;
+
+    if (offset + W25Q128_LOG_RECORD_HEADER_SIZE > W25Q128_SECTOR_SIZE)
+        return W25Q128_END;
+
+    if (log_read(log, addr, header, sizeof(header)) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    // Stored size, compressed data is checked without decompressing it
+    *size = (header[0] | (header[1] << 8)) & ~W25Q128_LOG_RECORD_COMPRESSED;
+    if (*size > W25Q128_LOG_MAX_RECORD_SIZE || offset +
+            W25Q128_LOG_RECORD_HEADER_SIZE + *size > W25Q128_SECTOR_SIZE)
+        return W25Q128_END;
+
+    crc = (header[1] & (W25Q128_LOG_RECORD_COMPRESSED >> 8)) ?
+                                        0 : W25Q128_Crc32(0, header, 2);
+    addr += W25Q128_LOG_RECORD_HEADER_SIZE;
+    for (uint32_t done = 0; done < *size; )
+    {
+        uint32_t len = *size - done;
+
+        if (len > sizeof(log->page))
+            len = sizeof(log->page);
+        if (log_read(log, addr + done, log->page, len) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+        crc = W25Q128_Crc32(crc, log->page, len);
+        done += len;
+    }
+    if (header[1] & (W25Q128_LOG_RECORD_COMPRESSED >> 8))
+        crc = W25Q128_Crc32(crc, header, 2);
+
+    return (crc == get_u32(&header[2])) ? W25Q128_SUCCESS : W25Q128_END;
+}
+
+/*
+ * Finds the write position after the last valid record of the head sector.
+ * A sector whose remainder is not erased (torn program) is closed, writing
+ * continues in the next sector.
+ */
+static W25Q128_StatusTypeDef log_find_end(W25Q128_LogTypeDef *log)
+{
+    W25Q128_StatusTypeDef status;
+    uint32_t offset = W25Q128_LOG_SECTOR_HEADER_SIZE;
+    uint32_t size;
+
+    while ((status = log_check_record(log, log->head, offset, &size))
+                                                        == W25Q128_SUCCESS)
+        offset += W25Q128_LOG_RECORD_HEADER_SIZE + size;
+    if (status == W25Q128_ERROR)
+        return W25Q128_ERROR;
+
+    log->head_offset = offset;
+    while (offset < W25Q128_SECTOR_SIZE)
+    {
+        uint32_t len = W25Q128_PAGE_SIZE - (offset % W25Q128_PAGE_SIZE);
+
+        if (len > W25Q128_SECTOR_SIZE - offset)
+            len = W25Q128_SECTOR_SIZE - offset;
+        if (log_read(log, sector_addr(log, log->head) + offset, log->page,
+                                                    len) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+
+        for (uint32_t i = 0; i < len; i++)
+        {
+            if (log->page[i] != 0xFF)
+            {
+                log->head_offset = W25Q128_SECTOR_SIZE;
+                break;
+            }
+        }
+        offset += len;
+    }
+
+    // Head page is partly programmed, the rest is filled from here
+    log->page_fill = log->head_offset % W25Q128_PAGE_SIZE;
+    log->page_prog = log->page_fill;
+
+    return W25Q128_SUCCESS;
+}
+
+static W25Q128_StatusTypeDef log_put(W25Q128_LogTypeDef *log,
+                                        const uint8_t *data, uint32_t size)
+{
+    while (size > 0)
+    {
+        uint32_t len = W25Q128_PAGE_SIZE - log->page_fill;
+
+        if (len > size)
+            len = size;
+        memcpy(&log->page[log->page_fill], data, len);
+        log->page_fill += len;
+        log->head_offset += len;
+        data += len;
+        size -= len;
+
+        if (log->page_fill == W25Q128_PAGE_SIZE)
+        {
+            if (W25Q128_Log_Sync(log) != W25Q128_SUCCESS)
+                return W25Q128_ERROR;
+            log->page_fill = 0;
+            log->page_prog = 0;
+        }
+    }
+
+    return W25Q128_SUCCESS;
+}
+
+// Closes the head sector and starts the next one with its header
+static W25Q128_StatusTypeDef log_advance(W25Q128_LogTypeDef *log)
+{
+    uint8_t header[W25Q128_LOG_SECTOR_HEADER_SIZE];
+
+    if (W25Q128_Log_Sync(log) != W25Q128_SUCCESS ||
+        W25Q128_Log_EraseAhead(log) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    log->head = (log->head + 1) % log->num_sectors;
+    log->head_seq++;
+    log->head_offset = 0;
+    log->page_fill = 0;
+    log->page_prog = 0;
+    log->erased--;
+    if (log->count == 0)
+    {
+        log->tail = log->head;
+        log->tail_seq = log->head_seq;
+    }
+    log->count++;
+
+    set_u32(&header[0], W25Q128_LOG_MAGIC);
+    set_u32(&header[4], log->head_seq);
+    set_u32(&header[8], W25Q128_Crc32(0, header, 8));
+
+    return log_put(log, header, sizeof(header));
+}
+
+static W25Q128_StatusTypeDef log_source(void *ctx, uint8_t *data,
+                                                            uint32_t size)
+{
+    W25Q128_LogSourceTypeDef *src = ctx;
+
+    while (size > 0)
+    {
+        uint32_t len;
+
+        if (src->pos == src->len)
+        {
+            len = src->end - src->addr;
+            if (len == 0)
+                return W25Q128_ERROR;
+            if (len > sizeof(src->buf))
+                len = sizeof(src->buf);
+            if (log_read(src->log, src->addr, src->buf, len)
+                                                        != W25Q128_SUCCESS)
+            {
+                src->read_failed = 1;
+                return W25Q128_ERROR;
+            }
+            src->crc = W25Q128_Crc32(src->crc, src->buf, len);
+            src->addr += len;
+            src->pos = 0;
+            src->len = len;
+        }
+
+        len = src->len - src->pos;
+        if (len > size)
+            len = size;
+        memcpy(data, &src->buf[src->pos], len);
+        src->pos += len;
+        data += len;
+        size -= len;
+    }
+
+    return W25Q128_SUCCESS;
+}
+
+/*
+ * Decompresses a record into data. W25Q128_END for a torn or malformed
+ * record, W25Q128_ERROR for a read error or an original size over max_size.
+ */
+static W25Q128_StatusTypeDef log_read_compressed(W25Q128_LogTypeDef *log,
+                                        const uint8_t *header, uint32_t addr,
+                                        uint32_t stored_size, uint8_t *data,
+                                        uint32_t max_size, uint32_t *size)
+{
+    W25Q128_LogSourceTypeDef src = { .log = log, .addr = addr,
+                                            .end = addr + stored_size };
+    W25Q128_StatusTypeDef status;
+    uint8_t original[2];
+
+    if (log_source(&src, original, sizeof(original)) != W25Q128_SUCCESS)
+        return src.read_failed ? W25Q128_ERROR : W25Q128_END;
+
+    *size = original[0] | (original[1] << 8);
+    if (*size > max_size)
+        return W25Q128_ERROR;
+
+    status = W25Q128_Lz_Decompress(log_source, &src, data, *size);
+    if (src.read_failed)
+        return W25Q128_ERROR;
+
+    // Whole stored data must be used, the CRC covers all of it
+    if (status != W25Q128_SUCCESS || src.pos != src.len || src.addr != src.end)
+        return W25Q128_END;
+
+    return (W25Q128_Crc32(src.crc, header, 2) == get_u32(&header[2])) ?
+                                                W25Q128_SUCCESS : W25Q128_END;
+}
+
+#if W25Q128_LOG_COMPRESSION
+static W25Q128_StatusTypeDef log_sink_count(void *ctx, const uint8_t *data,
+                                                            uint32_t size)
+{
+    W25Q128_LogSinkTypeDef *sink = ctx;
+
+    sink->size += size;
+    if (sink->size >= sink->max_size)
+        return W25Q128_END;
+    sink->crc = W25Q128_Crc32(sink->crc, data, size);
+
+    return W25Q128_SUCCESS;
+}
+
+static W25Q128_StatusTypeDef log_sink_put(void *ctx, const uint8_t *data,
+                                                            uint32_t size)
+{
+    return log_put(ctx, data, size);
+}
+#endif
\ No newline at end of file
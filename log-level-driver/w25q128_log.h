@@ -0,0 +1,199 @@
+/**
+ * @file w25q128_log.h
+ * @brief w25q128 append-only circular log store
+ * @author Filip Stojanovic
+ *
+ * Record store for high-rate logging, built directly on the page program and
+ * erase commands of the low-level driver (no read-modify-write, no file
+ * system metadata). A region of whole sectors is used as a ring:
+ *
+ * - every sector starts with a header (magic, sequence number, CRC), the
+ *   sequence number grows by one for every sector the head enters
+ * - records follow it back to back and may cross page boundaries, each has
+ *   a 6 byte header (size, CRC-32 of size and data). Records do not cross
+ *   sectors, 0xFFFF size (erased flash) ends the records of a sector
+ * - the top bit of the size marks a compressed record, whose data is the
+ *   original size and its W25Q128_Lz_Compress output, and whose CRC covers
+ *   that data first and the size after it. Readers get the original data
+ * - records are packed into a page buffer and programmed a full page at a
+ *   time, W25Q128_Log_Sync programs the partial page
+ * - sectors ahead of the head are erased up to the next
+ *   W25Q128_LOG_ERASE_AHEAD_SIZE boundary with the largest erase commands,
+ *   the oldest sectors are dropped when the ring is full
+ *
+ * Mount reads a few sector headers (binary search over the sequence numbers)
+ * and the records of the head sector only. Records that were not synced or
+ * whose program was interrupted are lost on power loss, a torn head sector
+ * is closed and writing continues in the next one.
+ */
+
+#ifndef W25Q128_LOG_H
+#define W25Q128_LOG_H
+
+#include "w25q128_conf_log.h"
+#include "w25q128_ll.h"
+#include "w25q128_lz.h"
+
+#include <stdint.h>
+
+#define W25Q128_LOG_SECTOR_HEADER_SIZE 12
+#define W25Q128_LOG_RECORD_HEADER_SIZE 6
+
+// Largest record, records do not cross sectors
+#define W25Q128_LOG_MAX_RECORD_SIZE (W25Q128_SECTOR_SIZE - \
+            W25Q128_LOG_SECTOR_HEADER_SIZE - W25Q128_LOG_RECORD_HEADER_SIZE)
+
+typedef struct {
+    uint32_t records;       // Appended records
+    uint32_t bytes;         // Appended payload bytes
+    uint32_t page_programs;
+    uint32_t erases;        // Erase-ahead calls
+    uint32_t dropped_sectors; // Oldest sectors erased to make room
+    uint32_t compressed;    // Records stored compressed
+    uint32_t saved_bytes;   // Payload bytes saved by compression
+} W25Q128_LogStatsTypeDef;
+
+typedef struct {
+    W25Q128_TypeDef *w25;
+    uint32_t first_sector;
+    uint32_t num_sectors;
+
+    // Ring state, sector indexes are relative to first_sector
+    uint32_t head;
+    uint32_t head_seq;
+    uint32_t head_offset;   // Write position in the head sector
+    uint32_t tail;
+    uint32_t tail_seq;
+    uint32_t count;         // Sectors from tail to head
+    uint32_t erased;        // Sectors after the head known to be erased
+
+    // Page under the head, bytes from page_prog to page_fill are not
+    // programmed yet
+    uint8_t page[W25Q128_PAGE_SIZE];
+    uint16_t page_fill;
+    uint16_t page_prog;
+
+#if W25Q128_LOG_COMPRESSION
+    uint16_t lz_table[W25Q128_LZ_TABLE_SIZE];
+#endif
+
+    W25Q128_LogStatsTypeDef stats;
+} W25Q128_LogTypeDef;
+
+/**
+ * Read position, W25Q128_Log_IterInit starts it at the oldest record.
+ */
+typedef struct {
+    uint32_t sector;
+    uint32_t seq;
+    uint32_t offset;
+} W25Q128_LogIteratorTypeDef;
+
+
+/**
+ * @brief Function that mounts a log, an erased region is an empty log
+ * @param log Pointer to the log struct
+ * @param w25 Pointer to the flash configuration struct
+ * @param first_sector First sector of the region
+ * @param num_sectors Number of sectors in the region, at least 2
+ * @retval ::W25Q128_StatusTypeDef
+ */
+W25Q128_StatusTypeDef W25Q128_Log_Mount(W25Q128_LogTypeDef *log,
+                                        W25Q128_TypeDef *w25,
+                                        uint32_t first_sector,
+                                        uint32_t num_sectors);
+
+/**
+ * @brief Function that erases the whole region and starts an empty log
+ * @param log Pointer to the log struct
+ * @param w25 Pointer to the flash configuration struct
+ * @param first_sector First sector of the region
+ * @param num_sectors Number of sectors in the region, at least 2
+ * @retval ::W25Q128_StatusTypeDef
+ */
+W25Q128_StatusTypeDef W25Q128_Log_Format(W25Q128_LogTypeDef *log,
+                                        W25Q128_TypeDef *w25,
+                                        uint32_t first_sector,
+                                        uint32_t num_sectors);
+
+/**
+ * @brief Function that appends a record
+ * @param log Pointer to the log struct
+ * @param data Pointer to the record data
+ * @param size Record size, up to W25Q128_LOG_MAX_RECORD_SIZE
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Record is durable after the page it ends in is programmed, or after
+ *       W25Q128_Log_Sync. Entering a sector that is not erased yet erases
+ *       ahead, call W25Q128_Log_EraseAhead from idle time to avoid it.
+ */
+W25Q128_StatusTypeDef W25Q128_Log_Append(W25Q128_LogTypeDef *log,
+                                        const uint8_t *data, uint32_t size);
+
+#if W25Q128_LOG_COMPRESSION
+/**
+ * @brief Function that appends a record in compressed form
+ * @param log Pointer to the log struct
+ * @param data Pointer to the record data
+ * @param size Record size, up to W25Q128_LOG_MAX_RECORD_SIZE
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Data is compressed twice, once to get the stored size and CRC and
+ *       once into the page buffer, so no output buffer is needed. Record that
+ *       does not get smaller is appended as with W25Q128_Log_Append.
+ */
+W25Q128_StatusTypeDef W25Q128_Log_AppendCompressed(W25Q128_LogTypeDef *log,
+                                        const uint8_t *data, uint32_t size);
+#endif
+
+/**
+ * @brief Function that programs the buffered part of the current page
+ * @param log Pointer to the log struct
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Rest of the page is still used by later records, the device allows
+ *       programming erased bytes of a page again.
+ */
+W25Q128_StatusTypeDef W25Q128_Log_Sync(W25Q128_LogTypeDef *log);
+
+/**
+ * @brief Function that erases sectors ahead of the head if none are left
+ * @param log Pointer to the log struct
+ * @retval ::W25Q128_StatusTypeDef
+ */
+W25Q128_StatusTypeDef W25Q128_Log_EraseAhead(W25Q128_LogTypeDef *log);
+
+/**
+ * @brief Function that positions an iterator at the oldest record
+ * @param log Pointer to the log struct
+ * @param it Pointer to the iterator
+ * @return None
+ */
+void W25Q128_Log_IterInit(W25Q128_LogTypeDef *log,
+                                            W25Q128_LogIteratorTypeDef *it);
+
+/**
+ * @brief Function that reads the next record
+ * @param log Pointer to the log struct
+ * @param it Pointer to the iterator
+ * @param data Pointer to the buffer for the record data
+ * @param max_size Buffer size
+ * @param size Pointer to which the record size is written, the original size
+ *        for a compressed record
+ * @retval ::W25Q128_StatusTypeDef, W25Q128_END after the newest record
+ * @note Buffered (not yet programmed) records are returned too. If the ring
+ *       overwrote the sector of the iterator, it continues at the oldest
+ *       record. Record larger than max_size is skipped with W25Q128_ERROR.
+ */
+W25Q128_StatusTypeDef W25Q128_Log_IterNext(W25Q128_LogTypeDef *log,
+                                        W25Q128_LogIteratorTypeDef *it,
+                                        uint8_t *data, uint32_t max_size,
+                                        uint32_t *size);
+
+/**
+ * @brief Function that copies log counters
+ * @param log Pointer to the log struct
+ * @param stats Pointer to the struct in which counters are copied
+ * @return None
+ */
+void W25Q128_Log_GetStats(W25Q128_LogTypeDef *log,
+                                            W25Q128_LogStatsTypeDef *stats);
+
+#endif
\ No newline at end of file
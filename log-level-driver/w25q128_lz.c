@@ -0,0 +1,206 @@
+/**
+ * @file w25q128_lz.c
+ * @brief w25q128 small-RAM LZ compressor for log records
+ * @author Filip Stojanovic
+ */
+
+#include "w25q128_lz.h"
+
+#include <string.h>
+
+#define W25Q128_LZ_MIN_MATCH  4
+#define W25Q128_LZ_MAX_OFFSET 0xFFFF
+#define W25Q128_LZ_RUN_MASK   15
+
+/**
+ * Compressed output collected in small pieces before it goes to the sink.
+ */
+typedef struct {
+    W25Q128_LzSink sink;
+    void *ctx;
+    uint8_t buf[16];
+    uint8_t len;
+    W25Q128_StatusTypeDef status;
+} W25Q128_LzWriterTypeDef;
+
+/*************************** Static functions *********************************/
+static uint32_t lz_hash(const uint8_t *p);
+static void lz_flush(W25Q128_LzWriterTypeDef *w);
+static void lz_put(W25Q128_LzWriterTypeDef *w, uint8_t byte);
+static void lz_put_length(W25Q128_LzWriterTypeDef *w, uint32_t length);
+static void lz_sequence(W25Q128_LzWriterTypeDef *w, const uint8_t *literals,
+                        uint32_t literal_len, uint32_t offset,
+                        uint32_t match_len);
+static W25Q128_StatusTypeDef lz_get_length(W25Q128_LzSource source,
+                                        void *ctx, uint32_t *length);
+
+W25Q128_StatusTypeDef W25Q128_Lz_Compress(const uint8_t *src, uint32_t size,
+                                        uint16_t *table, W25Q128_LzSink sink,
+                                        void *ctx)
+{
+    W25Q128_LzWriterTypeDef w = { .sink = sink, .ctx = ctx, .len = 0,
+                                            .status = W25Q128_SUCCESS };
+    uint32_t anchor = 0;
+    uint32_t i = 0;
+
+    if (size > W25Q128_LZ_MAX_OFFSET)
+        return W25Q128_ERROR;
+
+    // Positions are stored plus one, 0 is an empty entry
+    memset(table, 0, W25Q128_LZ_TABLE_SIZE * sizeof(table[0]));
+
+    while (i + W25Q128_LZ_MIN_MATCH <= size && w.status == W25Q128_SUCCESS)
+    {
+        uint32_t h = lz_hash(&src[i]);
+        uint32_t ref = table[h];
+        uint32_t len = W25Q128_LZ_MIN_MATCH;
+
+        table[h] = i + 1;
+        if (ref == 0 || memcmp(&src[ref - 1], &src[i], W25Q128_LZ_MIN_MATCH))
+        {
+            i++;
+            continue;
+        }
+
+        ref--;
+        while (i + len < size && src[ref + len] == src[i + len])
+            len++;
+
+        lz_sequence(&w, &src[anchor], i - anchor, i - ref, len);
+        i += len;
+        anchor = i;
+    }
+
+    if (anchor < size)
+        lz_sequence(&w, &src[anchor], size - anchor, 0, 0);
+    lz_flush(&w);
+
+    return w.status;
+}
+
+W25Q128_StatusTypeDef W25Q128_Lz_Decompress(W25Q128_LzSource source,
+                                        void *ctx, uint8_t *dst,
+                                        uint32_t size)
+{
+    uint32_t out = 0;
+
+    while (out < size)
+    {
+        uint8_t token;
+        uint8_t offset_bytes[2];
+        uint32_t literal_len;
+        uint32_t match_len;
+        uint32_t offset;
+
+        if (source(ctx, &token, 1) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+
+        literal_len = token >> 4;
+        if (literal_len == W25Q128_LZ_RUN_MASK &&
+                lz_get_length(source, ctx, &literal_len) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+        if (literal_len > size - out)
+            return W25Q128_ERROR;
+        if (literal_len > 0 &&
+            source(ctx, &dst[out], literal_len) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+        out += literal_len;
+
+        // Last sequence has no match
+        if (out == size)
+            break;
+
+        if (source(ctx, offset_bytes, 2) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+        offset = offset_bytes[0] | (offset_bytes[1] << 8);
+
+        match_len = token & W25Q128_LZ_RUN_MASK;
+        if (match_len == W25Q128_LZ_RUN_MASK &&
+                lz_get_length(source, ctx, &match_len) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+        match_len += W25Q128_LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > out || match_len > size - out)
+            return W25Q128_ERROR;
+
+        // Byte by byte, a match may overlap its own output
+        for (uint32_t k = 0; k < match_len; k++, out++)
+            dst[out] = dst[out - offset];
+    }
+
+    return W25Q128_SUCCESS;
+}
+
+/*************************** Static functions *********************************/
+static uint32_t lz_hash(const uint8_t *p)
+{
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+
+    return (v * 2654435761u) >> (32 - W25Q128_LZ_HASH_BITS);
+}
+
+static void lz_flush(W25Q128_LzWriterTypeDef *w)
+{
+    if (w->len > 0 && w->status == W25Q128_SUCCESS)
+        w->status = w->sink(w->ctx, w->buf, w->len);
+    w->len = 0;
+}
+
+static void lz_put(W25Q128_LzWriterTypeDef *w, uint8_t byte)
+{
+    if (w->len == sizeof(w->buf))
+        lz_flush(w);
+    w->buf[w->len++] = byte;
+}
+
+// Continuation of a length of at least 15, the token holds the 15
+static void lz_put_length(W25Q128_LzWriterTypeDef *w, uint32_t length)
+{
+    for (length -= W25Q128_LZ_RUN_MASK; length >= 255; length -= 255)
+        lz_put(w, 255);
+    lz_put(w, length);
+}
+
+static void lz_sequence(W25Q128_LzWriterTypeDef *w, const uint8_t *literals,
+                        uint32_t literal_len, uint32_t offset,
+                        uint32_t match_len)
+{
+    uint32_t match_code = (match_len > 0) ?
+                                    match_len - W25Q128_LZ_MIN_MATCH : 0;
+    uint8_t token;
+
+    token = ((literal_len < W25Q128_LZ_RUN_MASK) ?
+                                literal_len : W25Q128_LZ_RUN_MASK) << 4;
+    token |= (match_code < W25Q128_LZ_RUN_MASK) ?
+                                match_code : W25Q128_LZ_RUN_MASK;
+    lz_put(w, token);
+    if (literal_len >= W25Q128_LZ_RUN_MASK)
+        lz_put_length(w, literal_len);
+
+    // Literals go to the sink straight from the input
+    lz_flush(w);
+    if (literal_len > 0 && w->status == W25Q128_SUCCESS)
+        w->status = w->sink(w->ctx, literals, literal_len);
+
+    if (match_len == 0)
+        return;
+
+    lz_put(w, offset & 0xFF);
+    lz_put(w, (offset >> 8) & 0xFF);
+    if (match_code >= W25Q128_LZ_RUN_MASK)
+        lz_put_length(w, match_code);
+}
+
+static W25Q128_StatusTypeDef lz_get_length(W25Q128_LzSource source,
+                                        void *ctx, uint32_t *length)
+{
+    uint8_t byte;
+
+    do {
+        if (source(ctx, &byte, 1) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+        *length += byte;
+    } while (byte == 255);
+
+    return W25Q128_SUCCESS;
+}
@@ -0,0 +1,71 @@
+/**
+ * @file w25q128_lz.h
+ * @brief w25q128 small-RAM LZ compressor for log records
+ * @author Filip Stojanovic
+ *
+ * Byte oriented LZ77 in the LZ4 block layout: a token (literal run length in
+ * the high nibble, match length - 4 in the low one, 15 is continued in
+ * following bytes of 255), the literals, a 2 byte match offset and the match
+ * length continuation. The last sequence has literals only. Offsets are up
+ * to 65535, so a whole log record is the window.
+ *
+ * The compressor keeps no state but a hash table of 2^W25Q128_LZ_HASH_BITS
+ * positions given by the caller, and emits its output in pieces through a
+ * sink, so it needs no output buffer. The decompressor pulls input through a
+ * source and only writes to the output buffer.
+ */
+
+#ifndef W25Q128_LZ_H
+#define W25Q128_LZ_H
+
+#include "w25q128_conf_log.h"
+#include "w25q128_ll.h"
+
+#include <stdint.h>
+
+#define W25Q128_LZ_TABLE_SIZE (1u << W25Q128_LZ_HASH_BITS)
+
+/**
+ * @brief Consumer of compressed data
+ * @retval ::W25Q128_StatusTypeDef, any other than W25Q128_SUCCESS stops
+ *         compression and is returned by W25Q128_Lz_Compress
+ */
+typedef W25Q128_StatusTypeDef (*W25Q128_LzSink)(void *ctx,
+                                        const uint8_t *data, uint32_t size);
+
+/**
+ * @brief Producer of compressed data, reads the next size bytes
+ * @retval ::W25Q128_StatusTypeDef, decompression stops on W25Q128_ERROR
+ */
+typedef W25Q128_StatusTypeDef (*W25Q128_LzSource)(void *ctx, uint8_t *data,
+                                                            uint32_t size);
+
+
+/**
+ * @brief Function that compresses a buffer
+ * @param src Pointer to the data
+ * @param size Data size, up to 65535
+ * @param table Hash table of W25Q128_LZ_TABLE_SIZE entries
+ * @param sink Consumer of the compressed data
+ * @param ctx User pointer passed to the sink
+ * @retval ::W25Q128_StatusTypeDef, or the status that stopped the sink
+ * @note Output depends on the input only, compressing the same data twice
+ *       gives the same bytes.
+ */
+W25Q128_StatusTypeDef W25Q128_Lz_Compress(const uint8_t *src, uint32_t size,
+                                        uint16_t *table, W25Q128_LzSink sink,
+                                        void *ctx);
+
+/**
+ * @brief Function that decompresses data of a known size
+ * @param source Producer of the compressed data
+ * @param ctx User pointer passed to the source
+ * @param dst Pointer to the output buffer
+ * @param size Decompressed size
+ * @retval ::W25Q128_StatusTypeDef, W25Q128_ERROR for malformed data
+ */
+W25Q128_StatusTypeDef W25Q128_Lz_Decompress(W25Q128_LzSource source,
+                                        void *ctx, uint8_t *dst,
+                                        uint32_t size);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,181 @@
+/**
+ * @file w25q128_ring.c
+ * @brief w25q128 lock-free ingestion ring for the log store
+ * @author Filip Stojanovic
+ */
+
+#include "w25q128_ring.h"
+
+#include <string.h>
+
+// Producers in interrupt handlers must never fall back to a lock
+#if ATOMIC_INT_LOCK_FREE != 2 || ATOMIC_LONG_LOCK_FREE != 2
+#error "w25q128_ring needs lock-free 32-bit atomics (LDREX/STREX)"
+#endif
+
+#define W25Q128_RING_MASK (W25Q128_RING_SIZE / 4 - 1)
+
+/*************************** Static functions *********************************/
+static atomic_uint_least32_t *ring_word(W25Q128_RingTypeDef *ring,
+                                                            uint32_t pos);
+static void ring_update_high_water(W25Q128_RingTypeDef *ring, uint32_t used);
+
+void W25Q128_Ring_Init(W25Q128_RingTypeDef *ring)
+{
+    for (uint32_t i = 0; i < W25Q128_RING_SIZE / 4; i++)
+        atomic_init(&ring->data[i], 0);
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->pushed, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->high_water, 0);
+    ring->drained = 0;
+}
+
+W25Q128_StatusTypeDef W25Q128_Ring_Push(W25Q128_RingTypeDef *ring,
+                                        const uint8_t *data, uint32_t size)
+{
+    uint32_t len = 4 + ((size + 3) & ~3u);
+    uint32_t head;
+    uint32_t tail;
+    uint32_t used;
+
+    if (size == 0 || size > W25Q128_RING_MAX_RECORD_SIZE)
+        return W25Q128_ERROR;
+
+    // Reserve len bytes at the head
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (1)
+    {
+        // Acquire pairs with the release of the tail, cleared words are seen
+        tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        used = head - tail;
+
+        // Head was read before the consumer passed it, read it again
+        if (used > W25Q128_RING_SIZE)
+        {
+            head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            continue;
+        }
+
+        if (used + len > W25Q128_RING_SIZE)
+        {
+            atomic_fetch_add_explicit(&ring->dropped, 1,
+                                                    memory_order_relaxed);
+            return W25Q128_BUSY;
+        }
+
+        if (atomic_compare_exchange_weak_explicit(&ring->head, &head,
+                                        head + len, memory_order_relaxed,
+                                        memory_order_relaxed))
+            break;
+    }
+    ring_update_high_water(ring, used + len);
+
+    for (uint32_t i = 0; i < size; i += 4)
+    {
+        uint32_t word = 0;
+
+        memcpy(&word, &data[i], (size - i < 4) ? size - i : 4);
+        atomic_store_explicit(ring_word(ring, head + 4 + i), word,
+                                                    memory_order_relaxed);
+    }
+
+    // Nonzero header publishes the record, release orders the data before it
+    atomic_store_explicit(ring_word(ring, head), size, memory_order_release);
+    atomic_fetch_add_explicit(&ring->pushed, 1, memory_order_relaxed);
+
+    return W25Q128_SUCCESS;
+}
+
+W25Q128_StatusTypeDef W25Q128_Ring_Pop(W25Q128_RingTypeDef *ring,
+                                        uint8_t *data, uint32_t max_size,
+                                        uint32_t *size)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t record_size;
+
+    record_size = atomic_load_explicit(ring_word(ring, tail),
+                                                    memory_order_acquire);
+    if (record_size == 0)
+        return W25Q128_END;
+    if (record_size > max_size)
+        return W25Q128_ERROR;
+
+    // Every word goes back to 0, any of them may hold a header in the next lap
+    for (uint32_t i = 0; i < record_size; i += 4)
+    {
+        atomic_uint_least32_t *p = ring_word(ring, tail + 4 + i);
+        uint32_t word = atomic_load_explicit(p, memory_order_relaxed);
+
+        memcpy(&data[i], &word, (record_size - i < 4) ? record_size - i : 4);
+        atomic_store_explicit(p, 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(ring_word(ring, tail), 0, memory_order_relaxed);
+
+    // Release pairs with the acquire of producers, they see cleared words
+    atomic_store_explicit(&ring->tail, tail + 4 + ((record_size + 3) & ~3u),
+                                                    memory_order_release);
+    *size = record_size;
+
+    return W25Q128_SUCCESS;
+}
+
+W25Q128_StatusTypeDef W25Q128_Ring_Drain(W25Q128_RingTypeDef *ring,
+                                        W25Q128_LogTypeDef *log,
+                                        uint32_t max_records)
+{
+    uint8_t record[W25Q128_RING_MAX_RECORD_SIZE];
+    W25Q128_StatusTypeDef status;
+    uint32_t size;
+
+    for (uint32_t n = 0; max_records == 0 || n < max_records; n++)
+    {
+        status = W25Q128_Ring_Pop(ring, record, sizeof(record), &size);
+        if (status != W25Q128_SUCCESS)
+            return status;
+
+        if (W25Q128_Log_Append(log, record, size) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+        ring->drained++;
+    }
+
+    return W25Q128_SUCCESS;
+}
+
+uint32_t W25Q128_Ring_GetUsed(W25Q128_RingTypeDef *ring)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    return atomic_load_explicit(&ring->head, memory_order_relaxed) - tail;
+}
+
+void W25Q128_Ring_GetStats(W25Q128_RingTypeDef *ring,
+                                            W25Q128_RingStatsTypeDef *stats)
+{
+    stats->pushed = atomic_load_explicit(&ring->pushed, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&ring->dropped,
+                                                    memory_order_relaxed);
+    stats->high_water = atomic_load_explicit(&ring->high_water,
+                                                    memory_order_relaxed);
+    stats->drained = ring->drained;
+}
+
+/*************************** Static functions *********************************/
+static atomic_uint_least32_t *ring_word(W25Q128_RingTypeDef *ring,
+                                                            uint32_t pos)
+{
+    return &ring->data[(pos / 4) & W25Q128_RING_MASK];
+}
+
+static void ring_update_high_water(W25Q128_RingTypeDef *ring, uint32_t used)
+{
+    uint32_t high = atomic_load_explicit(&ring->high_water,
+                                                    memory_order_relaxed);
+
+    while (used > high && !atomic_compare_exchange_weak_explicit(
+                                        &ring->high_water, &high, used,
+                                        memory_order_relaxed,
+                                        memory_order_relaxed))
+        ;
+}
\ No newline at end of file
@@ -0,0 +1,127 @@
+/**
+ * @file w25q128_ring.h
+ * @brief w25q128 lock-free ingestion ring for the log store
+ * @author Filip Stojanovic
+ *
+ * Interrupt handlers and tasks push records into a RAM ring without touching
+ * the SPI bus or waiting for the flash, a single writer task drains the ring
+ * into a W25Q128_LogTypeDef, which packs records into full page programs and
+ * erases ahead of its write position.
+ *
+ * The ring uses C11 atomics only, no critical sections and no locks:
+ *
+ * - producers reserve space by advancing the head index with compare and
+ *   swap, copy the record and publish it by storing its header word last
+ * - the consumer takes published records in order from the tail, clears them
+ *   and advances the tail, which hands the space back to producers
+ *
+ * Any number of producers, including interrupt handlers of any priority, may
+ * push at the same time. A record whose producer was preempted before
+ * publishing holds back the records after it until the producer resumes.
+ * When the ring is full, the record is dropped and counted.
+ */
+
+#ifndef W25Q128_RING_H
+#define W25Q128_RING_H
+
+#include "w25q128_conf_log.h"
+#include "w25q128_ll.h"
+#include "w25q128_log.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#if (W25Q128_RING_SIZE & (W25Q128_RING_SIZE - 1)) != 0 || \
+                                                    W25Q128_RING_SIZE < 64
+#error "W25Q128_RING_SIZE must be a power of two, at least 64"
+#endif
+
+#if W25Q128_RING_MAX_RECORD_SIZE > W25Q128_RING_SIZE / 2 || \
+    W25Q128_RING_MAX_RECORD_SIZE > W25Q128_LOG_MAX_RECORD_SIZE
+#error "W25Q128_RING_MAX_RECORD_SIZE is too large"
+#endif
+
+typedef struct {
+    uint32_t pushed;        // Published records
+    uint32_t dropped;       // Records dropped on a full ring
+    uint32_t high_water;    // Most bytes in use at once
+    uint32_t drained;       // Records appended to the log
+} W25Q128_RingStatsTypeDef;
+
+typedef struct {
+    // Record headers and data in words, 0 is a free or unpublished header
+    atomic_uint_least32_t data[W25Q128_RING_SIZE / 4];
+    atomic_uint_least32_t head;     // Bytes reserved by producers
+    atomic_uint_least32_t tail;     // Bytes released by the consumer
+
+    atomic_uint_least32_t pushed;
+    atomic_uint_least32_t dropped;
+    atomic_uint_least32_t high_water;
+    uint32_t drained;
+} W25Q128_RingTypeDef;
+
+
+/**
+ * @brief Function that initializes an empty ring
+ * @param ring Pointer to the ring struct
+ * @return None
+ */
+void W25Q128_Ring_Init(W25Q128_RingTypeDef *ring);
+
+/**
+ * @brief Function that pushes a record, callable from interrupt handlers
+ * @param ring Pointer to the ring struct
+ * @param data Pointer to the record data
+ * @param size Record size, 1 to W25Q128_RING_MAX_RECORD_SIZE
+ * @retval ::W25Q128_StatusTypeDef, W25Q128_BUSY if the ring is full and the
+ *         record was dropped
+ * @note Never blocks, a retry loop only runs while other producers reserve
+ *       space at the same time.
+ */
+W25Q128_StatusTypeDef W25Q128_Ring_Push(W25Q128_RingTypeDef *ring,
+                                        const uint8_t *data, uint32_t size);
+
+/**
+ * @brief Function that takes the oldest published record, single consumer
+ * @param ring Pointer to the ring struct
+ * @param data Pointer to the buffer for the record data
+ * @param max_size Buffer size, at least W25Q128_RING_MAX_RECORD_SIZE
+ * @param size Pointer to which the record size is written
+ * @retval ::W25Q128_StatusTypeDef, W25Q128_END if no record is published
+ */
+W25Q128_StatusTypeDef W25Q128_Ring_Pop(W25Q128_RingTypeDef *ring,
+                                        uint8_t *data, uint32_t max_size,
+                                        uint32_t *size);
+
+/**
+ * @brief Function that moves published records into a log, single consumer
+ * @param ring Pointer to the ring struct
+ * @param log Pointer to the log struct
+ * @param max_records Most records moved in one call, 0 for no limit
+ * @retval ::W25Q128_StatusTypeDef, W25Q128_END if the ring was left empty
+ * @note Records are programmed as their pages fill up, call
+ *       W25Q128_Log_Sync to make the rest durable. Call
+ *       W25Q128_Log_EraseAhead from idle time so draining does not wait for
+ *       an erase.
+ */
+W25Q128_StatusTypeDef W25Q128_Ring_Drain(W25Q128_RingTypeDef *ring,
+                                        W25Q128_LogTypeDef *log,
+                                        uint32_t max_records);
+
+/**
+ * @brief Function that returns the number of bytes in use
+ * @param ring Pointer to the ring struct
+ * @return Reserved and not yet released bytes, record headers included
+ */
+uint32_t W25Q128_Ring_GetUsed(W25Q128_RingTypeDef *ring);
+
+/**
+ * @brief Function that copies ring counters
+ * @param ring Pointer to the ring struct
+ * @param stats Pointer to the struct in which counters are copied
+ * @return None
+ */
+void W25Q128_Ring_GetStats(W25Q128_RingTypeDef *ring,
+                                            W25Q128_RingStatsTypeDef *stats);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,761 @@
+/**
+ * @file w25q128_async_ll.c
+ * @brief w25q128 low-level asynchronous (DMA) transfer queue
+ * @author Filip Stojanovic
+ */
+
+#include "w25q128_async_ll.h"
+
+// HAL DMA transfers are limited to 16-bit length
+#define W25Q128_ASYNC_MAX_CHUNK 0xFFFF
+
+#if W25Q128_ASYNC_BULK_DEPTH > W25Q128_ASYNC_QUEUE_SIZE
+#error "W25Q128_ASYNC_BULK_DEPTH is larger than the queue"
+#endif
+
+#define QUEUE_AT(async, pos) \
+    ((async)->queue[((async)->head + (pos)) % W25Q128_ASYNC_QUEUE_SIZE])
+
+/*************************** Static functions *********************************/
+static void async_start_next(W25Q128_AsyncTypeDef *async);
+static void async_start(W25Q128_AsyncTypeDef *async, uint8_t pos);
+static void async_start_data(W25Q128_AsyncTypeDef *async);
+static void async_finish(W25Q128_AsyncTypeDef *async,
+                                            W25Q128_StatusTypeDef status);
+static uint32_t async_op_timeout(W25Q128_AsyncTypeDef *async,
+                                            W25Q128_AsyncOpTypeDef op);
+static void async_poll(W25Q128_AsyncTypeDef *async, uint8_t inst,
+                                            W25Q128_AsyncStateTypeDef state);
+static uint8_t async_try_suspend(W25Q128_AsyncTypeDef *async);
+static void async_resume(W25Q128_AsyncTypeDef *async);
+static uint8_t async_find_read(W25Q128_AsyncTypeDef *async);
+static uint8_t async_overlaps(const W25Q128_AsyncTransferTypeDef *op,
+                                    const W25Q128_AsyncTransferTypeDef *read);
+static void async_cancel(W25Q128_AsyncTypeDef *async,
+                                        W25Q128_AsyncTransferTypeDef *xfer);
+static W25Q128_StatusTypeDef async_bulk_wait(W25Q128_AsyncTypeDef *async,
+                                        W25Q128_AsyncTransferTypeDef *xfer);
+#if W25Q128_AUTO_POWER_DOWN
+static void async_power_mark(W25Q128_AsyncTypeDef *async, uint8_t active);
+#endif
+
+void W25Q128_Async_Init(W25Q128_AsyncTypeDef *async, W25Q128_TypeDef *w25)
+{
+    async->w25 = w25;
+    async->head = 0;
+    async->count = 0;
+    async->state = W25Q128_ASYNC_STATE_IDLE;
+    async->current = NULL;
+    async->current_pos = 0;
+    async->suspended = NULL;
+    async->suspend_count = 0;
+    async->suspend_reads = 0;
+    // No resume yet, the first suspend does not wait for tRS
+    async->resume_time = HAL_GetTick() - W25Q128_ASYNC_RESUME_INTERVAL_MS - 1;
+    async->suspends = 0;
+    async->wren = INST_WRITE_ENABLE;
+    async->suspend_inst = INST_ERASE_PROGRAM_SUSPEND;
+    async->resume_inst = INST_ERASE_PROGRAM_RESUME;
+    async->poll_tx[0] = INST_READ_STATUS_REG_1;
+    async->poll_tx[1] = 0x00;
+#if W25Q128_AUTO_POWER_DOWN
+    w25->power_async = 0;
+#endif
+}
+
+W25Q128_StatusTypeDef W25Q128_Async_Submit(W25Q128_AsyncTypeDef *async,
+                                        W25Q128_AsyncTransferTypeDef *xfer)
+{
+    uint32_t primask;
+
+    // DMA queue drives standard SPI only
+    if (async->w25->transport != W25Q128_TRANSPORT_SPI)
+        return W25Q128_ERROR;
+
+    if (xfer->op == W25Q128_ASYNC_PAGE_PROGRAM &&
+        ((xfer->addr % W25Q128_PAGE_SIZE) + xfer->size) > W25Q128_PAGE_SIZE)
+        return W25Q128_ERROR;
+
+#if W25Q128_AUTO_POWER_DOWN
+    // Queue drives the SPI directly, device must be out of deep power-down
+    if (W25Q128_PowerReady(async->w25) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+#endif
+
+    xfer->status = W25Q128_BUSY;
+
+    W25Q128_ENTER_CRITICAL(primask);
+    if (async->count == W25Q128_ASYNC_QUEUE_SIZE)
+    {
+        W25Q128_EXIT_CRITICAL(primask);
+        xfer->status = W25Q128_ERROR;
+        return W25Q128_ERROR;
+    }
+
+    uint8_t tail = (async->head + async->count) % W25Q128_ASYNC_QUEUE_SIZE;
+    async->queue[tail] = xfer;
+    async->count++;
+
+    if (async->state == W25Q128_ASYNC_STATE_IDLE)
+        async_start_next(async);
+    W25Q128_EXIT_CRITICAL(primask);
+
+    return W25Q128_SUCCESS;
+}
+
+W25Q128_StatusTypeDef W25Q128_Async_Read(W25Q128_AsyncTypeDef *async,
+                                        W25Q128_AsyncTransferTypeDef *xfer,
+                                        uint32_t addr, uint8_t *data,
+                                        uint32_t size,
+                                        W25Q128_AsyncCallback callback,
+                                        void *user_data)
+{
+    xfer->op = W25Q128_ASYNC_READ;
+    xfer->addr = addr;
+    xfer->data = data;
+    xfer->size = size;
+    xfer->callback = callback;
+    xfer->user_data = user_data;
+
+    return W25Q128_Async_Submit(async, xfer);
+}
+
+W25Q128_StatusTypeDef W25Q128_Async_WritePage(W25Q128_AsyncTypeDef *async,
+                                        W25Q128_AsyncTransferTypeDef *xfer,
+                                        uint32_t addr, uint8_t *data,
+                                        uint32_t size,
+                                        W25Q128_AsyncCallback callback,
+                                        void *user_data)
+{
+    xfer->op = W25Q128_ASYNC_PAGE_PROGRAM;
+    xfer->addr = addr;
+    xfer->data = data;
+    xfer->size = size;
+    xfer->callback = callback;
+    xfer->user_data = user_data;
+
+    return W25Q128_Async_Submit(async, xfer);
+}
+
+W25Q128_StatusTypeDef W25Q128_Async_EraseSector(W25Q128_AsyncTypeDef *async,
+                                        W25Q128_AsyncTransferTypeDef *xfer,
+                                        uint32_t num_sector,
+                                        W25Q128_AsyncCallback callback,
+                                        void *user_data)
+{
+    xfer->op = W25Q128_ASYNC_ERASE_SECTOR;
+    xfer->addr = (uint32_t)num_sector * W25Q128_SECTOR_SIZE;
+    xfer->data = NULL;
+    xfer->size = 0;
+    xfer->callback = callback;
+    xfer->user_data = user_data;
+
+    return W25Q128_Async_Submit(async, xfer);
+}
+
+W25Q128_StatusTypeDef W25Q128_Async_ProgramBulk(W25Q128_AsyncTypeDef *async,
+                                        uint32_t addr, uint8_t *data,
+                                        uint32_t size, uint32_t *crc)
+{
+    W25Q128_AsyncTransferTypeDef xfers[W25Q128_ASYNC_BULK_DEPTH];
+    W25Q128_StatusTypeDef status = W25Q128_SUCCESS;
+    uint32_t crc_value = (crc != NULL) ? *crc : 0;
+    uint32_t pos = 0;
+    uint8_t first = 0;
+    uint8_t pending = 0;
+
+    if (async->w25->transport != W25Q128_TRANSPORT_SPI)
+    {
+        if (size > 0)
+            status = W25Q128_WritePage(async->w25, addr / W25Q128_PAGE_SIZE,
+                                    addr % W25Q128_PAGE_SIZE, size, data);
+        if (crc != NULL)
+            *crc = W25Q128_Crc32(crc_value, data, size);
+        return status;
+    }
+
+    while ((pos < size && status == W25Q128_SUCCESS) || pending > 0)
+    {
+        if (pos < size && status == W25Q128_SUCCESS &&
+                                        pending < W25Q128_ASYNC_BULK_DEPTH)
+        {
+            W25Q128_AsyncTransferTypeDef *xfer =
+                        &xfers[(first + pending) % W25Q128_ASYNC_BULK_DEPTH];
+            uint32_t len = W25Q128_PAGE_SIZE - 
+                                    ((addr + pos) % W25Q128_PAGE_SIZE);
+
+            if (len > size - pos)
+                len = size - pos;
+
+            if (W25Q128_Async_WritePage(async, xfer, addr + pos, &data[pos], 
+                                    len, NULL, NULL) == W25Q128_SUCCESS)
+            {
+                // Page is on the bus or queued, its CRC is computed meanwhile
+                crc_value = W25Q128_Crc32(crc_value, &data[pos], len);
+                pos += len;
+                pending++;
+                continue;
+            }
+
+            // Queue is shared and full, retry once a page has completed
+            if (pending == 0)
+            {
+                status = W25Q128_ERROR;
+                continue;
+            }
+        }
+
+        // Descriptors live on this stack, so none may stay queued. Pages
+        // that have not started are taken out once one times out, the page
+        // on the device completes by its own operation timeout.
+        if (async_bulk_wait(async, &xfers[first]) == W25Q128_ERROR_TIMEOUT)
+        {
+            status = W25Q128_ERROR_TIMEOUT;
+            for (uint8_t i = 0; i < pending; i++)
+                async_cancel(async,
+                            &xfers[(first + i) % W25Q128_ASYNC_BULK_DEPTH]);
+        }
+        while (!W25Q128_Async_IsDone(&xfers[first]))
+            W25Q128_Async_Wait(async, &xfers[first],
+                        W25Q128_GetTimeout(async->w25, INST_PAGE_PROGRAM));
+        if (xfers[first].status != W25Q128_SUCCESS &&
+                                                status == W25Q128_SUCCESS)
+            status = W25Q128_ERROR;
+        first = (first + 1) % W25Q128_ASYNC_BULK_DEPTH;
+        pending--;
+    }
+
+    if (crc != NULL)
+        *crc = crc_value;
+
+    return status;
+}
+
+void W25Q128_Async_Process(W25Q128_AsyncTypeDef *async)
+{
+    uint32_t primask;
+    uint8_t suspending;
+
+    // Suspend timeout is checked once the status is known, the device may
+    // have suspended long before a late call
+    if (async->state == W25Q128_ASYNC_STATE_SUSPEND_WAIT)
+    {
+        async_poll(async, INST_READ_STATUS_REG_1,
+                                        W25Q128_ASYNC_STATE_SUSPEND_POLL);
+        return;
+    }
+
+    if (async->state != W25Q128_ASYNC_STATE_WAIT_WIP)
+        return;
+
+    // Timeout is checked once the poll still reads BUSY, a late call must
+    // not fail an operation that has already finished
+    W25Q128_ENTER_CRITICAL(primask);
+    suspending = async_try_suspend(async);
+    W25Q128_EXIT_CRITICAL(primask);
+    if (suspending)
+        return;
+
+    async_poll(async, INST_READ_STATUS_REG_1, W25Q128_ASYNC_STATE_POLL);
+}
+
+void W25Q128_Async_DMACpltHandler(W25Q128_AsyncTypeDef *async,
+                                                    SPI_HandleTypeDef *hspi)
+{
+    W25Q128_AsyncTransferTypeDef *xfer = async->current;
+
+    if (hspi != async->w25->hspi || xfer == NULL)
+        return;
+
+    switch (async->state)
+    {
+        case W25Q128_ASYNC_STATE_WREN:
+            W25Q128_ChipDeselect(async->w25);
+            W25Q128_ChipSelect(async->w25);
+            async->state = W25Q128_ASYNC_STATE_HEADER;
+            if (HAL_SPI_Transmit_DMA(hspi, async->cmd, async->cmd_len) 
+                                                                    != HAL_OK)
+            {
+                W25Q128_ChipDeselect(async->w25);
+                async_finish(async, W25Q128_ERROR);
+            }
+            break;
+
+        case W25Q128_ASYNC_STATE_HEADER:
+            if (async->remaining > 0)
+            {
+                async_start_data(async);
+                break;
+            }
+            // Erase has no data phase
+            W25Q128_ChipDeselect(async->w25);
+            async->op_start = HAL_GetTick();
+            async->state = W25Q128_ASYNC_STATE_WAIT_WIP;
+            break;
+
+        case W25Q128_ASYNC_STATE_DATA:
+            async->data_ptr += async->chunk;
+            async->remaining -= async->chunk;
+            if (async->remaining > 0)
+            {
+                async_start_data(async);
+                break;
+            }
+            W25Q128_ChipDeselect(async->w25);
+            if (xfer->op == W25Q128_ASYNC_READ)
+            {
+                async_finish(async, W25Q128_SUCCESS);
+            } else {
+                async->op_start = HAL_GetTick();
+                async->state = W25Q128_ASYNC_STATE_WAIT_WIP;
+            }
+            break;
+
+        case W25Q128_ASYNC_STATE_POLL:
+            W25Q128_ChipDeselect(async->w25);
+            if (!(async->poll_rx[1] & W25Q128_SR1_BUSY))
+                async_finish(async, W25Q128_SUCCESS);
+            else if ((HAL_GetTick() - async->op_start) > async->op_timeout)
+                async_finish(async, W25Q128_ERROR_TIMEOUT);
+            else
+                async->state = W25Q128_ASYNC_STATE_WAIT_WIP;
+            break;
+
+        case W25Q128_ASYNC_STATE_SUSPEND:
+            W25Q128_ChipDeselect(async->w25);
+            async->suspend_start = HAL_GetTick();
+            async->state = W25Q128_ASYNC_STATE_SUSPEND_WAIT;
+            break;
+
+        case W25Q128_ASYNC_STATE_SUSPEND_POLL:
+            W25Q128_ChipDeselect(async->w25);
+            if (!(async->poll_rx[1] & W25Q128_SR1_BUSY))
+                async_poll(async, INST_READ_STATUS_REG_2,
+                                        W25Q128_ASYNC_STATE_SUSPEND_CHECK);
+            else if ((HAL_GetTick() - async->suspend_start) > 
+                                                W25Q128_TIMEOUT_SUSPEND_MS)
+                async_poll(async, INST_READ_STATUS_REG_2,
+                                        W25Q128_ASYNC_STATE_SUSPEND_LATE);
+            else
+                async->state = W25Q128_ASYNC_STATE_SUSPEND_WAIT;
+            break;
+
+        case W25Q128_ASYNC_STATE_SUSPEND_LATE:
+            W25Q128_ChipDeselect(async->w25);
+            // Still busy past tSUS, SUS bit tells if suspend was accepted
+            if (async->poll_rx[1] & W25Q128_SR2_SUS)
+            {
+                async->state = W25Q128_ASYNC_STATE_SUSPEND_WAIT;
+                break;
+            }
+            // Device did not suspend, let the operation continue
+            async->resume_time = HAL_GetTick();
+            async->state = W25Q128_ASYNC_STATE_WAIT_WIP;
+            break;
+
+        case W25Q128_ASYNC_STATE_SUSPEND_CHECK:
+            W25Q128_ChipDeselect(async->w25);
+            // SUS bit is not set if the operation finished before suspend
+            if (!(async->poll_rx[1] & W25Q128_SR2_SUS))
+            {
+                async_finish(async, W25Q128_SUCCESS);
+                break;
+            }
+            async->suspended = xfer;
+            async->suspend_count++;
+            async->suspends++;
+            async_start_next(async);
+            break;
+
+        case W25Q128_ASYNC_STATE_RESUME:
+            W25Q128_ChipDeselect(async->w25);
+            // Suspended time does not count to the operation timeout
+            async->resume_time = HAL_GetTick();
+            async->op_start += async->resume_time - async->suspend_start;
+            async->state = W25Q128_ASYNC_STATE_WAIT_WIP;
+            break;
+
+        default:
+            break;
+    }
+}
+
+uint8_t W25Q128_Async_IsDone(W25Q128_AsyncTransferTypeDef *xfer)
+{
+    return (xfer->status != W25Q128_BUSY);
+}
+
+W25Q128_StatusTypeDef W25Q128_Async_Wait(W25Q128_AsyncTypeDef *async,
+                                        W25Q128_AsyncTransferTypeDef *xfer,
+                                        uint32_t timeout_ms)
+{
+    uint32_t start_time = HAL_GetTick();
+
+    while (!W25Q128_Async_IsDone(xfer))
+    {
+        if ((HAL_GetTick() - start_time) > timeout_ms)
+            return W25Q128_ERROR_TIMEOUT;
+        W25Q128_Async_Process(async);
+    }
+    return xfer->status;
+}
+
+/*************************** Static functions *********************************/
+// Must be called with the queue locked or from the DMA interrupt
+static void async_start_next(W25Q128_AsyncTypeDef *async)
+{
+    if (async->suspended != NULL)
+    {
+        uint8_t pos = 0;
+
+        if (async->suspend_reads > 0)
+            pos = async_find_read(async);
+
+        if (pos == 0)
+        {
+            async_resume(async);
+            return;
+        }
+        async->suspend_reads--;
+        async_start(async, pos);
+        return;
+    }
+
+    if (async->count == 0)
+    {
+        async->current = NULL;
+        async->state = W25Q128_ASYNC_STATE_IDLE;
+#if W25Q128_AUTO_POWER_DOWN
+        async_power_mark(async, 0);
+#endif
+        return;
+    }
+
+    async->suspend_count = 0;
+    async_start(async, 0);
+}
+
+// Must be called with the queue locked or from the DMA interrupt
+static void async_start(W25Q128_AsyncTypeDef *async, uint8_t pos)
+{
+    W25Q128_AsyncTransferTypeDef *xfer = QUEUE_AT(async, pos);
+    uint8_t inst;
+
+    async->current = xfer;
+    async->current_pos = pos;
+    async->data_ptr = xfer->data;
+    async->remaining = xfer->size;
+    async->op_timeout = async_op_timeout(async, xfer->op);
+#if W25Q128_INSTRUMENTATION
+    xfer->start_us = W25Q128_INSTR_TIME_US();
+#endif
+
+    switch (xfer->op)
+    {
+        case W25Q128_ASYNC_READ:
+            inst = INST_FAST_READ;
+            break;
+        case W25Q128_ASYNC_PAGE_PROGRAM:
+            inst = INST_PAGE_PROGRAM;
+            break;
+        default:
+            inst = INST_SECTOR_ERASE_4KB;
+            break;
+    }
+
+    async->cmd_len = 0;
+    async->cmd[async->cmd_len++] = W25Q128_ADDRESS_INST(async->w25, inst);
+    for (uint8_t b = W25Q128_ADDRESS_BYTES(async->w25); b > 0; b--)
+        async->cmd[async->cmd_len++] = (xfer->addr >> (8 * (b - 1))) & 0xFF;
+
+#if W25Q128_AUTO_POWER_DOWN
+    // Device stays awake until the queue drains, normally nothing to release
+    async_power_mark(async, 1);
+    if (W25Q128_PowerReady(async->w25) != W25Q128_SUCCESS)
+    {
+        async_finish(async, W25Q128_ERROR);
+        return;
+    }
+#endif
+
+    W25Q128_ChipSelect(async->w25);
+    if (xfer->op == W25Q128_ASYNC_READ)
+    {
+        async->state = W25Q128_ASYNC_STATE_HEADER;
+        async->cmd[async->cmd_len] = 0x00; // Fast read dummy byte
+        if (HAL_SPI_Transmit_DMA(async->w25->hspi, async->cmd, 
+                                            async->cmd_len + 1) == HAL_OK)
+            return;
+    } else {
+#if W25Q128_ERASED_MAP
+        W25Q128_UpdateErasedMap(async->w25, xfer->addr, 
+                    (xfer->op == W25Q128_ASYNC_ERASE_SECTOR) ? 
+                                    W25Q128_SECTOR_SIZE : xfer->size, 0);
+#endif
+        async->state = W25Q128_ASYNC_STATE_WREN;
+        if (HAL_SPI_Transmit_DMA(async->w25->hspi, &async->wren, 1)
+                                                                    == HAL_OK)
+            return;
+    }
+    W25Q128_ChipDeselect(async->w25);
+    async_finish(async, W25Q128_ERROR);
+}
+
+static void async_start_data(W25Q128_AsyncTypeDef *async)
+{
+    HAL_StatusTypeDef hal_status;
+
+    async->chunk = async->remaining;
+    if (async->chunk > W25Q128_ASYNC_MAX_CHUNK)
+        async->chunk = W25Q128_ASYNC_MAX_CHUNK;
+
+    async->state = W25Q128_ASYNC_STATE_DATA;
+    if (async->current->op == W25Q128_ASYNC_READ)
+        hal_status = HAL_SPI_Receive_DMA(async->w25->hspi, async->data_ptr,
+                                                                async->chunk);
+    else
+        hal_status = HAL_SPI_Transmit_DMA(async->w25->hspi, async->data_ptr,
+                                                                async->chunk);
+    if (hal_status != HAL_OK)
+    {
+        W25Q128_ChipDeselect(async->w25);
+        async_finish(async, W25Q128_ERROR);
+    }
+}
+
+// Must be called with the queue locked or from the DMA interrupt
+static void async_finish(W25Q128_AsyncTypeDef *async,
+                                            W25Q128_StatusTypeDef status)
+{
+    W25Q128_AsyncTransferTypeDef *xfer = async->current;
+
+    if (async->current_pos == 0)
+    {
+        async->head = (async->head + 1) % W25Q128_ASYNC_QUEUE_SIZE;
+    } else {
+        for (uint8_t i = async->current_pos; i + 1 < async->count; i++)
+            QUEUE_AT(async, i) = QUEUE_AT(async, i + 1);
+    }
+    async->count--;
+
+#if W25Q128_ERASED_MAP
+    if (xfer->op == W25Q128_ASYNC_ERASE_SECTOR && status == W25Q128_SUCCESS)
+        W25Q128_UpdateErasedMap(async->w25, xfer->addr, W25Q128_SECTOR_SIZE, 1);
+#endif
+
+#if W25Q128_AUTO_POWER_DOWN
+    async->w25->power_last_us = W25Q128_POWER_TIME_US();
+#endif
+
+#if W25Q128_INSTRUMENTATION
+    // Same counters as the blocking functions, time includes suspensions
+    if (status == W25Q128_SUCCESS)
+    {
+        W25Q128_InstrumentationTypeDef *instr = &async->w25->instr;
+        uint32_t us = W25Q128_INSTR_TIME_US() - xfer->start_us;
+
+        if (xfer->op == W25Q128_ASYNC_READ)
+        {
+            W25Q128_InstrHistAdd(instr->read_hist, us);
+        } else if (xfer->op == W25Q128_ASYNC_PAGE_PROGRAM) {
+            W25Q128_InstrHistAdd(instr->program_hist, us);
+        } else {
+            uint16_t *count = &instr->sector_erases[
+                                            xfer->addr / W25Q128_SECTOR_SIZE];
+
+            W25Q128_InstrHistAdd(instr->erase_hist, us);
+            if (*count != 0xFFFF)
+                (*count)++;
+        }
+    }
+#endif
+
+    xfer->status = status;
+    if (xfer->callback != NULL)
+        xfer->callback(xfer);
+
+    async_start_next(async);
+}
+
+// Same limits as the blocking functions, from SFDP when it has been read
+static uint32_t async_op_timeout(W25Q128_AsyncTypeDef *async,
+                                            W25Q128_AsyncOpTypeDef op)
+{
+    switch (op)
+    {
+        case W25Q128_ASYNC_PAGE_PROGRAM:
+            return W25Q128_GetTimeout(async->w25, INST_PAGE_PROGRAM);
+        case W25Q128_ASYNC_ERASE_SECTOR:
+            return W25Q128_GetTimeout(async->w25, INST_SECTOR_ERASE_4KB);
+        default:
+            return 0;
+    }
+}
+
+static void async_poll(W25Q128_AsyncTypeDef *async, uint8_t inst,
+                                            W25Q128_AsyncStateTypeDef state)
+{
+    W25Q128_AsyncStateTypeDef prev_state = async->state;
+
+    async->poll_tx[0] = inst;
+    async->state = state;
+    W25Q128_ChipSelect(async->w25);
+    if (HAL_SPI_TransmitReceive_DMA(async->w25->hspi, async->poll_tx,
+                                    async->poll_rx, 2) != HAL_OK)
+    {
+        W25Q128_ChipDeselect(async->w25);
+        async->state = (prev_state == W25Q128_ASYNC_STATE_SUSPEND_POLL) ?
+                        W25Q128_ASYNC_STATE_SUSPEND_WAIT : prev_state;
+    }
+}
+
+// Must be called with the queue locked, returns 1 if suspend was issued
+static uint8_t async_try_suspend(W25Q128_AsyncTypeDef *async)
+{
+#if W25Q128_ASYNC_MAX_SUSPEND > 0
+    uint8_t reads = 0;
+
+    // Tick may change right after the resume, one more makes up for it
+    if (async->suspend_count >= W25Q128_ASYNC_MAX_SUSPEND ||
+        (HAL_GetTick() - async->resume_time) <=
+                                            W25Q128_ASYNC_RESUME_INTERVAL_MS)
+        return 0;
+
+    if (async_find_read(async) == 0)
+        return 0;
+
+    // Serve only reads that are already queued, so operation makes progress
+    for (uint8_t pos = 1; pos < async->count; pos++)
+    {
+        if (QUEUE_AT(async, pos)->op == W25Q128_ASYNC_READ)
+            reads++;
+    }
+    async->suspend_reads = reads;
+
+    async->state = W25Q128_ASYNC_STATE_SUSPEND;
+    W25Q128_ChipSelect(async->w25);
+    if (HAL_SPI_Transmit_DMA(async->w25->hspi, &async->suspend_inst, 1)
+                                                                    != HAL_OK)
+    {
+        W25Q128_ChipDeselect(async->w25);
+        async->state = W25Q128_ASYNC_STATE_WAIT_WIP;
+        return 0;
+    }
+    return 1;
+#else
+    (void)async;
+    return 0;
+#endif
+}
+
+// Must be called with the queue locked or from the DMA interrupt
+static void async_resume(W25Q128_AsyncTypeDef *async)
+{
+    async->current = async->suspended;
+    async->current_pos = 0;
+    async->suspended = NULL;
+    async->op_timeout = async_op_timeout(async, async->current->op);
+
+    async->state = W25Q128_ASYNC_STATE_RESUME;
+    W25Q128_ChipSelect(async->w25);
+    if (HAL_SPI_Transmit_DMA(async->w25->hspi, &async->resume_inst, 1)
+                                                                    != HAL_OK)
+    {
+        W25Q128_ChipDeselect(async->w25);
+        async_finish(async, W25Q128_ERROR);
+    }
+}
+
+/*
+ * Returns position of the first read that may be served before the operation
+ * at the queue head, 0 if there is none. Read must not overlap any program or
+ * erase queued before it.
+ */
+static uint8_t async_find_read(W25Q128_AsyncTypeDef *async)
+{
+    for (uint8_t pos = 1; pos < async->count; pos++)
+    {
+        W25Q128_AsyncTransferTypeDef *read = QUEUE_AT(async, pos);
+        uint8_t blocked = 0;
+
+        if (read->op != W25Q128_ASYNC_READ)
+            continue;
+
+        for (uint8_t i = 0; i < pos && !blocked; i++)
+        {
+            W25Q128_AsyncTransferTypeDef *op = QUEUE_AT(async, i);
+            if (op->op != W25Q128_ASYNC_READ && async_overlaps(op, read))
+                blocked = 1;
+        }
+
+        if (!blocked)
+            return pos;
+    }
+    return 0;
+}
+
+// Whole page or sector is unreadable while being programmed or erased
+static uint8_t async_overlaps(const W25Q128_AsyncTransferTypeDef *op,
+                                    const W25Q128_AsyncTransferTypeDef *read)
+{
+    uint32_t op_size = (op->op == W25Q128_ASYNC_ERASE_SECTOR) ?
+                                    W25Q128_SECTOR_SIZE : W25Q128_PAGE_SIZE;
+    uint32_t op_addr = op->addr - (op->addr % op_size);
+
+    return (op_addr < read->addr + read->size) &&
+                                            (read->addr < op_addr + op_size);
+}
+
+// Takes a transfer that has not started out of the queue, without callback
+static void async_cancel(W25Q128_AsyncTypeDef *async,
+                                        W25Q128_AsyncTransferTypeDef *xfer)
+{
+    uint32_t primask;
+    uint8_t pos;
+
+    W25Q128_ENTER_CRITICAL(primask);
+    for (pos = 0; pos < async->count && QUEUE_AT(async, pos) != xfer; pos++)
+        ;
+    if (pos < async->count && xfer != async->current &&
+                                                xfer != async->suspended)
+    {
+        for (uint8_t i = pos; i + 1 < async->count; i++)
+            QUEUE_AT(async, i) = QUEUE_AT(async, i + 1);
+        async->count--;
+        if (pos < async->current_pos)
+            async->current_pos--;
+        xfer->status = W25Q128_ERROR_TIMEOUT;
+    }
+    W25Q128_EXIT_CRITICAL(primask);
+}
+
+/*
+ * Waits for a page of W25Q128_Async_ProgramBulk. Only the time the page is
+ * on the device counts to the page program timeout, transfers queued before
+ * it have their own. It expires a tick before the operation timeout of the
+ * queue, which would start the next page while the device is still busy.
+ */
+static W25Q128_StatusTypeDef async_bulk_wait(W25Q128_AsyncTypeDef *async,
+                                        W25Q128_AsyncTransferTypeDef *xfer)
+{
+    uint32_t start_time = HAL_GetTick();
+
+    while (!W25Q128_Async_IsDone(xfer))
+    {
+        if (async->current != xfer)
+            start_time = HAL_GetTick();
+        else if ((HAL_GetTick() - start_time) >= async->op_timeout)
+            return W25Q128_ERROR_TIMEOUT;
+        W25Q128_Async_Process(async);
+    }
+    return xfer->status;
+}
+
+#if W25Q128_AUTO_POWER_DOWN
+// Must be called with the queue locked or from the DMA interrupt
+static void async_power_mark(W25Q128_AsyncTypeDef *async, uint8_t active)
+{
+    async->w25->power_async = active;
+    async->w25->power_last_us = W25Q128_POWER_TIME_US();
+}
+#endif
\ No newline at end of file
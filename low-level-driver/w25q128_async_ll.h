@@ -0,0 +1,262 @@
+/**
+ * @file w25q128_async_ll.h
+ * @brief w25q128 low-level asynchronous (DMA) transfer queue
+ * @author Filip Stojanovic
+ *
+ * Transfers are submitted to a per-device queue and executed one after
+ * another using SPI DMA. The state machine is advanced by the DMA complete
+ * interrupts and by W25Q128_Async_Process(), which polls the WIP bit of
+ * program and erase operations. The SPI HAL callbacks must be forwarded to
+ * the queue, i.e:
+ *
+ *     void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+ *     {
+ *         W25Q128_Async_DMACpltHandler(&flash_async, hspi);
+ *     }
+ *
+ * and the same for HAL_SPI_RxCpltCallback and HAL_SPI_TxRxCpltCallback.
+ * Queue works with W25Q128_TRANSPORT_SPI only and always uses Fast Read.
+ *
+ * If W25Q128_ASYNC_MAX_SUSPEND is non-zero, a read that is queued while a
+ * program or erase is in progress suspends that operation, is served and the
+ * operation is resumed afterwards. Reads that overlap the suspended operation
+ * or any program/erase queued before them keep their place in the queue.
+ */
+
+#ifndef W25Q128_ASYNC_H
+#define W25Q128_ASYNC_H
+
+#include "w25q128_ll.h"
+
+#ifndef W25Q128_ASYNC_QUEUE_SIZE
+#define W25Q128_ASYNC_QUEUE_SIZE 8
+#endif
+
+// Maximum number of suspends of a single operation, 0 disables suspending
+#ifndef W25Q128_ASYNC_MAX_SUSPEND
+#define W25Q128_ASYNC_MAX_SUSPEND 4
+#endif
+
+// Minimum time between resume and the next suspend (tRS), whole ticks
+// passed after the one of the resume
+#ifndef W25Q128_ASYNC_RESUME_INTERVAL_MS
+#define W25Q128_ASYNC_RESUME_INTERVAL_MS 1
+#endif
+
+// Pages W25Q128_Async_ProgramBulk keeps queued, at most W25Q128_ASYNC_QUEUE_SIZE
+#ifndef W25Q128_ASYNC_BULK_DEPTH
+#define W25Q128_ASYNC_BULK_DEPTH 2
+#endif
+
+// Time until device has to enter suspend (tSUS is 20 us)
+#define W25Q128_TIMEOUT_SUSPEND_MS 2
+
+typedef enum {
+    W25Q128_ASYNC_READ = 0,
+    W25Q128_ASYNC_PAGE_PROGRAM = 1,
+    W25Q128_ASYNC_ERASE_SECTOR = 2,
+} W25Q128_AsyncOpTypeDef;
+
+typedef enum {
+    W25Q128_ASYNC_STATE_IDLE = 0,
+    W25Q128_ASYNC_STATE_WREN = 1,
+    W25Q128_ASYNC_STATE_HEADER = 2,
+    W25Q128_ASYNC_STATE_DATA = 3,
+    W25Q128_ASYNC_STATE_WAIT_WIP = 4,
+    W25Q128_ASYNC_STATE_POLL = 5,
+    W25Q128_ASYNC_STATE_SUSPEND = 6,
+    W25Q128_ASYNC_STATE_SUSPEND_WAIT = 7,
+    W25Q128_ASYNC_STATE_SUSPEND_POLL = 8,
+    W25Q128_ASYNC_STATE_SUSPEND_CHECK = 9,
+    W25Q128_ASYNC_STATE_RESUME = 10,
+    W25Q128_ASYNC_STATE_SUSPEND_LATE = 11,
+} W25Q128_AsyncStateTypeDef;
+
+typedef struct W25Q128_AsyncTransfer W25Q128_AsyncTransferTypeDef;
+
+/**
+ * @brief Completion callback, called once the transfer has finished
+ * @note Called from the DMA interrupt for reads and from
+ *       W25Q128_Async_Process() for program and erase operations.
+ */
+typedef void (*W25Q128_AsyncCallback)(W25Q128_AsyncTransferTypeDef *xfer);
+
+/**
+ * Transfer descriptor. It is owned by the caller and must stay valid until
+ * the transfer has completed, it also serves as a pollable handle.
+ */
+struct W25Q128_AsyncTransfer {
+    W25Q128_AsyncOpTypeDef op;
+    uint32_t addr;
+    uint8_t *data;
+    uint32_t size;
+    W25Q128_AsyncCallback callback;
+    void *user_data;
+    volatile W25Q128_StatusTypeDef status; // W25Q128_BUSY until completed
+#if W25Q128_INSTRUMENTATION
+    uint32_t start_us;      // Start on the bus, for the latency histograms
+#endif
+};
+
+typedef struct {
+    W25Q128_TypeDef *w25;
+
+    W25Q128_AsyncTransferTypeDef *queue[W25Q128_ASYNC_QUEUE_SIZE];
+    volatile uint8_t head;
+    volatile uint8_t count;
+
+    volatile W25Q128_AsyncStateTypeDef state;
+    W25Q128_AsyncTransferTypeDef *current;
+    uint8_t current_pos; // Position of the current transfer in the queue
+    uint8_t *data_ptr;
+    uint32_t remaining;
+    uint32_t chunk;
+    uint32_t op_start;
+    uint32_t op_timeout;
+
+    W25Q128_AsyncTransferTypeDef *suspended;
+    uint8_t suspend_count;  // Suspends of the current operation
+    uint8_t suspend_reads;  // Reads left to serve in the current suspend
+    uint32_t suspend_start;
+    uint32_t resume_time;
+    uint32_t suspends;      // Total number of suspends
+
+    uint8_t wren;
+    uint8_t suspend_inst;
+    uint8_t resume_inst;
+    uint8_t cmd[6];         // Instruction, address and fast read dummy byte
+    uint8_t cmd_len;        // Instruction and address bytes
+    uint8_t poll_tx[2];
+    uint8_t poll_rx[2];
+} W25Q128_AsyncTypeDef;
+
+
+/**
+ * @brief Function that initializes the asynchronous transfer queue
+ * @param async Pointer to the queue struct
+ * @param w25 Pointer to the flash configuration struct
+ * @return None
+ */
+void W25Q128_Async_Init(W25Q128_AsyncTypeDef *async, W25Q128_TypeDef *w25);
+
+/**
+ * @brief Function that submits prepared transfer to the queue
+ * @param async Pointer to the queue struct
+ * @param xfer Pointer to the transfer descriptor
+ * @retval ::W25Q128_StatusTypeDef
+ * @note W25Q128_ERROR is returned if the queue is full or if a page program
+ *       crosses the page boundary.
+ */
+W25Q128_StatusTypeDef W25Q128_Async_Submit(W25Q128_AsyncTypeDef *async,
+                                        W25Q128_AsyncTransferTypeDef *xfer);
+
+/**
+ * @brief Function that submits fast read of any size
+ * @param async Pointer to the queue struct
+ * @param xfer Pointer to the transfer descriptor
+ * @param addr Memory address from which data is red
+ * @param data Pointer to the receive buffer
+ * @param size Data size that is red
+ * @param callback Completion callback, can be NULL
+ * @param user_data User pointer stored in the descriptor
+ * @retval ::W25Q128_StatusTypeDef
+ */
+W25Q128_StatusTypeDef W25Q128_Async_Read(W25Q128_AsyncTypeDef *async,
+                                        W25Q128_AsyncTransferTypeDef *xfer,
+                                        uint32_t addr, uint8_t *data,
+                                        uint32_t size,
+                                        W25Q128_AsyncCallback callback,
+                                        void *user_data);
+
+/**
+ * @brief Function that submits program of a single page
+ * @param async Pointer to the queue struct
+ * @param xfer Pointer to the transfer descriptor
+ * @param addr Memory address to which data is written
+ * @param data Data pointer
+ * @param size Data size, must not cross the page boundary
+ * @param callback Completion callback, can be NULL
+ * @param user_data User pointer stored in the descriptor
+ * @retval ::W25Q128_StatusTypeDef
+ */
+W25Q128_StatusTypeDef W25Q128_Async_WritePage(W25Q128_AsyncTypeDef *async,
+                                        W25Q128_AsyncTransferTypeDef *xfer,
+                                        uint32_t addr, uint8_t *data,
+                                        uint32_t size,
+                                        W25Q128_AsyncCallback callback,
+                                        void *user_data);
+
+/**
+ * @brief Function that submits erase of a single sector
+ * @param async Pointer to the queue struct
+ * @param xfer Pointer to the transfer descriptor
+ * @param num_sector Number of sector
+ * @param callback Completion callback, can be NULL
+ * @param user_data User pointer stored in the descriptor
+ * @retval ::W25Q128_StatusTypeDef
+ */
+W25Q128_StatusTypeDef W25Q128_Async_EraseSector(W25Q128_AsyncTypeDef *async,
+                                        W25Q128_AsyncTransferTypeDef *xfer,
+                                        uint32_t num_sector,
+                                        W25Q128_AsyncCallback callback,
+                                        void *user_data);
+
+/**
+ * @brief Function that programs a large sequential range (image, blob)
+ * @param async Pointer to the queue struct
+ * @param addr Memory address to which data is written
+ * @param data Data pointer
+ * @param size Data size, range must be erased
+ * @param crc Pointer to a CRC-32 (W25Q128_Crc32) that is updated with the
+ *        data, can be NULL
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Blocks until the last page is programmed. W25Q128_ASYNC_BULK_DEPTH
+ *       pages are kept in the queue, so the next page program starts from the
+ *       interrupt that sees WIP clear, and the CRC of a page is computed while
+ *       it is transferred or programmed. Without the SPI transport the range
+ *       is programmed with W25Q128_WritePage.
+ * @note W25Q128_ERROR_TIMEOUT is returned if a page is not programmed within
+ *       the page program timeout (W25Q128_GetTimeout) of reaching the device,
+ *       its pages that have not started are taken out of the queue before
+ *       returning.
+ */
+W25Q128_StatusTypeDef W25Q128_Async_ProgramBulk(W25Q128_AsyncTypeDef *async,
+                                        uint32_t addr, uint8_t *data,
+                                        uint32_t size, uint32_t *crc);
+
+/**
+ * @brief Function that advances WIP polling of program/erase operations
+ * @param async Pointer to the queue struct
+ * @return None
+ * @note Call it periodically, i.e. from a timer or from the flash task.
+ */
+void W25Q128_Async_Process(W25Q128_AsyncTypeDef *async);
+
+/**
+ * @brief Function that must be called from the SPI DMA complete callbacks
+ * @param async Pointer to the queue struct
+ * @param hspi SPI handle passed to the HAL callback
+ * @return None
+ */
+void W25Q128_Async_DMACpltHandler(W25Q128_AsyncTypeDef *async,
+                                                    SPI_HandleTypeDef *hspi);
+
+/**
+ * @brief Function that checks if transfer has completed
+ * @param xfer Pointer to the transfer descriptor
+ * @return 1 if transfer has completed, 0 otherwise
+ */
+uint8_t W25Q128_Async_IsDone(W25Q128_AsyncTransferTypeDef *xfer);
+
+/**
+ * @brief Function that blocks until the transfer has completed
+ * @param async Pointer to the queue struct
+ * @param xfer Pointer to the transfer descriptor
+ * @param timeout_ms Maximum time to wait
+ * @retval ::W25Q128_StatusTypeDef Status of the completed transfer
+ */
+W25Q128_StatusTypeDef W25Q128_Async_Wait(W25Q128_AsyncTypeDef *async,
+                                        W25Q128_AsyncTransferTypeDef *xfer,
+                                        uint32_t timeout_ms);
+
+#endif
@@ -0,0 +1,216 @@
+/**
+ * @file w25q128_bus_ll.c
+ * @brief w25q128 shared SPI bus arbiter
+ * @author Filip Stojanovic
+ */
+
+#include "w25q128_bus_ll.h"
+
+#include <string.h>
+
+#if W25Q128_BUS_LOCK == W25Q128_BUS_LOCK_FREERTOS
+#define BUS_ENTER(bus) taskENTER_CRITICAL()
+#define BUS_EXIT(bus)  taskEXIT_CRITICAL()
+#define BUS_SELF()     xTaskGetCurrentTaskHandle()
+#define BUS_PRIORITY() ((uint32_t)uxTaskPriorityGet(NULL))
+#elif W25Q128_BUS_LOCK == W25Q128_BUS_LOCK_PTHREAD
+#define BUS_ENTER(bus) pthread_mutex_lock(&(bus)->mutex)
+#define BUS_EXIT(bus)  pthread_mutex_unlock(&(bus)->mutex)
+#define BUS_SELF()     pthread_self()
+#define BUS_PRIORITY() thread_priority
+
+static _Thread_local uint32_t thread_priority;
+#else
+#define BUS_ENTER(bus) ((void)(bus))
+#define BUS_EXIT(bus)  ((void)(bus))
+#define BUS_SELF()     0
+#define BUS_PRIORITY() 0
+#endif
+
+/*************************** Static functions *********************************/
+static uint8_t bus_is_owner(W25Q128_BusTypeDef *bus);
+static uint8_t bus_best_waiter(W25Q128_BusTypeDef *bus);
+static void bus_wait(W25Q128_BusTypeDef *bus,
+                                        W25Q128_BusWaiterTypeDef *waiter);
+static void bus_wake(W25Q128_BusWaiterTypeDef *waiter);
+
+W25Q128_StatusTypeDef W25Q128_Bus_Init(W25Q128_BusTypeDef *bus)
+{
+    memset(bus, 0, sizeof(*bus));
+
+#if W25Q128_BUS_LOCK == W25Q128_BUS_LOCK_PTHREAD
+    if (pthread_mutex_init(&bus->mutex, NULL) != 0)
+        return W25Q128_ERROR;
+#endif
+
+    return W25Q128_SUCCESS;
+}
+
+W25Q128_StatusTypeDef W25Q128_Bus_Acquire(W25Q128_BusTypeDef *bus)
+{
+    W25Q128_BusWaiterTypeDef waiter;
+
+    BUS_ENTER(bus);
+    if (bus->busy && bus_is_owner(bus))
+    {
+        bus->depth++;
+        BUS_EXIT(bus);
+        return W25Q128_SUCCESS;
+    }
+
+    bus->stats.acquisitions++;
+
+    // Bus is handed over on release, so a free bus has no waiters
+    if (!bus->busy)
+    {
+        bus->busy = 1;
+        bus->owner = BUS_SELF();
+        bus->depth = 1;
+        BUS_EXIT(bus);
+        return W25Q128_SUCCESS;
+    }
+
+    if (bus->num_waiters == W25Q128_BUS_MAX_WAITERS)
+    {
+        BUS_EXIT(bus);
+        return W25Q128_ERROR;
+    }
+
+    waiter.thread = BUS_SELF();
+    waiter.priority = BUS_PRIORITY();
+    waiter.seq = bus->seq++;
+    waiter.granted = 0;
+    bus->waiters[bus->num_waiters++] = &waiter;
+    bus->stats.contentions++;
+    if (bus->num_waiters > bus->stats.max_waiters)
+        bus->stats.max_waiters = bus->num_waiters;
+
+    // Releasing task hands the bus over, owner and depth are set by it
+    bus_wait(bus, &waiter);
+    BUS_EXIT(bus);
+
+    return W25Q128_SUCCESS;
+}
+
+void W25Q128_Bus_Release(W25Q128_BusTypeDef *bus)
+{
+    W25Q128_BusWaiterTypeDef *next;
+    uint8_t pos;
+
+    BUS_ENTER(bus);
+    if (!bus->busy || --bus->depth > 0)
+    {
+        BUS_EXIT(bus);
+        return;
+    }
+
+    if (bus->num_waiters == 0)
+    {
+        bus->busy = 0;
+        BUS_EXIT(bus);
+        return;
+    }
+
+    pos = bus_best_waiter(bus);
+    next = bus->waiters[pos];
+    bus->waiters[pos] = bus->waiters[--bus->num_waiters];
+
+    bus->owner = next->thread;
+    bus->depth = 1;
+    bus->stats.handoffs++;
+    next->granted = 1;
+    bus_wake(next);
+    BUS_EXIT(bus);
+}
+
+W25Q128_StatusTypeDef W25Q128_Bus_Lock(W25Q128_TypeDef *w25)
+{
+    if (w25->bus == NULL)
+        return W25Q128_SUCCESS;
+
+    return W25Q128_Bus_Acquire(w25->bus);
+}
+
+void W25Q128_Bus_Unlock(W25Q128_TypeDef *w25)
+{
+    if (w25->bus != NULL)
+        W25Q128_Bus_Release(w25->bus);
+}
+
+void W25Q128_Bus_GetStats(W25Q128_BusTypeDef *bus,
+                                            W25Q128_BusStatsTypeDef *stats)
+{
+    BUS_ENTER(bus);
+    *stats = bus->stats;
+    BUS_EXIT(bus);
+}
+
+#if W25Q128_BUS_LOCK == W25Q128_BUS_LOCK_PTHREAD
+void W25Q128_Bus_SetPriority(uint32_t priority)
+{
+    thread_priority = priority;
+}
+#endif
+
+/*************************** Static functions *********************************/
+static uint8_t bus_is_owner(W25Q128_BusTypeDef *bus)
+{
+#if W25Q128_BUS_LOCK == W25Q128_BUS_LOCK_PTHREAD
+    return pthread_equal(bus->owner, BUS_SELF()) != 0;
+#else
+    return bus->owner == BUS_SELF();
+#endif
+}
+
+static uint8_t bus_best_waiter(W25Q128_BusTypeDef *bus)
+{
+    uint8_t best = 0;
+
+    for (uint8_t i = 1; i < bus->num_waiters; i++)
+    {
+        W25Q128_BusWaiterTypeDef *w = bus->waiters[i];
+        W25Q128_BusWaiterTypeDef *b = bus->waiters[best];
+
+        // Sequence numbers are compared as a difference to survive wrap
+        if (w->priority > b->priority || (w->priority == b->priority &&
+                                        (int32_t)(w->seq - b->seq) < 0))
+            best = i;
+    }
+    return best;
+}
+
+// Called inside BUS_ENTER, returns inside it once the bus was handed over
+static void bus_wait(W25Q128_BusTypeDef *bus,
+                                        W25Q128_BusWaiterTypeDef *waiter)
+{
+#if W25Q128_BUS_LOCK == W25Q128_BUS_LOCK_FREERTOS
+    (void)bus;
+    while (!waiter->granted)
+    {
+        BUS_EXIT(bus);
+        ulTaskNotifyTakeIndexed(W25Q128_BUS_NOTIFY_INDEX, pdTRUE,
+                                                        portMAX_DELAY);
+        BUS_ENTER(bus);
+    }
+#elif W25Q128_BUS_LOCK == W25Q128_BUS_LOCK_PTHREAD
+    pthread_cond_init(&waiter->cond, NULL);
+    while (!waiter->granted)
+        pthread_cond_wait(&waiter->cond, &bus->mutex);
+    pthread_cond_destroy(&waiter->cond);
+#else
+    // Nobody else can release the bus in a single thread of execution
+    (void)bus;
+    waiter->granted = 1;
+#endif
+}
+
+static void bus_wake(W25Q128_BusWaiterTypeDef *waiter)
+{
+#if W25Q128_BUS_LOCK == W25Q128_BUS_LOCK_FREERTOS
+    xTaskNotifyGiveIndexed(waiter->thread, W25Q128_BUS_NOTIFY_INDEX);
+#elif W25Q128_BUS_LOCK == W25Q128_BUS_LOCK_PTHREAD
+    pthread_cond_signal(&waiter->cond);
+#else
+    (void)waiter;
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,161 @@
+/**
+ * @file w25q128_bus_ll.h
+ * @brief w25q128 shared SPI bus arbiter
+ * @author Filip Stojanovic
+ *
+ * Serializes access to an SPI bus shared by several tasks, several flash
+ * devices or other peripherals. Devices whose W25Q128_TypeDef bus pointer is
+ * set lock the bus for every chip select window and for every multi-step
+ * sequence (WREN + program/erase/status write + WIP poll), so sequences are
+ * atomic. Multi-page operations (W25Q128_WritePage, W25Q128_Write,
+ * W25Q128_EraseRange) release the bus between pages and sectors, and a
+ * waiting task with a higher priority gets it first. W25Q128_Write keeps the
+ * bus for the whole read-modify-write of a sector, since the static work
+ * buffer is shared; devices on different buses need their own work_buf.
+ *
+ * Lock is recursive for the owner and its primitives are selected with
+ * W25Q128_BUS_LOCK in w25q128_conf_ll.h:
+ *
+ * - W25Q128_BUS_LOCK_NONE: single thread of execution, no locking
+ * - W25Q128_BUS_LOCK_FREERTOS: critical sections and task notifications,
+ *   priority of a waiter is the priority of its task. Waiters are woken on
+ *   notification index W25Q128_BUS_NOTIFY_INDEX, so the application and
+ *   other libraries can keep using index 0 (FreeRTOS 10.4 or newer)
+ * - W25Q128_BUS_LOCK_PTHREAD: mutex and condition variables for host tests,
+ *   priority is set per thread with W25Q128_Bus_SetPriority()
+ *
+ * The asynchronous queue (w25q128_async_ll) runs from interrupts and can not
+ * wait for the bus, it must be the only user of its SPI bus.
+ */
+
+#ifndef W25Q128_BUS_H
+#define W25Q128_BUS_H
+
+#include "w25q128_ll.h"
+
+#define W25Q128_BUS_LOCK_NONE     0
+#define W25Q128_BUS_LOCK_FREERTOS 1
+#define W25Q128_BUS_LOCK_PTHREAD  2
+
+#ifndef W25Q128_BUS_LOCK
+#define W25Q128_BUS_LOCK W25Q128_BUS_LOCK_NONE
+#endif
+
+// Maximum number of tasks waiting for the bus at the same time
+#ifndef W25Q128_BUS_MAX_WAITERS
+#define W25Q128_BUS_MAX_WAITERS 8
+#endif
+
+#if W25Q128_BUS_LOCK == W25Q128_BUS_LOCK_FREERTOS
+#include "FreeRTOS.h"
+#include "task.h"
+typedef TaskHandle_t W25Q128_BusThreadTypeDef;
+
+// Task notification index reserved for the bus lock
+#ifndef W25Q128_BUS_NOTIFY_INDEX
+#define W25Q128_BUS_NOTIFY_INDEX 1
+#endif
+
+#if W25Q128_BUS_NOTIFY_INDEX >= configTASK_NOTIFICATION_ARRAY_ENTRIES
+#error "W25Q128_BUS_NOTIFY_INDEX needs more notification array entries"
+#endif
+#elif W25Q128_BUS_LOCK == W25Q128_BUS_LOCK_PTHREAD
+#include <pthread.h>
+typedef pthread_t W25Q128_BusThreadTypeDef;
+#else
+typedef uint8_t W25Q128_BusThreadTypeDef;
+#endif
+
+/**
+ * Task waiting for the bus, lives on the stack of the waiting task.
+ */
+typedef struct {
+    W25Q128_BusThreadTypeDef thread;
+    uint32_t priority;
+    uint32_t seq;           // Keeps waiters of equal priority in FIFO order
+    volatile uint8_t granted;
+#if W25Q128_BUS_LOCK == W25Q128_BUS_LOCK_PTHREAD
+    pthread_cond_t cond;
+#endif
+} W25Q128_BusWaiterTypeDef;
+
+typedef struct {
+    uint32_t acquisitions;  // Outermost locks
+    uint32_t contentions;   // Locks that had to wait
+    uint32_t handoffs;      // Releases that passed the bus to a waiter
+    uint32_t max_waiters;
+} W25Q128_BusStatsTypeDef;
+
+typedef struct W25Q128_Bus {
+#if W25Q128_BUS_LOCK == W25Q128_BUS_LOCK_PTHREAD
+    pthread_mutex_t mutex;
+#endif
+    uint8_t busy;
+    W25Q128_BusThreadTypeDef owner;
+    uint16_t depth;
+
+    W25Q128_BusWaiterTypeDef *waiters[W25Q128_BUS_MAX_WAITERS];
+    uint8_t num_waiters;
+    uint32_t seq;
+
+    W25Q128_BusStatsTypeDef stats;
+} W25Q128_BusTypeDef;
+
+
+/**
+ * @brief Function that initializes the bus arbiter
+ * @param bus Pointer to the bus struct
+ * @retval ::W25Q128_StatusTypeDef
+ */
+W25Q128_StatusTypeDef W25Q128_Bus_Init(W25Q128_BusTypeDef *bus);
+
+/**
+ * @brief Function that takes the bus, waits while another task owns it
+ * @param bus Pointer to the bus struct
+ * @retval ::W25Q128_StatusTypeDef
+ * @note W25Q128_ERROR is returned if W25Q128_BUS_MAX_WAITERS tasks already
+ *       wait. Nested calls of the owner only count the depth.
+ */
+W25Q128_StatusTypeDef W25Q128_Bus_Acquire(W25Q128_BusTypeDef *bus);
+
+/**
+ * @brief Function that gives the bus back, or passes it to the waiting task
+ *        with the highest priority
+ * @param bus Pointer to the bus struct
+ * @return None
+ */
+void W25Q128_Bus_Release(W25Q128_BusTypeDef *bus);
+
+/**
+ * @brief Function that locks the bus of a device, if it has one
+ * @param w25 Pointer to the flash configuration struct
+ * @retval ::W25Q128_StatusTypeDef
+ */
+W25Q128_StatusTypeDef W25Q128_Bus_Lock(W25Q128_TypeDef *w25);
+
+/**
+ * @brief Function that unlocks the bus of a device, if it has one
+ * @param w25 Pointer to the flash configuration struct
+ * @return None
+ */
+void W25Q128_Bus_Unlock(W25Q128_TypeDef *w25);
+
+/**
+ * @brief Function that copies bus counters
+ * @param bus Pointer to the bus struct
+ * @param stats Pointer to the struct in which counters are copied
+ * @return None
+ */
+void W25Q128_Bus_GetStats(W25Q128_BusTypeDef *bus,
+                                            W25Q128_BusStatsTypeDef *stats);
+
+#if W25Q128_BUS_LOCK == W25Q128_BUS_LOCK_PTHREAD
+/**
+ * @brief Function that sets the bus priority of the calling thread
+ * @param priority Priority, higher value is served first
+ * @return None
+ */
+void W25Q128_Bus_SetPriority(uint32_t priority);
+#endif
+
+#endif
\ No newline at end of file
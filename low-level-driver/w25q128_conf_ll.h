@@ -12,6 +12,15 @@
 
 #include "stm32f4xx_hal.h"
 
+/* Critical section used to protect the asynchronous transfer queue */
+#define W25Q128_ENTER_CRITICAL(primask) \
+    do { (primask) = __get_PRIMASK(); __disable_irq(); } while (0)
+#define W25Q128_EXIT_CRITICAL(primask) __set_PRIMASK(primask)
+
+/* Shared bus lock (w25q128_bus_ll): 0 - none, 1 - FreeRTOS, 2 - pthread */
+#ifndef W25Q128_BUS_LOCK
+#define W25Q128_BUS_LOCK 0
+#endif
 
 
 
@@ -5,13 +5,103 @@
  */
 
 #include "w25q128_ll.h"
+#include "w25q128_bus_ll.h"
+
+#include <string.h>
 
-#define W25Q128_SPI_TIMEOUT_MS 100
 #define W25Q128_RECOVERY_TIMEOUT_MS 500
 
+// HAL SPI transfers are limited to 16-bit length
+#define W25Q128_SPI_MAX_CHUNK 0xFFFF
+
+#define W25Q128_STREAM_TIMEOUT_MS 500
+
+#define W25Q128_SFDP_SIGNATURE  0x50444653 // "SFDP"
+#define W25Q128_SFDP_BFPT_ID    0xFF00
+// Basic Flash Parameter Table of JESD216B has 16 DWORDs, 12 are used
+#define W25Q128_SFDP_BFPT_DWORDS 16
+
+// W25Q128JV, datasheet maximums are used as timeouts
+static const W25Q128_GeometryTypeDef default_geometry = {
+    .capacity = W25Q128_CAPACITY,
+    .page_size = W25Q128_PAGE_SIZE,
+    .erase_inst = {INST_SECTOR_ERASE_4KB, INST_BLOCK_ERASE_32KB, 
+                                                    INST_BLOCK_ERASE_64KB},
+    .erase_size = {W25Q128_SECTOR_SIZE, W25Q128_BLOCK32_SIZE, 
+                                                    W25Q128_BLOCK64_SIZE},
+    .erase_typ_ms = {45, 120, 150},
+    .erase_max_ms = {W25Q128_TIMEOUT_SECTOR_ERASE_MS, 
+                    W25Q128_TIMEOUT_BLOCK32_ERASE_MS,
+                    W25Q128_TIMEOUT_BLOCK64_ERASE_MS},
+    .page_program_max_ms = W25Q128_TIMEOUT_PAGE_PROGRAM_MS,
+    .chip_erase_max_ms = W25Q128_TIMEOUT_CHIP_ERASE_MS,
+    .release_power_down_us = W25Q128_TIME_RELEASE_POWER_DOWN_US,
+    .read = {
+        [W25Q128_READ_MODE_SINGLE] = {INST_READ_DATA, 0, 0},
+        [W25Q128_READ_MODE_FAST] = {INST_FAST_READ, 8, 0},
+        [W25Q128_READ_MODE_DUAL_OUT] = {INST_FAST_READ_DUAL_OUTPUT, 8, 0},
+        [W25Q128_READ_MODE_DUAL_IO] = {INST_FAST_READ_DUAL_IO, 0, 4},
+        [W25Q128_READ_MODE_QUAD_OUT] = {INST_FAST_READ_QUAD_OUTPUT, 8, 0},
+        [W25Q128_READ_MODE_QUAD_IO] = {INST_FAST_READ_QUAD_IO, 4, 2},
+    },
+};
+
+#if W25Q128_STATIC_WORK_BUFFER
+// Shared sector buffer of W25Q128_Write, used if device has no work_buf
+static uint8_t work_buffer[W25Q128_SECTOR_SIZE];
+#endif
+
 /*************************** Static functions *********************************/
 static uint32_t calculate_bytes_to_write(uint32_t size, uint16_t offset);
 static uint32_t calculate_bytes_to_modify(uint32_t size, uint16_t offset);
+static const W25Q128_GeometryTypeDef *geometry(W25Q128_TypeDef *w25);
+static uint32_t erase_timeout(W25Q128_TypeDef *w25, uint8_t inst);
+static W25Q128_StatusTypeDef parse_bfpt(W25Q128_GeometryTypeDef *geo,
+                                        const uint32_t *dw, uint8_t num_dw);
+static W25Q128_ReadCommandTypeDef bfpt_read_command(uint32_t field, 
+                                                        uint8_t addr_lines);
+static W25Q128_StatusTypeDef erase_command(W25Q128_TypeDef *w25, uint8_t inst,
+                                        uint32_t mem_addr);
+static W25Q128_StatusTypeDef erase_command_unlocked(W25Q128_TypeDef *w25, 
+                                        uint8_t inst, uint32_t mem_addr);
+static W25Q128_StatusTypeDef erase_chip_unlocked(W25Q128_TypeDef *w25);
+static W25Q128_StatusTypeDef program_page(W25Q128_TypeDef *w25, 
+                                        uint32_t mem_addr, uint8_t *data,
+                                        uint32_t size);
+static W25Q128_StatusTypeDef program_page_unlocked(W25Q128_TypeDef *w25,
+                                        uint32_t mem_addr, uint8_t *data,
+                                        uint32_t size);
+static W25Q128_StatusTypeDef write_sector(W25Q128_TypeDef *w25,
+                                        uint32_t sector_addr, 
+                                        uint32_t sector_offset, uint32_t size,
+                                        uint8_t *data, uint8_t *sector_data);
+static uint8_t is_blank(const uint8_t *data, uint32_t size);
+#if W25Q128_ERASED_MAP
+static W25Q128_StatusTypeDef blank_check(W25Q128_TypeDef *w25, 
+                                        uint32_t mem_addr, uint8_t *blank);
+#endif
+static W25Q128_StatusTypeDef send_instruction(W25Q128_TypeDef *w25, 
+                                                                uint8_t inst);
+static W25Q128_StatusTypeDef read_data(W25Q128_TypeDef *w25, 
+                                        uint32_t mem_addr, uint32_t size,
+                                        uint8_t *r_data, uint8_t continuous);
+static W25Q128_StatusTypeDef command_read(W25Q128_TypeDef *w25,
+                                        const W25Q128_CommandTypeDef *cmd,
+                                        uint8_t *data, uint32_t size);
+static W25Q128_StatusTypeDef command_write(W25Q128_TypeDef *w25,
+                                        const W25Q128_CommandTypeDef *cmd,
+                                        uint8_t *data, uint32_t size);
+static W25Q128_StatusTypeDef wait_spi_ready(W25Q128_TypeDef *w25, 
+                                                        uint32_t timeout_ms);
+static void delay_ms(W25Q128_TypeDef *w25, uint32_t ms);
+static W25Q128_StatusTypeDef write_status_register_unlocked(
+                                        W25Q128_TypeDef *w25,
+                                        W25Q128_CommandTypeDef *cmd,
+                                        uint8_t value);
+#if W25Q128_AUTO_POWER_DOWN
+static W25Q128_StatusTypeDef power_release(W25Q128_TypeDef *w25);
+static uint32_t power_time_left(W25Q128_TypeDef *w25, uint32_t time_us);
+#endif
 
 void W25Q128_ChipSelect(W25Q128_TypeDef *w25q128)
 {
@@ -23,16 +113,30 @@ void W25Q128_ChipDeselect(W25Q128_TypeDef *w25q128)
     HAL_GPIO_WritePin(w25q128->cs_port, w25q128->cs_pin, GPIO_PIN_SET);
 }
 
-void W25Q128_SPIWrite(W25Q128_TypeDef *w25q128, uint8_t *data, uint16_t len, 
+void W25Q128_SPIWrite(W25Q128_TypeDef *w25q128, uint8_t *data, uint32_t len, 
                                                             uint32_t timeout)
 {
-    HAL_SPI_Transmit(w25q128->hspi, data, len, timeout);
+    while (len > 0)
+    {
+        uint16_t chunk = (len > W25Q128_SPI_MAX_CHUNK) ? 
+                                                W25Q128_SPI_MAX_CHUNK : len;
+        HAL_SPI_Transmit(w25q128->hspi, data, chunk, timeout);
+        data += chunk;
+        len -= chunk;
+    }
 }
 
-void W25Q128_SPIRead(W25Q128_TypeDef *w25q128, uint8_t *data, uint16_t len, 
+void W25Q128_SPIRead(W25Q128_TypeDef *w25q128, uint8_t *data, uint32_t len, 
                                                             uint32_t timeout)
 {
-    HAL_SPI_Receive(w25q128->hspi, data, len, timeout);
+    while (len > 0)
+    {
+        uint16_t chunk = (len > W25Q128_SPI_MAX_CHUNK) ? 
+                                                W25Q128_SPI_MAX_CHUNK : len;
+        HAL_SPI_Receive(w25q128->hspi, data, chunk, timeout);
+        data += chunk;
+        len -= chunk;
+    }
 }
 
 void W25Q128_DelayMs(uint32_t delay_ms)
@@ -40,36 +144,161 @@ void W25Q128_DelayMs(uint32_t delay_ms)
     HAL_Delay(delay_ms);
 }
 
+#if W25Q128_AUTO_POWER_DOWN
+void W25Q128_DelayUs(uint32_t delay_us)
+{
+    volatile uint32_t cycles = delay_us * (SystemCoreClock / 1000000U);
+
+    while (cycles > 0)
+        cycles--;
+}
+#endif
+
 void W25Q128_Reset(W25Q128_TypeDef *w25q128)
 {
-    uint8_t t_data[2];
+    if (W25Q128_Bus_Lock(w25q128) != W25Q128_SUCCESS)
+        return;
+
+    send_instruction(w25q128, INST_ENABLE_RESET);
+    send_instruction(w25q128, INST_RESET_DEVICE);
+
+    delay_ms(w25q128, 100);
+    W25Q128_Bus_Unlock(w25q128);
+}
+
+W25Q128_StatusTypeDef W25Q128_ReadSFDP(W25Q128_TypeDef *w25, uint32_t addr,
+                                            uint8_t *data, uint32_t size)
+{
+    W25Q128_CommandTypeDef cmd = {0};
+
+    cmd.instruction = INST_READ_SFDP_REG;
+    cmd.instruction_lines = 1;
+    cmd.address = addr;
+    cmd.address_bytes = 3;
+    cmd.address_lines = 1;
+    cmd.dummy_cycles = 8;
+    cmd.data_lines = 1;
+
+    return command_read(w25, &cmd, data, size);
+}
+
+W25Q128_StatusTypeDef W25Q128_InitSFDP(W25Q128_TypeDef *w25)
+{
+    W25Q128_GeometryTypeDef geo = {0};
+    uint32_t dw[W25Q128_SFDP_BFPT_DWORDS] = {0};
+    uint8_t header[8];
+    uint8_t num_headers;
+    uint32_t table_addr = 0;
+    uint8_t table_len = 0;
+
+    if (W25Q128_ReadSFDP(w25, 0, header, sizeof(header)) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    if ((header[0] | (header[1] << 8) | (header[2] << 16) | 
+        ((uint32_t)header[3] << 24)) != W25Q128_SFDP_SIGNATURE)
+        return W25Q128_ERROR;
 
-    t_data[0] = INST_ENABLE_RESET;
-    t_data[1] = INST_RESET_DEVICE;
+    // Number of parameter headers is zero based
+    num_headers = header[6];
+    for (uint16_t i = 0; i <= num_headers && table_addr == 0; i++)
+    {
+        if (W25Q128_ReadSFDP(w25, 8 + i * 8, header, sizeof(header)) 
+                                                        != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+
+        // ID LSB : ID MSB, major revision 1 is the JESD216 table
+        if ((header[0] | (header[7] << 8)) == W25Q128_SFDP_BFPT_ID && 
+                                                            header[2] == 1)
+        {
+            table_addr = header[4] | (header[5] << 8) | (header[6] << 16);
+            table_len = header[3];
+        }
+    }
+    if (table_addr == 0 || table_len < 9)
+        return W25Q128_ERROR;
+
+    if (table_len > W25Q128_SFDP_BFPT_DWORDS)
+        table_len = W25Q128_SFDP_BFPT_DWORDS;
+
+    if (W25Q128_ReadSFDP(w25, table_addr, (uint8_t *)dw, table_len * 4) 
+                                                        != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    // SFDP is little endian, as is the Cortex-M
+    if (parse_bfpt(&geo, dw, table_len) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    w25->geometry = geo;
+#if W25Q128_4BYTE_ADDRESS
+    // Upper memory is reached with the 4-byte opcodes only
+    w25->address_bytes = (geo.capacity > W25Q128_CAPACITY) ? 4 : 3;
+#endif
+    w25->continuous_read = 0;
+    w25->read_mode = W25Q128_READ_MODE_AUTO;
+
+    return W25Q128_SUCCESS;
+}
 
-    W25Q128_ChipSelect(w25q128);
+uint32_t W25Q128_GetCapacity(W25Q128_TypeDef *w25)
+{
+    return geometry(w25)->capacity;
+}
 
-    W25Q128_SPIWrite(w25q128, t_data, 2, W25Q128_SPI_TIMEOUT_MS);
+uint32_t W25Q128_GetTimeout(W25Q128_TypeDef *w25, uint8_t inst)
+{
+    if (inst == INST_PAGE_PROGRAM)
+        return geometry(w25)->page_program_max_ms;
+    if (inst == INST_CHIP_ERASE)
+        return geometry(w25)->chip_erase_max_ms;
 
-    W25Q128_ChipDeselect(w25q128);
+    return erase_timeout(w25, inst);
+}
 
-    W25Q128_DelayMs(100);
+#if W25Q128_4BYTE_ADDRESS
+uint8_t W25Q128_Instruction4B(uint8_t inst)
+{
+    switch (inst)
+    {
+        case INST_READ_DATA:
+            return INST_READ_DATA_4B;
+        case INST_FAST_READ:
+            return INST_FAST_READ_4B;
+        case INST_FAST_READ_DUAL_OUTPUT:
+            return INST_FAST_READ_DUAL_OUTPUT_4B;
+        case INST_FAST_READ_QUAD_OUTPUT:
+            return INST_FAST_READ_QUAD_OUTPUT_4B;
+        case INST_FAST_READ_DUAL_IO:
+            return INST_FAST_READ_DUAL_IO_4B;
+        case INST_FAST_READ_QUAD_IO:
+            return INST_FAST_READ_QUAD_IO_4B;
+        case INST_PAGE_PROGRAM:
+            return INST_PAGE_PROGRAM_4B;
+        case INST_QUAD_PAGE_PROGRAM:
+            return INST_QUAD_PAGE_PROGRAM_4B;
+        case INST_SECTOR_ERASE_4KB:
+            return INST_SECTOR_ERASE_4KB_4B;
+        case INST_BLOCK_ERASE_64KB:
+            return INST_BLOCK_ERASE_64KB_4B;
+        default:
+            return 0;
+    }
 }
+#endif
 
 uint32_t W25Q128_ReadID(W25Q128_TypeDef *w25q128, W25Q128_ID_TypeDef id)
 {
-    uint8_t t_data;
+    W25Q128_CommandTypeDef cmd = {0};
     uint8_t r_data[3];
-    uint32_t result_id;
+    uint32_t result_id = 0;
 
     switch (id)
     {
         case ID_JEDEC:
-            t_data = INST_JEDEC_ID;
-            W25Q128_ChipSelect(w25q128);
-            W25Q128_SPIWrite(w25q128, &t_data, 1, W25Q128_SPI_TIMEOUT_MS);
-            W25Q128_SPIRead(w25q128, r_data, 3, W25Q128_SPI_TIMEOUT_MS);
-            W25Q128_ChipDeselect(w25q128);
+            cmd.instruction = INST_JEDEC_ID;
+            cmd.instruction_lines = 1;
+            cmd.data_lines = 1;
+            if (command_read(w25q128, &cmd, r_data, 3) != W25Q128_SUCCESS)
+                break;
 
             // MFN_ID : MEM_ID : CAPACITY_ID
             result_id = ((r_data[0] << 16) | (r_data[1] << 8) | (r_data[2])); 
@@ -87,20 +316,9 @@ W25Q128_StatusTypeDef W25Q128_Read(W25Q128_TypeDef *w25,
                                     uint32_t size,
                                     uint8_t *r_data)
 {
-    uint8_t t_data[4];
     uint32_t mem_addr = (start_page * 256) + offset;
 
-    t_data[0] = INST_READ_DATA;
-    t_data[1] = (mem_addr >> 16) & 0xFF; // MSB of 24-bit memory address
-    t_data[2] = (mem_addr >> 8) & 0xFF;
-    t_data[3] = (mem_addr) & 0xFF;       // LSB of 24-bit memory address
-
-    W25Q128_ChipSelect(w25);
-    W25Q128_SPIWrite(w25, t_data, sizeof(t_data), W25Q128_SPI_TIMEOUT_MS);
-    W25Q128_SPIRead(w25, r_data, size, W25Q128_SPI_TIMEOUT_MS);
-    W25Q128_ChipDeselect(w25);
-
-    return W25Q128_SUCCESS;
+    return read_data(w25, mem_addr, size, r_data, W25Q128_CONTINUOUS_READ);
 }
 
 W25Q128_StatusTypeDef W25Q128_FastRead(W25Q128_TypeDef *w25,
@@ -109,81 +327,173 @@ W25Q128_StatusTypeDef W25Q128_FastRead(W25Q128_TypeDef *w25,
                                         uint32_t size,
                                         uint8_t *r_data)
 {
-    uint8_t t_data[5];
     uint32_t mem_addr = (start_page * 256) + offset;
-    
-    t_data[0] = INST_FAST_READ;
-    t_data[1] = (mem_addr >> 16) & 0xFF; // MSB of 24-bit memory address
-    t_data[2] = (mem_addr >> 8) & 0xFF;
-    t_data[3] = (mem_addr) & 0xFF;       // LSB of 24-bit memory address
-    t_data[4] = 0x00;
-    
-    W25Q128_ChipSelect(w25);
-    W25Q128_SPIWrite(w25, t_data, sizeof(t_data), W25Q128_SPI_TIMEOUT_MS);
-    W25Q128_SPIRead(w25, r_data, size, W25Q128_SPI_TIMEOUT_MS);
-    W25Q128_ChipDeselect(w25);
-    
-    return W25Q128_SUCCESS;
+
+    return read_data(w25, mem_addr, size, r_data, W25Q128_CONTINUOUS_READ);
 }
 
-W25Q128_StatusTypeDef W25Q128_WriteEnable(W25Q128_TypeDef *w25)
+W25Q128_StatusTypeDef W25Q128_SetReadMode(W25Q128_TypeDef *w25, 
+                                            W25Q128_ReadModeTypeDef mode)
 {
-    uint8_t t_data = INST_WRITE_ENABLE;
+    const W25Q128_GeometryTypeDef *geo = geometry(w25);
 
-    W25Q128_ChipSelect(w25);
-    W25Q128_SPIWrite(w25, &t_data, sizeof(t_data), W25Q128_SPI_TIMEOUT_MS);
-    W25Q128_ChipDeselect(w25);
-    
-    // TODO: Check if there is some better way to implement this delay...
-    W25Q128_DelayMs(5);
+    if (mode == W25Q128_READ_MODE_AUTO)
+    {
+        mode = W25Q128_READ_MODE_FAST;
+        if (w25->transport == W25Q128_TRANSPORT_QSPI)
+        {
+            // Modes are ordered by throughput, pick the fastest supported
+            for (uint8_t m = W25Q128_READ_MODE_QUAD_IO; 
+                                        m > W25Q128_READ_MODE_FAST; m--)
+            {
+                if (geo->read[m].instruction == 0)
+                    continue;
+                if (m >= W25Q128_READ_MODE_QUAD_OUT && 
+                                W25Q128_EnableQuad(w25) != W25Q128_SUCCESS)
+                    continue;
+                mode = (W25Q128_ReadModeTypeDef)m;
+                break;
+            }
+        }
+    }
+
+    // Standard SPI can not receive on multiple lines
+    if (w25->transport == W25Q128_TRANSPORT_SPI && 
+                                            mode > W25Q128_READ_MODE_FAST)
+        return W25Q128_ERROR;
+
+    if (geo->read[mode].instruction == 0)
+        return W25Q128_ERROR;
+
+    if ((mode == W25Q128_READ_MODE_QUAD_OUT || 
+                                        mode == W25Q128_READ_MODE_QUAD_IO) &&
+        W25Q128_EnableQuad(w25) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+#if W25Q128_CONTINUOUS_READ
+    // Latched instruction belongs to the previous mode
+    if (w25->continuous_read && mode != w25->read_mode)
+    {
+        uint8_t dummy;
+
+        if (read_data(w25, 0, 1, &dummy, 0) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+    }
+#endif
+    w25->read_mode = mode;
 
     return W25Q128_SUCCESS;
 }
 
-W25Q128_StatusTypeDef W25Q128_WriteDisable(W25Q128_TypeDef *w25)
+W25Q128_StatusTypeDef W25Q128_EnableQuad(W25Q128_TypeDef *w25)
 {
-    uint8_t t_data = INST_WRITE_DISABLE;
+    uint8_t sr2 = W25Q128_ReadStatusRegisterN(w25, 2);
 
-    W25Q128_ChipSelect(w25);
-    W25Q128_SPIWrite(w25, &t_data, sizeof(t_data), W25Q128_SPI_TIMEOUT_MS);
-    W25Q128_ChipDeselect(w25);
+    if (!(sr2 & W25Q128_SR2_QE))
+    {
+        if (W25Q128_WriteStatusRegisterN(w25, 2, sr2 | W25Q128_SR2_QE) 
+                                                        != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+
+        if (!(W25Q128_ReadStatusRegisterN(w25, 2) & W25Q128_SR2_QE))
+            return W25Q128_ERROR;
+    }
+    w25->quad_enabled = 1;
+
+    return W25Q128_SUCCESS;
+}
+
+W25Q128_StatusTypeDef W25Q128_WriteEnable(W25Q128_TypeDef *w25)
+{
+    if (send_instruction(w25, INST_WRITE_ENABLE) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
     
-    // TODO: Check if there is some better way to implement this delay...
-    W25Q128_DelayMs(5);
+    // WEL is latched on the rising edge of CS, no need to wait for it
+    if (!(W25Q128_ReadStatusRegister(w25) & W25Q128_SR1_WEL))
+        return W25Q128_ERROR;
 
     return W25Q128_SUCCESS;
 }
 
-W25Q128_StatusTypeDef W25Q128_EraseSector(W25Q128_TypeDef *w25, 
-                                                        uint16_t num_sector)
+W25Q128_StatusTypeDef W25Q128_WriteDisable(W25Q128_TypeDef *w25)
 {
-    W25Q128_StatusTypeDef status;
-    uint8_t t_data[4];
+    return send_instruction(w25, INST_WRITE_DISABLE);
+}
 
+W25Q128_StatusTypeDef W25Q128_EraseSector(W25Q128_TypeDef *w25, 
+                                                        uint32_t num_sector)
+{
     // Sector contains 16 pages, page contains 256 bytes.
     uint32_t mem_addr = num_sector*16*256;
 
-    status = W25Q128_WriteEnable(w25);
-    if (status != W25Q128_SUCCESS)
+    if (num_sector >= W25Q128_GetCapacity(w25) / W25Q128_SECTOR_SIZE)
         return W25Q128_ERROR;
-    
-    t_data[0] = INST_SECTOR_ERASE_4KB;
-    t_data[1] = (mem_addr >> 16) & 0xFF; // MSB of a 24-bit memory address
-    t_data[2] = (mem_addr >> 8) & 0xFF;
-    t_data[3] = (mem_addr) & 0xFF;       // LSB of a 24-bit memory address
-
-    W25Q128_ChipSelect(w25);
-    W25Q128_SPIWrite(w25, t_data, sizeof(t_data), W25Q128_SPI_TIMEOUT_MS);
-    W25Q128_ChipDeselect(w25);
 
-    // TODO: Check here for BUSY bit in Status Register
-    if (W25Q128_CheckBUSY(w25) == W25Q128_READY)
+#if W25Q128_ERASED_MAP
+    if (!W25Q128_IsSectorErased(w25, num_sector))
     {
-        status = W25Q128_WriteDisable(w25);
-        if (status != W25Q128_SUCCESS)
+        // Reading a sector is much faster than erasing it
+        uint8_t blank;
+        if (blank_check(w25, mem_addr, &blank) != W25Q128_SUCCESS)
             return W25Q128_ERROR;
-    } else {
+        if (blank)
+            W25Q128_UpdateErasedMap(w25, mem_addr, W25Q128_SECTOR_SIZE, 1);
+    }
+
+    if (W25Q128_IsSectorErased(w25, num_sector))
+    {
+        w25->erase_stats.erases_avoided++;
+        return W25Q128_SUCCESS;
+    }
+#endif
+
+    return erase_command(w25, INST_SECTOR_ERASE_4KB, mem_addr);
+}
+
+W25Q128_StatusTypeDef W25Q128_EraseChip(W25Q128_TypeDef *w25)
+{
+    W25Q128_StatusTypeDef status;
+
+    if (W25Q128_Bus_Lock(w25) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+    status = erase_chip_unlocked(w25);
+    W25Q128_Bus_Unlock(w25);
+
+    return status;
+}
+
+W25Q128_StatusTypeDef W25Q128_EraseRange(W25Q128_TypeDef *w25, uint32_t addr,
+                                                                uint32_t len)
+{
+    const W25Q128_GeometryTypeDef *geo = geometry(w25);
+    uint32_t capacity = W25Q128_GetCapacity(w25);
+
+    if ((addr % W25Q128_SECTOR_SIZE) || (len % W25Q128_SECTOR_SIZE) ||
+        (addr > capacity) || (len > capacity - addr))
         return W25Q128_ERROR;
+
+    if (addr == 0 && len == capacity)
+        return W25Q128_EraseChip(w25);
+
+    while (len > 0)
+    {
+        uint8_t type = 0;
+
+        // Pick the largest erase that is aligned and fits in the range
+        for (uint8_t i = 0; i < 4; i++)
+        {
+            uint32_t size = geo->erase_size[i];
+            if (size != 0 && !(addr % size) && len >= size &&
+                            W25Q128_ADDRESS_INST(w25, geo->erase_inst[i]))
+                type = i;
+        }
+
+        if (erase_command(w25, geo->erase_inst[type], addr) 
+                                                        != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+
+        addr += geo->erase_size[type];
+        len -= geo->erase_size[type];
     }
 
     return W25Q128_SUCCESS;
@@ -191,38 +501,102 @@ W25Q128_StatusTypeDef W25Q128_EraseSector(W25Q128_TypeDef *w25,
 
 uint8_t W25Q128_ReadStatusRegister(W25Q128_TypeDef *w25)
 {
-    uint8_t t_data = INST_READ_STATUS_REG_1;
+    return W25Q128_ReadStatusRegisterN(w25, 1);
+}
+
+uint8_t W25Q128_ReadStatusRegisterN(W25Q128_TypeDef *w25, uint8_t reg)
+{
+    W25Q128_CommandTypeDef cmd = {0};
     uint8_t status_val = 0;
 
-    W25Q128_ChipSelect(w25);
-    W25Q128_SPIWrite(w25, &t_data, sizeof(uint8_t), W25Q128_SPI_TIMEOUT_MS);
-    W25Q128_SPIRead(w25, &status_val, sizeof(uint8_t), W25Q128_SPI_TIMEOUT_MS);
-    W25Q128_ChipDeselect(w25);
+    switch (reg)
+    {
+        case 2:
+            cmd.instruction = INST_READ_STATUS_REG_2;
+            break;
+        case 3:
+            cmd.instruction = INST_READ_STATUS_REG_3;
+            break;
+        default:
+            cmd.instruction = INST_READ_STATUS_REG_1;
+            break;
+    }
+    cmd.instruction_lines = 1;
+    cmd.data_lines = 1;
+
+    command_read(w25, &cmd, &status_val, sizeof(uint8_t));
 
     return status_val;
 }
 
+W25Q128_StatusTypeDef W25Q128_WriteStatusRegisterN(W25Q128_TypeDef *w25, 
+                                                uint8_t reg, uint8_t value)
+{
+    W25Q128_CommandTypeDef cmd = {0};
+    W25Q128_StatusTypeDef status;
+
+    switch (reg)
+    {
+        case 1:
+            cmd.instruction = INST_WRITE_STATUS_REG_1;
+            break;
+        case 2:
+            cmd.instruction = INST_WRITE_STATUS_REG_2;
+            break;
+        case 3:
+            cmd.instruction = INST_WRITE_STATUS_REG_3;
+            break;
+        default:
+            return W25Q128_ERROR;
+    }
+    cmd.instruction_lines = 1;
+    cmd.data_lines = 1;
+
+    if (W25Q128_Bus_Lock(w25) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+    status = write_status_register_unlocked(w25, &cmd, value);
+    W25Q128_Bus_Unlock(w25);
+
+    return status;
+}
+
 W25Q128_StatusTypeDef W25Q128_CheckBUSY(W25Q128_TypeDef *w25)
 {
-    uint32_t current_time = HAL_GetTick();
-    while(W25Q128_ReadStatusRegister(w25) & 0x01)
+    return W25Q128_WaitForReady(w25, W25Q128_RECOVERY_TIMEOUT_MS);
+}
+
+W25Q128_StatusTypeDef W25Q128_WaitForReady(W25Q128_TypeDef *w25, 
+                                                        uint32_t timeout_ms)
+{
+    uint32_t start_time = HAL_GetTick();
+    W25Q128_StatusTypeDef status = W25Q128_READY;
+
+    while(W25Q128_ReadStatusRegister(w25) & W25Q128_SR1_BUSY)
     {
-        if ((HAL_GetTick() - current_time) > W25Q128_RECOVERY_TIMEOUT_MS)
+        uint32_t elapsed = HAL_GetTick() - start_time;
+#if W25Q128_INSTRUMENTATION
+        w25->instr.busy_polls++;
+#endif
+        if (elapsed > timeout_ms)
         {
-            return W25Q128_ERROR_TIMEOUT;
+            status = W25Q128_ERROR_TIMEOUT;
+            break;
         }
-        W25Q128_DelayMs(1);
+        // Short operations (page program, WREN) finish within the spin 
+        // window, long ones (erase) should not hog the CPU.
+        if (elapsed >= W25Q128_POLL_SPIN_MS)
+            delay_ms(w25, 1);
     }
-    return W25Q128_READY;
+#if W25Q128_INSTRUMENTATION
+    w25->instr.busy_ms += HAL_GetTick() - start_time;
+#endif
+    return status;
 }
 
 W25Q128_StatusTypeDef W25Q128_WritePage(W25Q128_TypeDef *w25, uint32_t page, 
                                         uint16_t offset, uint32_t data_size, 
                                         uint8_t *data)
 {
-    uint8_t t_data[266];
-    uint32_t index = 0;
-
     // Position of the data - track data in the data pointer
     uint32_t data_position = 0;
     
@@ -236,10 +610,10 @@ W25Q128_StatusTypeDef W25Q128_WritePage(W25Q128_TypeDef *w25, uint32_t page,
     uint32_t num_pages = end_page - start_page + 1;
 
 #if ERASE_BEFORE_PAGE_WRITE_AUTO
-    uint16_t start_sector = start_page/16;
-    uint16_t end_sector = end_page/16;
-    uint16_t num_sectors = end_sector - start_sector + 1;
-    for (int i = 0; i < num_sectors; i++)
+    uint32_t start_sector = start_page/16;
+    uint32_t end_sector = end_page/16;
+    uint32_t num_sectors = end_sector - start_sector + 1;
+    for (uint32_t i = 0; i < num_sectors; i++)
     {
         W25Q128_EraseSector(w25, start_sector++);
     }
@@ -251,35 +625,14 @@ W25Q128_StatusTypeDef W25Q128_WritePage(W25Q128_TypeDef *w25, uint32_t page,
         uint32_t mem_addr = (start_page * 256) + offset;
         uint16_t bytes_remaining = calculate_bytes_to_write(data_size, offset); 
         
-        W25Q128_WriteEnable(w25);
-
-        t_data[0] = INST_PAGE_PROGRAM;
-        t_data[1] = (mem_addr >> 16) & 0xFF; 
-        t_data[2] = (mem_addr >> 8) & 0xFF;
-        t_data[3] = (mem_addr) & 0xFF;
-
-        index = 4;
-
-        uint16_t bytes_to_send = bytes_remaining + index;
-
-        for (int i = 0; i < bytes_remaining; i++)
-        {
-            t_data[index++] = data[i + data_position];
-        }
-
-        W25Q128_ChipSelect(w25);
-
-        W25Q128_SPIWrite(w25, t_data, bytes_to_send, W25Q128_SPI_TIMEOUT_MS);
-
-        W25Q128_ChipDeselect(w25);
+        if (program_page(w25, mem_addr, &data[data_position], 
+                                        bytes_remaining) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
         
         start_page++;
         offset = 0;
         data_size = data_size - bytes_remaining;
         data_position = data_position + bytes_remaining;
-
-        W25Q128_DelayMs(5);
-        W25Q128_WriteDisable(w25);
     }
 
     return W25Q128_SUCCESS;
@@ -289,55 +642,1104 @@ W25Q128_StatusTypeDef W25Q128_Write(W25Q128_TypeDef *w25, uint32_t page,
                                     uint16_t offset, uint32_t size, 
                                     uint8_t *data)
 {
-    uint16_t start_sector = page/16;
-    uint16_t end_sector = (page + ((size + offset - 1)/256))/16;
-    uint16_t num_sectors = end_sector - start_sector + 1;
+    uint8_t *previous_data = w25->work_buf;
+    uint32_t mem_addr = (page * 256) + offset;
 
-    uint8_t previous_data[W25Q128_SECTOR_SIZE];
-    uint32_t sector_offset = ((page%16)*256) + offset;
-    uint32_t data_index = 0;
+    if (previous_data == NULL)
+    {
+#if W25Q128_STATIC_WORK_BUFFER
+        previous_data = work_buffer;
+#else
+        return W25Q128_ERROR;
+#endif
+    }
 
-    for (uint16_t i = 0; i < num_sectors; i++)
+    while (size > 0)
     {
-        uint32_t start_page = start_sector*16;
-        
-        if (W25Q128_FastRead(w25, start_page, 0, 
-                    W25Q128_SECTOR_SIZE, previous_data) != W25Q128_SUCCESS)
+        uint32_t sector_offset = mem_addr % W25Q128_SECTOR_SIZE;
+        uint32_t bytes_remaining = calculate_bytes_to_modify(size, 
+                                                            sector_offset);
+        W25Q128_StatusTypeDef status;
+
+        // Work buffer holds the sector until its last page is programmed,
+        // no other task of the bus may use it meanwhile
+        if (W25Q128_Bus_Lock(w25) != W25Q128_SUCCESS)
             return W25Q128_ERROR;
-        
-        uint16_t bytes_remaining = calculate_bytes_to_modify(size, offset);
-        for (uint16_t i = 0; i < bytes_remaining; i++)
-        {
-            previous_data[i + sector_offset] = data[i + data_index];
-        }
-        
-        W25Q128_StatusTypeDef status = W25Q128_WritePage(w25, page, 0, 
-                                            W25Q128_SECTOR_SIZE, previous_data);
+        status = write_sector(w25, mem_addr - sector_offset, sector_offset,
+                                    bytes_remaining, data, previous_data);
+        W25Q128_Bus_Unlock(w25);
         if (status != W25Q128_SUCCESS)
             return W25Q128_ERROR;
-        
-        start_sector++;
-        sector_offset = 0;
-        data_index = data_index + bytes_remaining;
-        size = size - bytes_remaining;
+
+        mem_addr += bytes_remaining;
+        data += bytes_remaining;
+        size -= bytes_remaining;
     }
 
     return W25Q128_SUCCESS;
 }
 
-/*************************** Static functions *********************************/
-static uint32_t calculate_bytes_to_write(uint32_t size, uint16_t offset)
+void W25Q128_GetWriteStats(W25Q128_TypeDef *w25, 
+                                        W25Q128_WriteStatsTypeDef *stats)
 {
-    if ((size + offset) < 256)
-        return size; 
-    else 
-        return (256 - offset);
+    *stats = w25->write_stats;
 }
 
-static uint32_t calculate_bytes_to_modify(uint32_t size, uint16_t offset)
+void W25Q128_ResetWriteStats(W25Q128_TypeDef *w25)
 {
-    if ((size + offset) < 4096)
-        return size;
-    else 
-        return (4096 - offset);
+    memset(&w25->write_stats, 0, sizeof(w25->write_stats));
+}
+
+W25Q128_StatusTypeDef W25Q128_StreamRead(W25Q128_TypeDef *w25, uint32_t addr,
+                                        uint32_t size, uint8_t *buf0, 
+                                        uint8_t *buf1, uint16_t chunk_size,
+                                        W25Q128_StreamCallback callback,
+                                        void *user_data)
+{
+    uint8_t *buf[2] = {buf0, buf1};
+    uint8_t header[6];
+    uint8_t header_len = 0;
+    uint32_t offset = 0;
+    uint32_t len;
+    uint8_t i = 0;
+    W25Q128_StatusTypeDef status = W25Q128_SUCCESS;
+
+    if (chunk_size == 0 || addr > W25Q128_GetCapacity(w25) || 
+        size > W25Q128_GetCapacity(w25) - addr)
+        return W25Q128_ERROR;
+
+    if (w25->transport != W25Q128_TRANSPORT_SPI)
+    {
+        while (offset < size)
+        {
+            len = size - offset;
+            if (len > chunk_size)
+                len = chunk_size;
+
+            if (read_data(w25, addr + offset, len, buf[i], 
+                            W25Q128_CONTINUOUS_READ) != W25Q128_SUCCESS)
+                return W25Q128_ERROR;
+            if (callback(buf[i], len, offset, user_data) != W25Q128_SUCCESS)
+                return W25Q128_ERROR;
+
+            offset += len;
+            i ^= 1;
+        }
+        return W25Q128_SUCCESS;
+    }
+
+    if (size == 0)
+        return W25Q128_SUCCESS;
+
+    header[header_len++] = W25Q128_ADDRESS_INST(w25, INST_FAST_READ);
+    for (uint8_t b = W25Q128_ADDRESS_BYTES(w25); b > 0; b--)
+        header[header_len++] = (addr >> (8 * (b - 1))) & 0xFF;
+    header[header_len++] = 0x00; // Dummy byte
+
+    len = (size > chunk_size) ? chunk_size : size;
+
+    // Whole stream is one chip select window
+    if (W25Q128_Bus_Lock(w25) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+#if W25Q128_AUTO_POWER_DOWN
+    if (W25Q128_PowerReady(w25) != W25Q128_SUCCESS)
+    {
+        W25Q128_Bus_Unlock(w25);
+        return W25Q128_ERROR;
+    }
+#endif
+
+    W25Q128_ChipSelect(w25);
+    W25Q128_SPIWrite(w25, header, header_len, W25Q128_STREAM_TIMEOUT_MS);
+    if (HAL_SPI_Receive_DMA(w25->hspi, buf[0], len) != HAL_OK)
+    {
+        W25Q128_ChipDeselect(w25);
+        W25Q128_Bus_Unlock(w25);
+        return W25Q128_ERROR;
+    }
+
+    while (len > 0)
+    {
+        uint32_t next_len = size - offset - len;
+
+        if (wait_spi_ready(w25, W25Q128_STREAM_TIMEOUT_MS) != W25Q128_SUCCESS)
+        {
+            status = W25Q128_ERROR_TIMEOUT;
+            break;
+        }
+
+        // Next chunk is received while the consumer works on this one
+        if (next_len > chunk_size)
+            next_len = chunk_size;
+        if (next_len > 0 && 
+            HAL_SPI_Receive_DMA(w25->hspi, buf[i ^ 1], next_len) != HAL_OK)
+        {
+            status = W25Q128_ERROR;
+            break;
+        }
+
+        if (callback(buf[i], len, offset, user_data) != W25Q128_SUCCESS)
+        {
+            if (next_len > 0)
+                wait_spi_ready(w25, W25Q128_STREAM_TIMEOUT_MS);
+            status = W25Q128_ERROR;
+            break;
+        }
+
+        offset += len;
+        len = next_len;
+        i ^= 1;
+    }
+    W25Q128_ChipDeselect(w25);
+#if W25Q128_AUTO_POWER_DOWN
+    w25->power_last_us = W25Q128_POWER_TIME_US();
+#endif
+    W25Q128_Bus_Unlock(w25);
+
+    return status;
+}
+
+#if W25Q128_ERASED_MAP
+W25Q128_StatusTypeDef W25Q128_ScanErased(W25Q128_TypeDef *w25, 
+                                uint32_t first_sector, uint32_t num_sectors)
+{
+    uint32_t sector_count = W25Q128_GetCapacity(w25) / W25Q128_SECTOR_SIZE;
+
+    if (first_sector > sector_count || 
+                                    num_sectors > sector_count - first_sector)
+        return W25Q128_ERROR;
+
+    for (uint32_t i = 0; i < num_sectors; i++)
+    {
+        uint32_t mem_addr = (first_sector + i) * W25Q128_SECTOR_SIZE;
+        uint8_t blank;
+
+        if (blank_check(w25, mem_addr, &blank) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+        W25Q128_UpdateErasedMap(w25, mem_addr, W25Q128_SECTOR_SIZE, blank);
+    }
+
+    return W25Q128_SUCCESS;
+}
+
+uint8_t W25Q128_IsSectorErased(W25Q128_TypeDef *w25, uint32_t num_sector)
+{
+    return (w25->erased_map[num_sector / 8] >> (num_sector % 8)) & 0x01;
+}
+
+void W25Q128_UpdateErasedMap(W25Q128_TypeDef *w25, uint32_t addr, 
+                                                uint32_t size, uint8_t erased)
+{
+    uint32_t first = addr / W25Q128_SECTOR_SIZE;
+    uint32_t last = (addr + size - 1) / W25Q128_SECTOR_SIZE;
+    uint32_t primask;
+
+    if (size == 0)
+        return;
+
+    // Async queue updates the map from the DMA interrupt, the byte RMW must
+    // not be split
+    W25Q128_ENTER_CRITICAL(primask);
+    for (uint32_t sector = first; sector <= last; sector++)
+    {
+        if (erased)
+            w25->erased_map[sector / 8] |= (1 << (sector % 8));
+        else
+            w25->erased_map[sector / 8] &= ~(1 << (sector % 8));
+    }
+    W25Q128_EXIT_CRITICAL(primask);
+}
+
+W25Q128_StatusTypeDef W25Q128_PreEraseSector(W25Q128_TypeDef *w25, 
+                                                        uint32_t num_sector)
+{
+    uint32_t start_time = HAL_GetTick();
+    uint32_t erases = w25->erase_stats.erases;
+    W25Q128_StatusTypeDef status;
+
+    status = W25Q128_EraseSector(w25, num_sector);
+
+    if (w25->erase_stats.erases != erases)
+    {
+        w25->erase_stats.background_erases++;
+        w25->erase_stats.background_time_ms += HAL_GetTick() - start_time;
+    }
+
+    return status;
+}
+
+void W25Q128_GetEraseStats(W25Q128_TypeDef *w25, 
+                                        W25Q128_EraseStatsTypeDef *stats)
+{
+    *stats = w25->erase_stats;
+}
+
+void W25Q128_ResetEraseStats(W25Q128_TypeDef *w25)
+{
+    memset(&w25->erase_stats, 0, sizeof(w25->erase_stats));
+}
+#endif
+
+#if W25Q128_INSTRUMENTATION
+void W25Q128_GetInstrumentation(W25Q128_TypeDef *w25, 
+                                    W25Q128_InstrumentationTypeDef *instr)
+{
+    *instr = w25->instr;
+}
+
+void W25Q128_ResetInstrumentation(W25Q128_TypeDef *w25)
+{
+    memset(&w25->instr, 0, sizeof(w25->instr));
+}
+
+void W25Q128_InstrHistAdd(uint32_t *hist, uint32_t us)
+{
+    uint8_t bucket = 0;
+
+    while (us != 0 && bucket < W25Q128_INSTR_HIST_BUCKETS - 1)
+    {
+        us >>= 1;
+        bucket++;
+    }
+    hist[bucket]++;
+}
+#endif
+
+#if W25Q128_AUTO_POWER_DOWN
+W25Q128_StatusTypeDef W25Q128_PowerIdle(W25Q128_TypeDef *w25)
+{
+    uint32_t idle_ms = w25->power_idle_ms ? w25->power_idle_ms : 
+                                                    W25Q128_POWER_IDLE_MS;
+
+    if (w25->power_down || (W25Q128_POWER_TIME_US() - w25->power_last_us) <
+                                                            idle_ms * 1000U)
+        return W25Q128_SUCCESS;
+
+    return W25Q128_PowerDown(w25);
+}
+
+W25Q128_StatusTypeDef W25Q128_PowerDown(W25Q128_TypeDef *w25)
+{
+    W25Q128_StatusTypeDef status = W25Q128_SUCCESS;
+    uint32_t now;
+
+    // Queue owns the bus until it drains, the device stays awake for it
+    if (w25->power_async)
+        return W25Q128_BUSY;
+
+    // Nothing else may start between the busy check and the command
+    if (W25Q128_Bus_Lock(w25) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    if (!w25->power_down)
+    {
+        // Device ignores power-down while busy, or it would lose a suspend
+        if ((W25Q128_ReadStatusRegister(w25) & W25Q128_SR1_BUSY) ||
+            (W25Q128_ReadStatusRegisterN(w25, 2) & W25Q128_SR2_SUS))
+        {
+            status = W25Q128_BUSY;
+        }
+        else if (send_instruction(w25, INST_POWER_DOWN) != W25Q128_SUCCESS)
+        {
+            status = W25Q128_ERROR;
+        } else {
+            now = W25Q128_POWER_TIME_US();
+            w25->power_stats.awake_us += now - w25->power_change_us;
+            w25->power_stats.power_downs++;
+            w25->power_change_us = now;
+            w25->power_down = 1;
+            w25->power_releasing = 0;
+        }
+    }
+    W25Q128_Bus_Unlock(w25);
+
+    return status;
+}
+
+W25Q128_StatusTypeDef W25Q128_PowerWake(W25Q128_TypeDef *w25)
+{
+    W25Q128_StatusTypeDef status = W25Q128_SUCCESS;
+
+    if (W25Q128_Bus_Lock(w25) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    if (w25->power_down)
+    {
+        status = power_release(w25);
+        if (status == W25Q128_SUCCESS)
+            w25->power_stats.hinted_releases++;
+    }
+    w25->power_last_us = W25Q128_POWER_TIME_US();
+    W25Q128_Bus_Unlock(w25);
+
+    return status;
+}
+
+W25Q128_StatusTypeDef W25Q128_PowerReady(W25Q128_TypeDef *w25)
+{
+    uint32_t tres1_us = geometry(w25)->release_power_down_us;
+
+    if (w25->power_down && power_release(w25) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    if (w25->power_releasing)
+    {
+        // Time since the release counts, i.e. after W25Q128_PowerWake
+        uint32_t left = power_time_left(w25, tres1_us);
+
+        if (left > 0)
+        {
+            w25->power_stats.release_waits++;
+            W25Q128_POWER_DELAY_US(left);
+        }
+        w25->power_releasing = 0;
+    }
+
+    return W25Q128_SUCCESS;
+}
+
+void W25Q128_GetPowerStats(W25Q128_TypeDef *w25,
+                                        W25Q128_PowerStatsTypeDef *stats)
+{
+    uint32_t elapsed = W25Q128_POWER_TIME_US() - w25->power_change_us;
+
+    *stats = w25->power_stats;
+    if (w25->power_down)
+        stats->power_down_us += elapsed;
+    else
+        stats->awake_us += elapsed;
+}
+
+void W25Q128_ResetPowerStats(W25Q128_TypeDef *w25)
+{
+    memset(&w25->power_stats, 0, sizeof(w25->power_stats));
+    w25->power_change_us = W25Q128_POWER_TIME_US();
+}
+#endif
+
+uint32_t W25Q128_Crc32(uint32_t crc, const uint8_t *data, uint32_t size)
+{
+    // Reflected polynomial 0xEDB88320, a nibble at a time
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+        0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+        0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+    };
+
+    crc = ~crc;
+    for (uint32_t i = 0; i < size; i++)
+    {
+        crc = (crc >> 4) ^ table[(crc ^ data[i]) & 0x0F];
+        crc = (crc >> 4) ^ table[(crc ^ (data[i] >> 4)) & 0x0F];
+    }
+    return ~crc;
+}
+
+/*************************** Static functions *********************************/
+static uint32_t calculate_bytes_to_write(uint32_t size, uint16_t offset)
+{
+    if ((size + offset) < 256)
+        return size; 
+    else 
+        return (256 - offset);
+}
+
+static uint32_t calculate_bytes_to_modify(uint32_t size, uint16_t offset)
+{
+    if ((size + offset) < 4096)
+        return size;
+    else 
+        return (4096 - offset);
+}
+
+// WREN, erase and WIP poll are one transaction on a shared bus
+static W25Q128_StatusTypeDef erase_command(W25Q128_TypeDef *w25, uint8_t inst,
+                                        uint32_t mem_addr)
+{
+    W25Q128_StatusTypeDef status;
+
+    if (W25Q128_Bus_Lock(w25) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+    status = erase_command_unlocked(w25, inst, mem_addr);
+    W25Q128_Bus_Unlock(w25);
+
+    return status;
+}
+
+static W25Q128_StatusTypeDef erase_command_unlocked(W25Q128_TypeDef *w25, 
+                                        uint8_t inst, uint32_t mem_addr)
+{
+    W25Q128_StatusTypeDef status;
+    W25Q128_CommandTypeDef cmd = {0};
+    uint32_t size = W25Q128_SECTOR_SIZE;
+    uint32_t timeout_ms = erase_timeout(w25, inst);
+#if W25Q128_INSTRUMENTATION
+    uint32_t start_us = W25Q128_INSTR_TIME_US();
+#endif
+
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        if (geometry(w25)->erase_inst[i] == inst && 
+                                            geometry(w25)->erase_size[i] != 0)
+            size = geometry(w25)->erase_size[i];
+    }
+
+    status = W25Q128_WriteEnable(w25);
+    if (status != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+#if W25Q128_ERASED_MAP
+    // State is unknown until the erase completes
+    W25Q128_UpdateErasedMap(w25, mem_addr, size, 0);
+#endif
+    
+    cmd.instruction = W25Q128_ADDRESS_INST(w25, inst);
+    cmd.instruction_lines = 1;
+    cmd.address = mem_addr;
+    cmd.address_bytes = W25Q128_ADDRESS_BYTES(w25);
+    cmd.address_lines = 1;
+
+    if (command_write(w25, &cmd, NULL, 0) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    // WEL is cleared by the device itself once the erase has finished
+    if (W25Q128_WaitForReady(w25, timeout_ms) != W25Q128_READY)
+        return W25Q128_ERROR;
+
+#if W25Q128_ERASED_MAP
+    W25Q128_UpdateErasedMap(w25, mem_addr, size, 1);
+    w25->erase_stats.erases++;
+#endif
+#if W25Q128_INSTRUMENTATION
+    W25Q128_InstrHistAdd(w25->instr.erase_hist, 
+                                        W25Q128_INSTR_TIME_US() - start_us);
+    for (uint32_t i = 0; i < size / W25Q128_SECTOR_SIZE; i++)
+    {
+        uint16_t *count = &w25->instr.sector_erases[
+                                        (mem_addr / W25Q128_SECTOR_SIZE) + i];
+        if (*count != 0xFFFF)
+            (*count)++;
+    }
+#else
+    (void)size;
+#endif
+
+    return W25Q128_SUCCESS;
+}
+
+static W25Q128_StatusTypeDef erase_chip_unlocked(W25Q128_TypeDef *w25)
+{
+    W25Q128_StatusTypeDef status;
+#if W25Q128_INSTRUMENTATION
+    uint32_t start_us = W25Q128_INSTR_TIME_US();
+#endif
+
+    status = W25Q128_WriteEnable(w25);
+    if (status != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+#if W25Q128_ERASED_MAP
+    W25Q128_UpdateErasedMap(w25, 0, W25Q128_GetCapacity(w25), 0);
+#endif
+
+    if (send_instruction(w25, INST_CHIP_ERASE) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    if (W25Q128_WaitForReady(w25, geometry(w25)->chip_erase_max_ms) 
+                                                            != W25Q128_READY)
+        return W25Q128_ERROR;
+
+#if W25Q128_ERASED_MAP
+    W25Q128_UpdateErasedMap(w25, 0, W25Q128_GetCapacity(w25), 1);
+    w25->erase_stats.erases++;
+#endif
+#if W25Q128_INSTRUMENTATION
+    W25Q128_InstrHistAdd(w25->instr.erase_hist, 
+                                        W25Q128_INSTR_TIME_US() - start_us);
+    for (uint32_t i = 0; i < W25Q128_GetCapacity(w25) / W25Q128_SECTOR_SIZE; 
+                                                                        i++)
+    {
+        if (w25->instr.sector_erases[i] != 0xFFFF)
+            w25->instr.sector_erases[i]++;
+    }
+#endif
+
+    return W25Q128_SUCCESS;
+}
+
+// WREN, program and WIP poll are one transaction on a shared bus
+static W25Q128_StatusTypeDef program_page(W25Q128_TypeDef *w25, 
+                                        uint32_t mem_addr, uint8_t *data,
+                                        uint32_t size)
+{
+    W25Q128_StatusTypeDef status;
+
+    if (W25Q128_Bus_Lock(w25) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+    status = program_page_unlocked(w25, mem_addr, data, size);
+    W25Q128_Bus_Unlock(w25);
+
+    return status;
+}
+
+static W25Q128_StatusTypeDef program_page_unlocked(W25Q128_TypeDef *w25,
+                                        uint32_t mem_addr, uint8_t *data,
+                                        uint32_t size)
+{
+    W25Q128_CommandTypeDef cmd = {0};
+#if W25Q128_INSTRUMENTATION
+    uint32_t start_us = W25Q128_INSTR_TIME_US();
+#endif
+
+    if (W25Q128_WriteEnable(w25) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+#if W25Q128_ERASED_MAP
+    W25Q128_UpdateErasedMap(w25, mem_addr, size, 0);
+#endif
+
+    cmd.instruction = W25Q128_ADDRESS_INST(w25, INST_PAGE_PROGRAM);
+    cmd.instruction_lines = 1;
+    cmd.address = mem_addr;
+    cmd.address_bytes = W25Q128_ADDRESS_BYTES(w25);
+    cmd.address_lines = 1;
+    cmd.data_lines = 1;
+
+    if (w25->transport == W25Q128_TRANSPORT_QSPI && w25->quad_enabled)
+    {
+        cmd.instruction = W25Q128_ADDRESS_INST(w25, INST_QUAD_PAGE_PROGRAM);
+        cmd.data_lines = 4;
+    }
+
+    // Command and payload are sent within the same chip select window, 
+    // payload goes straight from the caller's buffer
+    if (command_write(w25, &cmd, data, size) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    if (W25Q128_WaitForReady(w25, geometry(w25)->page_program_max_ms) 
+                                                            != W25Q128_READY)
+        return W25Q128_ERROR;
+
+#if W25Q128_INSTRUMENTATION
+    W25Q128_InstrHistAdd(w25->instr.program_hist, 
+                                        W25Q128_INSTR_TIME_US() - start_us);
+#endif
+
+    return W25Q128_SUCCESS;
+}
+
+/*
+ * Differential read-modify-write of a single sector. Pages that do not 
+ * change are skipped. If new data only clears bits (1->0) changed pages are 
+ * programmed in place, otherwise sector is erased and all non-blank pages are
+ * programmed again.
+ */
+static W25Q128_StatusTypeDef write_sector(W25Q128_TypeDef *w25,
+                                        uint32_t sector_addr, 
+                                        uint32_t sector_offset, uint32_t size,
+                                        uint8_t *data, uint8_t *sector_data)
+{
+    uint8_t need_erase = 0;
+    uint32_t programs = 0;
+
+    if (W25Q128_FastRead(w25, sector_addr / W25Q128_PAGE_SIZE, 0, 
+                    W25Q128_SECTOR_SIZE, sector_data) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    // Program can only clear bits, setting them back to 1 requires erase
+    for (uint32_t i = 0; i < size; i++)
+    {
+        if (data[i] & ~sector_data[sector_offset + i])
+        {
+            need_erase = 1;
+            break;
+        }
+    }
+
+    if (need_erase)
+    {
+        memcpy(&sector_data[sector_offset], data, size);
+
+        // Sector is known to hold data, no need for a blank check
+        if (erase_command(w25, INST_SECTOR_ERASE_4KB, sector_addr) 
+                                                        != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+        w25->write_stats.erases++;
+
+        for (uint32_t p = 0; p < W25Q128_PAGES_PER_SECTOR; p++)
+        {
+            uint8_t *page_data = &sector_data[p * W25Q128_PAGE_SIZE];
+            if (is_blank(page_data, W25Q128_PAGE_SIZE))
+                continue;
+
+            if (program_page(w25, sector_addr + (p * W25Q128_PAGE_SIZE), 
+                            page_data, W25Q128_PAGE_SIZE) != W25Q128_SUCCESS)
+                return W25Q128_ERROR;
+            programs++;
+        }
+    } else {
+        uint32_t pos = 0;
+
+        w25->write_stats.erases_avoided++;
+
+        while (pos < size)
+        {
+            uint32_t page_offset = (sector_offset + pos) % W25Q128_PAGE_SIZE;
+            uint32_t len = W25Q128_PAGE_SIZE - page_offset;
+            uint32_t first;
+            uint32_t last = 0;
+
+            if (len > size - pos)
+                len = size - pos;
+            first = len;
+
+            // Only program the span of bytes that actually changed
+            for (uint32_t i = 0; i < len; i++)
+            {
+                if (data[pos + i] != sector_data[sector_offset + pos + i])
+                {
+                    if (first == len)
+                        first = i;
+                    last = i;
+                }
+            }
+
+            if (first == len)
+            {
+                w25->write_stats.pages_unchanged++;
+            } else {
+                if (program_page(w25, sector_addr + sector_offset + pos + 
+                                first, &data[pos + first], last - first + 1)
+                                                        != W25Q128_SUCCESS)
+                    return W25Q128_ERROR;
+                programs++;
+            }
+            pos += len;
+        }
+    }
+
+    // Compared to the plain erase + program of every page in the sector
+    w25->write_stats.pages_programmed += programs;
+    w25->write_stats.programs_avoided += W25Q128_PAGES_PER_SECTOR - programs;
+
+    return W25Q128_SUCCESS;
+}
+
+static uint8_t is_blank(const uint8_t *data, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; i++)
+    {
+        if (data[i] != 0xFF)
+            return 0;
+    }
+    return 1;
+}
+
+#if W25Q128_ERASED_MAP
+// Reads the sector page by page and stops at the first programmed byte
+static W25Q128_StatusTypeDef blank_check(W25Q128_TypeDef *w25, 
+                                        uint32_t mem_addr, uint8_t *blank)
+{
+    uint8_t page_data[W25Q128_PAGE_SIZE];
+
+    w25->erase_stats.blank_checks++;
+    *blank = 0;
+
+    for (uint32_t p = 0; p < W25Q128_PAGES_PER_SECTOR; p++)
+    {
+        if (read_data(w25, mem_addr + (p * W25Q128_PAGE_SIZE), 
+                W25Q128_PAGE_SIZE, page_data, W25Q128_CONTINUOUS_READ) 
+                                                        != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+
+        if (!is_blank(page_data, W25Q128_PAGE_SIZE))
+            return W25Q128_SUCCESS;
+    }
+
+    *blank = 1;
+    return W25Q128_SUCCESS;
+}
+#endif
+
+static W25Q128_StatusTypeDef send_instruction(W25Q128_TypeDef *w25, 
+                                                                uint8_t inst)
+{
+    W25Q128_CommandTypeDef cmd = {0};
+
+    cmd.instruction = inst;
+    cmd.instruction_lines = 1;
+
+    return command_write(w25, &cmd, NULL, 0);
+}
+
+/*
+ * Read in the currently selected mode. If continuous is set, Dual/Quad I/O 
+ * reads send mode bits M5-4 = 10b and device stays in continuous read mode,
+ * otherwise mode bits 0xFF take it out of continuous read mode.
+ */
+static W25Q128_StatusTypeDef read_data(W25Q128_TypeDef *w25, 
+                                        uint32_t mem_addr, uint32_t size,
+                                        uint8_t *r_data, uint8_t continuous)
+{
+    W25Q128_CommandTypeDef cmd = {0};
+    W25Q128_StatusTypeDef status;
+#if W25Q128_INSTRUMENTATION
+    uint32_t start_us = W25Q128_INSTR_TIME_US();
+#endif
+
+    if (w25->read_mode == W25Q128_READ_MODE_AUTO &&
+        W25Q128_SetReadMode(w25, W25Q128_READ_MODE_AUTO) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    cmd.instruction_lines = 1;
+    cmd.address = mem_addr;
+    cmd.address_bytes = W25Q128_ADDRESS_BYTES(w25);
+    cmd.address_lines = 1;
+    cmd.data_lines = 1;
+
+    switch (w25->read_mode)
+    {
+        case W25Q128_READ_MODE_DUAL_OUT:
+            cmd.data_lines = 2;
+            break;
+        case W25Q128_READ_MODE_DUAL_IO:
+            cmd.address_lines = 2;
+            cmd.data_lines = 2;
+            break;
+        case W25Q128_READ_MODE_QUAD_OUT:
+            cmd.data_lines = 4;
+            break;
+        case W25Q128_READ_MODE_QUAD_IO:
+            cmd.address_lines = 4;
+            cmd.data_lines = 4;
+            break;
+        default:
+            break;
+    }
+
+    // Opcode and wait states come from SFDP, or the W25Q128JV defaults
+    cmd.instruction = W25Q128_ADDRESS_INST(w25, 
+                            geometry(w25)->read[w25->read_mode].instruction);
+    cmd.dummy_cycles = geometry(w25)->read[w25->read_mode].dummy_cycles;
+    if (geometry(w25)->read[w25->read_mode].mode_clocks)
+        cmd.mode_lines = cmd.address_lines;
+
+    if (cmd.mode_lines)
+    {
+        cmd.mode_bits = continuous ? 0x20 : 0xFF;
+        // Instruction was already latched by the previous read
+        if (w25->continuous_read)
+            cmd.instruction_lines = 0;
+    }
+
+    status = W25Q128_CommandRead(w25, &cmd, r_data, size);
+    w25->continuous_read = (cmd.mode_lines && continuous && 
+                                                status == W25Q128_SUCCESS);
+#if W25Q128_INSTRUMENTATION
+    if (status == W25Q128_SUCCESS)
+        W25Q128_InstrHistAdd(w25->instr.read_hist, 
+                                        W25Q128_INSTR_TIME_US() - start_us);
+#endif
+
+    return status;
+}
+
+static W25Q128_StatusTypeDef command_read(W25Q128_TypeDef *w25,
+                                        const W25Q128_CommandTypeDef *cmd,
+                                        uint8_t *data, uint32_t size)
+{
+#if W25Q128_CONTINUOUS_READ
+    W25Q128_StatusTypeDef status;
+    uint8_t dummy;
+
+    // Exit from continuous read mode and the command must not be split
+    if (W25Q128_Bus_Lock(w25) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+    if (w25->continuous_read && 
+                    read_data(w25, 0, 1, &dummy, 0) != W25Q128_SUCCESS)
+        status = W25Q128_ERROR;
+    else
+        status = W25Q128_CommandRead(w25, cmd, data, size);
+    W25Q128_Bus_Unlock(w25);
+
+    return status;
+#else
+    return W25Q128_CommandRead(w25, cmd, data, size);
+#endif
+}
+
+static W25Q128_StatusTypeDef command_write(W25Q128_TypeDef *w25,
+                                        const W25Q128_CommandTypeDef *cmd,
+                                        uint8_t *data, uint32_t size)
+{
+#if W25Q128_CONTINUOUS_READ
+    W25Q128_StatusTypeDef status;
+    uint8_t dummy;
+
+    // Exit from continuous read mode and the command must not be split
+    if (W25Q128_Bus_Lock(w25) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+    if (w25->continuous_read && 
+                    read_data(w25, 0, 1, &dummy, 0) != W25Q128_SUCCESS)
+        status = W25Q128_ERROR;
+    else
+        status = W25Q128_CommandWrite(w25, cmd, data, size);
+    W25Q128_Bus_Unlock(w25);
+
+    return status;
+#else
+    return W25Q128_CommandWrite(w25, cmd, data, size);
+#endif
+}
+
+static W25Q128_StatusTypeDef wait_spi_ready(W25Q128_TypeDef *w25, 
+                                                        uint32_t timeout_ms)
+{
+    uint32_t start_time = HAL_GetTick();
+
+    while (HAL_SPI_GetState(w25->hspi) != HAL_SPI_STATE_READY)
+    {
+        if ((HAL_GetTick() - start_time) > timeout_ms)
+            return W25Q128_ERROR_TIMEOUT;
+    }
+    return W25Q128_SUCCESS;
+}
+
+static W25Q128_StatusTypeDef write_status_register_unlocked(
+                                        W25Q128_TypeDef *w25,
+                                        W25Q128_CommandTypeDef *cmd,
+                                        uint8_t value)
+{
+    if (W25Q128_WriteEnable(w25) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    if (command_write(w25, cmd, &value, sizeof(uint8_t)) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    if (W25Q128_WaitForReady(w25, W25Q128_TIMEOUT_WRITE_SR_MS) 
+                                                            != W25Q128_READY)
+        return W25Q128_ERROR;
+
+    return W25Q128_SUCCESS;
+}
+
+static void delay_ms(W25Q128_TypeDef *w25, uint32_t ms)
+{
+    W25Q128_DelayMs(ms);
+#if W25Q128_INSTRUMENTATION
+    w25->instr.delay_calls++;
+    w25->instr.delay_ms += ms;
+#else
+    (void)w25;
+#endif
+}
+
+static const W25Q128_GeometryTypeDef *geometry(W25Q128_TypeDef *w25)
+{
+    if (w25->geometry.capacity == 0)
+        return &default_geometry;
+
+    return &w25->geometry;
+}
+
+static uint32_t erase_timeout(W25Q128_TypeDef *w25, uint8_t inst)
+{
+    const W25Q128_GeometryTypeDef *geo = geometry(w25);
+
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        if (geo->erase_size[i] != 0 && geo->erase_inst[i] == inst)
+            return geo->erase_max_ms[i];
+    }
+    return W25Q128_TIMEOUT_BLOCK64_ERASE_MS;
+}
+
+/*
+ * Decodes the JESD216 Basic Flash Parameter Table. Typical times are 
+ * (count + 1) * unit, the maximum is 2 * (multiplier + 1) * typical.
+ */
+static W25Q128_StatusTypeDef parse_bfpt(W25Q128_GeometryTypeDef *geo,
+                                        const uint32_t *dw, uint8_t num_dw)
+{
+    static const uint32_t erase_unit_ms[4] = {1, 16, 128, 1000};
+    static const uint32_t chip_unit_ms[4] = {16, 256, 4000, 64000};
+    uint64_t bits;
+    uint32_t multiplier = 2;
+    uint8_t num_erase = 0;
+
+    // 4 KB erase must be uniform over the whole memory
+    if ((dw[0] & 0x3) != 0x1)
+        return W25Q128_ERROR;
+
+#if !W25Q128_4BYTE_ADDRESS
+    // Parts in 4-byte only mode need W25Q128_4BYTE_ADDRESS
+    if (((dw[0] >> 17) & 0x3) == 0x2)
+        return W25Q128_ERROR;
+#endif
+
+    if (dw[1] & 0x80000000)
+    {
+        if ((dw[1] & 0x7FFFFFFF) > 63)
+            return W25Q128_ERROR;
+        bits = 1ULL << (dw[1] & 0x7FFFFFFF);
+    } else {
+        bits = (uint64_t)dw[1] + 1;
+    }
+    geo->capacity = (bits / 8 > W25Q128_MAX_CAPACITY) ? 
+                                            W25Q128_MAX_CAPACITY : bits / 8;
+
+    // JESD216 rev 0 tables end at DWORD 9 and use a 256 B page
+    geo->page_size = 256;
+    geo->page_program_max_ms = W25Q128_TIMEOUT_PAGE_PROGRAM_MS;
+    geo->chip_erase_max_ms = W25Q128_TIMEOUT_CHIP_ERASE_MS;
+    geo->release_power_down_us = W25Q128_TIME_RELEASE_POWER_DOWN_US;
+    if (num_dw >= 10)
+        multiplier = dw[9] & 0xF;
+    if (num_dw >= 11)
+    {
+        uint32_t page_us = (((dw[10] >> 8) & 0x1F) + 1) * 
+                                            ((dw[10] & (1 << 13)) ? 64 : 8);
+        uint32_t chip_ms = (((dw[10] >> 24) & 0x1F) + 1) * 
+                                            chip_unit_ms[(dw[10] >> 29) & 0x3];
+        uint32_t program_mul = 2 * ((dw[10] & 0xF) + 1);
+
+        geo->page_size = 1 << ((dw[10] >> 4) & 0xF);
+        geo->page_program_max_ms = (page_us * program_mul + 999) / 1000;
+        geo->chip_erase_max_ms = chip_ms * program_mul;
+    }
+
+    // Exit deep power-down to next operation delay, bit 31 clear if supported
+    if (num_dw >= 14 && !(dw[13] & 0x80000000))
+    {
+        static const uint32_t release_unit_ns[4] = {128, 1000, 8000, 64000};
+        uint32_t release_ns = (((dw[13] >> 8) & 0x1F) + 1) * 
+                                        release_unit_ns[(dw[13] >> 13) & 0x3];
+
+        geo->release_power_down_us = (release_ns + 999) / 1000;
+    }
+
+    // Page and sector helpers of the driver depend on these sizes
+    if (geo->page_size != W25Q128_PAGE_SIZE)
+        return W25Q128_ERROR;
+
+    // Erase types in DWORD 8 and 9 as size exponent : instruction pairs
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        uint32_t type = (i < 2 ? dw[7] : dw[8]) >> ((i % 2) * 16);
+        uint8_t exponent = type & 0xFF;
+        uint8_t pos = num_erase;
+
+        if (exponent < 12 || exponent > 24)
+            continue;
+
+        // Insertion sort by size
+        while (pos > 0 && geo->erase_size[pos - 1] > (1UL << exponent))
+        {
+            geo->erase_inst[pos] = geo->erase_inst[pos - 1];
+            geo->erase_size[pos] = geo->erase_size[pos - 1];
+            geo->erase_typ_ms[pos] = geo->erase_typ_ms[pos - 1];
+            geo->erase_max_ms[pos] = geo->erase_max_ms[pos - 1];
+            pos--;
+        }
+        geo->erase_inst[pos] = (type >> 8) & 0xFF;
+        geo->erase_size[pos] = 1UL << exponent;
+        if (num_dw >= 10)
+        {
+            static const uint8_t shift[4] = {4, 11, 18, 25};
+            uint32_t field = dw[9] >> shift[i];
+
+            geo->erase_typ_ms[pos] = ((field & 0x1F) + 1) * 
+                                            erase_unit_ms[(field >> 5) & 0x3];
+            geo->erase_max_ms[pos] = geo->erase_typ_ms[pos] * 
+                                                        2 * (multiplier + 1);
+        } else {
+            geo->erase_typ_ms[pos] = W25Q128_TIMEOUT_BLOCK64_ERASE_MS;
+            geo->erase_max_ms[pos] = W25Q128_TIMEOUT_BLOCK64_ERASE_MS;
+        }
+        num_erase++;
+    }
+    if (num_erase == 0 || geo->erase_size[0] != W25Q128_SECTOR_SIZE)
+        return W25Q128_ERROR;
+
+    // Fast read commands, single and fast read are mandatory
+    geo->read[W25Q128_READ_MODE_SINGLE] = default_geometry.read[
+                                                    W25Q128_READ_MODE_SINGLE];
+    geo->read[W25Q128_READ_MODE_FAST] = default_geometry.read[
+                                                    W25Q128_READ_MODE_FAST];
+    if (dw[0] & (1 << 16))
+        geo->read[W25Q128_READ_MODE_DUAL_OUT] = bfpt_read_command(dw[3], 1);
+    if (dw[0] & (1 << 20))
+        geo->read[W25Q128_READ_MODE_DUAL_IO] = bfpt_read_command(dw[3] >> 16,
+                                                                            2);
+    if (dw[0] & (1 << 22))
+        geo->read[W25Q128_READ_MODE_QUAD_OUT] = bfpt_read_command(
+                                                            dw[2] >> 16, 1);
+    if (dw[0] & (1 << 21))
+        geo->read[W25Q128_READ_MODE_QUAD_IO] = bfpt_read_command(dw[2], 4);
+
+    return W25Q128_SUCCESS;
+}
+
+/*
+ * Decodes the 16 bit fast read field of DWORD 3 or 4. Driver sends one mode
+ * byte, mode clocks that do not make a byte are sent as wait states.
+ */
+static W25Q128_ReadCommandTypeDef bfpt_read_command(uint32_t field, 
+                                                        uint8_t addr_lines)
+{
+    W25Q128_ReadCommandTypeDef read;
+
+    read.instruction = (field >> 8) & 0xFF;
+    read.dummy_cycles = field & 0x1F;
+    read.mode_clocks = (field >> 5) & 0x7;
+
+    if (addr_lines == 1 || read.mode_clocks * addr_lines != 8)
+    {
+        read.dummy_cycles += read.mode_clocks;
+        read.mode_clocks = 0;
+    }
+    return read;
+}
+
+#if W25Q128_AUTO_POWER_DOWN
+// Sends the release command, the caller holds the bus
+static W25Q128_StatusTypeDef power_release(W25Q128_TypeDef *w25)
+{
+    uint32_t now;
+
+    // Device takes tDP to enter deep power-down
+    W25Q128_POWER_DELAY_US(power_time_left(w25, W25Q128_TIME_POWER_DOWN_US));
+
+    // Cleared first, the release goes through the transport like any command
+    w25->power_down = 0;
+    if (send_instruction(w25, INST_RELEASE_POWER_DOWN_ID) != W25Q128_SUCCESS)
+    {
+        w25->power_down = 1;
+        return W25Q128_ERROR;
+    }
+
+    now = W25Q128_POWER_TIME_US();
+    w25->power_stats.power_down_us += now - w25->power_change_us;
+    w25->power_stats.releases++;
+    w25->power_change_us = now;
+    w25->power_releasing = 1;
+
+    return W25Q128_SUCCESS;
+}
+
+/*
+ * Time left of time_us since the last power-down or release. Only elapsed
+ * time beyond the resolution of the time source surely passed.
+ */
+static uint32_t power_time_left(W25Q128_TypeDef *w25, uint32_t time_us)
+{
+    uint32_t elapsed = W25Q128_POWER_TIME_US() - w25->power_change_us;
+
+    if (elapsed <= W25Q128_POWER_TIME_RES_US)
+        return time_us + 1;
+    elapsed -= W25Q128_POWER_TIME_RES_US;
+
+    return (elapsed > time_us) ? 0 : time_us + 1 - elapsed;
 }
+#endif
\ No newline at end of file
@@ -10,9 +10,161 @@
 #include "w25q128_conf_ll.h"
 
 #define ERASE_BEFORE_PAGE_WRITE_AUTO 0
+
+/*
+ * W25Q128_Write needs one sector sized work buffer. If W25Q128_TypeDef's 
+ * work_buf is NULL, static buffer shared by all devices is used (writes to
+ * different devices must not run concurrently then). Set to 0 to drop the 
+ * static buffer, work_buf must be provided then.
+ */
+#ifndef W25Q128_STATIC_WORK_BUFFER
+#define W25Q128_STATIC_WORK_BUFFER 1
+#endif
 #define W25Q128_SECTOR_SIZE 4096
 #define W25Q128_PAGE_SIZE   256
 #define W25Q128_SECTOR_COUNT 4096
+#define W25Q128_PAGES_PER_SECTOR (W25Q128_SECTOR_SIZE / W25Q128_PAGE_SIZE)
+#define W25Q128_BLOCK32_SIZE 32768
+#define W25Q128_BLOCK64_SIZE 65536
+#define W25Q128_CAPACITY     (W25Q128_SECTOR_SIZE * W25Q128_SECTOR_COUNT)
+
+/*
+ * 4-byte addressing for 256 Mbit and larger parts (W25Q256, W25Q512). The
+ * address width is selected per device at runtime (W25Q128_InitSFDP or the
+ * address_bytes field) and the 4-byte opcodes (13h, 0Ch, 12h, 21h, DCh...)
+ * are used, so the device stays in its default 3-byte mode. Set to 0 (default)
+ * for a 3-byte only driver without the runtime selection.
+ */
+#ifndef W25Q128_4BYTE_ADDRESS
+#define W25Q128_4BYTE_ADDRESS 0
+#endif
+
+// Largest memory the driver addresses, sizes the per-sector maps
+#if W25Q128_4BYTE_ADDRESS
+#define W25Q128_MAX_SECTOR_COUNT 16384 // 512 Mbit
+#else
+#define W25Q128_MAX_SECTOR_COUNT W25Q128_SECTOR_COUNT
+#endif
+#define W25Q128_MAX_CAPACITY (W25Q128_SECTOR_SIZE * W25Q128_MAX_SECTOR_COUNT)
+
+// Address width and opcode of a device, constants in a 3-byte only build
+#if W25Q128_4BYTE_ADDRESS
+#define W25Q128_ADDRESS_BYTES(w25) (((w25)->address_bytes == 4) ? 4 : 3)
+#define W25Q128_ADDRESS_INST(w25, inst) \
+    (((w25)->address_bytes == 4) ? W25Q128_Instruction4B(inst) : (inst))
+#else
+#define W25Q128_ADDRESS_BYTES(w25) 3
+#define W25Q128_ADDRESS_INST(w25, inst) (inst)
+#endif
+
+/*
+ * If enabled, driver keeps a bitmap of sectors known to be erased (one bit
+ * per sector in W25Q128_TypeDef). Unknown sectors are blank-checked before
+ * erase and erase of an erased sector returns right away. The map is built
+ * lazily, or at once with W25Q128_ScanErased(). The littlefs layer needs it
+ * for w25q128_lfs_background_erase. Since it changes W25Q128_TypeDef, it
+ * must be set the same for every source that includes this header.
+ *
+ * Caveats: the map goes stale if flash is written bypassing the driver
+ * without W25Q128_UpdateErasedMap(), and such a sector is then not erased.
+ * A sector whose erase was cut by a power loss can read back as all 0xFF
+ * without being fully erased, the blank check takes it as erased and the
+ * erase is not repeated.
+ */
+#ifndef W25Q128_ERASED_MAP
+#define W25Q128_ERASED_MAP 0
+#endif
+
+/*
+ * If enabled, Dual/Quad I/O reads leave the device in continuous read mode, 
+ * so the next read skips the instruction. Device is taken out of it 
+ * automatically before any other command is sent.
+ */
+#ifndef W25Q128_CONTINUOUS_READ
+#define W25Q128_CONTINUOUS_READ 0
+#endif
+
+/*
+ * If enabled, W25Q128_TypeDef keeps instrumentation counters (commands per
+ * opcode, bytes, time blocked in busy-wait and delays, latency histograms and
+ * erase counts per sector), read with W25Q128_GetInstrumentation(). Disabled
+ * instrumentation adds no code and no RAM.
+ */
+#ifndef W25Q128_INSTRUMENTATION
+#define W25Q128_INSTRUMENTATION 0
+#endif
+
+#if W25Q128_INSTRUMENTATION
+/* Time source of the latency histograms, i.e. a DWT cycle counter scaled to
+ * microseconds. HAL tick gives 1 ms resolution. */
+#ifndef W25Q128_INSTR_TIME_US
+#define W25Q128_INSTR_TIME_US() (HAL_GetTick() * 1000U)
+#endif
+
+/* Bucket n holds latencies in [2^(n-1), 2^n) us, bucket 0 is below 1 us and
+ * the last bucket holds everything above */
+#define W25Q128_INSTR_HIST_BUCKETS 28
+#endif
+
+/*
+ * If enabled, W25Q128_PowerIdle puts the device into deep power-down (B9h)
+ * once it has been idle for power_idle_ms, and the next command releases it
+ * (ABh) and waits only what is left of tRES1. W25Q128_PowerWake releases it
+ * ahead of a known burst. Counters and time in each state are read with
+ * W25Q128_GetPowerStats().
+ */
+#ifndef W25Q128_AUTO_POWER_DOWN
+#define W25Q128_AUTO_POWER_DOWN 0
+#endif
+
+#if W25Q128_AUTO_POWER_DOWN
+/* Time source of the idle time and power statistics, i.e. a DWT cycle
+ * counter scaled to microseconds. W25Q128_POWER_TIME_RES_US is its
+ * resolution, a release counts as passed only once it is older than that. */
+#ifndef W25Q128_POWER_TIME_US
+#define W25Q128_POWER_TIME_US() (HAL_GetTick() * 1000U)
+#ifndef W25Q128_POWER_TIME_RES_US
+#define W25Q128_POWER_TIME_RES_US 1000
+#endif
+#endif
+
+#ifndef W25Q128_POWER_TIME_RES_US
+#define W25Q128_POWER_TIME_RES_US 1
+#endif
+
+/* Delay of what is left of tDP and tRES1, a few microseconds. The time
+ * source is not polled for them, so a coarse one does not stretch them. */
+#ifndef W25Q128_POWER_DELAY_US
+#define W25Q128_POWER_DELAY_US(us) W25Q128_DelayUs(us)
+#endif
+
+/* Idle time before deep power-down if power_idle_ms is 0 */
+#ifndef W25Q128_POWER_IDLE_MS
+#define W25Q128_POWER_IDLE_MS 10
+#endif
+#endif
+
+/* Status register bits */
+#define W25Q128_SR1_BUSY 0x01
+#define W25Q128_SR1_WEL  0x02
+#define W25Q128_SR2_QE   0x02
+#define W25Q128_SR2_SUS  0x80
+
+/* Busy-wait timeouts in milliseconds (W25Q128JV datasheet maximums) */
+#define W25Q128_TIMEOUT_WRITE_SR_MS       15
+#define W25Q128_TIMEOUT_PAGE_PROGRAM_MS   3
+#define W25Q128_TIMEOUT_SECTOR_ERASE_MS   400
+#define W25Q128_TIMEOUT_BLOCK32_ERASE_MS  1600
+#define W25Q128_TIMEOUT_BLOCK64_ERASE_MS  2000
+#define W25Q128_TIMEOUT_CHIP_ERASE_MS     200000
+
+/* Deep power-down timings in microseconds (tDP, tRES1 datasheet maximums) */
+#define W25Q128_TIME_POWER_DOWN_US          3
+#define W25Q128_TIME_RELEASE_POWER_DOWN_US  3
+
+/* Ticks polled back-to-back before sleeping 1 ms between polls. The first
+ * tick may end right after the start, two make at least 1 ms of spinning. */
+#define W25Q128_POLL_SPIN_MS 2
 
 typedef enum {
     W25Q128_SUCCESS = 0,
@@ -20,8 +172,18 @@ typedef enum {
     W25Q128_READY = 2,
     W25Q128_BUSY = 3,
     W25Q128_ERROR_TIMEOUT = 4,
+    W25Q128_END = 5,        // No more data, i.e. end of a log
+    W25Q128_NOT_FOUND = 6,  // No such key
 } W25Q128_StatusTypeDef;
 
+/**
+ * Consumer of W25Q128_StreamRead. Called for every filled chunk while the next
+ * chunk is being received, returning anything but W25Q128_SUCCESS stops the 
+ * stream.
+ */
+typedef W25Q128_StatusTypeDef (*W25Q128_StreamCallback)(const uint8_t *data,
+                                uint32_t size, uint32_t offset, void *user_data);
+
 typedef enum {
     INST_WRITE_ENABLE = 0x06,
     INST_VOLATILE_SR_WRITE_ENABLE = 0x50,
@@ -34,12 +196,27 @@ typedef enum {
 
     INST_READ_DATA = 0x03,
     INST_FAST_READ = 0x0B,
+    INST_FAST_READ_DUAL_OUTPUT = 0x3B,
+    INST_FAST_READ_QUAD_OUTPUT = 0x6B,
+    INST_FAST_READ_DUAL_IO = 0xBB,
+    INST_FAST_READ_QUAD_IO = 0xEB,
+    INST_READ_DATA_4B = 0x13,
+    INST_FAST_READ_4B = 0x0C,
+    INST_FAST_READ_DUAL_OUTPUT_4B = 0x3C,
+    INST_FAST_READ_QUAD_OUTPUT_4B = 0x6C,
+    INST_FAST_READ_DUAL_IO_4B = 0xBC,
+    INST_FAST_READ_QUAD_IO_4B = 0xEC,
         
     INST_PAGE_PROGRAM = 0x02,
+    INST_QUAD_PAGE_PROGRAM = 0x32,
+    INST_PAGE_PROGRAM_4B = 0x12,
+    INST_QUAD_PAGE_PROGRAM_4B = 0x34,
 
     INST_SECTOR_ERASE_4KB = 0x20,
     INST_BLOCK_ERASE_32KB = 0x52,
     INST_BLOCK_ERASE_64KB = 0xD8,
+    INST_SECTOR_ERASE_4KB_4B = 0x21,
+    INST_BLOCK_ERASE_64KB_4B = 0xDC, // No 4-byte variant of 32 KB erase
     INST_CHIP_ERASE = 0xC7, // 0x60
 
     INST_READ_STATUS_REG_1 = 0x05,
@@ -75,10 +252,177 @@ typedef enum {
     ID_READ_UNIQUE = 3,
 } W25Q128_ID_TypeDef;
 
+/**
+ * Counters of the differential read-modify-write path (W25Q128_Write). 
+ * Avoided operations are counted against a plain erase followed by program
+ * of all pages of every modified sector.
+ */
+typedef struct {
+    uint32_t erases;
+    uint32_t erases_avoided;
+    uint32_t pages_programmed;
+    uint32_t pages_unchanged;
+    uint32_t programs_avoided;
+} W25Q128_WriteStatsTypeDef;
+
+/**
+ * Counters of the erased sector map. Time is the time spent in 
+ * W25Q128_PreEraseSector, i.e. erase time moved off the write path.
+ */
+typedef struct {
+    uint32_t erases;
+    uint32_t erases_avoided;
+    uint32_t blank_checks;
+    uint32_t background_erases;
+    uint32_t background_time_ms;
+} W25Q128_EraseStatsTypeDef;
+
+#if W25Q128_INSTRUMENTATION
+/**
+ * Instrumentation counters. Commands and bytes are counted in the transport,
+ * so they cover every blocking API call; W25Q128_StreamRead and the async 
+ * queue drive the SPI directly and are not counted. Transfers the async
+ * queue completes are added to the latency histograms and erase counts.
+ * Erase counts saturate at 0xFFFF.
+ */
+typedef struct {
+    uint32_t commands[256];
+    uint64_t bytes_tx;          // Instruction, address, dummy and data bytes
+    uint64_t bytes_rx;
+    uint32_t busy_polls;        // Status register reads in WaitForReady
+    uint32_t busy_ms;           // Time blocked waiting for BUSY to clear
+    uint32_t delay_calls;
+    uint32_t delay_ms;          // Time slept in W25Q128_DelayMs
+    uint32_t read_hist[W25Q128_INSTR_HIST_BUCKETS];
+    uint32_t program_hist[W25Q128_INSTR_HIST_BUCKETS];
+    uint32_t erase_hist[W25Q128_INSTR_HIST_BUCKETS];
+    uint16_t sector_erases[W25Q128_MAX_SECTOR_COUNT];
+} W25Q128_InstrumentationTypeDef;
+#endif
+
+#if W25Q128_AUTO_POWER_DOWN
+/**
+ * Counters of the automatic deep power-down. Time is added to a state when
+ * it is left, W25Q128_GetPowerStats adds the current state up to now.
+ */
+typedef struct {
+    uint32_t power_downs;
+    uint32_t releases;          // Hinted releases included
+    uint32_t hinted_releases;   // Releases by W25Q128_PowerWake
+    uint32_t release_waits;     // Commands that waited for tRES1
+    uint64_t awake_us;
+    uint64_t power_down_us;
+} W25Q128_PowerStatsTypeDef;
+#endif
+
+typedef enum {
+    W25Q128_TRANSPORT_SPI = 0,
+    W25Q128_TRANSPORT_QSPI = 1,
+} W25Q128_TransportTypeDef;
+
+typedef enum {
+    W25Q128_READ_MODE_AUTO = 0,     // Widest mode supported by the transport
+    W25Q128_READ_MODE_SINGLE = 1,   // 0x03, 1-1-1
+    W25Q128_READ_MODE_FAST = 2,     // 0x0B, 1-1-1, 8 dummy clocks
+    W25Q128_READ_MODE_DUAL_OUT = 3, // 0x3B, 1-1-2, 8 dummy clocks
+    W25Q128_READ_MODE_DUAL_IO = 4,  // 0xBB, 1-2-2, mode bits
+    W25Q128_READ_MODE_QUAD_OUT = 5, // 0x6B, 1-1-4, 8 dummy clocks
+    W25Q128_READ_MODE_QUAD_IO = 6,  // 0xEB, 1-4-4, mode bits, 4 dummy clocks
+} W25Q128_ReadModeTypeDef;
+
+/**
+ * Read command of a read mode, instruction 0 means that the mode is not
+ * supported by the device.
+ */
+typedef struct {
+    uint8_t instruction;
+    uint8_t dummy_cycles;   // Wait states after address and mode bits
+    uint8_t mode_clocks;    // 0 if the command has no mode bits
+} W25Q128_ReadCommandTypeDef;
+
+/**
+ * Runtime geometry and timings. Zeroed struct uses the W25Q128JV values,
+ * W25Q128_InitSFDP() fills it from the SFDP Basic Flash Parameter Table.
+ * Erase types are sorted by size, unused ones have size 0.
+ */
+typedef struct {
+    uint32_t capacity;
+    uint16_t page_size;
+    uint8_t erase_inst[4];
+    uint32_t erase_size[4];
+    uint32_t erase_typ_ms[4];
+    uint32_t erase_max_ms[4];
+    uint32_t page_program_max_ms;
+    uint32_t chip_erase_max_ms;
+    uint32_t release_power_down_us; // tRES1
+    W25Q128_ReadCommandTypeDef read[W25Q128_READ_MODE_QUAD_IO + 1];
+} W25Q128_GeometryTypeDef;
+
+/**
+ * Description of a single command. Number of lines equal to 0 means that
+ * the phase is skipped.
+ */
+typedef struct {
+    uint8_t instruction;
+    uint8_t instruction_lines;
+    uint32_t address;
+    uint8_t address_bytes;
+    uint8_t address_lines;
+    uint8_t mode_bits;
+    uint8_t mode_lines;
+    uint8_t dummy_cycles;
+    uint8_t data_lines;
+} W25Q128_CommandTypeDef;
+
+struct W25Q128_Bus;
+
 typedef struct {
     SPI_HandleTypeDef *hspi;
     GPIO_TypeDef *cs_port;
     uint16_t cs_pin;
+
+    // Shared bus arbiter (w25q128_bus_ll), NULL if the device owns its bus
+    struct W25Q128_Bus *bus;
+
+    // SPI is used by default, QSPI peripheral drives the chip select itself
+    W25Q128_TransportTypeDef transport;
+#ifdef HAL_QSPI_MODULE_ENABLED
+    QSPI_HandleTypeDef *hqspi;
+#endif
+    W25Q128_ReadModeTypeDef read_mode;
+    W25Q128_GeometryTypeDef geometry;
+#if W25Q128_4BYTE_ADDRESS
+    // 4 selects the 4-byte opcodes, 0 or 3 keeps 3-byte addresses
+    uint8_t address_bytes;
+#endif
+    uint8_t quad_enabled;
+    uint8_t continuous_read;
+
+    // Optional W25Q128_SECTOR_SIZE bytes buffer used by W25Q128_Write
+    uint8_t *work_buf;
+
+    W25Q128_WriteStatsTypeDef write_stats;
+
+#if W25Q128_ERASED_MAP
+    // Bit set - sector is known to be erased, zeroed struct means unknown
+    uint8_t erased_map[W25Q128_MAX_SECTOR_COUNT / 8];
+    W25Q128_EraseStatsTypeDef erase_stats;
+#endif
+
+#if W25Q128_INSTRUMENTATION
+    W25Q128_InstrumentationTypeDef instr;
+#endif
+
+#if W25Q128_AUTO_POWER_DOWN
+    // Idle time before deep power-down, 0 uses W25Q128_POWER_IDLE_MS
+    uint32_t power_idle_ms;
+    uint8_t power_down;         // Device is in deep power-down
+    uint8_t power_releasing;    // tRES1 of the last release is not over yet
+    uint32_t power_last_us;     // End of the last command
+    volatile uint8_t power_async; // Asynchronous queue has work, set by it
+    uint32_t power_change_us;   // Last power-down or release
+    W25Q128_PowerStatsTypeDef power_stats;
+#endif
 } W25Q128_TypeDef;
 
 
@@ -103,8 +447,9 @@ void W25Q128_ChipDeselect(W25Q128_TypeDef *w25q128);
  * @param len Size of data 
  * @param timeout Timeout of SPI write operation
  * @return None
+ * @note Data longer than 16-bit HAL limit is sent in multiple transfers.
  */
-void W25Q128_SPIWrite(W25Q128_TypeDef *w25q128, uint8_t *data, uint16_t len, 
+void W25Q128_SPIWrite(W25Q128_TypeDef *w25q128, uint8_t *data, uint32_t len, 
                                                             uint32_t timeout);
 
 /**
@@ -114,10 +459,37 @@ void W25Q128_SPIWrite(W25Q128_TypeDef *w25q128, uint8_t *data, uint16_t len,
  * @param len Size of data 
  * @param timeout Timeout of SPI read operation
  * @return None
+ * @note Data longer than 16-bit HAL limit is read in multiple transfers.
  */
-void W25Q128_SPIRead(W25Q128_TypeDef *w25q128, uint8_t *data, uint16_t len, 
+void W25Q128_SPIRead(W25Q128_TypeDef *w25q128, uint8_t *data, uint32_t len, 
                                                             uint32_t timeout);
 
+/**
+ * @brief Function that sends a command and receives its data phase
+ * @param w25q128 Pointer to the flash configuration struct
+ * @param cmd Pointer to the command description
+ * @param data Pointer to the receive buffer
+ * @param size Size of the data phase, can be 0
+ * @retval ::W25Q128_StatusTypeDef
+ * @note W25Q128_ERROR is returned if transport does not support number of 
+ *       lines requested by the command (i.e. Dual/Quad on standard SPI).
+ */
+W25Q128_StatusTypeDef W25Q128_CommandRead(W25Q128_TypeDef *w25q128,
+                                        const W25Q128_CommandTypeDef *cmd,
+                                        uint8_t *data, uint32_t size);
+
+/**
+ * @brief Function that sends a command and its data phase
+ * @param w25q128 Pointer to the flash configuration struct
+ * @param cmd Pointer to the command description
+ * @param data Data pointer
+ * @param size Size of the data phase, can be 0
+ * @retval ::W25Q128_StatusTypeDef
+ */
+W25Q128_StatusTypeDef W25Q128_CommandWrite(W25Q128_TypeDef *w25q128,
+                                        const W25Q128_CommandTypeDef *cmd,
+                                        uint8_t *data, uint32_t size);
+
 /**
  * @brief w25q128 delay function
  * @param delay_ms Delay in milliseconds
@@ -126,6 +498,18 @@ void W25Q128_SPIRead(W25Q128_TypeDef *w25q128, uint8_t *data, uint16_t len,
  */
 void W25Q128_DelayMs(uint32_t delay_ms);
 
+#if W25Q128_AUTO_POWER_DOWN
+/**
+ * @brief w25q128 microsecond delay function
+ * @param delay_us Delay in microseconds
+ * @return None
+ * @note Spins SystemCoreClock / 1 MHz iterations per microsecond, every one
+ *       takes at least a cycle, so it never waits less. Callable from
+ *       interrupts, used for the tDP and tRES1 waits.
+ */
+void W25Q128_DelayUs(uint32_t delay_us);
+#endif
+
 /**
  * @brief Function used to reset w25q128 flash memory
  * @param w25q128 Pointer to the flash configuration struct
@@ -133,6 +517,53 @@ void W25Q128_DelayMs(uint32_t delay_ms);
  */
 void W25Q128_Reset(W25Q128_TypeDef *w25q128);
 
+/**
+ * @brief Function that reads the SFDP (Serial Flash Discoverable Parameters)
+ * @param w25 Pointer to the flash configuration struct
+ * @param addr SFDP address
+ * @param data Pointer to the receive buffer
+ * @param size Data size that is red
+ * @retval ::W25Q128_StatusTypeDef
+ */
+W25Q128_StatusTypeDef W25Q128_ReadSFDP(W25Q128_TypeDef *w25, uint32_t addr,
+                                            uint8_t *data, uint32_t size);
+
+/**
+ * @brief Function that configures geometry, timings and read commands from
+ *        the JEDEC Basic Flash Parameter Table
+ * @param w25 Pointer to the flash configuration struct
+ * @retval ::W25Q128_StatusTypeDef
+ * @note On error the W25Q128JV defaults are kept. Device must support 256 B
+ *       pages and uniform 4 KB sectors. With W25Q128_4BYTE_ADDRESS parts 
+ *       larger than 16 MB switch the device to 4-byte opcodes, up to 
+ *       W25Q128_MAX_CAPACITY is used. Otherwise only the first 16 MB are.
+ */
+W25Q128_StatusTypeDef W25Q128_InitSFDP(W25Q128_TypeDef *w25);
+
+#if W25Q128_4BYTE_ADDRESS
+/**
+ * @brief Function that maps an addressed instruction to its 4-byte variant
+ * @param inst 3-byte instruction, i.e. INST_FAST_READ
+ * @return 4-byte instruction, 0 if the instruction has no 4-byte variant
+ */
+uint8_t W25Q128_Instruction4B(uint8_t inst);
+#endif
+
+/**
+ * @brief Function that returns the usable memory size
+ * @param w25 Pointer to the flash configuration struct
+ * @return Capacity in bytes
+ */
+uint32_t W25Q128_GetCapacity(W25Q128_TypeDef *w25);
+
+/**
+ * @brief Function that returns the maximum time of a program or erase
+ * @param w25 Pointer to the flash configuration struct
+ * @param inst Page program, chip erase or one of the erase instructions
+ * @return Timeout in ms, from SFDP once W25Q128_InitSFDP() has been called
+ */
+uint32_t W25Q128_GetTimeout(W25Q128_TypeDef *w25, uint8_t inst);
+
 /**
  * @brief Function that reads the flash ID
  * @param w25q128 Pointer to the flash configuration struct
@@ -172,6 +603,8 @@ W25Q128_StatusTypeDef W25Q128_Read(W25Q128_TypeDef *w25,
  * @retval ::W25Q128_StatusTypeDef
  * @note This function reads data much faster than regular W25Q128_Read function, 
  *       but note that is must send one dummy byte.
+ * @note Both W25Q128_Read and W25Q128_FastRead use the read mode selected by
+ *       W25Q128_SetReadMode, by default the widest mode of the transport.
  */
 W25Q128_StatusTypeDef W25Q128_FastRead(W25Q128_TypeDef *w25,
                                         uint32_t start_page,
@@ -179,6 +612,26 @@ W25Q128_StatusTypeDef W25Q128_FastRead(W25Q128_TypeDef *w25,
                                         uint32_t size,
                                         uint8_t *r_data);
 
+/**
+ * @brief Function that selects the read mode
+ * @param w25q128 Pointer to the flash configuration struct
+ * @param mode Read mode, W25Q128_READ_MODE_AUTO selects Fast Read on SPI and
+ *             the fastest mode supported by the device on QSPI transport
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Quad modes set the QE bit in status register 2 if needed.
+ */
+W25Q128_StatusTypeDef W25Q128_SetReadMode(W25Q128_TypeDef *w25, 
+                                            W25Q128_ReadModeTypeDef mode);
+
+/**
+ * @brief Function that sets the QE (Quad Enable) bit in status register 2
+ * @param w25q128 Pointer to the flash configuration struct
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Status register is written only if QE bit is not already set. Once
+ *       it is set, page programs on QSPI transport use Quad Page Program.
+ */
+W25Q128_StatusTypeDef W25Q128_EnableQuad(W25Q128_TypeDef *w25);
+
 /**
  * @brief Function that enables any operation with w25q128
  * @param w25q128 Pointer to the flash configuration struct
@@ -198,9 +651,34 @@ W25Q128_StatusTypeDef W25Q128_WriteDisable(W25Q128_TypeDef *w25);
  * @param w25q128 Pointer to the flash configuration struct
  * @param num_sector Number of sector
  * @retval ::W25Q128_StatusTypeDef
+ * @note With W25Q128_ERASED_MAP, sector that is already erased is not erased
+ *       again. That includes a sector that only reads back as erased after
+ *       an interrupted erase, see W25Q128_ERASED_MAP.
  */
 W25Q128_StatusTypeDef W25Q128_EraseSector(W25Q128_TypeDef *w25, 
-                                                        uint16_t num_sector);
+                                                        uint32_t num_sector);
+
+/**
+ * @brief Function that erases the whole chip
+ * @param w25q128 Pointer to the flash configuration struct
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Chip erase can take up to 200 s, see W25Q128_TIMEOUT_CHIP_ERASE_MS.
+ *       Timeout is taken from SFDP if W25Q128_InitSFDP was called.
+ */
+W25Q128_StatusTypeDef W25Q128_EraseChip(W25Q128_TypeDef *w25);
+
+/**
+ * @brief Function that erases memory range using the fewest erase commands
+ * @param w25q128 Pointer to the flash configuration struct
+ * @param addr Start address, must be aligned to W25Q128_SECTOR_SIZE
+ * @param len Range length, must be multiple of W25Q128_SECTOR_SIZE
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Range is split into the largest aligned erase types of the device
+ *       (64 KB, 32 KB and 4 KB by default). Chip erase is used if range 
+ *       covers the whole memory.
+ */
+W25Q128_StatusTypeDef W25Q128_EraseRange(W25Q128_TypeDef *w25, uint32_t addr,
+                                                                uint32_t len);
 
 /**
  * @brief Function used to read status register
@@ -209,6 +687,26 @@ W25Q128_StatusTypeDef W25Q128_EraseSector(W25Q128_TypeDef *w25,
  */
 uint8_t W25Q128_ReadStatusRegister(W25Q128_TypeDef *w25);
 
+/**
+ * @brief Function used to read any of the status registers
+ * @param w25q128 Pointer to the flash configuration struct
+ * @param reg Number of the status register (1, 2 or 3)
+ * @return Status register value
+ */
+uint8_t W25Q128_ReadStatusRegisterN(W25Q128_TypeDef *w25, uint8_t reg);
+
+/**
+ * @brief Function used to write any of the status registers
+ * @param w25q128 Pointer to the flash configuration struct
+ * @param reg Number of the status register (1, 2 or 3)
+ * @param value New value of the status register
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Non-volatile write, waits for the WIP bit up to 
+ *       W25Q128_TIMEOUT_WRITE_SR_MS.
+ */
+W25Q128_StatusTypeDef W25Q128_WriteStatusRegisterN(W25Q128_TypeDef *w25, 
+                                                uint8_t reg, uint8_t value);
+
 /**
  * @brief Function used to check if w25q128 has finished all operations
  * @param w25q128 Pointer to the flash configuration struct
@@ -216,6 +714,18 @@ uint8_t W25Q128_ReadStatusRegister(W25Q128_TypeDef *w25);
  */
 W25Q128_StatusTypeDef W25Q128_CheckBUSY(W25Q128_TypeDef *w25);
 
+/**
+ * @brief Function that waits until the BUSY (WIP) bit is cleared
+ * @param w25q128 Pointer to the flash configuration struct
+ * @param timeout_ms Maximum time the current operation may take
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Status register is polled back-to-back for the first 
+ *       W25Q128_POLL_SPIN_MS ticks, at least W25Q128_POLL_SPIN_MS - 1 ms,
+ *       after that the thread sleeps 1 ms between polls.
+ */
+W25Q128_StatusTypeDef W25Q128_WaitForReady(W25Q128_TypeDef *w25, 
+                                                        uint32_t timeout_ms);
+
 /**
  * @brief Function that writes data to a single page
  * @param w25q128 Pointer to the flash configuration struct
@@ -236,10 +746,211 @@ W25Q128_StatusTypeDef W25Q128_WritePage(W25Q128_TypeDef *w25, uint32_t page,
  * @param size Data size written to page
  * @param data Data pointer
  * @retval ::W25Q128_StatusTypeDef
+ * @note Affected sectors are compared with the new data page by page. 
+ *       Unchanged pages are skipped, changes that only clear bits are 
+ *       programmed in place and sector is erased only when some bit has to be
+ *       set back to 1. See W25Q128_GetWriteStats().
  */
 W25Q128_StatusTypeDef W25Q128_Write(W25Q128_TypeDef *w25, uint32_t page, 
                                     uint16_t offset, uint32_t size, 
                                     uint8_t *data);
 
+/**
+ * @brief Function that reads counters of the W25Q128_Write function
+ * @param w25q128 Pointer to the flash configuration struct
+ * @param stats Pointer to the struct in which counters are copied
+ * @return None
+ */
+void W25Q128_GetWriteStats(W25Q128_TypeDef *w25, 
+                                        W25Q128_WriteStatsTypeDef *stats);
+
+/**
+ * @brief Function that resets counters of the W25Q128_Write function
+ * @param w25q128 Pointer to the flash configuration struct
+ * @return None
+ */
+void W25Q128_ResetWriteStats(W25Q128_TypeDef *w25);
+
+/**
+ * @brief Function that reads data of any size through two chunk buffers
+ * @param w25q128 Pointer to the flash configuration struct
+ * @param addr Memory address from which data is red
+ * @param size Data size that is red
+ * @param buf0 First chunk buffer
+ * @param buf1 Second chunk buffer
+ * @param chunk_size Size of each chunk buffer
+ * @param callback Consumer of the filled chunks
+ * @param user_data User pointer passed to the callback
+ * @retval ::W25Q128_StatusTypeDef
+ * @note On SPI whole read is one Fast Read command, chunks are received with 
+ *       DMA into buf0 and buf1 in turns, so the consumer works on one chunk
+ *       while the next one is in flight. DMA completion is polled with 
+ *       HAL_SPI_GetState, the async queue must be idle meanwhile. On QSPI
+ *       every chunk is a separate read in the selected read mode.
+ */
+W25Q128_StatusTypeDef W25Q128_StreamRead(W25Q128_TypeDef *w25, uint32_t addr,
+                                        uint32_t size, uint8_t *buf0, 
+                                        uint8_t *buf1, uint16_t chunk_size,
+                                        W25Q128_StreamCallback callback,
+                                        void *user_data);
+
+
+#if W25Q128_ERASED_MAP
+/**
+ * @brief Function that blank-checks sectors and updates the erased map
+ * @param w25q128 Pointer to the flash configuration struct
+ * @param first_sector Number of the first sector
+ * @param num_sectors Number of sectors that are checked
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Intended for mount time, check stops at the first programmed byte of
+ *       every sector.
+ */
+W25Q128_StatusTypeDef W25Q128_ScanErased(W25Q128_TypeDef *w25, 
+                                uint32_t first_sector, uint32_t num_sectors);
+
+/**
+ * @brief Function that checks if sector is known to be erased
+ * @param w25q128 Pointer to the flash configuration struct
+ * @param num_sector Number of sector
+ * @return 1 if sector is known to be erased, 0 otherwise
+ */
+uint8_t W25Q128_IsSectorErased(W25Q128_TypeDef *w25, uint32_t num_sector);
+
+/**
+ * @brief Function that updates the erased map for an address range
+ * @param w25q128 Pointer to the flash configuration struct
+ * @param addr Start address of the range
+ * @param size Size of the range
+ * @param erased 1 if range has been erased, 0 if it has been programmed
+ * @return None
+ * @note Must be called by code that writes flash bypassing this driver.
+ *       Map is updated with interrupts disabled, so it can be called from
+ *       the DMA interrupt.
+ */
+void W25Q128_UpdateErasedMap(W25Q128_TypeDef *w25, uint32_t addr, 
+                                                uint32_t size, uint8_t erased);
+
+/**
+ * @brief Function that erases sector ahead of use, i.e. from idle time
+ * @param w25q128 Pointer to the flash configuration struct
+ * @param num_sector Number of sector
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Same as W25Q128_EraseSector, but counted as background erase.
+ */
+W25Q128_StatusTypeDef W25Q128_PreEraseSector(W25Q128_TypeDef *w25, 
+                                                        uint32_t num_sector);
+
+/**
+ * @brief Function that reads counters of the erased map
+ * @param w25q128 Pointer to the flash configuration struct
+ * @param stats Pointer to the struct in which counters are copied
+ * @return None
+ */
+void W25Q128_GetEraseStats(W25Q128_TypeDef *w25, 
+                                        W25Q128_EraseStatsTypeDef *stats);
+
+/**
+ * @brief Function that resets counters of the erased map
+ * @param w25q128 Pointer to the flash configuration struct
+ * @return None
+ */
+void W25Q128_ResetEraseStats(W25Q128_TypeDef *w25);
+#endif
+
+#if W25Q128_INSTRUMENTATION
+/**
+ * @brief Function that copies instrumentation counters
+ * @param w25 Pointer to the flash configuration struct
+ * @param instr Pointer to the struct in which counters are copied
+ * @return None
+ * @note Counters are updated by blocking API calls and by the async queue,
+ *       async reads complete in the DMA interrupt. The copy is consistent as
+ *       long as neither runs for the same device meanwhile.
+ */
+void W25Q128_GetInstrumentation(W25Q128_TypeDef *w25, 
+                                    W25Q128_InstrumentationTypeDef *instr);
+
+/**
+ * @brief Function that resets instrumentation counters
+ * @param w25 Pointer to the flash configuration struct
+ * @return None
+ */
+void W25Q128_ResetInstrumentation(W25Q128_TypeDef *w25);
+
+/**
+ * @brief Function that adds a latency sample to a log2 histogram
+ * @param hist Histogram with W25Q128_INSTR_HIST_BUCKETS buckets
+ * @param us Latency in microseconds
+ * @return None
+ */
+void W25Q128_InstrHistAdd(uint32_t *hist, uint32_t us);
+#endif
+
+#if W25Q128_AUTO_POWER_DOWN
+/**
+ * @brief Function that puts the device into deep power-down if it is idle
+ * @param w25 Pointer to the flash configuration struct
+ * @retval ::W25Q128_StatusTypeDef, W25Q128_BUSY if a program or erase keeps
+ *         the device awake or the asynchronous queue has transfers
+ * @note Call it periodically, i.e. from the idle task. Transfers of the
+ *       asynchronous queue restart the idle time as commands do.
+ */
+W25Q128_StatusTypeDef W25Q128_PowerIdle(W25Q128_TypeDef *w25);
+
+/**
+ * @brief Function that puts the device into deep power-down right away
+ * @param w25 Pointer to the flash configuration struct
+ * @retval ::W25Q128_StatusTypeDef, W25Q128_BUSY if a program or erase keeps
+ *         the device awake or the asynchronous queue has transfers
+ * @note The queue owns the bus while it has transfers, the device is not
+ *       touched then. Must not run at the same time as W25Q128_Async_Submit,
+ *       i.e. call both from the same task.
+ */
+W25Q128_StatusTypeDef W25Q128_PowerDown(W25Q128_TypeDef *w25);
+
+/**
+ * @brief Function that releases the device ahead of a known burst
+ * @param w25 Pointer to the flash configuration struct
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Does not wait for tRES1, work done until the first command hides
+ *       it. Also restarts the idle time.
+ */
+W25Q128_StatusTypeDef W25Q128_PowerWake(W25Q128_TypeDef *w25);
+
+/**
+ * @brief Function that makes the device ready for a command
+ * @param w25 Pointer to the flash configuration struct
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Releases the device from deep power-down and waits what is left of
+ *       tRES1. Called by the transport before every command, and by code that
+ *       drives the SPI directly (W25Q128_StreamRead, asynchronous queue).
+ */
+W25Q128_StatusTypeDef W25Q128_PowerReady(W25Q128_TypeDef *w25);
+
+/**
+ * @brief Function that copies counters of the automatic deep power-down
+ * @param w25 Pointer to the flash configuration struct
+ * @param stats Pointer to the struct in which counters are copied
+ * @return None
+ */
+void W25Q128_GetPowerStats(W25Q128_TypeDef *w25,
+                                        W25Q128_PowerStatsTypeDef *stats);
+
+/**
+ * @brief Function that resets counters of the automatic deep power-down
+ * @param w25 Pointer to the flash configuration struct
+ * @return None
+ */
+void W25Q128_ResetPowerStats(W25Q128_TypeDef *w25);
+#endif
+
+/**
+ * @brief Function that calculates CRC-32 (IEEE 802.3, as zlib crc32)
+ * @param crc CRC of the preceding data, 0 for the first block
+ * @param data Pointer to the data
+ * @param size Data size
+ * @return CRC of the preceding data and this block
+ */
+uint32_t W25Q128_Crc32(uint32_t crc, const uint8_t *data, uint32_t size);
 
-#endif 
\ No newline at end of file
+#endif
\ No newline at end of file
@@ -0,0 +1,209 @@
+/**
+ * @file w25q128_transport_ll.c
+ * @brief w25q128 low-level transport (SPI / QSPI)
+ * @author Filip Stojanovic
+ */
+
+#include "w25q128_ll.h"
+#include "w25q128_bus_ll.h"
+
+#define W25Q128_TRANSPORT_TIMEOUT_MS 100
+
+// Instruction + 4 address bytes + mode byte + up to 32 dummy clocks
+#define W25Q128_MAX_HEADER_SIZE 10
+
+/*************************** Static functions *********************************/
+static W25Q128_StatusTypeDef transport_command(W25Q128_TypeDef *w25,
+                                        const W25Q128_CommandTypeDef *cmd,
+                                        uint8_t *data, uint32_t size,
+                                        uint8_t read);
+static W25Q128_StatusTypeDef spi_command(W25Q128_TypeDef *w25,
+                                        const W25Q128_CommandTypeDef *cmd,
+                                        uint8_t *data, uint32_t size,
+                                        uint8_t read);
+#ifdef HAL_QSPI_MODULE_ENABLED
+static W25Q128_StatusTypeDef qspi_command(W25Q128_TypeDef *w25,
+                                        const W25Q128_CommandTypeDef *cmd,
+                                        uint8_t *data, uint32_t size,
+                                        uint8_t read);
+#endif
+
+W25Q128_StatusTypeDef W25Q128_CommandRead(W25Q128_TypeDef *w25q128,
+                                        const W25Q128_CommandTypeDef *cmd,
+                                        uint8_t *data, uint32_t size)
+{
+    return transport_command(w25q128, cmd, data, size, 1);
+}
+
+W25Q128_StatusTypeDef W25Q128_CommandWrite(W25Q128_TypeDef *w25q128,
+                                        const W25Q128_CommandTypeDef *cmd,
+                                        uint8_t *data, uint32_t size)
+{
+    return transport_command(w25q128, cmd, data, size, 0);
+}
+
+/*************************** Static functions *********************************/
+static W25Q128_StatusTypeDef transport_command(W25Q128_TypeDef *w25,
+                                        const W25Q128_CommandTypeDef *cmd,
+                                        uint8_t *data, uint32_t size,
+                                        uint8_t read)
+{
+    W25Q128_StatusTypeDef status;
+
+#if W25Q128_INSTRUMENTATION
+    w25->instr.commands[cmd->instruction]++;
+    w25->instr.bytes_tx += (cmd->instruction_lines ? 1 : 0) + 
+                        (cmd->address_lines ? cmd->address_bytes : 0) + 
+                        (cmd->mode_lines ? 1 : 0) + (cmd->dummy_cycles / 8);
+    if (read)
+        w25->instr.bytes_rx += size;
+    else
+        w25->instr.bytes_tx += size;
+#endif
+
+    // Chip select window of a shared bus belongs to a single command
+    if (W25Q128_Bus_Lock(w25) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+#if W25Q128_AUTO_POWER_DOWN
+    // Release from deep power-down, nothing gets between it and the command
+    if (W25Q128_PowerReady(w25) != W25Q128_SUCCESS)
+    {
+        W25Q128_Bus_Unlock(w25);
+        return W25Q128_ERROR;
+    }
+#endif
+
+    switch (w25->transport)
+    {
+        case W25Q128_TRANSPORT_SPI:
+            status = spi_command(w25, cmd, data, size, read);
+            break;
+#ifdef HAL_QSPI_MODULE_ENABLED
+        case W25Q128_TRANSPORT_QSPI:
+            status = qspi_command(w25, cmd, data, size, read);
+            break;
+#endif
+        default:
+            status = W25Q128_ERROR;
+            break;
+    }
+#if W25Q128_AUTO_POWER_DOWN
+    w25->power_last_us = W25Q128_POWER_TIME_US();
+#endif
+    W25Q128_Bus_Unlock(w25);
+
+    return status;
+}
+
+static W25Q128_StatusTypeDef spi_command(W25Q128_TypeDef *w25,
+                                        const W25Q128_CommandTypeDef *cmd,
+                                        uint8_t *data, uint32_t size,
+                                        uint8_t read)
+{
+    uint8_t header[W25Q128_MAX_HEADER_SIZE];
+    uint16_t len = 0;
+
+    // Standard SPI has a single data line in each direction
+    if (cmd->instruction_lines > 1 || cmd->address_lines > 1 ||
+        cmd->mode_lines > 1 || (size > 0 && cmd->data_lines > 1))
+        return W25Q128_ERROR;
+
+    if (cmd->instruction_lines)
+        header[len++] = cmd->instruction;
+
+    if (cmd->address_lines)
+    {
+        for (uint8_t i = cmd->address_bytes; i > 0; i--)
+            header[len++] = (cmd->address >> (8 * (i - 1))) & 0xFF;
+    }
+
+    if (cmd->mode_lines)
+        header[len++] = cmd->mode_bits;
+
+    for (uint8_t i = 0; i < cmd->dummy_cycles / 8; i++)
+        header[len++] = 0x00;
+
+    W25Q128_ChipSelect(w25);
+    if (len > 0)
+        W25Q128_SPIWrite(w25, header, len, W25Q128_TRANSPORT_TIMEOUT_MS);
+    if (size > 0)
+    {
+        if (read)
+            W25Q128_SPIRead(w25, data, size, W25Q128_TRANSPORT_TIMEOUT_MS);
+        else
+            W25Q128_SPIWrite(w25, data, size, W25Q128_TRANSPORT_TIMEOUT_MS);
+    }
+    W25Q128_ChipDeselect(w25);
+
+    return W25Q128_SUCCESS;
+}
+
+#ifdef HAL_QSPI_MODULE_ENABLED
+static W25Q128_StatusTypeDef qspi_command(W25Q128_TypeDef *w25,
+                                        const W25Q128_CommandTypeDef *cmd,
+                                        uint8_t *data, uint32_t size,
+                                        uint8_t read)
+{
+    // Indexed by the number of lines (0, 1, 2 or 4)
+    static const uint32_t instruction_mode[5] = {
+        QSPI_INSTRUCTION_NONE, QSPI_INSTRUCTION_1_LINE,
+        QSPI_INSTRUCTION_2_LINES, 0, QSPI_INSTRUCTION_4_LINES
+    };
+    static const uint32_t address_mode[5] = {
+        QSPI_ADDRESS_NONE, QSPI_ADDRESS_1_LINE,
+        QSPI_ADDRESS_2_LINES, 0, QSPI_ADDRESS_4_LINES
+    };
+    static const uint32_t alternate_mode[5] = {
+        QSPI_ALTERNATE_BYTES_NONE, QSPI_ALTERNATE_BYTES_1_LINE,
+        QSPI_ALTERNATE_BYTES_2_LINES, 0, QSPI_ALTERNATE_BYTES_4_LINES
+    };
+    static const uint32_t data_mode[5] = {
+        QSPI_DATA_NONE, QSPI_DATA_1_LINE, QSPI_DATA_2_LINES, 0,
+        QSPI_DATA_4_LINES
+    };
+    QSPI_CommandTypeDef q_cmd = {0};
+
+    if (cmd->instruction_lines > 4 || cmd->address_lines > 4 ||
+        cmd->mode_lines > 4 || cmd->data_lines > 4 ||
+        cmd->instruction_lines == 3 || cmd->address_lines == 3 ||
+        cmd->mode_lines == 3 || cmd->data_lines == 3)
+        return W25Q128_ERROR;
+
+    q_cmd.Instruction = cmd->instruction;
+    q_cmd.InstructionMode = instruction_mode[cmd->instruction_lines];
+    q_cmd.Address = cmd->address;
+    q_cmd.AddressMode = address_mode[cmd->address_lines];
+    q_cmd.AddressSize = (cmd->address_bytes == 4) ? QSPI_ADDRESS_32_BITS :
+                                                    QSPI_ADDRESS_24_BITS;
+    q_cmd.AlternateBytes = cmd->mode_bits;
+    q_cmd.AlternateByteMode = alternate_mode[cmd->mode_lines];
+    q_cmd.AlternateBytesSize = QSPI_ALTERNATE_BYTES_8_BITS;
+    q_cmd.DummyCycles = cmd->dummy_cycles;
+    q_cmd.DataMode = (size > 0) ? data_mode[cmd->data_lines] : QSPI_DATA_NONE;
+    q_cmd.NbData = size;
+    q_cmd.DdrMode = QSPI_DDR_MODE_DISABLE;
+    q_cmd.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
+    q_cmd.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
+
+    if (HAL_QSPI_Command(w25->hqspi, &q_cmd, W25Q128_TRANSPORT_TIMEOUT_MS)
+                                                                    != HAL_OK)
+        return W25Q128_ERROR;
+
+    if (size == 0)
+        return W25Q128_SUCCESS;
+
+    if (read)
+    {
+        if (HAL_QSPI_Receive(w25->hqspi, data, W25Q128_TRANSPORT_TIMEOUT_MS)
+                                                                    != HAL_OK)
+            return W25Q128_ERROR;
+    } else {
+        if (HAL_QSPI_Transmit(w25->hqspi, data, W25Q128_TRANSPORT_TIMEOUT_MS)
+                                                                    != HAL_OK)
+            return W25Q128_ERROR;
+    }
+
+    return W25Q128_SUCCESS;
+}
+#endif
@@ -0,0 +1,37 @@
+/**
+ * @file w25q128_conf_nvs.h
+ * @brief w25q128 key-value store configuration file
+ * @author Filip Stojanovic
+ */
+
+#ifndef W25Q128_CONF_NVS_H
+#define W25Q128_CONF_NVS_H
+
+/*
+ * Slots of the RAM hash index, 4 bytes each, power of two up to 65536, at
+ * most 3/4 of them are used
+ */
+#ifndef W25Q128_NVS_INDEX_SIZE
+#define W25Q128_NVS_INDEX_SIZE 2048
+#endif
+
+/*
+ * Entries start at multiples of this, power of two. An index slot locates an
+ * entry in 16 bits, so a store has at most 65536 * W25Q128_NVS_ENTRY_ALIGN
+ * bytes: up to 64 sectors with 4, 128 with 8 and 256 with 16
+ */
+#ifndef W25Q128_NVS_ENTRY_ALIGN
+#define W25Q128_NVS_ENTRY_ALIGN 4
+#endif
+
+/* Maximum number of sectors of a store */
+#ifndef W25Q128_NVS_MAX_SECTORS
+#define W25Q128_NVS_MAX_SECTORS 64
+#endif
+
+/* Maximum key length, without the terminating null character (1 - 248) */
+#ifndef W25Q128_NVS_MAX_KEY_SIZE
+#define W25Q128_NVS_MAX_KEY_SIZE 32
+#endif
+
+#endif
\ No newline at end of file
@@ -0,0 +1,805 @@
+/**
+ * @file w25q128_nvs.c
+ * @brief w25q128 key-value store
+ * @author Filip Stojanovic
+ */
+
+#include "w25q128_nvs.h"
+
+#include <string.h>
+
+#define W25Q128_NVS_MAGIC 0x4E353257 // "W25N"
+
+// Entry state byte, any other value is an obsolete entry
+#define W25Q128_NVS_LIVE     0xFF
+#define W25Q128_NVS_OBSOLETE 0x00
+
+// Key length of erased flash (no more entries) and of a closed sector
+#define W25Q128_NVS_KEY_ERASED 0xFF
+#define W25Q128_NVS_KEY_CLOSED 0x00
+
+#define W25Q128_NVS_INDEX_MASK (W25Q128_NVS_INDEX_SIZE - 1)
+#define W25Q128_NVS_MAX_KEYS (W25Q128_NVS_INDEX_SIZE / 4 * 3)
+
+// Index slot, location 0 is a sector header and marks an empty slot
+#define W25Q128_NVS_EMPTY_SLOT 0
+#define W25Q128_NVS_SLOT(tag, loc) \
+                (((tag) << 16) | ((loc) / W25Q128_NVS_ENTRY_ALIGN))
+#define W25Q128_NVS_SLOT_TAG(slot) ((slot) >> 16)
+#define W25Q128_NVS_SLOT_LOC(slot) \
+                (((slot) & 0xFFFF) * W25Q128_NVS_ENTRY_ALIGN)
+
+// Entry size as stored and space it takes in the sector
+#define W25Q128_NVS_ENTRY_SIZE(key_size, value_size) \
+                (W25Q128_NVS_ENTRY_HEADER_SIZE + (key_size) + (value_size))
+#define W25Q128_NVS_ENTRY_SPACE(key_size, value_size) \
+                W25Q128_NVS_ALIGN(W25Q128_NVS_ENTRY_SIZE(key_size, value_size))
+#define W25Q128_NVS_FIRST_ENTRY \
+                W25Q128_NVS_ALIGN(W25Q128_NVS_SECTOR_HEADER_SIZE)
+
+#if (W25Q128_NVS_INDEX_SIZE & W25Q128_NVS_INDEX_MASK) != 0 || \
+                                            W25Q128_NVS_INDEX_SIZE > 65536
+#error "W25Q128_NVS_INDEX_SIZE must be a power of two up to 65536"
+#endif
+
+#if (W25Q128_NVS_ENTRY_ALIGN & (W25Q128_NVS_ENTRY_ALIGN - 1)) != 0
+#error "W25Q128_NVS_ENTRY_ALIGN must be a power of two"
+#endif
+
+#if W25Q128_NVS_MAX_SECTORS * (W25Q128_SECTOR_SIZE / W25Q128_NVS_ENTRY_ALIGN) \
+                                                                    > 65536
+#error "W25Q128_NVS_MAX_SECTORS is too large for W25Q128_NVS_ENTRY_ALIGN"
+#endif
+
+#if W25Q128_NVS_ENTRY_HEADER_SIZE + W25Q128_NVS_MAX_KEY_SIZE > W25Q128_PAGE_SIZE
+#error "W25Q128_NVS_MAX_KEY_SIZE is too large"
+#endif
+
+/*************************** Static functions *********************************/
+static uint32_t nvs_tag(const char *key, uint32_t key_size);
+static uint32_t value_size(const uint8_t *header);
+static void nvs_init(W25Q128_NvsTypeDef *nvs, W25Q128_TypeDef *w25,
+                                uint32_t first_sector, uint32_t num_sectors);
+static W25Q128_StatusTypeDef nvs_read(W25Q128_NvsTypeDef *nvs, uint32_t loc,
+                                        void *data, uint32_t size);
+static W25Q128_StatusTypeDef nvs_program(W25Q128_NvsTypeDef *nvs,
+                                uint32_t loc, const void *data, uint32_t size);
+static const uint8_t *nvs_fetch(W25Q128_NvsTypeDef *nvs, uint32_t loc,
+                                                            uint32_t size);
+static W25Q128_StatusTypeDef nvs_lookup(W25Q128_NvsTypeDef *nvs,
+                                const char *key, uint32_t key_size,
+                                uint32_t tag, uint32_t *slot,
+                                uint8_t *header);
+static void nvs_remove_slot(W25Q128_NvsTypeDef *nvs, uint32_t slot);
+static W25Q128_StatusTypeDef nvs_make_obsolete(W25Q128_NvsTypeDef *nvs,
+                                        uint32_t loc, uint32_t size);
+static W25Q128_StatusTypeDef nvs_scan_sector(W25Q128_NvsTypeDef *nvs,
+                                        uint32_t sector, uint8_t active);
+static W25Q128_StatusTypeDef nvs_open_sector(W25Q128_NvsTypeDef *nvs);
+static W25Q128_StatusTypeDef nvs_reserve(W25Q128_NvsTypeDef *nvs,
+                                                            uint32_t size);
+
+W25Q128_StatusTypeDef W25Q128_Nvs_Mount(W25Q128_NvsTypeDef *nvs,
+                                        W25Q128_TypeDef *w25,
+                                        uint32_t first_sector,
+                                        uint32_t num_sectors)
+{
+    uint16_t order[W25Q128_NVS_MAX_SECTORS];
+    uint32_t used = 0;
+
+    if (num_sectors < 2 || num_sectors > W25Q128_NVS_MAX_SECTORS ||
+        (first_sector + num_sectors) * W25Q128_SECTOR_SIZE >
+                                                    W25Q128_GetCapacity(w25))
+        return W25Q128_ERROR;
+
+    nvs_init(nvs, w25, first_sector, num_sectors);
+
+    for (uint32_t s = 0; s < num_sectors; s++)
+    {
+        uint8_t header[W25Q128_NVS_SECTOR_HEADER_SIZE];
+        uint32_t magic;
+        uint32_t seq;
+        uint32_t crc;
+        uint32_t i;
+
+        if (nvs_read(nvs, s * W25Q128_SECTOR_SIZE, header, sizeof(header))
+                                                        != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+
+        memcpy(&magic, &header[0], 4);
+        memcpy(&seq, &header[4], 4);
+        memcpy(&crc, &header[8], 4);
+        if (magic == W25Q128_NVS_MAGIC && seq != 0 &&
+                                        crc == W25Q128_Crc32(0, header, 8))
+        {
+            // Sorted by sequence number, newer entries replace older ones
+            for (i = used; i > 0 && nvs->sectors[order[i - 1]].seq > seq; i--)
+                order[i] = order[i - 1];
+            order[i] = s;
+            used++;
+            nvs->sectors[s].seq = seq;
+            continue;
+        }
+
+        // Erased or torn header, erased flash is only checked when opened
+        for (i = 0; i < sizeof(header) && header[i] == 0xFF; i++)
+            ;
+        if (i < sizeof(header) &&
+            W25Q128_EraseSector(w25, first_sector + s) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+        nvs->free++;
+    }
+
+    for (uint32_t i = 0; i < used; i++)
+    {
+        if (nvs_scan_sector(nvs, order[i], i == used - 1) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+    }
+
+    if (used > 0)
+    {
+        nvs->active = order[used - 1];
+        nvs->seq = nvs->sectors[nvs->active].seq;
+    }
+
+    return W25Q128_SUCCESS;
+}
+
+W25Q128_StatusTypeDef W25Q128_Nvs_Format(W25Q128_NvsTypeDef *nvs,
+                                        W25Q128_TypeDef *w25,
+                                        uint32_t first_sector,
+                                        uint32_t num_sectors)
+{
+    if (num_sectors < 2 || num_sectors > W25Q128_NVS_MAX_SECTORS ||
+        (first_sector + num_sectors) * W25Q128_SECTOR_SIZE >
+                                                    W25Q128_GetCapacity(w25))
+        return W25Q128_ERROR;
+
+    nvs_init(nvs, w25, first_sector, num_sectors);
+    nvs->free = num_sectors;
+
+    return W25Q128_EraseRange(w25, first_sector * W25Q128_SECTOR_SIZE,
+                                            num_sectors * W25Q128_SECTOR_SIZE);
+}
+
+W25Q128_StatusTypeDef W25Q128_Nvs_Get(W25Q128_NvsTypeDef *nvs, const char *key,
+                                        void *value, uint32_t max_size,
+                                        uint32_t *size)
+{
+    uint8_t header[W25Q128_NVS_ENTRY_HEADER_SIZE];
+    uint32_t key_size = strlen(key);
+    W25Q128_StatusTypeDef status;
+    uint32_t slot;
+    uint32_t crc;
+
+    nvs->stats.gets++;
+
+    if (key_size == 0 || key_size > W25Q128_NVS_MAX_KEY_SIZE)
+        return W25Q128_ERROR;
+
+    status = nvs_lookup(nvs, key, key_size, nvs_tag(key, key_size), &slot,
+                                                                    header);
+    if (status != W25Q128_SUCCESS)
+        return status;
+
+    *size = value_size(header);
+    if (*size > max_size)
+        return W25Q128_ERROR;
+
+    if (nvs_read(nvs, W25Q128_NVS_SLOT_LOC(nvs->index[slot]) +
+                                    W25Q128_NVS_ENTRY_SIZE(key_size, 0),
+                                    value, *size) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    crc = W25Q128_Crc32(0, &header[1], 3);
+    crc = W25Q128_Crc32(crc, (const uint8_t *)key, key_size);
+    crc = W25Q128_Crc32(crc, value, *size);
+    if (memcmp(&crc, &header[4], 4) != 0)
+        return W25Q128_ERROR;
+
+    return W25Q128_SUCCESS;
+}
+
+W25Q128_StatusTypeDef W25Q128_Nvs_Set(W25Q128_NvsTypeDef *nvs, const char *key,
+                                        const void *value, uint32_t size)
+{
+    uint8_t header[W25Q128_NVS_ENTRY_HEADER_SIZE];
+    uint32_t key_size = strlen(key);
+    uint32_t tag = nvs_tag(key, key_size);
+    W25Q128_StatusTypeDef status;
+    uint32_t old_size = 0;
+    uint32_t slot;
+    uint32_t loc;
+    uint32_t len;
+    uint32_t crc;
+
+    nvs->stats.sets++;
+
+    if (key_size == 0 || key_size > W25Q128_NVS_MAX_KEY_SIZE ||
+                                            size > W25Q128_NVS_MAX_VALUE_SIZE)
+        return W25Q128_ERROR;
+
+    status = nvs_lookup(nvs, key, key_size, tag, &slot, header);
+    if (status == W25Q128_ERROR)
+        return W25Q128_ERROR;
+
+    if (status == W25Q128_SUCCESS)
+    {
+        old_size = W25Q128_NVS_ENTRY_SPACE(key_size, value_size(header));
+
+        // Rewriting the same value would only wear the flash
+        if (value_size(header) == size)
+        {
+            loc = W25Q128_NVS_SLOT_LOC(nvs->index[slot]) +
+                                        W25Q128_NVS_ENTRY_SIZE(key_size, 0);
+            for (len = 0; len < size; len += sizeof(nvs->buf))
+            {
+                uint32_t n = (size - len < sizeof(nvs->buf)) ?
+                                            size - len : sizeof(nvs->buf);
+
+                nvs->buf_len = 0;
+                if (nvs_read(nvs, loc + len, nvs->buf, n) != W25Q128_SUCCESS)
+                    return W25Q128_ERROR;
+                if (memcmp(nvs->buf, (const uint8_t *)value + len, n) != 0)
+                    break;
+            }
+            if (len >= size)
+            {
+                nvs->stats.unchanged++;
+                return W25Q128_SUCCESS;
+            }
+        }
+    } else if (nvs->keys >= W25Q128_NVS_MAX_KEYS) {
+        return W25Q128_ERROR;
+    }
+
+    // Collection may move the old entry, but not the index slot
+    if (nvs_reserve(nvs, W25Q128_NVS_ENTRY_SPACE(key_size, size))
+                                                        != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    header[0] = W25Q128_NVS_LIVE;
+    header[1] = key_size;
+    header[2] = size & 0xFF;
+    header[3] = (size >> 8) & 0xFF;
+    crc = W25Q128_Crc32(0, &header[1], 3);
+    crc = W25Q128_Crc32(crc, (const uint8_t *)key, key_size);
+    crc = W25Q128_Crc32(crc, value, size);
+    memcpy(&header[4], &crc, 4);
+
+    // Header, key and the start of the value go in one page program
+    loc = nvs->active * W25Q128_SECTOR_SIZE + nvs->sectors[nvs->active].used;
+    len = W25Q128_PAGE_SIZE - (loc % W25Q128_PAGE_SIZE);
+    if (len > W25Q128_NVS_ENTRY_SIZE(key_size, size))
+        len = W25Q128_NVS_ENTRY_SIZE(key_size, size);
+    if (len < W25Q128_NVS_ENTRY_SIZE(key_size, 0))
+        len = W25Q128_NVS_ENTRY_SIZE(key_size, 0);
+
+    nvs->buf_len = 0;
+    memcpy(nvs->buf, header, sizeof(header));
+    memcpy(&nvs->buf[sizeof(header)], key, key_size);
+    memcpy(&nvs->buf[W25Q128_NVS_ENTRY_SIZE(key_size, 0)], value,
+                                    len - W25Q128_NVS_ENTRY_SIZE(key_size, 0));
+
+    if (nvs_program(nvs, loc, nvs->buf, len) != W25Q128_SUCCESS ||
+        nvs_program(nvs, loc + len, (const uint8_t *)value + len -
+                            W25Q128_NVS_ENTRY_SIZE(key_size, 0),
+                            W25Q128_NVS_ENTRY_SIZE(key_size, size) - len)
+                                                        != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+    nvs->sectors[nvs->active].used += W25Q128_NVS_ENTRY_SPACE(key_size, size);
+
+    if (status == W25Q128_SUCCESS)
+    {
+        if (nvs_make_obsolete(nvs, W25Q128_NVS_SLOT_LOC(nvs->index[slot]),
+                                            old_size) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+    } else {
+        nvs->keys++;
+    }
+    nvs->index[slot] = W25Q128_NVS_SLOT(tag, loc);
+
+    return W25Q128_SUCCESS;
+}
+
+W25Q128_StatusTypeDef W25Q128_Nvs_Delete(W25Q128_NvsTypeDef *nvs,
+                                                            const char *key)
+{
+    uint8_t header[W25Q128_NVS_ENTRY_HEADER_SIZE];
+    uint32_t key_size = strlen(key);
+    W25Q128_StatusTypeDef status;
+    uint32_t slot;
+
+    nvs->stats.deletes++;
+
+    if (key_size == 0 || key_size > W25Q128_NVS_MAX_KEY_SIZE)
+        return W25Q128_ERROR;
+
+    status = nvs_lookup(nvs, key, key_size, nvs_tag(key, key_size), &slot,
+                                                                    header);
+    if (status != W25Q128_SUCCESS)
+        return status;
+
+    if (nvs_make_obsolete(nvs, W25Q128_NVS_SLOT_LOC(nvs->index[slot]),
+            W25Q128_NVS_ENTRY_SPACE(key_size, value_size(header)))
+                                                        != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    nvs_remove_slot(nvs, slot);
+    nvs->keys--;
+
+    return W25Q128_SUCCESS;
+}
+
+W25Q128_StatusTypeDef W25Q128_Nvs_Collect(W25Q128_NvsTypeDef *nvs,
+                                                        uint32_t min_dead)
+{
+    uint32_t victim = nvs->num_sectors;
+    uint32_t base;
+    uint32_t end;
+    uint32_t live;
+
+    for (uint32_t s = 0; s < nvs->num_sectors; s++)
+    {
+        if (s == nvs->active || nvs->sectors[s].seq == 0)
+            continue;
+        if (victim == nvs->num_sectors ||
+            nvs->sectors[s].dead > nvs->sectors[victim].dead)
+            victim = s;
+    }
+    if (victim == nvs->num_sectors || nvs->sectors[victim].dead == 0 ||
+                                    nvs->sectors[victim].dead < min_dead)
+        return W25Q128_END;
+
+    // Live entries go to the active sector if they fit, else to an erased one
+    live = nvs->sectors[victim].used - W25Q128_NVS_FIRST_ENTRY -
+                                                nvs->sectors[victim].dead;
+    if (nvs->active == nvs->num_sectors ||
+        nvs->sectors[nvs->active].used + live > W25Q128_SECTOR_SIZE)
+    {
+        if (nvs->free == 0 || nvs_open_sector(nvs) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+    }
+
+    base = victim * W25Q128_SECTOR_SIZE;
+    end = base + nvs->sectors[victim].used;
+    nvs->buf_len = 0;
+    for (uint32_t loc = base + W25Q128_NVS_FIRST_ENTRY;
+                    loc + W25Q128_NVS_ENTRY_HEADER_SIZE <= end; )
+    {
+        const uint8_t *entry = nvs_fetch(nvs, loc,
+                                            W25Q128_NVS_ENTRY_HEADER_SIZE);
+        uint32_t key_size;
+        uint32_t size;
+        uint32_t dst;
+        uint32_t tag;
+        uint32_t slot;
+
+        if (entry == NULL)
+            return W25Q128_ERROR;
+
+        // Erased, closed or torn header, no entries follow
+        key_size = entry[1];
+        size = W25Q128_NVS_ENTRY_SPACE(key_size, value_size(entry));
+        if (key_size == W25Q128_NVS_KEY_ERASED ||
+            key_size == W25Q128_NVS_KEY_CLOSED ||
+            key_size > W25Q128_NVS_MAX_KEY_SIZE || loc + size > end)
+            break;
+
+        if (entry[0] != W25Q128_NVS_LIVE)
+        {
+            loc += size;
+            continue;
+        }
+
+        entry = nvs_fetch(nvs, loc, W25Q128_NVS_ENTRY_SIZE(key_size, 0));
+        if (entry == NULL)
+            return W25Q128_ERROR;
+
+        // Live entries are always indexed
+        tag = nvs_tag((const char *)&entry[W25Q128_NVS_ENTRY_HEADER_SIZE],
+                                                                    key_size);
+        slot = tag & W25Q128_NVS_INDEX_MASK;
+        while (nvs->index[slot] != W25Q128_NVS_SLOT(tag, loc))
+        {
+            if (nvs->index[slot] == W25Q128_NVS_EMPTY_SLOT)
+                return W25Q128_ERROR;
+            slot = (slot + 1) & W25Q128_NVS_INDEX_MASK;
+        }
+
+        dst = nvs->active * W25Q128_SECTOR_SIZE +
+                                            nvs->sectors[nvs->active].used;
+        for (uint32_t done = 0; done < size; )
+        {
+            uint32_t len = W25Q128_PAGE_SIZE -
+                                    ((dst + done) % W25Q128_PAGE_SIZE);
+
+            if (len > size - done)
+                len = size - done;
+            entry = nvs_fetch(nvs, loc + done, len);
+            if (entry == NULL ||
+                nvs_program(nvs, dst + done, entry, len) != W25Q128_SUCCESS)
+                return W25Q128_ERROR;
+            done += len;
+        }
+
+        nvs->sectors[nvs->active].used += size;
+        nvs->index[slot] = W25Q128_NVS_SLOT(tag, dst);
+        nvs->stats.moved++;
+        loc += size;
+    }
+
+    if (W25Q128_EraseSector(nvs->w25, nvs->first_sector + victim)
+                                                        != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    memset(&nvs->sectors[victim], 0, sizeof(nvs->sectors[victim]));
+    nvs->free++;
+    nvs->stats.collections++;
+
+    return W25Q128_SUCCESS;
+}
+
+void W25Q128_Nvs_GetStats(W25Q128_NvsTypeDef *nvs,
+                                            W25Q128_NvsStatsTypeDef *stats)
+{
+    *stats = nvs->stats;
+}
+
+/*************************** Static functions *********************************/
+// FNV-1a, the upper half is the 16 bit tag of an index slot
+static uint32_t nvs_tag(const char *key, uint32_t key_size)
+{
+    uint32_t hash = 2166136261u;
+
+    for (uint32_t i = 0; i < key_size; i++)
+    {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619u;
+    }
+    return hash >> 16;
+}
+
+static uint32_t value_size(const uint8_t *header)
+{
+    return header[2] | (header[3] << 8);
+}
+
+static void nvs_init(W25Q128_NvsTypeDef *nvs, W25Q128_TypeDef *w25,
+                                uint32_t first_sector, uint32_t num_sectors)
+{
+    memset(nvs, 0, sizeof(*nvs));
+    nvs->w25 = w25;
+    nvs->first_sector = first_sector;
+    nvs->num_sectors = num_sectors;
+    nvs->active = num_sectors;
+}
+
+static W25Q128_StatusTypeDef nvs_read(W25Q128_NvsTypeDef *nvs, uint32_t loc,
+                                        void *data, uint32_t size)
+{
+    uint32_t addr = nvs->first_sector * W25Q128_SECTOR_SIZE + loc;
+
+    return W25Q128_FastRead(nvs->w25, addr / W25Q128_PAGE_SIZE,
+                                    addr % W25Q128_PAGE_SIZE, size, data);
+}
+
+static W25Q128_StatusTypeDef nvs_program(W25Q128_NvsTypeDef *nvs,
+                                uint32_t loc, const void *data, uint32_t size)
+{
+    uint32_t addr = nvs->first_sector * W25Q128_SECTOR_SIZE + loc;
+
+    if (size == 0)
+        return W25Q128_SUCCESS;
+
+    return W25Q128_WritePage(nvs->w25, addr / W25Q128_PAGE_SIZE,
+                            addr % W25Q128_PAGE_SIZE, size, (uint8_t *)data);
+}
+
+/*
+ * Returns size bytes at loc from the window in buf, which is moved when it
+ * does not hold them. Size is at most W25Q128_PAGE_SIZE.
+ */
+static const uint8_t *nvs_fetch(W25Q128_NvsTypeDef *nvs, uint32_t loc,
+                                                            uint32_t size)
+{
+    uint32_t region = nvs->num_sectors * W25Q128_SECTOR_SIZE;
+
+    if (nvs->buf_len == 0 || loc < nvs->buf_loc ||
+                            loc + size > nvs->buf_loc + nvs->buf_len)
+    {
+        nvs->buf_loc = loc;
+        nvs->buf_len = (region - loc < sizeof(nvs->buf)) ?
+                                            region - loc : sizeof(nvs->buf);
+        if (size > nvs->buf_len ||
+            nvs_read(nvs, loc, nvs->buf, nvs->buf_len) != W25Q128_SUCCESS)
+        {
+            nvs->buf_len = 0;
+            return NULL;
+        }
+    }
+
+    return &nvs->buf[loc - nvs->buf_loc];
+}
+
+/*
+ * W25Q128_SUCCESS with the slot of the key and its entry header, or
+ * W25Q128_NOT_FOUND with the empty slot that ends the probe sequence.
+ */
+static W25Q128_StatusTypeDef nvs_lookup(W25Q128_NvsTypeDef *nvs,
+                                const char *key, uint32_t key_size,
+                                uint32_t tag, uint32_t *slot,
+                                uint8_t *header)
+{
+    uint8_t entry[W25Q128_NVS_ENTRY_HEADER_SIZE + W25Q128_NVS_MAX_KEY_SIZE];
+    uint32_t i = tag & W25Q128_NVS_INDEX_MASK;
+
+    for (; nvs->index[i] != W25Q128_NVS_EMPTY_SLOT;
+                                    i = (i + 1) & W25Q128_NVS_INDEX_MASK)
+    {
+        if (W25Q128_NVS_SLOT_TAG(nvs->index[i]) != tag)
+            continue;
+
+        nvs->stats.probes++;
+        if (nvs_read(nvs, W25Q128_NVS_SLOT_LOC(nvs->index[i]), entry,
+                W25Q128_NVS_ENTRY_SIZE(key_size, 0)) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+
+        if (entry[1] == key_size && memcmp(&entry[
+                    W25Q128_NVS_ENTRY_HEADER_SIZE], key, key_size) == 0)
+        {
+            memcpy(header, entry, W25Q128_NVS_ENTRY_HEADER_SIZE);
+            *slot = i;
+            return W25Q128_SUCCESS;
+        }
+    }
+
+    *slot = i;
+    return W25Q128_NOT_FOUND;
+}
+
+// Backward shift deletion, keeps probe sequences without tombstones
+static void nvs_remove_slot(W25Q128_NvsTypeDef *nvs, uint32_t slot)
+{
+    uint32_t j = slot;
+
+    while (1)
+    {
+        uint32_t home;
+
+        j = (j + 1) & W25Q128_NVS_INDEX_MASK;
+        if (nvs->index[j] == W25Q128_NVS_EMPTY_SLOT)
+            break;
+
+        // Entry stays if its home slot is cyclically in (slot, j]
+        home = W25Q128_NVS_SLOT_TAG(nvs->index[j]) & W25Q128_NVS_INDEX_MASK;
+        if ((slot <= j) ? (slot < home && home <= j) :
+                                            (slot < home || home <= j))
+            continue;
+
+        nvs->index[slot] = nvs->index[j];
+        slot = j;
+    }
+
+    nvs->index[slot] = W25Q128_NVS_EMPTY_SLOT;
+}
+
+static W25Q128_StatusTypeDef nvs_make_obsolete(W25Q128_NvsTypeDef *nvs,
+                                        uint32_t loc, uint32_t size)
+{
+    uint8_t state = W25Q128_NVS_OBSOLETE;
+
+    if (nvs_program(nvs, loc, &state, 1) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    nvs->sectors[loc / W25Q128_SECTOR_SIZE].dead += size;
+    return W25Q128_SUCCESS;
+}
+
+/*
+ * Indexes the live entries of a sector. Entries of the active sector are
+ * checked against their CRC, the first bad one (interrupted set) is closed
+ * on flash, as is a malformed header in any sector, and the sector is
+ * closed in RAM if the flash after its last entry is not erased.
+ */
+static W25Q128_StatusTypeDef nvs_scan_sector(W25Q128_NvsTypeDef *nvs,
+                                        uint32_t sector, uint8_t active)
+{
+    uint8_t closed[W25Q128_NVS_ENTRY_HEADER_SIZE] = { 0 };
+    uint32_t base = sector * W25Q128_SECTOR_SIZE;
+    uint32_t end = base + W25Q128_SECTOR_SIZE;
+    uint32_t loc = base + W25Q128_NVS_FIRST_ENTRY;
+    uint8_t blank = active;
+
+    nvs->buf_len = 0;
+    while (loc + W25Q128_NVS_ENTRY_HEADER_SIZE <= end)
+    {
+        uint8_t header[W25Q128_NVS_ENTRY_HEADER_SIZE];
+        const uint8_t *entry;
+        W25Q128_StatusTypeDef status;
+        uint32_t key_size;
+        uint32_t size;
+        uint32_t tag;
+        uint32_t slot;
+
+        entry = nvs_fetch(nvs, loc, W25Q128_NVS_ENTRY_HEADER_SIZE);
+        if (entry == NULL)
+            return W25Q128_ERROR;
+        memcpy(header, entry, sizeof(header));
+
+        key_size = header[1];
+        if (key_size == W25Q128_NVS_KEY_ERASED)
+            break;
+
+        size = W25Q128_NVS_ENTRY_SIZE(key_size, value_size(header));
+        if (key_size == W25Q128_NVS_KEY_CLOSED ||
+            key_size > W25Q128_NVS_MAX_KEY_SIZE || loc + size > end)
+        {
+            // Header torn by an interrupted set, closed like a bad CRC
+            if (key_size != W25Q128_NVS_KEY_CLOSED)
+            {
+                if (nvs_program(nvs, loc, closed, sizeof(closed))
+                                                        != W25Q128_SUCCESS)
+                    return W25Q128_ERROR;
+                nvs->buf_len = 0;
+            }
+            blank = 0;
+            break;
+        }
+
+        if (active)
+        {
+            uint32_t crc = W25Q128_Crc32(0, &header[1], 3);
+
+            for (uint32_t done = W25Q128_NVS_ENTRY_HEADER_SIZE; done < size; )
+            {
+                uint32_t len = (size - done < W25Q128_PAGE_SIZE) ?
+                                            size - done : W25Q128_PAGE_SIZE;
+
+                entry = nvs_fetch(nvs, loc + done, len);
+                if (entry == NULL)
+                    return W25Q128_ERROR;
+                crc = W25Q128_Crc32(crc, entry, len);
+                done += len;
+            }
+
+            if (memcmp(&crc, &header[4], 4) != 0)
+            {
+                // Key length 0 ends the entries of this sector for good
+                if (nvs_program(nvs, loc, closed, sizeof(closed))
+                                                        != W25Q128_SUCCESS)
+                    return W25Q128_ERROR;
+                nvs->buf_len = 0;
+                blank = 0;
+                break;
+            }
+        }
+
+        // Padding is skipped, it stays erased
+        size = W25Q128_NVS_ALIGN(size);
+        if (header[0] != W25Q128_NVS_LIVE)
+        {
+            nvs->sectors[sector].dead += size;
+            loc += size;
+            continue;
+        }
+
+        entry = nvs_fetch(nvs, loc, W25Q128_NVS_ENTRY_SIZE(key_size, 0));
+        if (entry == NULL)
+            return W25Q128_ERROR;
+        tag = nvs_tag((const char *)&entry[W25Q128_NVS_ENTRY_HEADER_SIZE],
+                                                                    key_size);
+
+        status = nvs_lookup(nvs, (const char *)&entry[
+                        W25Q128_NVS_ENTRY_HEADER_SIZE], key_size, tag,
+                        &slot, header);
+        if (status == W25Q128_ERROR)
+            return W25Q128_ERROR;
+
+        if (status == W25Q128_SUCCESS)
+        {
+            // Older copy left by an interrupted set or collection
+            if (nvs_make_obsolete(nvs, W25Q128_NVS_SLOT_LOC(nvs->index[slot]),
+                    W25Q128_NVS_ENTRY_SPACE(key_size, value_size(header)))
+                                                        != W25Q128_SUCCESS)
+                return W25Q128_ERROR;
+            nvs->buf_len = 0;
+        } else {
+            if (nvs->keys >= W25Q128_NVS_MAX_KEYS)
+                return W25Q128_ERROR;
+            nvs->keys++;
+        }
+        nvs->index[slot] = W25Q128_NVS_SLOT(tag, loc);
+        loc += size;
+    }
+
+    // Rest of the active sector is written to, so it must be erased
+    for (uint32_t i = loc; blank && i < end; i++)
+    {
+        const uint8_t *byte = nvs_fetch(nvs, i, 1);
+
+        if (byte == NULL)
+            return W25Q128_ERROR;
+        blank = (*byte == 0xFF);
+    }
+
+    nvs->sectors[sector].used = loc - base;
+    if (!blank)
+    {
+        nvs->sectors[sector].dead += end - loc;
+        nvs->sectors[sector].used = W25Q128_SECTOR_SIZE;
+    }
+
+    return W25Q128_SUCCESS;
+}
+
+// Starts a new active sector in the erased sector after the current one
+static W25Q128_StatusTypeDef nvs_open_sector(W25Q128_NvsTypeDef *nvs)
+{
+    uint8_t header[W25Q128_NVS_SECTOR_HEADER_SIZE];
+    uint32_t magic = W25Q128_NVS_MAGIC;
+    uint32_t sector = nvs->active;
+    uint32_t crc;
+
+    do {
+        sector = (sector + 1) % nvs->num_sectors;
+    } while (nvs->sectors[sector].seq != 0);
+
+    // Erased as far as the header shows, skipped by the driver if it is
+    if (W25Q128_EraseSector(nvs->w25, nvs->first_sector + sector)
+                                                        != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    nvs->seq++;
+    memcpy(&header[0], &magic, 4);
+    memcpy(&header[4], &nvs->seq, 4);
+    crc = W25Q128_Crc32(0, header, 8);
+    memcpy(&header[8], &crc, 4);
+    if (nvs_program(nvs, sector * W25Q128_SECTOR_SIZE, header,
+                                        sizeof(header)) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    // Space left in the previous sector is never used
+    if (nvs->active != nvs->num_sectors)
+    {
+        W25Q128_NvsSectorTypeDef *prev = &nvs->sectors[nvs->active];
+
+        prev->dead += W25Q128_SECTOR_SIZE - prev->used;
+        prev->used = W25Q128_SECTOR_SIZE;
+    }
+
+    nvs->active = sector;
+    nvs->sectors[sector].seq = nvs->seq;
+    nvs->sectors[sector].used = W25Q128_NVS_FIRST_ENTRY;
+    nvs->sectors[sector].dead = 0;
+    nvs->free--;
+
+    return W25Q128_SUCCESS;
+}
+
+// Makes room for an entry in the active sector, one sector stays erased
+static W25Q128_StatusTypeDef nvs_reserve(W25Q128_NvsTypeDef *nvs,
+                                                                uint32_t size)
+{
+    for (uint32_t i = 0; i <= nvs->num_sectors; i++)
+    {
+        W25Q128_StatusTypeDef status;
+
+        if (nvs->active != nvs->num_sectors &&
+            nvs->sectors[nvs->active].used + size <= W25Q128_SECTOR_SIZE)
+            return W25Q128_SUCCESS;
+
+        if (nvs->free > 1)
+        {
+            if (nvs_open_sector(nvs) != W25Q128_SUCCESS)
+                return W25Q128_ERROR;
+            continue;
+        }
+
+        status = W25Q128_Nvs_Collect(nvs, 1);
+        if (status != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+    }
+
+    return W25Q128_ERROR;
+}
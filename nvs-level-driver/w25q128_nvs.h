@@ -0,0 +1,176 @@
+/**
+ * @file w25q128_nvs.h
+ * @brief w25q128 key-value store
+ * @author Filip Stojanovic
+ *
+ * Key-value store for many small entries (configuration, calibration), built
+ * directly on the low-level driver. A region of whole sectors holds entries
+ * appended one after another:
+ *
+ * - every used sector starts with a header (magic, sequence number, CRC),
+ *   entries go to the active sector, which has the highest sequence number
+ * - an entry is an 8 byte header (state, key length, value length, CRC-32 of
+ *   the lengths, key and value), the key and the value, padded to
+ *   W25Q128_NVS_ENTRY_ALIGN. Set appends a new entry and then marks the
+ *   previous one obsolete by programming its state byte, delete only marks it
+ * - a RAM hash index (open addressing, 4 bytes per slot) maps the key hash to
+ *   the flash location of the live entry, so get and set read a single entry.
+ *   A slot holds a 16 bit tag of the hash, which also gives the home slot,
+ *   and the entry location in 16 bits: its sector and its offset divided by
+ *   W25Q128_NVS_ENTRY_ALIGN
+ * - one sector is kept erased. When no other is left, the sector with the
+ *   most obsolete bytes is collected: its live entries are copied to the
+ *   erased one, which becomes the active sector, and it is erased
+ *
+ * Mount rebuilds the index from the entry headers and keys, values are only
+ * read (and their CRC checked) in the active sector, where an interrupted set
+ * can be. Of two live entries with the same key, left by an interrupted set
+ * or collection, the newer one is kept and the older one is marked obsolete.
+ */
+
+#ifndef W25Q128_NVS_H
+#define W25Q128_NVS_H
+
+#include "w25q128_conf_nvs.h"
+#include "w25q128_ll.h"
+
+#include <stdint.h>
+
+#define W25Q128_NVS_SECTOR_HEADER_SIZE 12
+#define W25Q128_NVS_ENTRY_HEADER_SIZE 8
+
+#define W25Q128_NVS_ALIGN(size) (((size) + W25Q128_NVS_ENTRY_ALIGN - 1) & \
+                                            ~(W25Q128_NVS_ENTRY_ALIGN - 1))
+
+// Largest value, an entry does not cross sectors
+#define W25Q128_NVS_MAX_VALUE_SIZE (W25Q128_SECTOR_SIZE - \
+            W25Q128_NVS_ALIGN(W25Q128_NVS_SECTOR_HEADER_SIZE) - \
+            W25Q128_NVS_ENTRY_HEADER_SIZE - W25Q128_NVS_MAX_KEY_SIZE)
+
+typedef struct {
+    uint32_t seq;           // 0 for an erased sector
+    uint16_t used;          // End of the entries
+    uint16_t dead;          // Obsolete entries and space left unused
+} W25Q128_NvsSectorTypeDef;
+
+typedef struct {
+    uint32_t gets;
+    uint32_t sets;
+    uint32_t unchanged;     // Sets skipped, the value was already stored
+    uint32_t deletes;
+    uint32_t collections;   // Sectors collected
+    uint32_t moved;         // Entries copied by collection
+    uint32_t probes;        // Entries read to compare a key
+} W25Q128_NvsStatsTypeDef;
+
+typedef struct {
+    W25Q128_TypeDef *w25;
+    uint32_t first_sector;
+    uint32_t num_sectors;
+
+    W25Q128_NvsSectorTypeDef sectors[W25Q128_NVS_MAX_SECTORS];
+    uint32_t active;        // num_sectors if there is no active sector
+    uint32_t seq;           // Highest sequence number
+    uint32_t free;          // Erased sectors
+
+    // Index, hash tag in the upper half of a slot, location in the lower
+    uint32_t index[W25Q128_NVS_INDEX_SIZE];
+    uint32_t keys;
+
+    // Staging buffer, while mounting and collecting a window of the region
+    uint8_t buf[W25Q128_PAGE_SIZE];
+    uint32_t buf_loc;
+    uint32_t buf_len;
+
+    W25Q128_NvsStatsTypeDef stats;
+} W25Q128_NvsTypeDef;
+
+
+/**
+ * @brief Function that mounts a store and builds its index
+ * @param nvs Pointer to the store struct
+ * @param w25 Pointer to the flash configuration struct
+ * @param first_sector First sector of the region
+ * @param num_sectors Number of sectors in the region, 2 to
+ *        W25Q128_NVS_MAX_SECTORS
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Sectors with an invalid header are erased, an erased region is an
+ *       empty store.
+ */
+W25Q128_StatusTypeDef W25Q128_Nvs_Mount(W25Q128_NvsTypeDef *nvs,
+                                        W25Q128_TypeDef *w25,
+                                        uint32_t first_sector,
+                                        uint32_t num_sectors);
+
+/**
+ * @brief Function that erases the whole region and starts an empty store
+ * @param nvs Pointer to the store struct
+ * @param w25 Pointer to the flash configuration struct
+ * @param first_sector First sector of the region
+ * @param num_sectors Number of sectors in the region, 2 to
+ *        W25Q128_NVS_MAX_SECTORS
+ * @retval ::W25Q128_StatusTypeDef
+ */
+W25Q128_StatusTypeDef W25Q128_Nvs_Format(W25Q128_NvsTypeDef *nvs,
+                                        W25Q128_TypeDef *w25,
+                                        uint32_t first_sector,
+                                        uint32_t num_sectors);
+
+/**
+ * @brief Function that reads the value of a key
+ * @param nvs Pointer to the store struct
+ * @param key Null terminated key
+ * @param value Pointer to the buffer for the value
+ * @param max_size Buffer size
+ * @param size Pointer to which the value size is written
+ * @retval ::W25Q128_StatusTypeDef, W25Q128_NOT_FOUND if there is no such key
+ * @note If the value is larger than max_size, its size is written and
+ *       W25Q128_ERROR is returned.
+ */
+W25Q128_StatusTypeDef W25Q128_Nvs_Get(W25Q128_NvsTypeDef *nvs, const char *key,
+                                        void *value, uint32_t max_size,
+                                        uint32_t *size);
+
+/**
+ * @brief Function that stores the value of a key
+ * @param nvs Pointer to the store struct
+ * @param key Null terminated key, up to W25Q128_NVS_MAX_KEY_SIZE characters
+ * @param value Pointer to the value
+ * @param size Value size, up to W25Q128_NVS_MAX_VALUE_SIZE
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Value is durable when the function returns. Storing the value that
+ *       is already stored writes nothing.
+ */
+W25Q128_StatusTypeDef W25Q128_Nvs_Set(W25Q128_NvsTypeDef *nvs, const char *key,
+                                        const void *value, uint32_t size);
+
+/**
+ * @brief Function that deletes a key
+ * @param nvs Pointer to the store struct
+ * @param key Null terminated key
+ * @retval ::W25Q128_StatusTypeDef, W25Q128_NOT_FOUND if there is no such key
+ */
+W25Q128_StatusTypeDef W25Q128_Nvs_Delete(W25Q128_NvsTypeDef *nvs,
+                                                            const char *key);
+
+/**
+ * @brief Function that collects the dirtiest sector if it is worth it
+ * @param nvs Pointer to the store struct
+ * @param min_dead Collect only if the sector has at least this many
+ *        obsolete bytes
+ * @retval ::W25Q128_StatusTypeDef, W25Q128_END if there is nothing to collect
+ * @note Called from idle time, it moves the collection off the set path.
+ */
+W25Q128_StatusTypeDef W25Q128_Nvs_Collect(W25Q128_NvsTypeDef *nvs,
+                                                        uint32_t min_dead);
+
+/**
+ * @brief Function that copies store counters
+ * @param nvs Pointer to the store struct
+ * @param stats Pointer to the struct in which counters are copied
+ * @return None
+ */
+void W25Q128_Nvs_GetStats(W25Q128_NvsTypeDef *nvs,
+                                            W25Q128_NvsStatsTypeDef *stats);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,28 @@
+/**
+ * @file w25q128_conf_ota.h
+ * @brief w25q128 image writer configuration file
+ * @author Filip Stojanovic
+ */
+
+#ifndef W25Q128_CONF_OTA_H
+#define W25Q128_CONF_OTA_H
+
+/*
+ * Image area erased ahead of the write pointer at once, multiple of the
+ * sector size. Erase ends at the next boundary of this size, so 64 KB uses
+ * block erases once the pointer is aligned.
+ */
+#ifndef W25Q128_OTA_ERASE_AHEAD_SIZE
+#define W25Q128_OTA_ERASE_AHEAD_SIZE 65536
+#endif
+
+/*
+ * Progress marker interval, multiple of the sector size. At most this much
+ * data is downloaded again after an interruption. Larger images use a
+ * multiple of it, the marker sector holds about 500 markers.
+ */
+#ifndef W25Q128_OTA_MARKER_INTERVAL
+#define W25Q128_OTA_MARKER_INTERVAL 16384
+#endif
+
+#endif
\ No newline at end of file
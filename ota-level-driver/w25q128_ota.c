@@ -0,0 +1,418 @@
+/**
+ * @file w25q128_ota.c
+ * @brief w25q128 resumable firmware image writer
+ * @author Filip Stojanovic
+ */
+
+#include "w25q128_ota.h"
+
+#include <string.h>
+
+#define W25Q128_OTA_MAGIC 0x4F353257 // "W25O"
+
+// Header sector: magic, id, size, header CRC, image CRC, state, markers
+#define W25Q128_OTA_HEADER_SIZE   12
+#define W25Q128_OTA_IMAGE_CRC_POS 16
+#define W25Q128_OTA_STATE_POS     20
+#define W25Q128_OTA_MARKER_START  32
+#define W25Q128_OTA_MARKER_SIZE   8
+
+#define W25Q128_OTA_STATE_COMPLETE 0x00000000
+
+// Markers of the intervals, the last one is left for the image end
+#define W25Q128_OTA_MAX_MARKERS ((W25Q128_SECTOR_SIZE - \
+            W25Q128_OTA_MARKER_START) / W25Q128_OTA_MARKER_SIZE - 1)
+
+/*************************** Static functions *********************************/
+static uint32_t get_u32(const uint8_t *p);
+static void set_u32(uint8_t *p, uint32_t value);
+static uint32_t header_addr(W25Q128_OtaTypeDef *ota);
+static W25Q128_StatusTypeDef ota_init(W25Q128_OtaTypeDef *ota,
+                                        W25Q128_TypeDef *w25,
+                                        uint32_t slot_addr,
+                                        uint32_t slot_size);
+static W25Q128_StatusTypeDef ota_read(W25Q128_OtaTypeDef *ota, uint32_t addr,
+                                        uint8_t *data, uint32_t size);
+static W25Q128_StatusTypeDef ota_read_header(W25Q128_OtaTypeDef *ota,
+                                        uint8_t *header);
+static W25Q128_StatusTypeDef ota_find_marker(W25Q128_OtaTypeDef *ota);
+static W25Q128_StatusTypeDef ota_erase_next(W25Q128_OtaTypeDef *ota);
+static W25Q128_StatusTypeDef ota_program(W25Q128_OtaTypeDef *ota,
+                                        const uint8_t *data, uint32_t size);
+static W25Q128_StatusTypeDef ota_mark(W25Q128_OtaTypeDef *ota);
+static W25Q128_StatusTypeDef ota_image_crc(W25Q128_OtaTypeDef *ota,
+                                                            uint32_t *crc);
+
+W25Q128_StatusTypeDef W25Q128_Ota_Open(W25Q128_OtaTypeDef *ota,
+                                        W25Q128_TypeDef *w25,
+                                        uint32_t slot_addr, uint32_t slot_size,
+                                        uint32_t image_id,
+                                        uint32_t image_size)
+{
+    uint8_t header[W25Q128_OTA_MARKER_START];
+    W25Q128_StatusTypeDef status;
+
+    if (ota_init(ota, w25, slot_addr, slot_size) != W25Q128_SUCCESS ||
+        image_size == 0 || image_size > slot_size - W25Q128_SECTOR_SIZE)
+        return W25Q128_ERROR;
+
+    ota->image_id = image_id;
+    ota->image_size = image_size;
+
+    // Same interval on every open, so markers of a resumed download match
+    ota->marker_interval = W25Q128_OTA_MARKER_INTERVAL;
+    while (image_size / ota->marker_interval > W25Q128_OTA_MAX_MARKERS)
+        ota->marker_interval *= 2;
+
+    status = ota_read_header(ota, header);
+    if (status == W25Q128_ERROR)
+        return W25Q128_ERROR;
+
+    if (status == W25Q128_SUCCESS && get_u32(&header[4]) == image_id &&
+                                        get_u32(&header[8]) == image_size)
+        return ota_find_marker(ota);
+
+    // Different image, the slot is started over
+    ota->marker_pos = W25Q128_OTA_MARKER_START;
+    if (W25Q128_EraseSector(w25, header_addr(ota) / W25Q128_SECTOR_SIZE)
+                                                        != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    set_u32(&header[0], W25Q128_OTA_MAGIC);
+    set_u32(&header[4], image_id);
+    set_u32(&header[8], image_size);
+    set_u32(&header[W25Q128_OTA_HEADER_SIZE],
+                            W25Q128_Crc32(0, header, W25Q128_OTA_HEADER_SIZE));
+
+    return W25Q128_WritePage(w25, header_addr(ota) / W25Q128_PAGE_SIZE, 0,
+                                        W25Q128_OTA_HEADER_SIZE + 4, header);
+}
+
+uint32_t W25Q128_Ota_GetOffset(W25Q128_OtaTypeDef *ota)
+{
+    return ota->programmed + ota->page_fill;
+}
+
+W25Q128_StatusTypeDef W25Q128_Ota_Append(W25Q128_OtaTypeDef *ota,
+                                        const uint8_t *data, uint32_t size)
+{
+    if (size > ota->image_size - W25Q128_Ota_GetOffset(ota))
+        return W25Q128_ERROR;
+
+    ota->stats.bytes += size;
+
+    while (size > 0)
+    {
+        uint32_t len;
+
+        // Whole pages go straight from the chunk
+        if (ota->page_fill == 0 && size >= W25Q128_PAGE_SIZE)
+        {
+            len = size - (size % W25Q128_PAGE_SIZE);
+            if (ota_program(ota, data, len) != W25Q128_SUCCESS)
+                return W25Q128_ERROR;
+            data += len;
+            size -= len;
+            continue;
+        }
+
+        len = W25Q128_PAGE_SIZE - ota->page_fill;
+        if (len > size)
+            len = size;
+        memcpy(&ota->page[ota->page_fill], data, len);
+        ota->page_fill += len;
+        data += len;
+        size -= len;
+
+        if (ota->page_fill == W25Q128_PAGE_SIZE)
+        {
+            if (ota_program(ota, ota->page, W25Q128_PAGE_SIZE)
+                                                        != W25Q128_SUCCESS)
+                return W25Q128_ERROR;
+            ota->page_fill = 0;
+        }
+    }
+
+    return W25Q128_SUCCESS;
+}
+
+W25Q128_StatusTypeDef W25Q128_Ota_EraseAhead(W25Q128_OtaTypeDef *ota)
+{
+    if (ota->erased >= ota->image_size ||
+        ota->erased - ota->programmed >= W25Q128_OTA_ERASE_AHEAD_SIZE)
+        return W25Q128_SUCCESS;
+
+    return ota_erase_next(ota);
+}
+
+W25Q128_StatusTypeDef W25Q128_Ota_Finalize(W25Q128_OtaTypeDef *ota,
+                                                            uint32_t crc)
+{
+    uint8_t state[8];
+    uint32_t image_crc;
+
+    if (W25Q128_Ota_GetOffset(ota) != ota->image_size)
+        return W25Q128_ERROR;
+
+    // Last partial page, and the marker of the image end
+    if (ota->page_fill > 0)
+    {
+        if (ota_program(ota, ota->page, ota->page_fill) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+        ota->page_fill = 0;
+    }
+
+    if (ota_image_crc(ota, &image_crc) != W25Q128_SUCCESS ||
+                                                        image_crc != crc)
+        return W25Q128_ERROR;
+
+    set_u32(&state[0], image_crc);
+    set_u32(&state[4], W25Q128_OTA_STATE_COMPLETE);
+
+    return W25Q128_WritePage(ota->w25, header_addr(ota) / W25Q128_PAGE_SIZE,
+                                W25Q128_OTA_IMAGE_CRC_POS, 8, state);
+}
+
+W25Q128_StatusTypeDef W25Q128_Ota_Verify(W25Q128_OtaTypeDef *ota,
+                                        W25Q128_TypeDef *w25,
+                                        uint32_t slot_addr,
+                                        uint32_t slot_size)
+{
+    uint8_t header[W25Q128_OTA_MARKER_START];
+    uint32_t image_crc;
+
+    if (ota_init(ota, w25, slot_addr, slot_size) != W25Q128_SUCCESS ||
+        ota_read_header(ota, header) != W25Q128_SUCCESS ||
+        get_u32(&header[W25Q128_OTA_STATE_POS]) != W25Q128_OTA_STATE_COMPLETE)
+        return W25Q128_ERROR;
+
+    ota->image_id = get_u32(&header[4]);
+    ota->image_size = get_u32(&header[8]);
+    if (ota->image_size > slot_size - W25Q128_SECTOR_SIZE)
+        return W25Q128_ERROR;
+
+    if (ota_image_crc(ota, &image_crc) != W25Q128_SUCCESS ||
+        image_crc != get_u32(&header[W25Q128_OTA_IMAGE_CRC_POS]))
+        return W25Q128_ERROR;
+
+    return W25Q128_SUCCESS;
+}
+
+void W25Q128_Ota_GetStats(W25Q128_OtaTypeDef *ota,
+                                            W25Q128_OtaStatsTypeDef *stats)
+{
+    *stats = ota->stats;
+}
+
+/*************************** Static functions *********************************/
+static uint32_t get_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void set_u32(uint8_t *p, uint32_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
+}
+
+static uint32_t header_addr(W25Q128_OtaTypeDef *ota)
+{
+    return ota->slot_addr + ota->slot_size - W25Q128_SECTOR_SIZE;
+}
+
+static W25Q128_StatusTypeDef ota_init(W25Q128_OtaTypeDef *ota,
+                                        W25Q128_TypeDef *w25,
+                                        uint32_t slot_addr,
+                                        uint32_t slot_size)
+{
+    memset(ota, 0, sizeof(*ota));
+    ota->w25 = w25;
+    ota->slot_addr = slot_addr;
+    ota->slot_size = slot_size;
+
+    if ((slot_addr % W25Q128_SECTOR_SIZE) || (slot_size % W25Q128_SECTOR_SIZE)
+        || slot_size < 2 * W25Q128_SECTOR_SIZE ||
+        slot_addr > W25Q128_GetCapacity(w25) ||
+        slot_size > W25Q128_GetCapacity(w25) - slot_addr)
+        return W25Q128_ERROR;
+
+    return W25Q128_SUCCESS;
+}
+
+static W25Q128_StatusTypeDef ota_read(W25Q128_OtaTypeDef *ota, uint32_t addr,
+                                        uint8_t *data, uint32_t size)
+{
+    return W25Q128_FastRead(ota->w25, addr / W25Q128_PAGE_SIZE,
+                                    addr % W25Q128_PAGE_SIZE, size, data);
+}
+
+// W25Q128_SUCCESS for a valid header, W25Q128_END for erased or torn one
+static W25Q128_StatusTypeDef ota_read_header(W25Q128_OtaTypeDef *ota,
+                                        uint8_t *header)
+{
+    if (ota_read(ota, header_addr(ota), header, W25Q128_OTA_MARKER_START)
+                                                        != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    if (get_u32(&header[0]) != W25Q128_OTA_MAGIC ||
+        get_u32(&header[W25Q128_OTA_HEADER_SIZE]) !=
+                            W25Q128_Crc32(0, header, W25Q128_OTA_HEADER_SIZE))
+        return W25Q128_END;
+
+    return W25Q128_SUCCESS;
+}
+
+/*
+ * Resumes at the last valid marker. A marker is its offset and the inverted
+ * offset, so one torn by power loss does not match and is skipped.
+ */
+static W25Q128_StatusTypeDef ota_find_marker(W25Q128_OtaTypeDef *ota)
+{
+    uint32_t addr = header_addr(ota);
+    uint32_t pos = W25Q128_OTA_MARKER_START;
+
+    while (pos < W25Q128_SECTOR_SIZE)
+    {
+        uint32_t len = W25Q128_PAGE_SIZE - (pos % W25Q128_PAGE_SIZE);
+
+        if (ota_read(ota, addr + pos, ota->page, len) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+
+        for (uint32_t i = 0; i < len; i += W25Q128_OTA_MARKER_SIZE)
+        {
+            uint32_t offset = get_u32(&ota->page[i]);
+            uint32_t inverted = get_u32(&ota->page[i + 4]);
+
+            if (offset == 0xFFFFFFFF && inverted == 0xFFFFFFFF)
+            {
+                ota->marker_pos = pos + i;
+                ota->erased = ota->programmed;
+                ota->stats.resumed = ota->programmed;
+                return W25Q128_SUCCESS;
+            }
+
+            if (offset == ~inverted && offset >= ota->programmed &&
+                offset <= ota->image_size &&
+                (offset % ota->marker_interval == 0 ||
+                                            offset == ota->image_size))
+                ota->programmed = offset;
+        }
+        pos += len;
+    }
+
+    // No free marker left, the rest of the download goes without them
+    ota->marker_pos = W25Q128_SECTOR_SIZE;
+    ota->erased = ota->programmed;
+    ota->stats.resumed = ota->programmed;
+
+    return W25Q128_SUCCESS;
+}
+
+/*
+ * Erases from the end of the erased area to the next erase-ahead boundary.
+ * Markers are sector aligned, so a resumed download never erases its data.
+ */
+static W25Q128_StatusTypeDef ota_erase_next(W25Q128_OtaTypeDef *ota)
+{
+    uint32_t addr = ota->slot_addr + ota->erased;
+    uint32_t end = addr - (addr % W25Q128_OTA_ERASE_AHEAD_SIZE) +
+                                                W25Q128_OTA_ERASE_AHEAD_SIZE;
+    uint32_t image_end = ota->slot_addr + ota->image_size;
+
+    if (image_end % W25Q128_SECTOR_SIZE)
+        image_end += W25Q128_SECTOR_SIZE - (image_end % W25Q128_SECTOR_SIZE);
+    if (end > image_end)
+        end = image_end;
+
+    if (W25Q128_EraseRange(ota->w25, addr, end - addr) != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    ota->erased = end - ota->slot_addr;
+    ota->stats.erases++;
+
+    return W25Q128_SUCCESS;
+}
+
+// Programs at the write pointer, erasing ahead and marking progress
+static W25Q128_StatusTypeDef ota_program(W25Q128_OtaTypeDef *ota,
+                                        const uint8_t *data, uint32_t size)
+{
+    while (size > 0)
+    {
+        uint32_t addr = ota->slot_addr + ota->programmed;
+        uint32_t next_marker = ota->programmed - (ota->programmed %
+                            ota->marker_interval) + ota->marker_interval;
+        uint32_t len = size;
+
+        if (ota->programmed >= ota->erased &&
+                                        ota_erase_next(ota) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+
+        if (len > ota->erased - ota->programmed)
+            len = ota->erased - ota->programmed;
+        if (len > next_marker - ota->programmed)
+            len = next_marker - ota->programmed;
+
+        if (W25Q128_WritePage(ota->w25, addr / W25Q128_PAGE_SIZE,
+                    addr % W25Q128_PAGE_SIZE, len, (uint8_t *)data)
+                                                        != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+
+        ota->stats.page_programs += (len + W25Q128_PAGE_SIZE - 1) /
+                                                        W25Q128_PAGE_SIZE;
+        ota->programmed += len;
+        data += len;
+        size -= len;
+
+        if ((ota->programmed % ota->marker_interval == 0 ||
+             ota->programmed == ota->image_size) &&
+                                            ota_mark(ota) != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+    }
+
+    return W25Q128_SUCCESS;
+}
+
+static W25Q128_StatusTypeDef ota_mark(W25Q128_OtaTypeDef *ota)
+{
+    uint8_t marker[W25Q128_OTA_MARKER_SIZE];
+    uint32_t addr = header_addr(ota) + ota->marker_pos;
+
+    if (ota->marker_pos + W25Q128_OTA_MARKER_SIZE > W25Q128_SECTOR_SIZE)
+        return W25Q128_SUCCESS;
+
+    set_u32(&marker[0], ota->programmed);
+    set_u32(&marker[4], ~ota->programmed);
+    if (W25Q128_WritePage(ota->w25, addr / W25Q128_PAGE_SIZE,
+                            addr % W25Q128_PAGE_SIZE, sizeof(marker), marker)
+                                                        != W25Q128_SUCCESS)
+        return W25Q128_ERROR;
+
+    ota->marker_pos += W25Q128_OTA_MARKER_SIZE;
+    ota->stats.markers++;
+
+    return W25Q128_SUCCESS;
+}
+
+// Reads the programmed image back through the page buffer
+static W25Q128_StatusTypeDef ota_image_crc(W25Q128_OtaTypeDef *ota,
+                                                            uint32_t *crc)
+{
+    *crc = 0;
+    for (uint32_t pos = 0; pos < ota->image_size; pos += W25Q128_PAGE_SIZE)
+    {
+        uint32_t len = ota->image_size - pos;
+
+        if (len > W25Q128_PAGE_SIZE)
+            len = W25Q128_PAGE_SIZE;
+        if (ota_read(ota, ota->slot_addr + pos, ota->page, len)
+                                                        != W25Q128_SUCCESS)
+            return W25Q128_ERROR;
+        *crc = W25Q128_Crc32(*crc, ota->page, len);
+    }
+
+    return W25Q128_SUCCESS;
+}
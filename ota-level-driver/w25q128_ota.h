@@ -0,0 +1,140 @@
+/**
+ * @file w25q128_ota.h
+ * @brief w25q128 resumable firmware image writer
+ * @author Filip Stojanovic
+ *
+ * Writes an image that arrives in small chunks (network download) to a slot
+ * of whole sectors, without the read-modify-write of W25Q128_Write:
+ *
+ * - the image starts at the slot start, the last sector of the slot holds
+ *   the image header (id, size), progress markers and, once verified, the
+ *   image CRC
+ * - chunks are collected in a page buffer and programmed a full page at a
+ *   time, page aligned data is programmed straight from the caller
+ * - the image area is erased ahead of the write pointer up to the next
+ *   W25Q128_OTA_ERASE_AHEAD_SIZE boundary, with the largest erase commands
+ * - every W25Q128_OTA_MARKER_INTERVAL programmed bytes a progress marker is
+ *   programmed. Opening the slot again with the same id and size resumes at
+ *   the last marker, W25Q128_Ota_GetOffset tells where the download continues
+ * - finalize reads the image back, compares its CRC-32 with the expected one
+ *   and marks the slot complete, W25Q128_Ota_Verify checks a complete slot,
+ *   i.e. from the bootloader
+ */
+
+#ifndef W25Q128_OTA_H
+#define W25Q128_OTA_H
+
+#include "w25q128_conf_ota.h"
+#include "w25q128_ll.h"
+
+#include <stdint.h>
+
+typedef struct {
+    uint32_t bytes;         // Image bytes received
+    uint32_t page_programs;
+    uint32_t erases;        // Erase-ahead calls
+    uint32_t markers;
+    uint32_t resumed;       // Image bytes kept from an interrupted download
+} W25Q128_OtaStatsTypeDef;
+
+typedef struct {
+    W25Q128_TypeDef *w25;
+    uint32_t slot_addr;
+    uint32_t slot_size;
+    uint32_t image_id;
+    uint32_t image_size;
+
+    // Offsets in the image
+    uint32_t programmed;
+    uint32_t erased;        // End of the erased image area
+    uint32_t marker_interval;
+    uint32_t marker_pos;    // Next free marker in the header sector
+
+    // Page under the write pointer, programmed once it is full
+    uint8_t page[W25Q128_PAGE_SIZE];
+    uint16_t page_fill;
+
+    W25Q128_OtaStatsTypeDef stats;
+} W25Q128_OtaTypeDef;
+
+
+/**
+ * @brief Function that opens a slot for an image, or resumes its download
+ * @param ota Pointer to the image writer struct
+ * @param w25 Pointer to the flash configuration struct
+ * @param slot_addr Slot address, sector aligned
+ * @param slot_size Slot size, multiple of the sector size
+ * @param image_id Image identifier, i.e. version
+ * @param image_size Image size, at most slot_size less one sector
+ * @retval ::W25Q128_StatusTypeDef
+ * @note If the slot holds a download of the same id and size, it resumes.
+ *       Otherwise the slot is started over.
+ */
+W25Q128_StatusTypeDef W25Q128_Ota_Open(W25Q128_OtaTypeDef *ota,
+                                        W25Q128_TypeDef *w25,
+                                        uint32_t slot_addr, uint32_t slot_size,
+                                        uint32_t image_id,
+                                        uint32_t image_size);
+
+/**
+ * @brief Function that returns the image offset the download continues at
+ * @param ota Pointer to the image writer struct
+ * @return Number of image bytes received so far
+ */
+uint32_t W25Q128_Ota_GetOffset(W25Q128_OtaTypeDef *ota);
+
+/**
+ * @brief Function that appends the next chunk of the image
+ * @param ota Pointer to the image writer struct
+ * @param data Pointer to the chunk
+ * @param size Chunk size, any
+ * @retval ::W25Q128_StatusTypeDef
+ * @note Erases ahead when the write pointer reaches unerased flash, call
+ *       W25Q128_Ota_EraseAhead while waiting for the link to avoid it.
+ */
+W25Q128_StatusTypeDef W25Q128_Ota_Append(W25Q128_OtaTypeDef *ota,
+                                        const uint8_t *data, uint32_t size);
+
+/**
+ * @brief Function that erases the next part of the image area if the
+ *        erased part ahead of the write pointer is short
+ * @param ota Pointer to the image writer struct
+ * @retval ::W25Q128_StatusTypeDef
+ */
+W25Q128_StatusTypeDef W25Q128_Ota_EraseAhead(W25Q128_OtaTypeDef *ota);
+
+/**
+ * @brief Function that completes the image and verifies it
+ * @param ota Pointer to the image writer struct
+ * @param crc Expected CRC-32 (W25Q128_Crc32) of the image
+ * @retval ::W25Q128_StatusTypeDef
+ * @note All image bytes must be appended. The image is read back and the
+ *       slot is marked complete only if its CRC matches.
+ */
+W25Q128_StatusTypeDef W25Q128_Ota_Finalize(W25Q128_OtaTypeDef *ota,
+                                                            uint32_t crc);
+
+/**
+ * @brief Function that checks a complete slot against its stored CRC
+ * @param ota Pointer to the image writer struct, image_id and image_size
+ *        are filled in
+ * @param w25 Pointer to the flash configuration struct
+ * @param slot_addr Slot address, sector aligned
+ * @param slot_size Slot size, multiple of the sector size
+ * @retval ::W25Q128_StatusTypeDef
+ */
+W25Q128_StatusTypeDef W25Q128_Ota_Verify(W25Q128_OtaTypeDef *ota,
+                                        W25Q128_TypeDef *w25,
+                                        uint32_t slot_addr,
+                                        uint32_t slot_size);
+
+/**
+ * @brief Function that copies image writer counters
+ * @param ota Pointer to the image writer struct
+ * @param stats Pointer to the struct in which counters are copied
+ * @return None
+ */
+void W25Q128_Ota_GetStats(W25Q128_OtaTypeDef *ota,
+                                            W25Q128_OtaStatsTypeDef *stats);
+
+#endif
\ No newline at end of file